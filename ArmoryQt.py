@@ -2640,6 +2640,10 @@ class ArmoryMainWindow(QMainWindow):
       memdata = memfile.read()
       memfile.close()
 
+      # The new format is a log, the BDM drops a corrupt tail by itself
+      if memdata.startswith('ZCLOG001'):
+         return
+
       binunpacker = BinaryUnpacker(memdata)
       try:
          while binunpacker.getRemainingSize() > 0:
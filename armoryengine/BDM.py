@@ -198,6 +198,10 @@ class BlockDataManagerThread(threading.Thread):
       self.ldbdir = LEVELDB_DIR
       self.lastPctLoad = 0
 
+      # New blocks streamed in by the blk dir watcher, see registerNewBlockCallback
+      self.newBlockCallbacks = []
+      self.numStreamedBlocks = 0
+
       
          
 
@@ -224,6 +228,10 @@ class BlockDataManagerThread(threading.Thread):
       if not hasattr(self.bdm, name):
          LOGERROR('No BDM method: %s', name)
          raise AttributeError
+      elif name.startswith('query'):
+         # The C++ query* methods are thread-safe, and can run while the 
+         # BDM thread is busy:  no need to wait in the queue behind it
+         return getattr(self.bdm, name)
       else:
          def passthruFunc(*args, **kwargs):
             #LOGDEBUG('External thread requesting: %s (%d)', name, rndID)
@@ -468,6 +476,18 @@ class BlockDataManagerThread(threading.Thread):
       return self.waitForOutputIfNecessary(expectOutput, rndID)
       
 
+   #############################################################################
+   def registerNewBlockCallback(self, callback):
+      """
+      Once the blockchain is loaded, the BDM thread watches the blocks/ dir
+      and reads new blocks as soon as bitcoind writes them.  callback(nBlk)
+      is then called from the BDM thread, so it must not touch the GUI 
+      directly.  readBlkFileUpdate() still returns those blocks to whoever
+      calls it next, so the heartbeat doesn't miss them.
+      """
+      self.newBlockCallbacks.append(callback)
+
+
    #############################################################################
    def isInitialized(self):
       return self.blkMode==BLOCKCHAINMODE.Full and self.bdm.isInitialized()
@@ -576,6 +596,11 @@ class BlockDataManagerThread(threading.Thread):
       #if not self.__checkBDMReadyToServeData():
          #return None
 
+      # Once loaded, go straight to the thread-safe query instead of waiting
+      # behind whatever the BDM thread is doing
+      if self.blkMode==BLOCKCHAINMODE.Full:
+         return self.bdm.queryTxByHash(txHash)
+
       rndID = int(random.uniform(0,100000000)) 
       self.inputQueue.put([BDMINPUTTYPE.TxRequested, rndID, True, txHash])
 
@@ -603,6 +628,10 @@ class BlockDataManagerThread(threading.Thread):
       #if not self.__checkBDMReadyToServeData():
          #return None
 
+      if self.blkMode==BLOCKCHAINMODE.Full:
+         head = self.bdm.queryHeaderByHash(headHash)
+         return head if head.isInitialized() else None
+
       rndID = int(random.uniform(0,100000000)) 
       self.inputQueue.put([BDMINPUTTYPE.HeaderRequested, rndID, True, headHash])
 
@@ -940,6 +969,9 @@ class BlockDataManagerThread(threading.Thread):
       self.bdm.scanBlockchainForTx(self.masterCppWallet)
       self.bdm.saveScrAddrHistories()
 
+      # From now on, new blocks are read as soon as they show up
+      self.bdm.startBlkDirWatcher()
+
       
    #############################################################################
    @TimeThisFunction
@@ -1063,6 +1095,34 @@ class BlockDataManagerThread(threading.Thread):
          #self.bdm.saveScrAddrHistories()
 
       return nblk
+
+
+   #############################################################################
+   def __waitForInputStreamingBlocks(self):
+      """
+      Same as self.inputQueue.get(), but reads new blocks while waiting, as
+      soon as the C++ blk dir watcher sees them
+      """
+      while True:
+         try:
+            return self.inputQueue.get(True, 0.1)
+         except Queue.Empty:
+            pass
+
+         if not self.bdm.waitForBlkFileData(0):
+            continue
+
+         nblk = self.__readBlockfileUpdates()
+         self.blkMode = BLOCKCHAINMODE.Full
+         if not nblk:
+            continue
+
+         self.numStreamedBlocks += nblk
+         for callback in self.newBlockCallbacks:
+            try:
+               callback(nblk)
+            except:
+               LOGEXCEPT('Error in new block callback')
          
 
    #############################################################################
@@ -1238,8 +1298,13 @@ class BlockDataManagerThread(threading.Thread):
 
                self.currentActivity = 'None'
 
-               # Block until something shows up.
-               inputTuple = self.inputQueue.get()
+               # Block until something shows up.  If we're watching the
+               # blk dir, new blocks are read in the meantime.
+               if self.blkMode==BLOCKCHAINMODE.Full and \
+                  self.bdm.isBlkDirWatcherRunning():
+                  inputTuple = self.__waitForInputStreamingBlocks()
+               else:
+                  inputTuple = self.inputQueue.get()
             except:
                LOGERROR('Unknown error in BDM thread')
 
@@ -1336,6 +1401,12 @@ class BlockDataManagerThread(threading.Thread):
             elif cmd == BDMINPUTTYPE.ReadBlkUpdate:
                output = self.__readBlockfileUpdates()
 
+               # Blocks the watcher read since the last request are still
+               # new to the caller
+               if output is not None:
+                  output += self.numStreamedBlocks
+                  self.numStreamedBlocks = 0
+
             elif cmd == BDMINPUTTYPE.Passthrough:
                # If the caller is waiting, then it is notified by output
                funcName = inputTuple[3]
@@ -1364,6 +1435,7 @@ class BlockDataManagerThread(threading.Thread):
                   # being reset.  It can safely pick up from where it 
                   # left off
                   self.__readBlockfileUpdates()
+                  self.bdm.startBlkDirWatcher()
                else:
                   self.blkMode = BLOCKCHAINMODE.Uninitialized
                   self.__startLoadBlockchain()
@@ -1371,6 +1443,7 @@ class BlockDataManagerThread(threading.Thread):
             elif cmd == BDMINPUTTYPE.GoOfflineRequested:
                LOGINFO('Go offline requested')
                self.prefMode = BLOCKCHAINMODE.Offline
+               self.bdm.stopBlkDirWatcher()
 
             self.inputQueue.task_done()
             if expectOutput:
@@ -0,0 +1,292 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "BalanceCache.h"
+#include "BtcUtils.h"
+
+////////////////////////////////////////////////////////////////////////////////
+BalanceCache::BalanceCache(uint32_t maxEntries) :
+   maxEntries_(maxEntries),
+   numEntries_(0),
+   numWriters_(0),
+   writeGen_(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BalanceCache::clear(void)
+{
+   lock_guard<mutex> lock(lock_);
+   entries_.clear();
+   numEntries_ = 0;
+   writeGen_++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BalanceCache::clearZeroConf(void)
+{
+   lock_guard<mutex> lock(lock_);
+   zcTotals_.clear();
+   zcDeltas_.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t BalanceCache::size(void)
+{
+   lock_guard<mutex> lock(lock_);
+   return (uint32_t)entries_.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Doesn't drop anything already cached, only affects what gets in
+void BalanceCache::setMaxEntries(uint32_t maxEntries)
+{
+   lock_guard<mutex> lock(lock_);
+   maxEntries_ = maxEntries;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool BalanceCache::get(BinaryDataRef scrAddr,
+                       uint32_t topBlk,
+                       ScrAddrBalance & bal)
+{
+   lock_guard<mutex> lock(lock_);
+   map<BinaryData, Entry>::const_iterator iter = entries_.find(scrAddr);
+   if(iter == entries_.end())
+      return false;
+
+   fillBalance(scrAddr, iter->second, topBlk, bal);
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool BalanceCache::canInsert(void)
+{
+   lock_guard<mutex> lock(lock_);
+   return numWriters_ == 0 && entries_.size() < maxEntries_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t BalanceCache::getWriteGeneration(void)
+{
+   lock_guard<mutex> lock(lock_);
+   return writeGen_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool BalanceCache::insert(BinaryDataRef scrAddr,
+                          StoredScriptHistory const & ssh,
+                          uint64_t multisigUnspent,
+                          uint32_t topBlk,
+                          uint64_t writeGen,
+                          ScrAddrBalance & bal)
+{
+   Entry entry;
+   entry.confirmed_ = ssh.totalUnspent_;
+   entry.multisig_  = multisigUnspent;
+
+   map<BinaryData, StoredSubHistory>::const_iterator iterSubSSH;
+   map<BinaryData, TxIOPair>::const_iterator iterTxio;
+   for(iterSubSSH  = ssh.subHistMap_.begin();
+       iterSubSSH != ssh.subHistMap_.end();
+       iterSubSSH++)
+   {
+      StoredSubHistory const & subSSH = iterSubSSH->second;
+      uint32_t height = DBUtils.hgtxToHeight(subSSH.hgtX_);
+      for(iterTxio  = subSSH.txioSet_.begin();
+          iterTxio != subSSH.txioSet_.end();
+          iterTxio++)
+      {
+         TxIOPair const & txio = iterTxio->second;
+         if(txio.hasTxIn() || txio.isMultisig())
+            continue;
+
+         entry.utxoCount_++;
+         if(txio.isFromCoinbase())
+            entry.coinbase_[height] += txio.getValue();
+      }
+   }
+
+   lock_guard<mutex> lock(lock_);
+   fillBalance(scrAddr, entry, topBlk, bal);
+   if(numWriters_ > 0 || writeGen != writeGen_ || 
+      entries_.size() >= maxEntries_)
+      return false;
+
+   entries_[scrAddr] = entry;
+   numEntries_ = (uint32_t)entries_.size();
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BalanceCache::fillBalance(BinaryDataRef scrAddr,
+                               Entry const & entry,
+                               uint32_t topBlk,
+                               ScrAddrBalance & bal) const
+{
+   bal.confirmed_   = entry.confirmed_;
+   bal.multisig_    = entry.multisig_;
+   bal.utxoCount_   = entry.utxoCount_;
+   bal.spendable_   = entry.confirmed_;
+   bal.unconfirmed_ = 0;
+
+   // Same as TxIOPair::isSpendable:  mature once it has more than
+   // COINBASE_MATURITY confirmations
+   uint32_t firstImmature = (topBlk < COINBASE_MATURITY ? 0 :
+                                      topBlk - COINBASE_MATURITY + 1);
+   map<uint32_t, uint64_t>::const_iterator iterCB;
+   for(iterCB  = entry.coinbase_.lower_bound(firstImmature);
+       iterCB != entry.coinbase_.end();
+       iterCB++)
+      bal.spendable_ -= min(bal.spendable_, iterCB->second);
+
+   map<BinaryData, ZeroConfTotals>::const_iterator iterZC;
+   iterZC = zcTotals_.find(scrAddr);
+   if(iterZC == zcTotals_.end())
+      return;
+
+   ZeroConfTotals const & zct = iterZC->second;
+   bal.spendable_  -= min(bal.spendable_, zct.spentConf_);
+   bal.unconfirmed_ = zct.received_ - min(zct.received_, zct.spentUnconf_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BalanceCache::beginWrites(void)
+{
+   lock_guard<mutex> lock(lock_);
+   numWriters_++;
+   writeGen_++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BalanceCache::endWrites(void)
+{
+   lock_guard<mutex> lock(lock_);
+   if(numWriters_ > 0)
+      numWriters_--;
+   writeGen_++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BalanceCache::addTxOut(BinaryDataRef scrAddr,
+                            uint64_t value,
+                            uint32_t height,
+                            bool isCoinbase,
+                            bool isMultisigRef)
+{
+   lock_guard<mutex> lock(lock_);
+   map<BinaryData, Entry>::iterator iter = entries_.find(scrAddr);
+   if(iter == entries_.end())
+      return;
+
+   Entry & entry = iter->second;
+   if(isMultisigRef)
+   {
+      entry.multisig_ += value;
+      return;
+   }
+
+   entry.confirmed_ += value;
+   entry.utxoCount_++;
+   if(isCoinbase)
+      entry.coinbase_[height] += value;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BalanceCache::removeTxOut(BinaryDataRef scrAddr,
+                               uint64_t value,
+                               uint32_t height,
+                               bool isCoinbase,
+                               bool isMultisigRef)
+{
+   lock_guard<mutex> lock(lock_);
+   map<BinaryData, Entry>::iterator iter = entries_.find(scrAddr);
+   if(iter == entries_.end())
+      return;
+
+   Entry & entry = iter->second;
+   if(isMultisigRef)
+   {
+      entry.multisig_ -= min(entry.multisig_, value);
+      return;
+   }
+
+   entry.confirmed_ -= min(entry.confirmed_, value);
+   if(entry.utxoCount_ > 0)
+      entry.utxoCount_--;
+
+   if(!isCoinbase)
+      return;
+
+   map<uint32_t, uint64_t>::iterator iterCB = entry.coinbase_.find(height);
+   if(iterCB == entry.coinbase_.end())
+      return;
+
+   iterCB->second -= min(iterCB->second, value);
+   if(iterCB->second == 0)
+      entry.coinbase_.erase(iterCB);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BalanceCache::addZeroConf(BinaryDataRef txHash,
+                               vector<ZeroConfDelta> const & deltas)
+{
+   if(deltas.size() == 0)
+      return;
+
+   lock_guard<mutex> lock(lock_);
+   if(zcDeltas_.find(txHash) != zcDeltas_.end())
+      return;
+
+   zcDeltas_[txHash] = deltas;
+   for(uint32_t i=0; i<deltas.size(); i++)
+   {
+      ZeroConfTotals & zct = zcTotals_[deltas[i].scrAddr_];
+      switch(deltas[i].type_)
+      {
+         case ZC_DELTA_RECEIVED:          zct.received_    += deltas[i].value_; break;
+         case ZC_DELTA_SPENT_CONFIRMED:   zct.spentConf_   += deltas[i].value_; break;
+         case ZC_DELTA_SPENT_UNCONFIRMED: zct.spentUnconf_ += deltas[i].value_; break;
+      }
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BalanceCache::removeZeroConf(BinaryDataRef txHash)
+{
+   lock_guard<mutex> lock(lock_);
+   map<BinaryData, vector<ZeroConfDelta> >::iterator iter;
+   iter = zcDeltas_.find(txHash);
+   if(iter == zcDeltas_.end())
+      return;
+
+   vector<ZeroConfDelta> const & deltas = iter->second;
+   for(uint32_t i=0; i<deltas.size(); i++)
+   {
+      map<BinaryData, ZeroConfTotals>::iterator iterZC;
+      iterZC = zcTotals_.find(deltas[i].scrAddr_);
+      if(iterZC == zcTotals_.end())
+         continue;
+
+      ZeroConfTotals & zct = iterZC->second;
+      uint64_t val = deltas[i].value_;
+      switch(deltas[i].type_)
+      {
+         case ZC_DELTA_RECEIVED:          zct.received_    -= min(zct.received_,    val); break;
+         case ZC_DELTA_SPENT_CONFIRMED:   zct.spentConf_   -= min(zct.spentConf_,   val); break;
+         case ZC_DELTA_SPENT_UNCONFIRMED: zct.spentUnconf_ -= min(zct.spentUnconf_, val); break;
+      }
+
+      if(zct.received_ == 0 && zct.spentConf_ == 0 && zct.spentUnconf_ == 0)
+         zcTotals_.erase(iterZC);
+   }
+
+   zcDeltas_.erase(iter);
+}
+
+// kate: indent-width 3; replace-tabs on;
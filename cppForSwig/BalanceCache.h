@@ -0,0 +1,181 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// BalanceCache
+//
+// Balance and UTXO count per scrAddr, for callers polling the same addresses
+// over and over.  getBalanceForScrAddr reads the SSH summary on every call
+// (the whole SSH and its UTXOs with multisig), here that's done once, the
+// first time an address is asked for.  After that the entry is kept up to
+// date by the BlockWriteBatcher as it applies and undoes blocks, so a
+// lookup never touches the DB.
+//
+// Entries are only created while no BlockWriteBatcher is running (see
+// beginWrites):  an SSH read from the DB then can't be missing changes that
+// are still sitting in a batch.  Until the cache is full, that is.  Then
+// nothing new gets in, lookups of other addresses go to the DB.
+//
+// A batcher can also start and finish between the DB read and the insert, 
+// so the reader takes getWriteGeneration() before its snapshot, and insert
+// refuses the entry if any writes began or ended since.
+//
+// Zero-conf txs are kept apart, by tx hash, for all scrAddrs and not just
+// the cached ones.  The pool is bounded, so this is too.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _BALANCECACHE_H_
+#define _BALANCECACHE_H_
+
+#include <map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "BinaryData.h"
+#include "StoredBlockObj.h"
+
+#define BALANCE_CACHE_MAX_ENTRIES  (256*1024)
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////
+// All in satoshis
+struct ScrAddrBalance
+{
+   ScrAddrBalance(void) : confirmed_(0), multisig_(0), unconfirmed_(0),
+                          spendable_(0), utxoCount_(0) {}
+
+   // Unspent TxOuts in the main chain (the SSH totalUnspent_), and the
+   // unspent multisig TxOuts this address is one of the keys of
+   uint64_t confirmed_;
+   uint64_t multisig_;
+
+   // Received in zero-conf txs, less what other zero-conf txs spend of it
+   uint64_t unconfirmed_;
+
+   // confirmed_, less immature coinbase and what zero-conf txs spend
+   uint64_t spendable_;
+
+   // Number of TxOuts in confirmed_
+   uint32_t utxoCount_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// What a zero-conf tx does to one scrAddr
+enum ZC_DELTA_TYPE
+{
+   ZC_DELTA_RECEIVED,
+   ZC_DELTA_SPENT_CONFIRMED,
+   ZC_DELTA_SPENT_UNCONFIRMED
+};
+
+struct ZeroConfDelta
+{
+   ZeroConfDelta(BinaryDataRef scrAddr, uint64_t value, ZC_DELTA_TYPE type) :
+      scrAddr_(scrAddr), value_(value), type_(type) {}
+
+   BinaryData     scrAddr_;
+   uint64_t       value_;
+   ZC_DELTA_TYPE  type_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+class BalanceCache
+{
+public:
+   BalanceCache(uint32_t maxEntries=BALANCE_CACHE_MAX_ENTRIES);
+
+   // Drops the cached scrAddrs, when the SSHs in the DB are rewritten by
+   // something other than a BlockWriteBatcher.  The zero-conf part stays.
+   void     clear(void);
+   void     clearZeroConf(void);
+   uint32_t size(void);
+
+   void     setMaxEntries(uint32_t maxEntries);
+
+   // Returns false if the scrAddr isn't cached.  topBlk is for coinbase
+   // maturity.
+   bool get(BinaryDataRef scrAddr, uint32_t topBlk, ScrAddrBalance & bal);
+
+   // False if insert() would refuse any new scrAddr right now (a writer, or
+   // a full cache), so the caller can skip the reads it needs
+   bool     canInsert(void);
+
+   // Take this before reading the SSH that goes to insert()
+   uint64_t getWriteGeneration(void);
+
+   // Adds the scrAddr from its full SSH, plus the value of the unspent
+   // multisig TxOuts it's in.  Returns false if it wasn't added (there's a
+   // writer, the generation changed, or the cache is full); bal is still 
+   // filled in.
+   bool insert(BinaryDataRef scrAddr,
+               StoredScriptHistory const & ssh,
+               uint64_t multisigUnspent,
+               uint32_t topBlk,
+               uint64_t writeGen,
+               ScrAddrBalance & bal);
+
+   /////////////////////////////////////////////////////////////////////////////
+   // For the BlockWriteBatcher.  Between beginWrites and endWrites (when all
+   // its changes are on disk), no scrAddr is added.  The TxOut calls only
+   // change scrAddrs already in the cache, isMultisigRef is for the
+   // individual addresses of a multisig TxOut.
+   void beginWrites(void);
+   void endWrites(void);
+   bool isEmpty(void) const { return numEntries_ == 0; }
+
+   void addTxOut(BinaryDataRef scrAddr, uint64_t value, uint32_t height,
+                 bool isCoinbase, bool isMultisigRef);
+   void removeTxOut(BinaryDataRef scrAddr, uint64_t value, uint32_t height,
+                    bool isCoinbase, bool isMultisigRef);
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Zero-conf txs as they go in and out of the pool
+   void addZeroConf(BinaryDataRef txHash, vector<ZeroConfDelta> const & deltas);
+   void removeZeroConf(BinaryDataRef txHash);
+
+private:
+   struct Entry
+   {
+      Entry(void) : confirmed_(0), multisig_(0), utxoCount_(0) {}
+
+      uint64_t                 confirmed_;
+      uint64_t                 multisig_;
+      uint32_t                 utxoCount_;
+
+      // Unspent coinbase value by height.  Only the ones less than
+      // COINBASE_MATURITY blocks deep are looked at.
+      map<uint32_t, uint64_t>  coinbase_;
+   };
+
+   struct ZeroConfTotals
+   {
+      ZeroConfTotals(void) : received_(0), spentConf_(0), spentUnconf_(0) {}
+
+      uint64_t received_;
+      uint64_t spentConf_;
+      uint64_t spentUnconf_;
+   };
+
+   void fillBalance(BinaryDataRef scrAddr, Entry const & entry,
+                    uint32_t topBlk, ScrAddrBalance & bal) const;
+
+   mutex                                    lock_;
+   map<BinaryData, Entry>                   entries_;
+   uint32_t                                 maxEntries_;
+   atomic<uint32_t>                         numEntries_;
+   uint32_t                                 numWriters_;
+
+   // Bumped by beginWrites, endWrites and clear
+   uint64_t                                 writeGen_;
+
+   map<BinaryData, ZeroConfTotals>          zcTotals_;
+   map<BinaryData, vector<ZeroConfDelta> >  zcDeltas_;
+};
+
+#endif
+// kate: indent-width 3; replace-tabs on;
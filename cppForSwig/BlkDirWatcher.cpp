@@ -0,0 +1,296 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef __linux__
+   #include <sys/inotify.h>
+   #include <sys/eventfd.h>
+   #include <poll.h>
+   #include <unistd.h>
+   #include <errno.h>
+#endif
+
+#include <fstream>
+#include <chrono>
+#include "BlkDirWatcher.h"
+#include "BtcUtils.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+BlkDirWatcher::BlkDirWatcher(string const &     blkDir,
+                             BinaryData const & magicBytes,
+                             uint32_t           pollIntervalMs) :
+   blkDir_(blkDir),
+   magicBytes_(magicBytes),
+   pollIntervalMs_(pollIntervalMs==0 ? 1 : pollIntervalMs),
+   inotifyFd_(-1),
+   wakeFd_(-1),
+   fnum_(0),
+   offset_(0),
+   newData_(false),
+   wakeRequested_(false),
+   stopRequested_(false),
+   running_(false)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlkDirWatcher::~BlkDirWatcher(void)
+{
+   stop();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Only used from the BDM thread
+bool BlkDirWatcher::start(uint32_t fnum, uint64_t offset)
+{
+   if(running_)
+   {
+      setReadPosition(fnum, offset);
+      return true;
+   }
+
+   string blkfile = BtcUtils::getBlkFilename(blkDir_, fnum);
+   if(BtcUtils::GetFileSize(blkfile) == FILE_DOES_NOT_EXIST)
+   {
+      LOGERR << "Cannot watch blk dir, " << blkfile.c_str() << " does not exist";
+      return false;
+   }
+
+   fnum_          = fnum;
+   offset_        = offset;
+   newData_       = false;
+   wakeRequested_ = false;
+   stopRequested_ = false;
+
+   openInotify();
+   if(usesInotify())
+      LOGINFO << "Watching " << blkDir_.c_str() << " with inotify";
+   else
+      LOGINFO << "Watching " << blkDir_.c_str() << " every "
+              << pollIntervalMs_ << " ms";
+
+   running_ = true;
+   thread_ = thread(&BlkDirWatcher::watchLoop, this);
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlkDirWatcher::stop(void)
+{
+   if(!running_)
+      return;
+
+   {
+      unique_lock<mutex> lock(lock_);
+      stopRequested_ = true;
+   }
+   wakeThread();
+   cv_.notify_all();
+
+   thread_.join();
+   closeInotify();
+   running_ = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlkDirWatcher::setReadPosition(uint32_t fnum, uint64_t offset)
+{
+   {
+      unique_lock<mutex> lock(lock_);
+      fnum_    = fnum;
+      offset_  = offset;
+      newData_ = false;
+   }
+
+   // More blocks may have come in while the BDM was reading, and their
+   // events were already consumed:  check again right away
+   wakeThread();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool BlkDirWatcher::waitForNewData(uint32_t timeoutMs)
+{
+   unique_lock<mutex> lock(lock_);
+   if(!running_ || timeoutMs == 0)
+      return newData_;
+
+   cv_.wait_for(lock, chrono::milliseconds(timeoutMs),
+                [this](void) { return newData_ || stopRequested_; });
+   return newData_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Same test as readBlkFileUpdate:  bitcoind preallocates the files with
+// zeros, so there is new data only if the magic bytes are where the next
+// block would start
+bool BlkDirWatcher::hasBlockAt(string const &     blkDir,
+                               BinaryData const & magicBytes,
+                               uint32_t           fnum,
+                               uint64_t           offset)
+{
+   uint8_t magic[4];
+
+   string blkfile = BtcUtils::getBlkFilename(blkDir, fnum);
+   ifstream is(blkfile.c_str(), ios::in | ios::binary);
+   if(is.is_open())
+   {
+      is.seekg(offset);
+      is.read((char*)magic, 4);
+      if(is.gcount() == 4 && BinaryDataRef(magic, 4) == magicBytes)
+         return true;
+      is.close();
+   }
+
+   string nextfile = BtcUtils::getBlkFilename(blkDir, fnum+1);
+   ifstream nis(nextfile.c_str(), ios::in | ios::binary);
+   if(!nis.is_open())
+      return false;
+
+   nis.read((char*)magic, 4);
+   return nis.gcount() == 4 && BinaryDataRef(magic, 4) == magicBytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlkDirWatcher::watchLoop(void)
+{
+   while(true)
+   {
+      uint32_t fnum;
+      uint64_t offset;
+      {
+         unique_lock<mutex> lock(lock_);
+         if(stopRequested_)
+            return;
+
+         fnum   = fnum_;
+         offset = offset_;
+         wakeRequested_ = false;
+
+         // Nothing to do until the BDM has read what we found
+         if(newData_)
+            fnum = UINT32_MAX;
+      }
+
+      if(fnum != UINT32_MAX && hasBlockAt(blkDir_, magicBytes_, fnum, offset))
+      {
+         unique_lock<mutex> lock(lock_);
+
+         // Don't report it if the BDM has moved on in the meantime
+         if(fnum_ == fnum && offset_ == offset)
+         {
+            newData_ = true;
+            cv_.notify_all();
+         }
+      }
+
+      waitForDirEvent();
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Returns after any change in the directory, a wakeThread() call, or
+// pollIntervalMs_ without either
+void BlkDirWatcher::waitForDirEvent(void)
+{
+#ifdef __linux__
+   if(inotifyFd_ >= 0)
+   {
+      struct pollfd fds[2];
+      fds[0].fd     = inotifyFd_;
+      fds[0].events = POLLIN;
+      fds[1].fd     = wakeFd_;
+      fds[1].events = POLLIN;
+
+      int nReady = poll(fds, 2, pollIntervalMs_);
+      if(nReady == 0 || (nReady < 0 && errno == EINTR))
+         return;
+
+      // Wait out the interval anyway, so a persistent error doesn't spin
+      if(nReady < 0)
+      {
+         LOGWARN << "poll() on the blk dir watch failed, errno " << errno;
+         unique_lock<mutex> lock(lock_);
+         cv_.wait_for(lock, chrono::milliseconds(pollIntervalMs_),
+                      [this](void) { return stopRequested_; });
+         return;
+      }
+
+      // We don't care which file changed, checking is cheaper than
+      // parsing the events.  Just drain both fds.
+      char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+      if(fds[0].revents & POLLIN)
+         while(read(inotifyFd_, buf, sizeof(buf)) > 0) {}
+
+      uint64_t count;
+      if(fds[1].revents & POLLIN)
+         while(read(wakeFd_, &count, sizeof(count)) > 0) {}
+
+      return;
+   }
+#endif
+
+   unique_lock<mutex> lock(lock_);
+   cv_.wait_for(lock, chrono::milliseconds(pollIntervalMs_),
+                [this](void) { return wakeRequested_ || stopRequested_; });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlkDirWatcher::wakeThread(void)
+{
+#ifdef __linux__
+   if(wakeFd_ >= 0)
+   {
+      uint64_t one = 1;
+      if(write(wakeFd_, &one, sizeof(one)) < 0) {}
+      return;
+   }
+#endif
+
+   {
+      unique_lock<mutex> lock(lock_);
+      wakeRequested_ = true;
+   }
+   cv_.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Falls back to polling if anything fails here
+void BlkDirWatcher::openInotify(void)
+{
+#ifdef __linux__
+   inotifyFd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   if(inotifyFd_ < 0)
+   {
+      LOGWARN << "inotify_init1() failed, errno " << errno;
+      return;
+   }
+
+   uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO;
+   wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if(wakeFd_ < 0 || inotify_add_watch(inotifyFd_, blkDir_.c_str(), mask) < 0)
+   {
+      LOGWARN << "Cannot set up the inotify watch, errno " << errno;
+      closeInotify();
+   }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlkDirWatcher::closeInotify(void)
+{
+#ifdef __linux__
+   if(inotifyFd_ >= 0)
+      close(inotifyFd_);
+   if(wakeFd_ >= 0)
+      close(wakeFd_);
+#endif
+   inotifyFd_ = -1;
+   wakeFd_    = -1;
+}
+
+// kate: indent-width 3; replace-tabs on;
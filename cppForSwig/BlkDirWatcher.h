@@ -0,0 +1,103 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// BlkDirWatcher
+//
+// Tells the BDM thread as soon as bitcoind has written a new block, instead
+// of waiting for the GUI to poll readBlkFileUpdate.  A background thread
+// watches the blocks/ directory, and checks whether there is a block at the
+// position the BDM has read up to:  magic bytes at that offset in the last
+// blk file, or at the start of the next one once bitcoind rolls over.
+//
+// On Linux the thread sleeps on inotify, so a new block is seen within a
+// few ms of being written.  Elsewhere (or if inotify is not available) it
+// re-checks every pollIntervalMs.  It also re-checks on that interval with
+// inotify, as a safety net.  Since bitcoind preallocates the blk files the
+// file size doesn't tell us anything, only the magic bytes do.
+//
+// The watcher never touches the BDM:  it only reads the files, and the BDM
+// thread tells it where it is with setReadPosition() after each update.
+// Once it has found new data it stops checking until that happens.
+//
+// Not included in BlockUtils.h, SWIG can't parse <thread>.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _BLKDIRWATCHER_H_
+#define _BLKDIRWATCHER_H_
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "BinaryData.h"
+
+using namespace std;
+
+class BlkDirWatcher
+{
+public:
+   BlkDirWatcher(string const &     blkDir,
+                 BinaryData const & magicBytes,
+                 uint32_t           pollIntervalMs);
+   ~BlkDirWatcher(void);
+
+   // Watch for blocks after byte offset of blk file fnum
+   bool start(uint32_t fnum, uint64_t offset);
+   void stop(void);
+
+   bool isRunning(void) const    { return running_; }
+   bool usesInotify(void) const  { return inotifyFd_ >= 0; }
+
+   // Called by the BDM thread after it read new blocks, or found nothing
+   // to read.  Clears the new-data flag, the next check decides again.
+   void setReadPosition(uint32_t fnum, uint64_t offset);
+
+   // Returns true as soon as there is new data, false after timeoutMs
+   // without any.  timeoutMs=0 only checks the flag.
+   bool waitForNewData(uint32_t timeoutMs);
+
+   // Whether there is a block at offset in blk file fnum, or at the start
+   // of blk file fnum+1
+   static bool hasBlockAt(string const &     blkDir,
+                          BinaryData const & magicBytes,
+                          uint32_t           fnum,
+                          uint64_t           offset);
+
+private:
+   // Not copyable:  owns a thread and a file descriptor
+   BlkDirWatcher(BlkDirWatcher const &);
+   BlkDirWatcher & operator=(BlkDirWatcher const &);
+
+   void watchLoop(void);
+   void waitForDirEvent(void);
+   void wakeThread(void);
+   void openInotify(void);
+   void closeInotify(void);
+
+   string               blkDir_;
+   BinaryData           magicBytes_;
+   uint32_t             pollIntervalMs_;
+   int                  inotifyFd_;
+   int                  wakeFd_;      // eventfd, to interrupt the poll()
+
+   thread               thread_;
+   mutex                lock_;
+   condition_variable   cv_;
+
+   // All guarded by lock_, except running_ which only changes on the
+   // thread calling start/stop
+   uint32_t             fnum_;
+   uint64_t             offset_;
+   bool                 newData_;
+   bool                 wakeRequested_;
+   bool                 stopRequested_;
+   bool                 running_;
+};
+
+#endif
+// kate: indent-width 3; replace-tabs on;
@@ -0,0 +1,216 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef _MSC_VER
+   #include <windows.h>
+#else
+   #include <sys/types.h>
+   #include <sys/stat.h>
+   #include <sys/mman.h>
+   #include <fcntl.h>
+   #include <unistd.h>
+#endif
+
+#include "BlkFileMap.h"
+#include "OS_TranslatePath.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+BlkFileMap::BlkFileMap(void) :
+   ptr_(NULL),
+   size_(0),
+   releasedTo_(0),
+   isOpen_(false)
+{
+#ifdef _MSC_VER
+   fileHandle_ = INVALID_HANDLE_VALUE;
+   mapHandle_  = NULL;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlkFileMap::BlkFileMap(string const & filename) :
+   ptr_(NULL),
+   size_(0),
+   releasedTo_(0),
+   isOpen_(false)
+{
+#ifdef _MSC_VER
+   fileHandle_ = INVALID_HANDLE_VALUE;
+   mapHandle_  = NULL;
+#endif
+   open(filename);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlkFileMap::~BlkFileMap(void)
+{
+   close();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool BlkFileMap::open(string const & filename)
+{
+   close();
+   filename_ = filename;
+
+#ifdef _MSC_VER
+   // Share write access, bitcoind may still be appending to the file
+   HANDLE fh = CreateFileW(OS_TranslatePath(filename).c_str(), 
+                           GENERIC_READ, 
+                           FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           NULL,
+                           OPEN_EXISTING,
+                           FILE_FLAG_SEQUENTIAL_SCAN,
+                           NULL);
+   if(fh == INVALID_HANDLE_VALUE)
+   {
+      LOGERR << "Could not open " << filename.c_str() << " for mapping";
+      return false;
+   }
+
+   LARGE_INTEGER fsize;
+   if(!GetFileSizeEx(fh, &fsize))
+   {
+      LOGERR << "Could not get the size of " << filename.c_str();
+      CloseHandle(fh);
+      return false;
+   }
+
+   size_ = (uint64_t)fsize.QuadPart;
+   fileHandle_ = fh;
+   if(size_ > 0)
+   {
+      HANDLE mh = CreateFileMapping(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+      if(mh == NULL)
+      {
+         LOGERR << "Could not map " << filename.c_str();
+         close();
+         return false;
+      }
+      mapHandle_ = mh;
+
+      ptr_ = (uint8_t*)MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+      if(ptr_ == NULL)
+      {
+         LOGERR << "Could not map " << filename.c_str();
+         close();
+         return false;
+      }
+   }
+#else
+   int fd = ::open(filename.c_str(), O_RDONLY);
+   if(fd < 0)
+   {
+      LOGERR << "Could not open " << filename.c_str() << " for mapping";
+      return false;
+   }
+
+   struct stat st;
+   if(fstat(fd, &st) != 0)
+   {
+      LOGERR << "Could not get the size of " << filename.c_str();
+      ::close(fd);
+      return false;
+   }
+
+   size_ = (uint64_t)st.st_size;
+   if(size_ > 0)
+   {
+      void* ptr = mmap(NULL, (size_t)size_, PROT_READ, MAP_SHARED, fd, 0);
+      if(ptr == MAP_FAILED)
+      {
+         LOGERR << "Could not map " << filename.c_str();
+         ::close(fd);
+         size_ = 0;
+         return false;
+      }
+      ptr_ = (uint8_t*)ptr;
+   }
+
+   // The mapping stays valid after the descriptor is closed
+   ::close(fd);
+#endif
+
+   releasedTo_ = 0;
+   isOpen_ = true;
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlkFileMap::close(void)
+{
+#ifdef _MSC_VER
+   if(ptr_ != NULL)
+      UnmapViewOfFile(ptr_);
+   if(mapHandle_ != NULL)
+      CloseHandle((HANDLE)mapHandle_);
+   if(fileHandle_ != INVALID_HANDLE_VALUE)
+      CloseHandle((HANDLE)fileHandle_);
+   mapHandle_  = NULL;
+   fileHandle_ = INVALID_HANDLE_VALUE;
+#else
+   if(ptr_ != NULL)
+      munmap(ptr_, (size_t)size_);
+#endif
+
+   ptr_ = NULL;
+   size_ = 0;
+   releasedTo_ = 0;
+   isOpen_ = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BinaryDataRef BlkFileMap::getDataRef(uint64_t offset, uint64_t len) const
+{
+   if(offset > size_ || len > size_ - offset)
+      return BinaryDataRef();
+
+   return BinaryDataRef(ptr_ + offset, (size_t)len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BinaryRefReader BlkFileMap::getReader(uint64_t offset) const
+{
+   if(offset > size_)
+      return BinaryRefReader();
+
+   return BinaryRefReader(ptr_ + offset, (uint32_t)(size_ - offset));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlkFileMap::adviseSequential(void)
+{
+#ifndef _MSC_VER
+   if(ptr_ != NULL)
+      madvise(ptr_, (size_t)size_, MADV_SEQUENTIAL);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Let the OS drop all the whole pages before offset.  Only ever moves forward.
+void BlkFileMap::releaseBefore(uint64_t offset)
+{
+#ifndef _MSC_VER
+   if(ptr_ == NULL)
+      return;
+
+   if(offset > size_)
+      offset = size_;
+
+   uint64_t pageSize = (uint64_t)PAGESIZE;
+   uint64_t releaseTo = offset - (offset % pageSize);
+   if(releaseTo <= releasedTo_)
+      return;
+
+   madvise(ptr_ + releasedTo_, (size_t)(releaseTo - releasedTo_), MADV_DONTNEED);
+   releasedTo_ = releaseTo;
+#endif
+}
+
+// kate: indent-width 3; replace-tabs on;
@@ -0,0 +1,81 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// BlkFileMap
+//
+// Read-only memory map of a blkXXXXX.dat file.  The blk files are read 
+// front-to-back exactly once during a DB build, so instead of copying them
+// through an ifstream and a BinaryStreamBuffer we map them and hand out 
+// BinaryDataRef/BinaryRefReader views straight into the mapping.  Any 
+// number of threads can read from the same map concurrently.
+//
+// The refs are only valid for the lifetime of the BlkFileMap object.  Once
+// a block has been consumed, call releaseBefore() so that the OS can drop
+// those pages:  they are clean file-backed pages, so they are simply read
+// back from disk if they are touched again.
+//
+// Don't map a file bitcoind is still writing to if it can be avoided.  It
+// preallocates that file and truncates it when it moves on to the next 
+// one, and touching a mapped page past the new end raises SIGBUS.  
+// readBlkFileUpdate reads the live files with plain reads for that reason.
+// The initial load does map the last file:  a file switch in the middle 
+// of a load is the one race left.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _BLKFILEMAP_H_
+#define _BLKFILEMAP_H_
+
+#include <string>
+#include "BinaryData.h"
+
+using namespace std;
+
+class BlkFileMap
+{
+public:
+   BlkFileMap(void);
+   explicit BlkFileMap(string const & filename);
+   ~BlkFileMap(void);
+
+   // Maps the whole file as it is right now.  Data appended to the file
+   // later is not visible, re-open the map to see it.
+   bool open(string const & filename);
+   void close(void);
+
+   bool            isOpen(void) const   { return isOpen_; }
+   uint64_t        getSize(void) const  { return size_; }
+   uint8_t const * getPtr(void) const   { return ptr_; }
+   string const &  getFilename(void) const { return filename_; }
+
+   // Returns an empty ref if the range is not entirely inside the file
+   BinaryDataRef   getDataRef(uint64_t offset, uint64_t len) const;
+   BinaryRefReader getReader(uint64_t offset=0) const;
+
+   // Hints to the kernel.  No-ops where madvise is not available.
+   void adviseSequential(void);
+   void releaseBefore(uint64_t offset);
+
+private:
+   // Not copyable:  the mapping is released in the destructor
+   BlkFileMap(BlkFileMap const &);
+   BlkFileMap & operator=(BlkFileMap const &);
+
+   string     filename_;
+   uint8_t*   ptr_;
+   uint64_t   size_;
+   uint64_t   releasedTo_;
+   bool       isOpen_;
+
+#ifdef _MSC_VER
+   void*      fileHandle_;
+   void*      mapHandle_;
+#endif
+};
+
+#endif
+// kate: indent-width 3; replace-tabs on;
@@ -25,12 +25,12 @@ void BlockHeader::unserialize(uint8_t const * ptr, uint32_t size)
 {
    if (size < HEADER_SIZE)
       throw BlockDeserializingException();
-   dataCopy_.copyFrom(ptr, HEADER_SIZE);
-   BtcUtils::getHash256(dataCopy_.getPtr(), HEADER_SIZE, thisHash_);
+   memcpy(dataCopy_, ptr, HEADER_SIZE);
+   BtcUtils::getHash256(dataCopy_, HEADER_SIZE, thisHash_);
    difficultyDbl_ = BtcUtils::convertDiffBitsToDouble( 
-                              BinaryDataRef(dataCopy_.getPtr()+72, 4));
+                              BinaryDataRef(dataCopy_+72, 4));
    isInitialized_ = true;
-   nextHash_ = BinaryData(0);
+   memset(nextHash_, 0, 32);
    blockHeight_ = UINT32_MAX;
    difficultySum_ = -1;
    isMainBranch_ = false;
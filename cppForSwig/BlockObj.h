@@ -37,15 +37,16 @@ class BlockHeader
 {
    friend class BlockDataManager_LevelDB;
    friend class InterfaceToLDB;
+   friend class HeaderStore;
 
 public:
 
    /////////////////////////////////////////////////////////////////////////////
    BlockHeader(void) : 
-      isInitialized_(false), 
       numTx_(UINT32_MAX), 
       numBlockBytes_(UINT32_MAX),
-      duplicateID_(UINT8_MAX) {}
+      duplicateID_(UINT8_MAX),
+      isInitialized_(false) { memset(nextHash_, 0, 32); }
 
    explicit BlockHeader(uint8_t const * ptr, uint32_t size) { unserialize(ptr, size); }
    explicit BlockHeader(BinaryRefReader & brr)    { unserialize(brr); }
@@ -56,9 +57,9 @@ public:
    BlockHeader & unserialize_1_(BinaryData const & str) { unserialize(str); return *this; }
 
    uint32_t           getVersion(void) const      { return READ_UINT32_LE(getPtr() );   }
-   BinaryData const & getThisHash(void) const     { return thisHash_;                   }
+   BinaryData         getThisHash(void) const     { return BinaryData(thisHash_, 32);   }
    BinaryData         getPrevHash(void) const     { return BinaryData(getPtr()+4 ,32);  }
-   BinaryData const & getNextHash(void) const     { return nextHash_;                   }
+   BinaryData         getNextHash(void) const     { return BinaryData(nextHash_, 32);   }
    BinaryData         getMerkleRoot(void) const   { return BinaryData(getPtr()+36,32);  }
    BinaryData         getDiffBits(void) const     { return BinaryData(getPtr()+72,4 );  }
    uint32_t           getTimestamp(void) const    { return READ_UINT32_LE(getPtr()+68); }
@@ -70,32 +71,33 @@ public:
    double             getDifficultySum(void) const{ return difficultySum_;              }
 
    /////////////////////////////////////////////////////////////////////////////
-   BinaryDataRef  getThisHashRef(void) const   { return thisHash_.getRef();            }
+   BinaryDataRef  getThisHashRef(void) const   { return BinaryDataRef(thisHash_, 32);  }
    BinaryDataRef  getPrevHashRef(void) const   { return BinaryDataRef(getPtr()+4, 32); }
-   BinaryDataRef  getNextHashRef(void) const   { return nextHash_.getRef();            }
+   BinaryDataRef  getNextHashRef(void) const   { return BinaryDataRef(nextHash_, 32);  }
    BinaryDataRef  getMerkleRootRef(void) const { return BinaryDataRef(getPtr()+36,32); }
    BinaryDataRef  getDiffBitsRef(void) const   { return BinaryDataRef(getPtr()+72,4 ); }
    uint32_t       getNumTx(void) const         { return numTx_; }
 
    /////////////////////////////////////////////////////////////////////////////
-   uint8_t const * getPtr(void) const  { assert(isInitialized_); return dataCopy_.getPtr(); }
-   uint32_t        getSize(void) const { assert(isInitialized_); return dataCopy_.getSize(); }
+   uint8_t const * getPtr(void) const  { assert(isInitialized_); return dataCopy_; }
+   uint32_t        getSize(void) const { assert(isInitialized_); return HEADER_SIZE; }
    uint32_t        isInitialized(void) const { return isInitialized_; }
    uint32_t        getBlockSize(void) const { return numBlockBytes_; }
    void            setBlockSize(uint32_t sz) { numBlockBytes_ = sz; }
    void            setNumTx(uint32_t ntx) { numTx_ = ntx; }
 
    /////////////////////////////////////////////////////////////////////////////
-   void           setBlockFile(string filename)     {blkFile_       = filename;}
    void           setBlockFileNum(uint32_t fnum)    {blkFileNum_    = fnum;}
    void           setBlockFileOffset(uint64_t offs) {blkFileOffset_ = offs;}
+   uint32_t       getBlockFileNum(void) const       {return blkFileNum_;}
+   uint64_t       getBlockFileOffset(void) const    {return blkFileOffset_;}
 
    /////////////////////////////////////////////////////////////////////////////
    void          pprint(ostream & os=cout, int nIndent=0, bool pBigendian=true) const;
    void          pprintAlot(ostream & os=cout);
 
    /////////////////////////////////////////////////////////////////////////////
-   BinaryData    serialize(void)    { return dataCopy_; }
+   BinaryData    serialize(void) const { return BinaryData(dataCopy_, HEADER_SIZE); }
 
 
    /////////////////////////////////////////////////////////////////////////////
@@ -113,33 +115,33 @@ public:
    uint8_t getDuplicateID(void) const { return duplicateID_; }
    void    setDuplicateID(uint8_t d)  { duplicateID_ = d; }
 
-   void clearDataCopy() {dataCopy_.resize(0);}
-
 private:
-   BinaryData     dataCopy_;
-   bool           isInitialized_;
+   // No heap members:  there are a few hundred thousand of these living in
+   // the HeaderStore, so the raw header and both hashes are stored inline
+   // and copying a header is a plain memberwise copy.
+   uint8_t        dataCopy_[HEADER_SIZE];
 
    // Derived properties - we expect these to be set after construct/copy
-   BinaryData     thisHash_;
+   uint8_t        thisHash_[32];
    double         difficultyDbl_;
 
    // Need to compute these later
-   BinaryData     nextHash_;
-   uint32_t       blockHeight_;
+   uint8_t        nextHash_[32];  // all zeros if there is no next block
    double         difficultySum_;
-   bool           isMainBranch_;
-   bool           isOrphan_;
-   bool           isFinishedCalc_;
+   uint32_t       blockHeight_;
    uint32_t       numTx_;
    uint32_t       numBlockBytes_; // includes header + nTx + sum(Tx)
 
-   string         blkFile_;
    uint32_t       blkFileNum_;
    uint64_t       blkFileOffset_;
 
    // Specific to the DB storage
    uint8_t        duplicateID_; // ID of this blk rel to others at same height
 
+   bool           isInitialized_;
+   bool           isMainBranch_;
+   bool           isOrphan_;
+   bool           isFinishedCalc_;
 };
 
 
@@ -741,7 +743,7 @@ public:
    UnspentTxOut(BinaryData const & hash, uint32_t outIndex, uint32_t height, 
                 uint64_t val, BinaryData const & script) :
       txHash_(hash), txOutIndex_(outIndex), txHeight_(height),
-      value_(val), script_(script) {}
+      value_(val), script_(script), numConfirm_(0), isMultisigRef_(false) {}
 
    void init(TxOut & txout, uint32_t blknum, bool isMultiRef=false);
 
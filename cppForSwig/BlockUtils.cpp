@@ -9,7 +9,15 @@
 #include <algorithm>
 #include <time.h>
 #include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <exception>
+#include <atomic>
 #include "BlockUtils.h"
+#include "BlkDirWatcher.h"
 
 
 static void updateBlkDataHeader(InterfaceToLDB* iface, StoredHeader const & sbh)
@@ -19,59 +27,57 @@ static void updateBlkDataHeader(InterfaceToLDB* iface, StoredHeader const & sbh)
 
 
 ////////////////////////////////////////////////////////////////////////////////
-static StoredTx* makeSureSTXInMap(
-            InterfaceToLDB* iface,
-            BinaryDataRef txHash,
-            map<BinaryData, StoredTx> & stxMap,
-            uint64_t* additionalSize)
+// TxOuts updated by themselves (see BlockWriteBatcher::updateStxo) are newer
+// than a copy of their tx just read from the DB or the in-flight batch
+static void applyPendingStxos(StoredTx & stx, 
+                              WriteBatchArena<StoredTxOut> & stxoMap)
 {
-   // TODO:  If we are pruning, we may have completely removed this tx from
-   //        the DB, which means that it won't be in the map or the DB.
-   //        But this method was written before pruning was ever implemented...
-   StoredTx * stxptr;
+   if(stxoMap.empty())
+      return;
 
-   // Get the existing STX or make a new one
-   map<BinaryData, StoredTx>::iterator txIter = stxMap.find(txHash);
-   if(ITER_IN_MAP(txIter, stxMap))
-      stxptr = &(txIter->second);
-   else
+   map<uint16_t, StoredTxOut>::iterator iter;
+   for(iter = stx.stxoMap_.begin(); iter != stx.stxoMap_.end(); iter++)
    {
-      StoredTx stxTemp;
-      iface->getStoredTx(stxTemp, txHash);
-      stxMap[txHash] = stxTemp;
-      stxptr = &stxMap[txHash];
-      if (additionalSize)
-         *additionalSize += stxptr->numBytes_;
+      BinaryData stxoKey = DBUtils.getBlkDataKeyNoPrefix(stx.blockHeight_,
+                                                         stx.duplicateID_,
+                                                         stx.txIndex_,
+                                                         iter->first);
+      StoredTxOut * pending = stxoMap.find(stxoKey);
+      if(pending != NULL)
+         iter->second = *pending;
    }
-   
-   return stxptr;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// This avoids having to do the double-lookup when fetching by hash.
-// We still pass in the hash anyway, because the map is indexed by the hash,
-// and we'd like to not have to do a lookup for the hash if only provided
-// {hgt, dup, idx}
 static StoredTx* makeSureSTXInMap(
             InterfaceToLDB* iface,
-            uint32_t hgt,
-            uint8_t  dup,
-            uint16_t txIdx,
-            BinaryDataRef txHash,
-            map<BinaryData, StoredTx> & stxMap,
+            BinaryData const & txHash,
+            WriteBatchArena<StoredTx> & stxMap,
+            WriteBatchArena<StoredTx> * inFlightMap,
+            WriteBatchArena<StoredTxOut> & stxoMap,
+            WriteBatchArena<StoredTxOut> * stxoInFlightMap,
             uint64_t* additionalSize)
 {
-   StoredTx * stxptr;
+   // TODO:  If we are pruning, we may have completely removed this tx from
+   //        the DB, which means that it won't be in the map or the DB.
+   //        But this method was written before pruning was ever implemented...
+   
+   // Get the existing STX or make a new one.  The batch being written in
+   // the background is newer than the DB.
+   StoredTx * stxptr = stxMap.find(txHash);
+   if(stxptr == NULL)
+   {
+      StoredTx * inFlight = inFlightMap->find(txHash);
+      if(inFlight != NULL)
+         stxptr = &stxMap.set(txHash, *inFlight);
+      else
+      {
+         stxptr = &stxMap.getOrCreate(txHash);
+         iface->getStoredTx(*stxptr, txHash);
+      }
+      applyPendingStxos(*stxptr, *stxoInFlightMap);
+      applyPendingStxos(*stxptr, stxoMap);
 
-   // Get the existing STX or make a new one
-   map<BinaryData, StoredTx>::iterator txIter = stxMap.find(txHash);
-   if(ITER_IN_MAP(txIter, stxMap))
-      stxptr = &(txIter->second);
-   else
-   {
-      StoredTx &stxTemp = stxMap[txHash];
-      iface->getStoredTx(stxTemp, hgt, dup, txIdx);
-      stxptr = &stxMap[txHash];
       if (additionalSize)
          *additionalSize += stxptr->numBytes_;
    }
@@ -81,45 +87,52 @@ static StoredTx* makeSureSTXInMap(
 
 static StoredScriptHistory* makeSureSSHInMap(
             InterfaceToLDB* iface,
-            BinaryDataRef uniqKey,
-            BinaryDataRef hgtX,
-            map<BinaryData, StoredScriptHistory> & sshMap,
+            BinaryData const & uniqKey,
+            BinaryData const & hgtX,
+            WriteBatchArena<StoredScriptHistory> & sshMap,
+            WriteBatchArena<StoredScriptHistory> * inFlightMap,
             uint64_t* additionalSize,
             bool createIfDNE=true)
 {
    SCOPED_TIMER("makeSureSSHInMap");
-   StoredScriptHistory * sshptr;
 
    // If already in Map
-   map<BinaryData, StoredScriptHistory>::iterator iter = sshMap.find(uniqKey);
-   if(ITER_IN_MAP(iter, sshMap))
+   StoredScriptHistory * sshptr = sshMap.find(uniqKey);
+   StoredScriptHistory * inFlight;
+   if(sshptr != NULL)
    {
       SCOPED_TIMER("___SSH_AlreadyInMap");
-      sshptr = &(iter->second);
+   }
+   else if((inFlight = inFlightMap->find(uniqKey)) != NULL)
+   {
+      // Still being written to the DB, the in-flight copy is the latest
+      sshptr = &sshMap.set(uniqKey, *inFlight);
+      if (additionalSize)
+         *additionalSize += UPDATE_BYTES_SSH;
    }
    else
    {
-      StoredScriptHistory sshTemp;
-      
-      iface->getStoredScriptHistorySummary(sshTemp, uniqKey);
-      // sshTemp.alreadyScannedUpToBlk_ = getAppliedToHeightInDB(); TODO
+      // Read the summary straight into the batch record
+      sshptr = &sshMap.getOrCreate(uniqKey);
+      iface->getStoredScriptHistorySummary(*sshptr, uniqKey);
+      // sshptr->alreadyScannedUpToBlk_ = getAppliedToHeightInDB(); TODO
       if (additionalSize)
          *additionalSize += UPDATE_BYTES_SSH;
-      if(sshTemp.isInitialized())
+      if(sshptr->isInitialized())
       {
          SCOPED_TIMER("___SSH_AlreadyInDB");
-         // We already have an SSH in DB -- pull it into the map
-         sshMap[uniqKey] = sshTemp; 
-         sshptr = &sshMap[uniqKey];
+         // We already have an SSH in DB -- it's in the map now
       }
       else
       {
          SCOPED_TIMER("___SSH_NeedCreate");
          if(!createIfDNE)
+         {
+            sshMap.erase(uniqKey);
             return NULL;
+         }
 
-         sshMap[uniqKey] = StoredScriptHistory(); 
-         sshptr = &sshMap[uniqKey];
+         *sshptr = StoredScriptHistory(); 
          sshptr->uniqueKey_ = uniqKey;
       }
    }
@@ -137,6 +150,39 @@ static StoredScriptHistory* makeSureSSHInMap(
    return sshptr;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Same bytes as DBUtils.getBlkDataKeyNoPrefix(hgt, dup, txIdx, ioIdx), but
+// written into an existing buffer:  hgtX, then txIdx and ioIdx big-endian.
+// The first four bytes are the hgtX of the SSH sub-history.
+static void writeTxIOKey(BinaryData & key,
+                         uint32_t hgt, uint8_t dup, uint16_t txIdx, uint16_t ioIdx)
+{
+   key.resize(8);
+   uint8_t* ptr = key.getPtr();
+   uint32_t hgtx = (hgt<<8) | (uint32_t)dup;
+   ptr[0] = (uint8_t)(hgtx >> 24);
+   ptr[1] = (uint8_t)(hgtx >> 16);
+   ptr[2] = (uint8_t)(hgtx >>  8);
+   ptr[3] = (uint8_t)(hgtx      );
+   ptr[4] = (uint8_t)(txIdx >> 8);
+   ptr[5] = (uint8_t)(txIdx     );
+   ptr[6] = (uint8_t)(ioIdx >> 8);
+   ptr[7] = (uint8_t)(ioIdx     );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The serialized OutPoint, same as in a TxIn, which is the UTXO set key
+static void writeOutPoint(BinaryData & op, BinaryDataRef txHash, uint32_t txOutIdx)
+{
+   op.resize(36);
+   txHash.copyTo(op.getPtr(), 32);
+   uint8_t* ptr = op.getPtr() + 32;
+   ptr[0] = (uint8_t)(txOutIdx      );
+   ptr[1] = (uint8_t)(txOutIdx >>  8);
+   ptr[2] = (uint8_t)(txOutIdx >> 16);
+   ptr[3] = (uint8_t)(txOutIdx >> 24);
+}
+
 
 
 
@@ -431,6 +477,9 @@ void BtcWallet::addScrAddress(HashString    scrAddr,
    *addrPtr = ScrAddrObj(scrAddr, firstTimestamp, firstBlockNum,
                                   lastTimestamp,  lastBlockNum);
    scrAddrPtrs_.push_back(addrPtr);
+   scrAddrMatcher_.insert(scrAddr);
+   if(scrAddr.getSize() == SCRADDR_MATCH_KEY_LEN)
+      scrAddrIndex_[ScrAddrKey(scrAddr.getPtr())] = addrPtr;
 
    // Default behavior is "don't know, must rescan" if no firstBlk is spec'd
    if(bdmPtr_!=NULL)
@@ -447,6 +496,9 @@ void BtcWallet::addNewScrAddress(BinaryData scrAddr)
    ScrAddrObj* addrPtr = &(scrAddrMap_[scrAddr]);
    *addrPtr = ScrAddrObj(scrAddr, 0,0, 0,0); 
    scrAddrPtrs_.push_back(addrPtr);
+   scrAddrMatcher_.insert(scrAddr);
+   if(scrAddr.getSize() == SCRADDR_MATCH_KEY_LEN)
+      scrAddrIndex_[ScrAddrKey(scrAddr.getPtr())] = addrPtr;
 
    if(bdmPtr_!=NULL)
       bdmPtr_->registerNewScrAddr(scrAddr);
@@ -464,6 +516,9 @@ void BtcWallet::addScrAddress(ScrAddrObj const & newScrAddr)
       ScrAddrObj * addrPtr = &(scrAddrMap_[newScrAddr.getScrAddr()]);
       *addrPtr = newScrAddr;
       scrAddrPtrs_.push_back(addrPtr);
+      scrAddrMatcher_.insert(newScrAddr.getScrAddr());
+      if(newScrAddr.getScrAddr().getSize() == SCRADDR_MATCH_KEY_LEN)
+         scrAddrIndex_[ScrAddrKey(newScrAddr.getScrAddr().getPtr())] = addrPtr;
    }
 
    if(bdmPtr_!=NULL)
@@ -515,10 +570,30 @@ bool BtcWallet::hasScrAddress(HashString const & scrAddr) const
 
 
 /////////////////////////////////////////////////////////////////////////////
+// Same as below on our own txioMap_, but through txioIndex_:  each TxIn is
+// looked up by its raw outpoint bytes, nothing is allocated
 pair<bool,bool> BtcWallet::isMineBulkFilter(Tx & tx, 
                                             bool withMultiSig) const
 {
-   return isMineBulkFilter(tx, txioMap_, withMultiSig);
+   uint8_t const * txStartPtr = tx.getPtr();
+   for(uint32_t iin=0; iin<tx.getNumTxIn(); iin++)
+   {
+      OutPointKey opKey(txStartPtr + tx.getTxInOffset(iin));
+      if(txioIndex_.find(opKey) != txioIndex_.end())
+         return pair<bool,bool>(true,true);
+   }
+
+   for(uint32_t iout=0; iout<tx.getNumTxOut(); iout++)
+   {
+      uint32_t txOutStart = tx.getTxOutOffset(iout);
+      uint32_t txOutSize  = tx.getTxOutOffset(iout+1) - txOutStart;
+      if(scrAddrMatcher_.containsTxOut(txStartPtr + txOutStart, 
+                                       txOutSize, 
+                                       withMultiSig))
+         return pair<bool,bool>(true,false);
+   }
+
+   return pair<bool,bool>(false,false);
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -535,11 +610,12 @@ pair<bool,bool> BtcWallet::isMineBulkFilter(
    // we will skip the TxIn/TxOut convenience methods and follow the
    // pointers directly to the data we want
 
+   // Not static:  wallets are scanned from several threads at once
    uint8_t const * txStartPtr = tx.getPtr();
+   OutPoint op;
    for(uint32_t iin=0; iin<tx.getNumTxIn(); iin++)
    {
       // We have the txin, now check if it contains one of our TxOuts
-      static OutPoint op;
       op.unserialize(txStartPtr + tx.getTxInOffset(iin), 
                      tx.getSize()-tx.getTxInOffset(iin));
       if(KEY_IN_MAP(op, txiomap))
@@ -548,70 +624,16 @@ pair<bool,bool> BtcWallet::isMineBulkFilter(
 
    // TxOuts are a little more complicated, because we have to process each
    // different type separately.  Nonetheless, 99% of transactions use the
-   // 25-byte repr which is ridiculously fast
+   // 25-byte repr which is ridiculously fast.  Multisig may be 
+   // compute-intensive, so it's opt-in only
    for(uint32_t iout=0; iout<tx.getNumTxOut(); iout++)
    {
-      static uint8_t scriptLenFirstByte;
-      static HashString scrAddr(20);
-
-      uint8_t const * ptr = (txStartPtr + tx.getTxOutOffset(iout) + 8);
-      scriptLenFirstByte = *(uint8_t*)ptr;
-      if(scriptLenFirstByte == 25)
-      {
-         // Std TxOut with 25-byte script
-         scrAddr.copyFrom(ptr+4, 20);
-         if( hasScrAddress(HASH160PREFIX + scrAddr) )
-            return pair<bool,bool>(true,false);
-      }
-      if(scriptLenFirstByte == 23)
-      {
-         // Std P2SH with 23-byte script
-         scrAddr.copyFrom(ptr+3, 20);
-         if( hasScrAddress(P2SHPREFIX + scrAddr) )
-            return pair<bool,bool>(true,false);
-      }
-      else if(scriptLenFirstByte==67)
-      {
-         // Std spend-coinbase TxOut script
-         static HashString scrAddr(20);
-         BtcUtils::getHash160_NoSafetyCheck(ptr+2, 65, scrAddr);
-         if( hasScrAddress(HASH160PREFIX + scrAddr) )
-            return pair<bool,bool>(true,false);
-      }
-      else if(scriptLenFirstByte==35)
-      {
-         // Std spend-coinbase TxOut script
-         static HashString scrAddr(20);
-         BtcUtils::getHash160_NoSafetyCheck(ptr+2, 33, scrAddr);
-         if( hasScrAddress(HASH160PREFIX + scrAddr) )
-            return pair<bool,bool>(true,false);
-      }
-      else if(withMultiSig)
-      {
-         // This branch may be compute-intensive, so it's opt-in only
-         uint32_t viStart  = tx.getTxOutOffset(iout) + 8;
-         uint32_t txOutEnd = tx.getTxOutOffset(iout+1);
-         if(txStartPtr[txOutEnd-1] == OP_CHECKMULTISIG)
-         {
-            BinaryRefReader brr(ptr, txOutEnd-viStart);
-            uint64_t scrsz = brr.get_var_int();
-            BinaryDataRef scr = brr.get_BinaryDataRef((uint32_t)scrsz);
-   
-            BinaryData msigkey = BtcUtils::getMultisigUniqueKey(scr); 
-            if(msigkey.getSize() == 0)
-               continue;
-        
-            if(hasScrAddress(MSIGPREFIX + msigkey))
-               return pair<bool,bool>(true,false);
-
-            BinaryRefReader brrmsig(msigkey);
-            uint8_t M = brrmsig.get_uint8_t();
-            uint8_t N = brrmsig.get_uint8_t();
-            for(uint8_t a=0; a<N; a++)
-               if(hasScrAddress(HASH160PREFIX + brr.get_BinaryDataRef(20)))
-                  return pair<bool,bool>(true,false);
-         }
-      }
+      uint32_t txOutStart = tx.getTxOutOffset(iout);
+      uint32_t txOutSize  = tx.getTxOutOffset(iout+1) - txOutStart;
+      if(scrAddrMatcher_.containsTxOut(txStartPtr + txOutStart, 
+                                       txOutSize, 
+                                       withMultiSig))
+         return pair<bool,bool>(true,false);
 
        
       // Try to flag non-standard scripts
@@ -806,7 +828,7 @@ void BlockDataManager_LevelDB::registeredScrAddrScan(
    uint32_t nTxOut = txOutOffsets->size()-1;
    
 
-   if(registeredScrAddrMap_.size() == 0)
+   if(registeredScrAddrMatcher_.empty())
       return;
 
    uint8_t const * txStartPtr = txptr;
@@ -827,48 +849,14 @@ void BlockDataManager_LevelDB::registeredScrAddrScan(
    // ours on future to-be-scanned transactions
    for(uint32_t iout=0; iout<nTxOut; iout++)
    {
-      static uint8_t scriptLenFirstByte;
-      static HashString addr160(20);
-
-      uint8_t const * ptr = (txStartPtr + (*txOutOffsets)[iout] + 8);
-      scriptLenFirstByte = *(uint8_t*)ptr;
-      if(scriptLenFirstByte == 25)
-      {
-         // Std TxOut with 25-byte script
-         addr160.copyFrom(ptr+4, 20);
-         if( scrAddrIsRegistered(HASH160PREFIX + addr160) )
-         {
-            HashString txHash = BtcUtils::getHash256(txptr, txSize);
-            insertRegisteredTxIfNew(txHash);
-            registeredOutPoints_.insert(OutPoint(txHash, iout));
-         }
-      }
-      else if(scriptLenFirstByte==67)
-      {
-         // Std spend-coinbase TxOut script
-         BtcUtils::getHash160_NoSafetyCheck(ptr+2, 65, addr160);
-         if( scrAddrIsRegistered(HASH160PREFIX + addr160) )
-         {
-            HashString txHash = BtcUtils::getHash256(txptr, txSize);
-            insertRegisteredTxIfNew(txHash);
-            registeredOutPoints_.insert(OutPoint(txHash, iout));
-         }
-      }
-      else
+      uint32_t txOutStart = (*txOutOffsets)[iout];
+      uint32_t txOutSize  = (*txOutOffsets)[iout+1] - txOutStart;
+      if( registeredScrAddrMatcher_.containsTxOut(txStartPtr + txOutStart, 
+                                                  txOutSize) )
       {
-         /* TODO:  Right now we will just ignoring non-std tx
-                   I don't do anything with them right now, anyway
-         TxOut txout = tx.getTxOutCopy(iout);
-         for(uint32_t i=0; i<scrAddrPtrs_.size(); i++)
-         {
-            ScrAddrObj & thisAddr = *(scrAddrPtrs_[i]);
-            HashString const & scraddr = thisAddr.getScrAddr();
-            if(txout.getScriptRef().find(thisAddr.getScrAddr()) > -1)
-               scanNonStdTx(0, 0, tx, iout, thisAddr);
-            continue;
-         }
-         //break;
-         */
+         HashString txHash = BtcUtils::getHash256(txptr, txSize);
+         insertRegisteredTxIfNew(txHash);
+         registeredOutPoints_.insert(OutPoint(txHash, iout));
       }
    }
 }
@@ -884,12 +872,9 @@ void BlockDataManager_LevelDB::registeredScrAddrScan(
 // creating multiple iterators on the iface_ side.  Until then, 
 // we can't use registeredScrAddrScan.
 //
-void BlockDataManager_LevelDB::registeredScrAddrScan_IterSafe( 
-                                            StoredTx & stx,
-                                            vector<uint32_t> * txInOffsets,
-                                            vector<uint32_t> * txOutOffsets)
+void BlockDataManager_LevelDB::registeredScrAddrScan_IterSafe(StoredTx & stx)
 {
-   if(registeredScrAddrMap_.size() == 0)
+   if(registeredScrAddrMatcher_.empty())
       return;
 
    if(!stx.isInitialized())
@@ -898,96 +883,59 @@ void BlockDataManager_LevelDB::registeredScrAddrScan_IterSafe(
       return;
    }
 
-   // Probably doesn't matter, but I'll keep these on the heap between calls
-   static vector<uint32_t> localOffsIn;
-   static vector<uint32_t> localOffsOut;
+   // New outpoints go straight into registeredOutPoints_, so that we can 
+   // identify TxIns that are ours on future to-be-scanned transactions
+   if(findRegisteredTxIO(stx, registeredOutPoints_))
+      insertRegisteredTxIfNew(TxRef(stx.getDBKey(false)),
+                              stx.thisHash_,
+                              stx.blockHeight_,
+                              stx.txIndex_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Checks one tx against the registered scrAddrs and outpoints.  Outputs paying
+// to a registered scrAddr are added to newOutPoints, and the TxIns are checked
+// against both registeredOutPoints_ and newOutPoints.  Nothing else is 
+// modified, so the rescan threads can all call this at once.
+bool BlockDataManager_LevelDB::findRegisteredTxIO(StoredTx const & stx,
+                                                  set<OutPoint> & newOutPoints)
+{
+   // Can't be checked without all the TxOuts (and getTxCopy would log)
+   if(!stx.isInitialized() || !stx.haveAllTxOut())
+      return false;
 
    Tx tx = stx.getTxCopy();
    uint8_t const * txStartPtr = tx.getPtr();
+   bool isRelevant = false;
 
-   if(txInOffsets==NULL || txOutOffsets==NULL)
-   {
-      txInOffsets  = &localOffsIn;
-      txOutOffsets = &localOffsOut;
-      BtcUtils::TxCalcLength(txStartPtr, tx.getSize(), txInOffsets, txOutOffsets);
-   }
-   
-   uint32_t nTxIn  = txInOffsets->size()-1;
-   uint32_t nTxOut = txOutOffsets->size()-1;
-   
-   for(uint32_t iin=0; iin<nTxIn; iin++)
+   OutPoint op;
+   for(uint32_t iin=0; iin<tx.getNumTxIn(); iin++)
    {
       // We have the txin, now check if it spends one of our TxOuts
-      static OutPoint op;
-      op.unserialize(txStartPtr + (*txInOffsets)[iin], tx.getSize()-(*txInOffsets)[iin]);
-      if(registeredOutPoints_.count(op) > 0)
+      uint32_t offset = tx.getTxInOffset(iin);
+      op.unserialize(txStartPtr + offset, tx.getSize() - offset);
+      if(registeredOutPoints_.count(op) > 0 || newOutPoints.count(op) > 0)
       {
-         insertRegisteredTxIfNew(tx.getTxRef(),
-                                 stx.thisHash_,
-                                 stx.blockHeight_,
-                                 stx.txIndex_);
+         isRelevant = true;
          break; // we only care if ANY txIns are ours, not which ones
       }
    }
 
-   // We have to scan all TxOuts regardless, to make sure our list of 
-   // registeredOutPoints_ is up-to-date so that we can identify TxIns that are
-   // ours on future to-be-scanned transactions
-   for(uint32_t iout=0; iout<nTxOut; iout++)
+   // We have to scan all TxOuts regardless, to make sure the new outpoints
+   // are all recorded
+   for(uint32_t iout=0; iout<tx.getNumTxOut(); iout++)
    {
-      static uint8_t scriptLenFirstByte;
-      static HashString addr160(20);
-      static HashString scrAddr;
-
-      uint8_t const * ptr = (txStartPtr + (*txOutOffsets)[iout] + 8);
-      scriptLenFirstByte = *(uint8_t*)ptr;
-      if(scriptLenFirstByte == 25)
-      {
-         // Std TxOut with 25-byte script
-         addr160.copyFrom(ptr+4, 20);
-         scrAddr = HASH160PREFIX + addr160;
-      }
-      else if(scriptLenFirstByte==67)
-      {
-         // Std spend-coinbase TxOut script
-         BtcUtils::getHash160_NoSafetyCheck(ptr+2, 65, addr160);
-         scrAddr = HASH160PREFIX + addr160;
-      }
-      else if(scriptLenFirstByte==35)
-      {
-         // Compressed public key
-         BtcUtils::getHash160_NoSafetyCheck(ptr+2, 33, addr160);
-         scrAddr = HASH160PREFIX + addr160;
-      }
-      else
-      {
-         /* TODO:  Right now we will just ignoring non-std tx
-                   I don't do anything with them right now, anyway
-         scrAddr = getTxOutScrAddr(stx.stxoMap_[iout].getScript());
-
-         // Old code for scanning non-std txout... 
-         TxOut txout = tx.getTxOutCopy(iout);
-         for(uint32_t i=0; i<scrAddrPtrs_.size(); i++)
-         {
-            ScrAddrObj & thisAddr = *(scrAddrPtrs_[i]);
-            HashString const & scraddr = thisAddr.getScrAddr();
-            if(txout.getScriptRef().find(thisAddr.getScrAddr()) > -1)
-               scanNonStdTx(0, 0, tx, iout, thisAddr);
-            continue;
-         }
-         //break;
-         */
-      }
+      uint32_t txOutStart = tx.getTxOutOffset(iout);
+      uint32_t txOutSize  = tx.getTxOutOffset(iout+1) - txOutStart;
+      if(!registeredScrAddrMatcher_.containsTxOut(txStartPtr + txOutStart, 
+                                                  txOutSize))
+         continue;
 
-      if(scrAddrIsRegistered(scrAddr))
-      {
-         insertRegisteredTxIfNew(tx.getTxRef(),
-                                 stx.thisHash_,
-                                 stx.blockHeight_,
-                                 stx.txIndex_);
-         registeredOutPoints_.insert(OutPoint(stx.thisHash_, iout));
-      }
+      isRelevant = true;
+      newOutPoints.insert(OutPoint(stx.thisHash_, iout));
    }
+
+   return isRelevant;
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -1017,117 +965,56 @@ void BtcWallet::scanTx(Tx & tx,
    int64_t totalLedgerAmt = 0;
    bool isZeroConf = blknum==UINT32_MAX;
 
-   vector<bool> thisTxOutIsOurs(tx.getNumTxOut(), false);
+   // Everything is read off the raw tx, through the offsets Tx already has
+   // from TxCalcLength.  Nothing is copied, hashed or allocated until one
+   // of the TxIns or TxOuts turns out to be ours, and 99.9%+ of the tx a
+   // big scan goes through aren't.
+   uint8_t const * txPtr = tx.getPtr();
+   uint32_t numTxIn  = tx.getNumTxIn();
+   uint32_t numTxOut = tx.getNumTxOut();
 
-   pair<bool,bool> boolPair = isMineBulkFilter(tx);
-   bool txIsRelevant  = boolPair.first;
-   bool anyTxInIsOurs = boolPair.second;
-
-   if( !txIsRelevant )
-      return;
+   // Filled in with the first TxIn/TxOut that's ours
+   BinaryData txHash;
 
    // We distinguish "any" from "anyNew" because we want to avoid re-adding
    // transactions/TxIOPairs that are already part of the our tx list/ledger
    // but we do need to determine if this was sent-to-self, regardless of 
    // whether it was new.
+   bool anyTxInIsOurs      = false;
    bool anyNewTxInIsOurs   = false;
    bool anyNewTxOutIsOurs  = false;
    bool isCoinbaseTx       = false;
+   uint32_t numTxOutOurs   = 0;
 
-   map<HashString, ScrAddrObj>::iterator addrIter;
    ScrAddrObj* thisAddrPtr;
-   HashString  scraddr;
 
    bool savedAsTxIn = false;
 
    ///// LOOP OVER ALL TXIN IN TX /////
-   for(uint32_t iin=0; iin<tx.getNumTxIn(); iin++)
+   // A TxIn that spends one of our TxIOs makes the tx relevant by itself, so
+   // the lookup and the ledger work are done in the same pass
+   for(uint32_t iin=0; iin<numTxIn; iin++)
    {
-      TxIn txin = tx.getTxInCopy(iin);
-      OutPoint outpt = txin.getOutPoint();
+      uint8_t const * outPointPtr = txPtr + tx.getTxInOffset(iin);
+
       // Empty hash in Outpoint means it's a COINBASE tx --> no addr inputs
-      if(outpt.getTxHashRef() == BtcUtils::EmptyHash_)
+      if(memcmp(outPointPtr, BtcUtils::EmptyHash_.getPtr(), 32) == 0)
       {
          isCoinbaseTx = true;
          continue;
       }
 
       // We have the txin, now check if it contains one of our TxOuts
-      map<OutPoint, TxIOPair>::iterator txioIter = txioMap_.find(outpt);
-      //bool txioWasInMapAlready = (txioIter != txioMap_.end());
-      bool txioWasInMapAlready = ITER_IN_MAP(txioIter, txioMap_);
-      if(txioWasInMapAlready)
-      {
-         // If we are here, we know that this input is spending an 
-         // output owned by this wallet.
-         // We will get here for every address in the search, even 
-         // though it is only relevant to one of the addresses.
-         TxIOPair & txio  = txioIter->second;
-         TxOut txout = txio.getTxOutCopy();
-
-         // It's our TxIn, so address should be in this wallet
-         scraddr  = txout.getScrAddressStr();
-         addrIter = scrAddrMap_.find(scraddr);
-         //if( addrIter == scrAddrMap_.end())
-         if(ITER_NOT_IN_MAP(addrIter, scrAddrMap_))
-         {
-            // Have TxIO but address is not in the map...?
-            LOGERR << "ERROR: TxIn in TxIO map, but addr not in wallet...?";
-            continue;
-         }
-         thisAddrPtr = &addrIter->second;
-
-         // We need to make sure the ledger entry makes sense, and make
-         // sure we update TxIO objects appropriately
-         int64_t thisVal = (int64_t)txout.getValue();
-         totalLedgerAmt -= thisVal;
-
-         // Skip, if zero-conf-spend, but it's already got a zero-conf
-         if( isZeroConf && txio.hasTxInZC() )
-            return; // this tx can't be valid, might as well bail now
-
-         if( !txio.hasTxInInMain() && !(isZeroConf && txio.hasTxInZC())  )
-         {
-            // isValidNew only identifies whether this set-call succeeded
-            // If it didn't, it's because this is from a zero-conf tx but this 
-            // TxIn already exists in the blockchain spending the same output.
-            // (i.e. we have a ref to the prev output, but it's been spent!)
-            bool isValidNew;
-            if(isZeroConf)
-               isValidNew = txio.setTxInZC(&tx, iin);
-            else
-               isValidNew = txio.setTxIn(tx.getTxRef(), iin);
-
-            if(!isValidNew)
-               continue;
-
-            anyNewTxInIsOurs = true;
-
-            LedgerEntry newEntry(scraddr, 
-                                -(int64_t)thisVal,
-                                 blknum, 
-                                 tx.getThisHash(), 
-                                 iin,
-                                 txtime,
-                                 isCoinbaseTx,
-                                 false,  // SentToSelf is meaningless for addr ledger
-                                 false); // "isChangeBack" is meaningless for TxIn
-            thisAddrPtr->addLedgerEntry(newEntry, isZeroConf);
-
-            txLedgerForComments_.push_back(newEntry);
-            savedAsTxIn = true;
-
-            // Update last seen on the network
-            thisAddrPtr->setLastTimestamp(txtime);
-            thisAddrPtr->setLastBlockNum(blknum);
-         }
-      }
-      else
+      TxIOIndex::iterator idxIter = txioIndex_.find(OutPointKey(outPointPtr));
+      if(idxIter == txioIndex_.end())
       {
          // Lots of txins that we won't have, this is a normal conditional
          // But we should check the non-std txio list since it may actually
          // be there
-         //if(nonStdTxioMap_.find(outpt) != nonStdTxioMap_.end())
+         if(nonStdTxioMap_.size() == 0)
+            continue;
+
+         OutPoint outpt(outPointPtr, 36);
          if(KEY_IN_MAP(outpt, nonStdTxioMap_))
          {
             if(isZeroConf)
@@ -1136,136 +1023,223 @@ void BtcWallet::scanTx(Tx & tx,
                nonStdTxioMap_[outpt].setTxIn(tx.getTxRef(), iin);
             nonStdUnspentOutPoints_.erase(outpt);
          }
+         continue;
+      }
+
+      // If we are here, we know that this input is spending an 
+      // output owned by this wallet, and the index knows which address
+      // that output paid to
+      anyTxInIsOurs = true;
+      if(txHash.getSize() == 0)
+         txHash = tx.getThisHash();
+
+      TxIOPair & txio = *idxIter->second.txio_;
+      thisAddrPtr     =  idxIter->second.scrAddr_;
+
+      // We need to make sure the ledger entry makes sense, and make
+      // sure we update TxIO objects appropriately
+      int64_t thisVal = (int64_t)txio.getValue();
+      totalLedgerAmt -= thisVal;
+
+      // Skip, if zero-conf-spend, but it's already got a zero-conf
+      if( isZeroConf && txio.hasTxInZC() )
+         return; // this tx can't be valid, might as well bail now
+
+      if( !txio.hasTxInInMain() && !(isZeroConf && txio.hasTxInZC())  )
+      {
+         // isValidNew only identifies whether this set-call succeeded
+         // If it didn't, it's because this is from a zero-conf tx but this 
+         // TxIn already exists in the blockchain spending the same output.
+         // (i.e. we have a ref to the prev output, but it's been spent!)
+         bool isValidNew;
+         if(isZeroConf)
+            isValidNew = txio.setTxInZC(&tx, iin);
+         else
+            isValidNew = txio.setTxIn(tx.getTxRef(), iin);
+
+         if(!isValidNew)
+            continue;
+
+         anyNewTxInIsOurs = true;
+
+         LedgerEntry newEntry(thisAddrPtr->getScrAddr(), 
+                             -(int64_t)thisVal,
+                              blknum, 
+                              txHash, 
+                              iin,
+                              txtime,
+                              isCoinbaseTx,
+                              false,  // SentToSelf is meaningless for addr ledger
+                              false); // "isChangeBack" is meaningless for TxIn
+         thisAddrPtr->addLedgerEntry(newEntry, isZeroConf);
+
+         txLedgerForComments_.push_back(newEntry);
+         savedAsTxIn = true;
+
+         // Update last seen on the network
+         thisAddrPtr->setLastTimestamp(txtime);
+         thisAddrPtr->setLastBlockNum(blknum);
       }
    } // loop over TxIns
 
+   // Same test as isMineBulkFilter for the TxOuts:  multisig only counts 
+   // when something else already made the tx relevant
+   bool txIsRelevant = anyTxInIsOurs;
+   for(uint32_t iout=0; iout<numTxOut && !txIsRelevant; iout++)
+   {
+      uint32_t txOutStart = tx.getTxOutOffset(iout);
+      txIsRelevant = scrAddrMatcher_.containsTxOut(
+                                 txPtr + txOutStart, 
+                                 tx.getTxOutOffset(iout+1) - txOutStart,
+                                 false);
+   }
+
+   if( !txIsRelevant )
+      return;
 
-   //ScrAddrObj & thisAddr = *(scrAddrPtrs_[i]);
-   //HashString const & scraddr = thisAddr.getScrAddr();
+   if(txHash.getSize() == 0)
+      txHash = tx.getThisHash();
 
    ///// LOOP OVER ALL TXOUT IN TX /////
-   for(uint32_t iout=0; iout<tx.getNumTxOut(); iout++)
+   BinaryData scraddr;
+   for(uint32_t iout=0; iout<numTxOut; iout++)
    {
-      TxOut txout = tx.getTxOutCopy(iout);
-      if( txout.getScriptType() == TXOUT_SCRIPT_NONSTANDARD )
-      {
-         //if(txout.getScriptRef().find(scraddr) > -1)
-            //scanNonStdTx(blknum, txIndex, tx, iout, *thisAddrPtr);
+      uint32_t txOutStart = tx.getTxOutOffset(iout);
+      uint32_t txOutSize  = tx.getTxOutOffset(iout+1) - txOutStart;
+      uint8_t const * txOutPtr = txPtr + txOutStart;
+
+      // Rejects non-standard scripts and nearly all the TxOuts that aren't
+      // ours.  For multisig, any of its addresses is a hit here, but only
+      // the unique key counts below.
+      if(!scrAddrMatcher_.containsTxOut(txOutPtr, txOutSize))
          continue;
+
+      uint32_t viLen;
+      uint32_t scrLen = (uint32_t)BtcUtils::readVarInt(txOutPtr+8, 
+                                                        txOutSize-8, 
+                                                        &viLen);
+      BtcUtils::getTxOutScrAddr(BinaryDataRef(txOutPtr+8+viLen, scrLen), 
+                                scraddr);
+
+      thisAddrPtr = NULL;
+      if(scraddr.getSize() == SCRADDR_MATCH_KEY_LEN)
+      {
+         ScrAddrIndex::iterator addrIter;
+         addrIter = scrAddrIndex_.find(ScrAddrKey(scraddr.getPtr()));
+         if(addrIter != scrAddrIndex_.end())
+            thisAddrPtr = addrIter->second;
+      }
+      else
+      {
+         map<HashString, ScrAddrObj>::iterator addrIter;
+         addrIter = scrAddrMap_.find(scraddr);
+         if(ITER_IN_MAP(addrIter, scrAddrMap_))
+            thisAddrPtr = &addrIter->second;
       }
 
-      scraddr   = txout.getScrAddressStr();
-      addrIter = scrAddrMap_.find(scraddr);
-      //if( addrIter != scrAddrMap_.end())
-      if(ITER_IN_MAP(addrIter, scrAddrMap_))
+      if(thisAddrPtr == NULL)
+         continue;
+
+      // If we got here, at least this TxOut is for this address.
+      // But we still need to find out if it's new and update
+      // ledgers/TXIOs appropriately
+      int64_t thisVal = (int64_t)READ_UINT64_LE(txOutPtr);
+      totalLedgerAmt += thisVal;
+
+      OutPointKey opKey(txHash.getPtr(), iout);
+      TxIOIndex::iterator idxIter = txioIndex_.find(opKey);
+      bool txioWasInMapAlready = (idxIter != txioIndex_.end());
+      bool doAddLedgerEntry = false;
+      TxIOPair* txioPtr;
+      if(txioWasInMapAlready)
       {
-         thisAddrPtr = &addrIter->second;
-         // If we got here, at least this TxOut is for this address.
-         // But we still need to find out if it's new and update
-         // ledgers/TXIOs appropriately
-         int64_t thisVal = (int64_t)(txout.getValue());
-         totalLedgerAmt += thisVal;
-
-         OutPoint outpt(tx.getThisHash(), iout);      
-         map<OutPoint, TxIOPair>::iterator txioIter = txioMap_.find(outpt);
-         //bool txioWasInMapAlready = (txioIter != txioMap_.end());
-         bool txioWasInMapAlready = ITER_IN_MAP(txioIter, txioMap_);
-         bool doAddLedgerEntry = false;
-         if(txioWasInMapAlready)
+         txioPtr = idxIter->second.txio_;
+         if(isZeroConf) 
          {
-            if(isZeroConf) 
-            {
-               // This is a real txOut, in the blockchain
-               if(txioIter->second.hasTxOutZC() || txioIter->second.hasTxOutInMain())
-                  continue; 
-
-               // If we got here, somehow the Txio existed already, but 
-               // there was no existing TxOut referenced by it.  Probably,
-               // there was, but that TxOut was invalidated due to reorg
-               // and now being re-added
-               txioIter->second.setTxOutZC(&tx, iout);
-               txioIter->second.setValue((uint64_t)thisVal);
-               thisAddrPtr->addTxIO( txioIter->second, isZeroConf);
-               doAddLedgerEntry = true;
-            }
-            else
-            {
-               if(txioIter->second.hasTxOutInMain()) // ...but we already have one
-                  continue;
-
-               // If we got here, we have an in-blockchain TxOut that is 
-               // replacing a zero-conf txOut.  Reset the txio to have 
-               // only this real TxOut, blank out the ZC TxOut.  And the addr 
-               // relevantTxIOPtrs_ does not have this yet so it needs 
-               // to be added (it's already part of the relevantTxIOPtrsZC_
-               // but that will be removed)
-               txioIter->second.setTxOut(tx.getTxRef(), iout);
-               txioIter->second.setValue((uint64_t)thisVal);
-               thisAddrPtr->addTxIO( txioIter->second, isZeroConf);
-               doAddLedgerEntry = true;
-            }
+            // This is a real txOut, in the blockchain
+            if(txioPtr->hasTxOutZC() || txioPtr->hasTxOutInMain())
+               continue; 
+
+            // If we got here, somehow the Txio existed already, but 
+            // there was no existing TxOut referenced by it.  Probably,
+            // there was, but that TxOut was invalidated due to reorg
+            // and now being re-added
+            txioPtr->setTxOutZC(&tx, iout);
+            txioPtr->setValue((uint64_t)thisVal);
+            thisAddrPtr->addTxIO( *txioPtr, isZeroConf);
+            doAddLedgerEntry = true;
          }
          else
          {
-            // TxIO is not in the map yet -- create and add it
-            TxIOPair newTxio(thisVal);
-            if(isZeroConf)
-               newTxio.setTxOutZC(&tx, iout);
-            else
-               newTxio.setTxOut(tx.getTxRef(), iout);
+            if(txioPtr->hasTxOutInMain()) // ...but we already have one
+               continue;
 
-            pair<OutPoint, TxIOPair> toBeInserted(outpt, newTxio);
-            txioIter = txioMap_.insert(toBeInserted).first;
-            thisAddrPtr->addTxIO( txioIter->second, isZeroConf);
+            // If we got here, we have an in-blockchain TxOut that is 
+            // replacing a zero-conf txOut.  Reset the txio to have 
+            // only this real TxOut, blank out the ZC TxOut.  And the addr 
+            // relevantTxIOPtrs_ does not have this yet so it needs 
+            // to be added (it's already part of the relevantTxIOPtrsZC_
+            // but that will be removed)
+            txioPtr->setTxOut(tx.getTxRef(), iout);
+            txioPtr->setValue((uint64_t)thisVal);
+            thisAddrPtr->addTxIO( *txioPtr, isZeroConf);
             doAddLedgerEntry = true;
          }
+      }
+      else
+      {
+         // TxIO is not in the map yet -- create and add it
+         TxIOPair newTxio(thisVal);
+         if(isZeroConf)
+            newTxio.setTxOutZC(&tx, iout);
+         else
+            newTxio.setTxOut(tx.getTxRef(), iout);
 
-         if(anyTxInIsOurs)
-            txioIter->second.setTxOutFromSelf(true);
-        
-         if(isCoinbaseTx)
-            txioIter->second.setFromCoinbase(true);
+         pair<OutPoint, TxIOPair> toBeInserted(OutPoint(txHash, iout), newTxio);
+         txioPtr = &(txioMap_.insert(toBeInserted).first->second);
+         txioIndex_[opKey] = TxIORef(txioPtr, thisAddrPtr);
+         thisAddrPtr->addTxIO( *txioPtr, isZeroConf);
+         doAddLedgerEntry = true;
+      }
 
-         anyNewTxOutIsOurs = true;
-         thisTxOutIsOurs[iout] = true;
+      if(anyTxInIsOurs)
+         txioPtr->setTxOutFromSelf(true);
+     
+      if(isCoinbaseTx)
+         txioPtr->setFromCoinbase(true);
 
-         if(doAddLedgerEntry)
-         {
-            LedgerEntry newLedger(scraddr, 
-                                  thisVal, 
-                                  blknum, 
-                                  tx.getThisHash(), 
-                                  iout,
-                                  txtime,
-                                  isCoinbaseTx, // input was coinbase/generation
-                                  false,   // sentToSelf meaningless for addr ledger
-                                  false);  // we don't actually know
-            thisAddrPtr->addLedgerEntry(newLedger, isZeroConf);
-
-            if(!savedAsTxIn) txLedgerForComments_.push_back(newLedger);
-         }
-         // Check if this is the first time we've seen this
-         if(thisAddrPtr->getFirstTimestamp() == 0)
-         {
-            thisAddrPtr->setFirstBlockNum( blknum );
-            thisAddrPtr->setFirstTimestamp( txtime );
-         }
-         // Update last seen on the network
-         thisAddrPtr->setLastTimestamp(txtime);
-         thisAddrPtr->setLastBlockNum(blknum);
+      anyNewTxOutIsOurs = true;
+      numTxOutOurs++;
+
+      if(doAddLedgerEntry)
+      {
+         LedgerEntry newLedger(thisAddrPtr->getScrAddr(), 
+                               thisVal, 
+                               blknum, 
+                               txHash, 
+                               iout,
+                               txtime,
+                               isCoinbaseTx, // input was coinbase/generation
+                               false,   // sentToSelf meaningless for addr ledger
+                               false);  // we don't actually know
+         thisAddrPtr->addLedgerEntry(newLedger, isZeroConf);
+
+         if(!savedAsTxIn) txLedgerForComments_.push_back(newLedger);
+      }
+      // Check if this is the first time we've seen this
+      if(thisAddrPtr->getFirstTimestamp() == 0)
+      {
+         thisAddrPtr->setFirstBlockNum( blknum );
+         thisAddrPtr->setFirstTimestamp( txtime );
       }
+      // Update last seen on the network
+      thisAddrPtr->setLastTimestamp(txtime);
+      thisAddrPtr->setLastBlockNum(blknum);
    } // loop over TxOuts
 
 
-   bool allTxOutIsOurs = true;
-   bool anyTxOutIsOurs = false;
-   for(uint32_t i=0; i<tx.getNumTxOut(); i++)
-   {
-      if( thisTxOutIsOurs[i] )
-         anyTxOutIsOurs = true;
-      else
-         allTxOutIsOurs = false;
-   }
+   bool allTxOutIsOurs = (numTxOutOurs == numTxOut);
+   bool anyTxOutIsOurs = (numTxOutOurs > 0);
 
    bool isSentToSelf = (anyTxInIsOurs && allTxOutIsOurs);
    bool isChangeBack = (anyTxInIsOurs && anyTxOutIsOurs && !isSentToSelf);
@@ -1275,7 +1249,7 @@ void BtcWallet::scanTx(Tx & tx,
       LedgerEntry le( BinaryData(0),
                       totalLedgerAmt, 
                       blknum, 
-                      tx.getThisHash(), 
+                      txHash, 
                       txIndex,
                       txtime,
                       isCoinbaseTx,
@@ -1402,6 +1376,7 @@ void ScrAddrObj::clearBlkData(void)
 void BtcWallet::clearBlkData(void)
 {
    txioMap_.clear();
+   txioIndex_.clear();
    ledgerAllAddr_.clear();
    ledgerAllAddrZC_.clear();
    nonStdTxioMap_.clear();
@@ -1513,18 +1488,49 @@ uint64_t BtcWallet::getFullBalance(void)
 vector<UnspentTxOut> BtcWallet::getSpendableTxOutList(uint32_t blkNum, 
                                                       bool ignoreAllZC)
 {
-   vector<UnspentTxOut> utxoList(0);
+   vector<TxIOPair*> spendable;
+   vector<BinaryData> txOutKeys;
    map<OutPoint, TxIOPair>::iterator iter;
    for(iter  = txioMap_.begin();
        iter != txioMap_.end();
        iter++)
    {
       TxIOPair & txio = iter->second;
-      if(txio.isSpendable(blkNum, ignoreAllZC))
+      if(!txio.isSpendable(blkNum, ignoreAllZC))
+         continue;
+
+      spendable.push_back(&txio);
+      if(txio.hasTxOut())
+         txOutKeys.push_back(txio.getDBKeyOfOutput());
+   }
+
+   // Getting them one at a time is two random DB reads per TxOut (the TxOut,
+   // then its tx's hash).  The wallet decides spentness, not the DB.
+   map<BinaryData, UnspentTxOut> utxoMap;
+   if(bdmPtr_ != NULL && txOutKeys.size() > 0)
+      bdmPtr_->getUnspentTxOutsByDBKey(txOutKeys, utxoMap, false);
+
+   vector<UnspentTxOut> utxoList(0);
+   utxoList.reserve(spendable.size());
+   uint32_t iKey = 0;
+   for(uint32_t i=0; i<spendable.size(); i++)
+   {
+      TxIOPair & txio = *spendable[i];
+      if(txio.hasTxOut())
       {
-         TxOut txout = txio.getTxOutCopy();
-         utxoList.push_back(UnspentTxOut(txout, blkNum) );
+         map<BinaryData, UnspentTxOut>::iterator utxoIter;
+         utxoIter = utxoMap.find(txOutKeys[iKey++]);
+         if(utxoIter != utxoMap.end())
+         {
+            utxoList.push_back(utxoIter->second);
+            utxoList.back().updateNumConfirm(blkNum);
+            continue;
+         }
       }
+
+      // Zero-conf, or not in the DB
+      TxOut txout = txio.getTxOutCopy();
+      utxoList.push_back(UnspentTxOut(txout, blkNum) );
    }
    return utxoList;
 }
@@ -1670,16 +1676,50 @@ vector<AddressBookEntry> BtcWallet::createAddressBook(void)
 
 
 ////////////////////////////////////////////////////////////////////////////////
-// AddRawBlockTODB
-//
-// Assumptions:
-//  -- We have already determined the correct height and dup for the header 
-//     and we assume it's part of the sbh object
-//  -- It has definitely been added to the headers DB (bail if not)
-//  -- We don't know if it's been added to the blkdata DB yet
-//
-// Things to do when adding a block:
-//
+// Writes one detached BLKDATA batch in its own thread
+class BatchCommitter
+{
+public:
+   BatchCommitter(void) : success_(true) {}
+
+   void start(InterfaceToLDB* iface, leveldb::WriteBatch* batch)
+   {
+      success_ = true;
+      thread_  = thread(&BatchCommitter::run, this, iface, batch);
+   }
+
+   bool isRunning(void) { return thread_.joinable(); }
+
+   // Returns false if the write failed
+   bool wait(void)
+   {
+      if(thread_.joinable())
+         thread_.join();
+      return success_;
+   }
+
+private:
+   void run(InterfaceToLDB* iface, leveldb::WriteBatch* batch)
+   {
+      success_ = iface->writeDetachedBatch(BLKDATA, batch);
+   }
+
+   thread   thread_;
+   bool     success_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// AddRawBlockTODB
+//
+// Assumptions:
+//  -- We have already determined the correct height and dup for the header 
+//     and we assume it's part of the sbh object
+//  -- It has definitely been added to the headers DB (bail if not)
+//  -- We don't know if it's been added to the blkdata DB yet
+//
+// Things to do when adding a block:
+//
 //  -- PREPARATION:
 //    -- Create list of all OutPoints affected, and scripts touched
 //    -- If not supernode, then check above data against registeredSSHs_
@@ -1720,15 +1760,70 @@ vector<AddressBookEntry> BtcWallet::createAddressBook(void)
 //            to have been added already but is different.
 //
 ////////////////////////////////////////////////////////////////////////////////
-BlockWriteBatcher::BlockWriteBatcher(InterfaceToLDB* iface)
-   : iface_(iface), dbUpdateSize_(0), mostRecentBlockApplied_(0)
+BlockWriteBatcher::BlockWriteBatcher(InterfaceToLDB* iface, 
+                                     bool asyncCommit,
+                                     uint64_t commitThresh,
+                                     uint64_t utxoCacheBytes,
+                                     uint32_t undoRetention)
+   : iface_(iface), dbUpdateSize_(0), commitThresh_(commitThresh),
+     utxoCacheBytes_(utxoCacheBytes), utxoCacheUsed_(0),
+     undoRetention_(undoRetention),
+     committer_(NULL), balanceCache_(NULL), mostRecentBlockApplied_(0)
+{
+   stxToModify_  = &stxBuffers_[0];
+   stxoToModify_ = &stxoBuffers_[0];
+   sshToModify_  = &sshBuffers_[0];
+   utxoCache_    = &utxoBuffers_[0];
+   stxInFlight_  = &stxBuffers_[1];
+   stxoInFlight_ = &stxoBuffers_[1];
+   sshInFlight_  = &sshBuffers_[1];
+   utxoInFlight_ = &utxoBuffers_[1];
+
+   if(asyncCommit)
+      committer_ = new BatchCommitter;
+}
+
+BlockWriteBatcher::~BlockWriteBatcher()
 {
+   commit(true);
+   waitForInFlightCommit();
+   delete committer_;
 
+   if(balanceCache_ != NULL)
+      balanceCache_->endWrites();
 }
 
-BlockWriteBatcher::~BlockWriteBatcher()
+BinaryData* BlockWriteBatcher::getTxHashIdxToModify(BinaryDataRef txHash)
+{
+   uint32_t idxLen = iface_->getTxHashIndexLength();
+   if(idxLen == 0)
+      return NULL;
+
+   BinaryData idxKey = txHash.getSliceCopy(0, idxLen);
+   map<BinaryData, BinaryData>::iterator idxIter = 
+                                       txHashIdxToModify_.find(idxKey);
+   if(ITER_IN_MAP(idxIter, txHashIdxToModify_))
+      return &idxIter->second;
+
+   map<BinaryData, BinaryData>::iterator inFlightIter = 
+                                       txHashIdxInFlight_.find(idxKey);
+   BinaryData keyList;
+   if(ITER_IN_MAP(inFlightIter, txHashIdxInFlight_))
+      keyList = inFlightIter->second;
+   else
+      keyList = iface_->getTxHashIndexEntry(idxKey);
+
+   return &txHashIdxToModify_.insert(make_pair(idxKey, keyList)).first->second;
+}
+
+void BlockWriteBatcher::setBalanceCache(BalanceCache* balanceCache)
 {
-   commit();
+   if(balanceCache_ != NULL)
+      balanceCache_->endWrites();
+
+   balanceCache_ = balanceCache;
+   if(balanceCache_ != NULL)
+      balanceCache_->beginWrites();
 }
 
 void BlockWriteBatcher::applyBlockToDB(StoredHeader &sbh)
@@ -1743,7 +1838,9 @@ void BlockWriteBatcher::applyBlockToDB(StoredHeader &sbh)
    
    mostRecentBlockApplied_= sbh.blockHeight_;
 
-   // We will accumulate undoData as we apply the tx
+   // Only if pruning, we accumulate undoData as we apply the tx:  without
+   // pruning, a reorg gets the spent TxOuts back from TXDATA
+   bool pruning = (DBUtils.getDbPruneType() == DB_PRUNE_ALL);
    StoredUndoData sud;
    sud.blockHash_   = sbh.thisHash_; 
    sud.blockHeight_ = sbh.blockHeight_;
@@ -1758,7 +1855,7 @@ void BlockWriteBatcher::applyBlockToDB(StoredHeader &sbh)
       // and then it will modify either the pulled StoredTx or pre-existing
       // one.  This means that if a single Tx is affected by multiple TxIns
       // or TxOuts, earlier changes will not be overwritten by newer changes.
-      applyTxToBatchWriteData(iter->second, &sud);
+      applyTxToBatchWriteData(iter->second, pruning ? &sud : NULL);
    }
 
    // At this point we should have a list of STX and SSH with all the correct
@@ -1767,22 +1864,18 @@ void BlockWriteBatcher::applyBlockToDB(StoredHeader &sbh)
    updateBlkDataHeader(iface_, sbh);
    //iface_->putStoredHeader(sbh, false);
 
-   // we want to commit the undo data at the same time as actual changes
-   iface_->startBatch(BLKDATA);
+   // The undo data is committed along with the changes it undoes
+   if(pruning)
+   {
+      BinaryData & undoVal = undoToModify_[sud.getDBKey()];
+      undoVal = sud.serializeDBValue();
+      dbUpdateSize_ += undoVal.getSize();
+   }
    
    // Now actually write all the changes to the DB all at once
    // if we've gotten to that threshold
-   if (dbUpdateSize_ > UPDATE_BYTES_THRESH)
+   if (dbUpdateSize_ > commitThresh_)
       commit();
-
-   // Only if pruning, we need to store 
-   // TODO: this is going to get run every block, probably should batch it 
-   //       like we do with the other data...when we actually implement pruning
-   if(DBUtils.getDbPruneType() == DB_PRUNE_ALL)
-      iface_->putStoredUndoData(sud);
-   
-      
-   iface_->commitBatch(BLKDATA);
 }
 
 
@@ -1812,104 +1905,56 @@ void BlockWriteBatcher::undoBlockFromDB(StoredUndoData & sud)
    // Use int32_t index so that -1 != UINT32_MAX and we go into inf loop
    for(int32_t i=sud.stxOutsRemovedByBlock_.size()-1; i>=0; i--)
    {
-      StoredTxOut & sudStxo = sud.stxOutsRemovedByBlock_[i];
-      StoredTx * stxptr = makeSureSTXInMap( 
-               iface_,
-               sudStxo.blockHeight_,
-               sudStxo.duplicateID_,
-               sudStxo.txIndex_,
-               sudStxo.parentHash_,
-               stxToModify_,
-               &dbUpdateSize_);
+      // The undo data has the whole TxOut, so this works the same whether
+      // or not it was pruned by the forward op:  the TXDATA entry is 
+      // rewritten as unspent, and it goes back in the UTXO set
+      StoredTxOut stxoReAdd = sud.stxOutsRemovedByBlock_[i];
+      stxoReAdd.spentness_      = TXOUT_UNSPENT;
+      stxoReAdd.spentByTxInKey_ = BinaryData(0);
 
-      
-      const uint16_t stxoIdx = sudStxo.txOutIndex_;
+      writeTxIOKey(txOutKey_, stxoReAdd.blockHeight_, stxoReAdd.duplicateID_,
+                              stxoReAdd.txIndex_,     stxoReAdd.txOutIndex_);
+      updateStxo(stxoReAdd, txOutKey_);
 
-      if(DBUtils.getDbPruneType() == DB_PRUNE_NONE)
-      {
-         // If full/super, we have the TxOut in DB, just need mark it unspent
-         map<uint16_t,StoredTxOut>::iterator iter = stxptr->stxoMap_.find(stxoIdx);
-         //if(iter == stxptr->stxoMap_.end())
-         if(ITER_NOT_IN_MAP(iter, stxptr->stxoMap_))
-         {
-            LOGERR << "Expecting to find existing STXO, but DNE";
-            continue;
-         }
+      writeOutPoint(outPoint_, stxoReAdd.parentHash_, stxoReAdd.txOutIndex_);
+      addUtxo(outPoint_, stxoReAdd);
 
-         StoredTxOut & stxoReAdd = iter->second;
-         if(stxoReAdd.spentness_ == TXOUT_UNSPENT || 
-            stxoReAdd.spentByTxInKey_.getSize() == 0 )
-         {
-            LOGERR << "STXO needs to be re-added/marked-unspent but it";
-            LOGERR << "was already declared unspent in the DB";
-         }
-         
-         stxoReAdd.spentness_ = TXOUT_UNSPENT;
-         stxoReAdd.spentByTxInKey_ = BinaryData(0);
-      }
-      else
+      ////// Finished updating STX, now update the SSH in the DB
+      BinaryData uniqKey = stxoReAdd.getScrAddress();
+      updateBalanceCache(uniqKey, stxoReAdd, true);
+      BinaryData hgtX    = stxoReAdd.getHgtX();
+      StoredScriptHistory* sshptr = makeSureSSHInMap(
+            iface_, uniqKey, hgtX, *sshToModify_, sshInFlight_, &dbUpdateSize_
+         );
+      if(sshptr==NULL)
       {
-         // If we're pruning, we should have the Tx in the DB, but without the
-         // TxOut because it had been pruned by this block on the forward op
-         map<uint16_t,StoredTxOut>::iterator iter = stxptr->stxoMap_.find(stxoIdx);
-         //if(iter != stxptr->stxoMap_.end())
-         if(ITER_IN_MAP(iter, stxptr->stxoMap_))
-            LOGERR << "Somehow this TxOut had not been pruned!";
-         else
-            iter->second = sudStxo;
-
-         iter->second.spentness_      = TXOUT_UNSPENT;
-         iter->second.spentByTxInKey_ = BinaryData(0);
+         LOGERR << "No SSH found for marking TxOut unspent on undo";
+         continue;
       }
 
+      // Now get the TxIOPair in the StoredScriptHistory and mark unspent
+      sshptr->markTxOutUnspent(txOutKey_,
+                               stxoReAdd.getValue(),
+                               stxoReAdd.isCoinbase_,
+                               false);
 
+      
+      // If multisig, we need to update the SSHs for individual addresses
+      if(uniqKey[0] == SCRIPT_PREFIX_MULTISIG)
       {
-         ////// Finished updating STX, now update the SSH in the DB
-         // Updating the SSH objects works the same regardless of pruning
-         map<uint16_t,StoredTxOut>::iterator iter = stxptr->stxoMap_.find(stxoIdx);
-         //if(iter == stxptr->stxoMap_.end())
-         if(ITER_NOT_IN_MAP(iter, stxptr->stxoMap_))
-         {
-            LOGERR << "Somehow STXO DNE even though we should've just added it!";
-            continue;
-         }
-
-         StoredTxOut & stxoReAdd = iter->second;
-         BinaryData uniqKey = stxoReAdd.getScrAddress();
-         BinaryData hgtX    = stxoReAdd.getHgtX();
-         StoredScriptHistory* sshptr = makeSureSSHInMap(
-               iface_, uniqKey, hgtX, sshToModify_, &dbUpdateSize_
-            );
-         if(sshptr==NULL)
-         {
-            LOGERR << "No SSH found for marking TxOut unspent on undo";
-            continue;
-         }
-
-         // Now get the TxIOPair in the StoredScriptHistory and mark unspent
-         sshptr->markTxOutUnspent(stxoReAdd.getDBKey(false),
-                                 stxoReAdd.getValue(),
-                                 stxoReAdd.isCoinbase_,
-                                 false);
-
-         
-         // If multisig, we need to update the SSHs for individual addresses
-         if(uniqKey[0] == SCRIPT_PREFIX_MULTISIG)
+         vector<BinaryData> addr160List;
+         BtcUtils::getMultisigAddrList(stxoReAdd.getScriptRef(), addr160List);
+         for(uint32_t a=0; a<addr160List.size(); a++)
          {
-            vector<BinaryData> addr160List;
-            BtcUtils::getMultisigAddrList(stxoReAdd.getScriptRef(), addr160List);
-            for(uint32_t a=0; a<addr160List.size(); i++)
-            {
-               // Get the existing SSH or make a new one
-               BinaryData uniqKey = HASH160PREFIX + addr160List[a];
-               StoredScriptHistory* sshms = makeSureSSHInMap(iface_, uniqKey, 
-                                                            stxoReAdd.getHgtX(),
-                                                            sshToModify_, &dbUpdateSize_);
-               sshms->markTxOutUnspent(stxoReAdd.getDBKey(false),
-                                       stxoReAdd.getValue(),
-                                       stxoReAdd.isCoinbase_,
-                                       true);
-            }
+            // Get the existing SSH or make a new one
+            BinaryData uniqKey = HASH160PREFIX + addr160List[a];
+            StoredScriptHistory* sshms = makeSureSSHInMap(iface_, uniqKey, 
+                                                         hgtX,
+                                                         *sshToModify_, sshInFlight_, &dbUpdateSize_);
+            sshms->markTxOutUnspent(txOutKey_,
+                                    stxoReAdd.getValue(),
+                                    stxoReAdd.isCoinbase_,
+                                    true);
          }
       }
    }
@@ -1927,29 +1972,63 @@ void BlockWriteBatcher::undoBlockFromDB(StoredUndoData & sud)
                                                   sbh.duplicateID_,
                                                   itx);
 
-      StoredTx * stxptr  = makeSureSTXInMap(
-            iface_,
-            sbh.blockHeight_,
-            sbh.duplicateID_,
-            itx, 
-            txHash,
-            stxToModify_,
-            &dbUpdateSize_);
-
-      for(int16_t txoIdx = stxptr->stxoMap_.size()-1; txoIdx >= 0; txoIdx--)
+      // Not in the main branch anymore, lookups of it go to TXHINTS
+      BinaryData* idxKeyList = getTxHashIdxToModify(txHash);
+      if(idxKeyList != NULL)
+      {
+         BinaryData dbKey6 = DBUtils.getBlkDataKeyNoPrefix(sbh.blockHeight_,
+                                                           sbh.duplicateID_,
+                                                           (uint16_t)itx);
+         InterfaceToLDB::removeTxKeyFromList(*idxKeyList, dbKey6);
+         dbUpdateSize_ += iface_->getTxHashIndexLength() + 6;
+      }
+
+      // The tx itself doesn't change, only its TxOut scripts are needed.
+      // A batch copy is at least as recent as the DB.
+      StoredTx blockStx;
+      StoredTx * stxptr = stxToModify_->find(txHash);
+      if(stxptr == NULL)
+         stxptr = stxInFlight_->find(txHash);
+      if(stxptr == NULL)
       {
+         iface_->getStoredTx(blockStx, sbh.blockHeight_, sbh.duplicateID_, itx);
+         stxptr = &blockStx;
+      }
+
+      for(int32_t txoIdx = stxptr->numTxOut_-1; txoIdx >= 0; txoIdx--)
+      {
+         // When pruning, the TxOuts spent in this block are gone from TXDATA,
+         // the copies put back from the undo data above are in the batch
+         writeTxIOKey(txOutKey_, sbh.blockHeight_, sbh.duplicateID_,
+                                 (uint16_t)itx,    (uint16_t)txoIdx);
+         StoredTxOut * stxoPtr = NULL;
+         map<uint16_t, StoredTxOut>::iterator stxoIter = 
+                                       stxptr->stxoMap_.find((uint16_t)txoIdx);
+         if(ITER_IN_MAP(stxoIter, stxptr->stxoMap_))
+            stxoPtr = &stxoIter->second;
+         else if((stxoPtr = stxoToModify_->find(txOutKey_)) == NULL)
+            stxoPtr = stxoInFlight_->find(txOutKey_);
+         if(stxoPtr == NULL)
+         {
+            LOGERR << "TxOut of the block being undone is not in the DB";
+            continue;
+         }
 
-         StoredTxOut & stxo    = stxptr->stxoMap_[txoIdx];
+         StoredTxOut & stxo    = *stxoPtr;
          BinaryData    stxoKey = stxo.getDBKey(false);
 
+         // Gone from the UTXO set, whether or not it had been spent since
+         writeOutPoint(outPoint_, txHash, (uint32_t)txoIdx);
+         takeUtxo(outPoint_, NULL);
    
          // Then fetch the StoredScriptHistory of the StoredTxOut scraddress
          BinaryData uniqKey = stxo.getScrAddress();
          BinaryData hgtX    = stxo.getHgtX();
+         updateBalanceCache(uniqKey, stxo, false);
          StoredScriptHistory * sshptr = makeSureSSHInMap(
                iface_, uniqKey, 
                hgtX,
-               sshToModify_, 
+               *sshToModify_, sshInFlight_, 
                &dbUpdateSize_,
                false);
    
@@ -1971,21 +2050,26 @@ void BlockWriteBatcher::undoBlockFromDB(StoredUndoData & sud)
                      iface_,
                      uniqKey,
                      hgtX,
-                     sshToModify_, 
+                     *sshToModify_, sshInFlight_, 
                      &dbUpdateSize_,
                      false
                   );
-               sshms->eraseTxio(stxoKey);
+               if(sshms != NULL)
+                  sshms->eraseTxio(stxoKey);
             }
          }
       }
    }
 
+   // Its undo data can't be used again
+   if(DBUtils.getDbPruneType() == DB_PRUNE_ALL)
+      undoToModify_[sud.getDBKey()] = BinaryData(0);
+
    // Finally, mark this block as UNapplied.
    sbh.blockAppliedToDB_ = false;
    updateBlkDataHeader(iface_, sbh);
    
-   if (dbUpdateSize_ > UPDATE_BYTES_THRESH)
+   if (dbUpdateSize_ > commitThresh_)
       commit();
 }
 
@@ -2002,11 +2086,9 @@ bool BlockWriteBatcher::applyTxToBatchWriteData(
 {
    SCOPED_TIMER("applyTxToBatchWriteData");
 
-   Tx tx = thisSTX.getTxCopy();
-
    // We never expect thisSTX to already be in the map (other tx in the map
    // may be affected/retrieved multiple times).  
-   if(KEY_IN_MAP(tx.getThisHash(), stxToModify_))
+   if(stxToModify_->contains(thisSTX.thisHash_))
       LOGERR << "How did we already add this tx?";
 
    // I just noticed we never set TxOuts to TXOUT_UNSPENT.  Might as well do 
@@ -2021,58 +2103,100 @@ bool BlockWriteBatcher::applyTxToBatchWriteData(
    // This tx itself needs to be added to the map, which makes it accessible 
    // to future tx in the same block which spend outputs from this tx, without
    // doing anything crazy in the code here
-   stxToModify_[tx.getThisHash()] = thisSTX;
+   stxToModify_->set(thisSTX.thisHash_, thisSTX);
 
    dbUpdateSize_ += thisSTX.numBytes_;
+
+   // The tx we are applying is on the main branch, so it goes to the front
+   // of its hash index entry
+   BinaryData* idxKeyList = getTxHashIdxToModify(thisSTX.thisHash_);
+   if(idxKeyList != NULL)
+   {
+      InterfaceToLDB::preferTxKeyInList(*idxKeyList, thisSTX.getDBKey(false));
+      dbUpdateSize_ += iface_->getTxHashIndexLength() + idxKeyList->getSize();
+   }
+
+   // The TxIns are read in place from the STX data (the TxOuts are already
+   // split out in stxoMap_), instead of reassembling the whole Tx with 
+   // getTxCopy.  All the keys below go in the batcher's scratch buffers,
+   // which keep their memory from one TxIn/TxOut to the next.
+   uint8_t const * txPtr = thisSTX.dataCopy_.getPtr();
+   BtcUtils::StoredTxCalcLength(txPtr, 
+                                thisSTX.isFragged_, 
+                                &txInOffsets_, 
+                                &txOutOffsets_);
    
    // Go through and find all the previous TxOuts that are affected by this tx
-   for(uint32_t iin=0; iin<tx.getNumTxIn(); iin++)
+   for(uint32_t iin=0; iin+1<txInOffsets_.size(); iin++)
    {
-      TxIn txin = tx.getTxInCopy(iin);
-      if(txin.isCoinbase())
+      // Get the OutPoint data of TxOut being spent.  Coinbase spends the
+      // all-zero hash.
+      uint8_t const * opPtr = txPtr + txInOffsets_[iin];
+      if(memcmp(opPtr, BtcUtils::EmptyHash_.getPtr(), 32) == 0)
          continue;
 
-      // Get the OutPoint data of TxOut being spent
-      const OutPoint      op       = txin.getOutPoint();
-      const BinaryDataRef opTxHash = op.getTxHashRef();
-      const uint32_t      opTxoIdx = op.getTxOutIndex();
-
-      // This will fetch the STX from DB and put it in the stxToModify
-      // map if it's not already there.  Or it will do nothing if it's
-      // already part of the map.  In both cases, it returns a pointer
-      // to the STX that will be written to DB that we can modify.
-      StoredTx    * stxptr = makeSureSTXInMap(iface_, opTxHash, stxToModify_, &dbUpdateSize_);
-      StoredTxOut & stxo   = stxptr->stxoMap_[opTxoIdx];
-      BinaryData    uniqKey   = stxo.getScrAddress();
-
-      // Update the stxo by marking it spent by this Block:TxIndex:TxInIndex
-      map<uint16_t,StoredTxOut>::iterator iter = stxptr->stxoMap_.find(opTxoIdx);
-      
-      // Some sanity checks
-      //if(iter == stxptr->stxoMap_.end())
-      if(ITER_NOT_IN_MAP(iter, stxptr->stxoMap_))
+      // Spending a TxOut from the UTXO set doesn't need its funding tx.  If
+      // it's not in there, it was spent already (the STX lookup below will
+      // complain), or the DB predates the UTXO set.
+      StoredTxOut * stxoSpend = NULL;
+      StoredTx *    stxptr    = NULL;
+      if(takeUtxo(BinaryDataRef(opPtr, 36), &spentStxo_))
+         stxoSpend = &spentStxo_;
+      else
       {
-         LOGERR << "Needed to get OutPoint for a TxIn, but DNE";
-         continue;
-      }
+         opTxHash_.copyFrom(opPtr, 32);
+         const uint32_t opTxoIdx = READ_UINT32_LE(opPtr+32);
+
+         // This will fetch the STX from DB and put it in the stxToModify
+         // map if it's not already there.  Or it will do nothing if it's
+         // already part of the map.  In both cases, it returns a pointer
+         // to the STX that will be written to DB that we can modify.
+         stxptr = makeSureSTXInMap(iface_, 
+                                   opTxHash_, 
+                                   *stxToModify_, 
+                                   stxInFlight_, 
+                                   *stxoToModify_,
+                                   stxoInFlight_,
+                                   &dbUpdateSize_);
+
+         // Update the stxo by marking it spent by this Block:TxIndex:TxInIndex
+         map<uint16_t,StoredTxOut>::iterator iter = stxptr->stxoMap_.find(opTxoIdx);
+         
+         // Some sanity checks
+         //if(iter == stxptr->stxoMap_.end())
+         if(ITER_NOT_IN_MAP(iter, stxptr->stxoMap_))
+         {
+            LOGERR << "Needed to get OutPoint for a TxIn, but DNE";
+            continue;
+         }
 
-      // We're aliasing this because "iter->second" is not clear at all
-      StoredTxOut & stxoSpend = iter->second;
-   
-      if(stxoSpend.spentness_ == TXOUT_SPENT)
-      {
-         LOGERR << "Trying to mark TxOut spent, but it's already marked";
-         continue;
+         // We're aliasing this because "iter->second" is not clear at all
+         stxoSpend = &iter->second;
+      
+         if(stxoSpend->spentness_ == TXOUT_SPENT)
+         {
+            LOGERR << "Trying to mark TxOut spent, but it's already marked";
+            continue;
+         }
       }
 
       // Just about to {remove-if-pruning, mark-spent-if-not} STXO
       // Record it in the StoredUndoData object
       if(sud != NULL)
-         sud->stxOutsRemovedByBlock_.push_back(stxoSpend);
+      {
+         sud->stxOutsRemovedByBlock_.push_back(*stxoSpend);
+         sud->stxOutsRemovedByBlock_.back().parentHash_.copyFrom(opPtr, 32);
+      }
 
       // Need to modify existing UTXOs, so that we can delete or mark as spent
-      stxoSpend.spentness_      = TXOUT_SPENT;
-      stxoSpend.spentByTxInKey_ = thisSTX.getDBKeyOfChild(iin, false);
+      writeTxIOKey(txInKey_, thisSTX.blockHeight_, thisSTX.duplicateID_,
+                             thisSTX.txIndex_,     (uint16_t)iin);
+      writeTxIOKey(txOutKey_, stxoSpend->blockHeight_, stxoSpend->duplicateID_,
+                              stxoSpend->txIndex_,     stxoSpend->txOutIndex_);
+      stxoSpend->spentness_      = TXOUT_SPENT;
+      stxoSpend->spentByTxInKey_ = txInKey_;
+      if(stxptr == NULL)
+         updateStxo(*stxoSpend, txOutKey_);
 
       if(DBUtils.getArmoryDbType() != ARMORY_DB_SUPER)
       {
@@ -2082,20 +2206,21 @@ bool BlockWriteBatcher::applyTxToBatchWriteData(
       ////// Now update the SSH to show this TxIOPair was spent
       // Same story as stxToModify above, except this will actually create a new
       // SSH if it doesn't exist in the map or the DB
-      BinaryData hgtX = stxo.getHgtX();
+      BtcUtils::getTxOutScrAddr(stxoSpend->getScriptRef(), scrAddr_);
+      hgtX_.copyFrom(txOutKey_.getPtr(), 4);
+      updateBalanceCache(scrAddr_, *stxoSpend, false);
       StoredScriptHistory* sshptr = makeSureSSHInMap(
             iface_,
-            uniqKey,
-            hgtX,
-            sshToModify_,
+            scrAddr_,
+            hgtX_,
+            *sshToModify_, sshInFlight_,
             &dbUpdateSize_
          );
 
       // Assuming supernode, we don't need to worry about removing references
       // to multisig scripts that reference this script.  Simply find and 
       // update the correct SSH TXIO directly
-      sshptr->markTxOutSpent(stxoSpend.getDBKey(false),
-                             thisSTX.getDBKeyOfChild(iin, false));
+      sshptr->markTxOutSpent(txOutKey_, txInKey_);
    }
 
 
@@ -2103,27 +2228,38 @@ bool BlockWriteBatcher::applyTxToBatchWriteData(
    // We don't need to update any TXDATA, since it is part of writing thisSTX
    // to the DB ... but we do need to update the StoredScriptHistory objects
    // with references to the new [unspent] TxOuts
-   for(uint32_t iout=0; iout<tx.getNumTxOut(); iout++)
+   for(map<uint16_t, StoredTxOut>::iterator iter = thisSTX.stxoMap_.begin(); 
+       iter != thisSTX.stxoMap_.end();
+       iter++)
    {
-      StoredTxOut & stxoToAdd = thisSTX.stxoMap_[iout];
-      BinaryData uniqKey = stxoToAdd.getScrAddress();
-      BinaryData hgtX    = stxoToAdd.getHgtX();
+      StoredTxOut & stxoToAdd = iter->second;
+      writeOutPoint(outPoint_, thisSTX.thisHash_, iter->first);
+      addUtxo(outPoint_, stxoToAdd);
+      if(sud != NULL)
+         sud->outPointsAddedByBlock_.push_back(
+                                    OutPoint(thisSTX.thisHash_, iter->first));
+
+      BtcUtils::getTxOutScrAddr(stxoToAdd.getScriptRef(), scrAddr_);
+      updateBalanceCache(scrAddr_, stxoToAdd, true);
+      writeTxIOKey(txOutKey_, stxoToAdd.blockHeight_, stxoToAdd.duplicateID_,
+                              stxoToAdd.txIndex_,     stxoToAdd.txOutIndex_);
+      hgtX_.copyFrom(txOutKey_.getPtr(), 4);
       StoredScriptHistory* sshptr = makeSureSSHInMap(
             iface_,
-            uniqKey,
-            hgtX,
-            sshToModify_,
+            scrAddr_,
+            hgtX_,
+            *sshToModify_, sshInFlight_,
             &dbUpdateSize_
          );
 
       // Add reference to the next STXO to the respective SSH object
-      sshptr->markTxOutUnspent(stxoToAdd.getDBKey(false),
+      sshptr->markTxOutUnspent(txOutKey_,
                                stxoToAdd.getValue(),
                                stxoToAdd.isCoinbase_,
                                false);
                              
       // If this was a multisig address, add a ref to each individual scraddr
-      if(uniqKey[0] == SCRIPT_PREFIX_MULTISIG)
+      if(scrAddr_[0] == SCRIPT_PREFIX_MULTISIG)
       {
          vector<BinaryData> addr160List;
          BtcUtils::getMultisigAddrList(stxoToAdd.getScriptRef(), addr160List);
@@ -2134,11 +2270,11 @@ bool BlockWriteBatcher::applyTxToBatchWriteData(
             StoredScriptHistory* sshms = makeSureSSHInMap(
                   iface_,
                   uniqKey,
-                  hgtX,
-                  sshToModify_,
+                  hgtX_,
+                  *sshToModify_, sshInFlight_,
                   &dbUpdateSize_
                );
-            sshms->markTxOutUnspent(stxoToAdd.getDBKey(false),
+            sshms->markTxOutUnspent(txOutKey_,
                                     stxoToAdd.getValue(),
                                     stxoToAdd.isCoinbase_,
                                     true);
@@ -2151,8 +2287,190 @@ bool BlockWriteBatcher::applyTxToBatchWriteData(
 
 
 
-void BlockWriteBatcher::commit()
+////////////////////////////////////////////////////////////////////////////////
+bool BlockWriteBatcher::takeUtxo(BinaryDataRef outPoint, StoredTxOut* stxo)
+{
+   UtxoCacheEntry* entry = utxoCache_->find(outPoint);
+   if(entry != NULL)
+   {
+      if(entry->spent_)
+         return false;
+   }
+   else
+   {
+      // Whatever is in flight is newer than the DB.  If it's not in there
+      // either, only the DB can tell, but we only have to ask it if the 
+      // TxOut is needed:  deleting an entry that isn't there is harmless.
+      UtxoCacheEntry* inFlight = utxoInFlight_->find(outPoint);
+      if(inFlight != NULL && inFlight->spent_)
+         return false;
+
+      entry = &utxoCache_->getOrCreate(outPoint);
+      utxoCacheUsed_ += UPDATE_BYTES_UTXO;
+      if(inFlight != NULL)
+      {
+         if(stxo != NULL)
+            entry->value_ = inFlight->value_;
+         entry->onDisk_ = true;
+      }
+      else if(stxo != NULL)
+      {
+         // Straight from the DB, the value doesn't need to be cached
+         entry->onDisk_ = iface_->getUtxo(outPoint, *stxo);
+         entry->spent_  = true;
+         if(!entry->onDisk_)
+            return false;
+         stxo->spentByTxInKey_ = BinaryData(0);
+         return true;
+      }
+      else
+         entry->onDisk_ = true;
+   }
+
+   entry->spent_ = true;
+   if(stxo == NULL)
+      return true;
+
+   stxo->unserializeUtxoValue(entry->value_);
+   stxo->parentHash_.copyFrom(outPoint.getPtr(), 32);
+   stxo->spentByTxInKey_ = BinaryData(0);
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockWriteBatcher::updateBalanceCache(BinaryDataRef scrAddr,
+                                           StoredTxOut const & stxo,
+                                           bool added)
+{
+   // Nothing can be added to the cache while we're around
+   if(balanceCache_ == NULL || balanceCache_->isEmpty())
+      return;
+
+   if(added)
+      balanceCache_->addTxOut(scrAddr, stxo.getValue(), stxo.blockHeight_,
+                              stxo.isCoinbase_, false);
+   else
+      balanceCache_->removeTxOut(scrAddr, stxo.getValue(), stxo.blockHeight_,
+                                 stxo.isCoinbase_, false);
+
+   if(scrAddr.getSize() == 0 || scrAddr[0] != SCRIPT_PREFIX_MULTISIG)
+      return;
+
+   vector<BinaryData> addr160List;
+   BtcUtils::getMultisigAddrList(stxo.getScriptRef(), addr160List);
+   for(uint32_t a=0; a<addr160List.size(); a++)
+   {
+      BinaryData uniqKey = HASH160PREFIX + addr160List[a];
+      if(added)
+         balanceCache_->addTxOut(uniqKey, stxo.getValue(), stxo.blockHeight_,
+                                 stxo.isCoinbase_, true);
+      else
+         balanceCache_->removeTxOut(uniqKey, stxo.getValue(), stxo.blockHeight_,
+                                    stxo.isCoinbase_, true);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockWriteBatcher::addUtxo(BinaryDataRef outPoint, StoredTxOut const & stxo)
+{
+   // If the OutPoint is already here, it was spent since the last flush
+   // (and is being re-added by an undo), and its DB entry may not have been
+   // deleted yet.  If it's only in the in-flight batch, that one deletes it.
+   UtxoCacheEntry* entry = utxoCache_->find(outPoint);
+   if(entry == NULL)
+   {
+      entry = &utxoCache_->getOrCreate(outPoint);
+      entry->onDisk_ = false;
+   }
+
+   BinaryWriter bw;
+   stxo.serializeUtxoValue(bw);
+   entry->value_  = bw.getData();
+   entry->spent_  = false;
+   entry->dirty_  = true;
+   utxoCacheUsed_ += UPDATE_BYTES_UTXO + entry->value_.getSize();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockWriteBatcher::updateStxo(StoredTxOut const & stxo, 
+                                   BinaryDataRef stxoKey)
+{
+   // If the whole tx is in the batch, update it there.  The single TxOut
+   // has to be updated too if it's already in the batch by itself, since
+   // it's written after the tx.
+   StoredTx* stxptr = stxToModify_->find(stxo.parentHash_);
+   if(stxptr != NULL)
+      stxptr->stxoMap_[stxo.txOutIndex_] = stxo;
+
+   if(stxptr == NULL || stxoToModify_->contains(stxoKey))
+   {
+      stxoToModify_->set(stxoKey, stxo);
+      dbUpdateSize_ += stxoKey.getSize() + stxo.dataCopy_.getSize() + 10;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Spent entries that are on disk are deleted with every batch, and re-added
+// ones that are on disk are rewritten, so the DB never has a UTXO entry that
+// disagrees with TXDATA.  The others are only written when the cache is 
+// flushed:  if we stop before that, the DB just lacks entries for them, and
+// spending those later goes through TXDATA, same as in a DB built without 
+// the UTXO set.
+void BlockWriteBatcher::writeUtxoCache(bool flush)
+{
+   for(uint32_t slot=0; slot<utxoCache_->numSlots(); slot++)
+   {
+      if(!utxoCache_->isLive(slot))
+         continue;
+
+      UtxoCacheEntry & entry = utxoCache_->valueAt(slot);
+      if(entry.spent_ && entry.onDisk_)
+      {
+         iface_->deleteUtxo(utxoCache_->keyAt(slot));
+         entry.onDisk_ = false;
+      }
+      else if(!entry.spent_ && entry.dirty_ && (flush || entry.onDisk_))
+      {
+         iface_->putUtxo(utxoCache_->keyAt(slot), entry.value_);
+         entry.onDisk_ = true;
+         entry.dirty_  = false;
+      }
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockWriteBatcher::writeUndoData(void)
+{
+   // Blocks below this height are out of the window:  their records in the
+   // DB are purged, and the ones in this batch aren't even written
+   uint32_t keepFromHgt = 0;
+   if(mostRecentBlockApplied_+1 > undoRetention_)
+      keepFromHgt = mostRecentBlockApplied_+1 - undoRetention_;
+
+   for(map<BinaryData, BinaryData>::iterator iter = undoToModify_.begin();
+       iter != undoToModify_.end();
+       iter++)
+   {
+      if(iter->second.getSize() == 0)
+         iface_->deleteValue(BLKDATA, iter->first);
+      else if(DBUtils.hgtxToHeight(iter->first.getSliceCopy(1,4)) >= keepFromHgt)
+         iface_->putValue(BLKDATA, iter->first, iter->second);
+   }
+
+   if(keepFromHgt > 0)
+      iface_->purgeOldUndoData(keepFromHgt);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockWriteBatcher::commit(bool flushUtxoCache)
 {
+   TIMER_START("commitBatch");
+
+   // Only one batch in flight at a time.  It also has to be on disk before
+   // this one is serialized, putStoredTx and the SDBI below read the DB.
+   waitForInFlightCommit();
+
    // Check for any SSH objects that are now completely empty.  If they exist,
    // they should be removed from the DB, instead of simply written as empty
    // objects
@@ -2160,18 +2478,53 @@ void BlockWriteBatcher::commit()
    
    iface_->startBatch(BLKDATA);
 
-   for(map<BinaryData, StoredTx>::iterator iter_stx = stxToModify_.begin();
-       iter_stx != stxToModify_.end();
-       iter_stx++)
+   // When pruning, spent TxOuts are deleted instead of written as spent,
+   // the undo data of the block that spent them has the whole TxOut
+   bool pruning = (DBUtils.getDbPruneType() == DB_PRUNE_ALL);
+
+   for(uint32_t slot=0; slot<stxToModify_->numSlots(); slot++)
+   {
+      if(!stxToModify_->isLive(slot))
+         continue;
+
+      StoredTx & stx = stxToModify_->valueAt(slot);
+      iface_->putStoredTx(stx, true);
+      if(!pruning)
+         continue;
+
+      map<uint16_t, StoredTxOut>::iterator iter;
+      for(iter = stx.stxoMap_.begin(); iter != stx.stxoMap_.end(); iter++)
+         if(iter->second.spentness_ == TXOUT_SPENT)
+            iface_->deleteValue(BLKDATA, iter->second.getDBKey());
+   }
+       
+   for(uint32_t slot=0; slot<stxoToModify_->numSlots(); slot++)
    {
-      iface_->putStoredTx(iter_stx->second, true);
+      if(!stxoToModify_->isLive(slot))
+         continue;
+
+      StoredTxOut & stxo = stxoToModify_->valueAt(slot);
+      if(pruning && stxo.spentness_ == TXOUT_SPENT)
+         iface_->deleteValue(BLKDATA, stxo.getDBKey());
+      else
+         iface_->putStoredTxOut(stxo);
    }
        
-   for(map<BinaryData, StoredScriptHistory>::iterator iter_ssh = sshToModify_.begin();
-       iter_ssh != sshToModify_.end();
-       iter_ssh++)
+   for(uint32_t slot=0; slot<sshToModify_->numSlots(); slot++)
+   {
+      if(sshToModify_->isLive(slot))
+         iface_->putStoredScriptHistory(sshToModify_->valueAt(slot));
+   }
+
+   // Only written out in full once the cache is full
+   flushUtxoCache = flushUtxoCache || utxoCacheUsed_ > utxoCacheBytes_;
+   writeUtxoCache(flushUtxoCache);
+
+   for(map<BinaryData, BinaryData>::iterator iter_idx = txHashIdxToModify_.begin();
+       iter_idx != txHashIdxToModify_.end();
+       iter_idx++)
    {
-      iface_->putStoredScriptHistory(iter_ssh->second);
+      iface_->putTxHashIndexEntry(iter_idx->first, iter_idx->second);
    }
 
    for(set<BinaryData>::const_iterator iter_del  = keysToDelete.begin();
@@ -2181,6 +2534,10 @@ void BlockWriteBatcher::commit()
       iface_->deleteValue(BLKDATA, *iter_del);
    }
 
+   if(pruning)
+      writeUndoData();
+   undoToModify_.clear();
+
 
    if(mostRecentBlockApplied_ != 0)
    {
@@ -2195,26 +2552,73 @@ void BlockWriteBatcher::commit()
       }
    }
 
-   iface_->commitBatch(BLKDATA);
+   if(committer_ == NULL)
+   {
+      iface_->commitBatch(BLKDATA);
    
-   stxToModify_.clear();
-   sshToModify_.clear();
+      // The records are kept for the next batch to overwrite
+      stxToModify_->reset();
+      stxoToModify_->reset();
+      sshToModify_->reset();
+      txHashIdxToModify_.clear();
+      if(flushUtxoCache)
+         utxoCache_->reset();
+   }
+   else
+   {
+      // The appliedToHgt_ update is in the same batch as the data, so it
+      // only becomes durable along with it.  If we're nested in a caller's
+      // batch, whatever it had put so far goes with this one too.
+      leveldb::WriteBatch* batch = iface_->detachBatch(BLKDATA);
+      iface_->commitBatch(BLKDATA);
+
+      // The buffers just serialized stay readable as the in-flight batch,
+      // and the next blocks are applied to the other set
+      swap(stxToModify_, stxInFlight_);
+      swap(stxoToModify_, stxoInFlight_);
+      swap(sshToModify_, sshInFlight_);
+      txHashIdxToModify_.swap(txHashIdxInFlight_);
+      if(flushUtxoCache)
+         swap(utxoCache_, utxoInFlight_);
+      committer_->start(iface_, batch);
+   }
+
+   if(flushUtxoCache)
+      utxoCacheUsed_ = 0;
+
    dbUpdateSize_ = 0;
+
+   TIMER_STOP("commitBatch");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockWriteBatcher::waitForInFlightCommit()
+{
+   if(committer_ == NULL || !committer_->isRunning())
+      return;
+
+   if(!committer_->wait())
+      LOGERR << "Background write of a BLKDATA batch failed!";
+
+   stxInFlight_->reset();
+   stxoInFlight_->reset();
+   sshInFlight_->reset();
+   utxoInFlight_->reset();
+   txHashIdxInFlight_.clear();
 }
 
+////////////////////////////////////////////////////////////////////////////////
 set<BinaryData> BlockWriteBatcher::searchForSSHKeysToDelete()
 {
    set<BinaryData> keysToDelete;
    vector<BinaryData> fullSSHToDelete;
    
-   for(map<BinaryData, StoredScriptHistory>::iterator iterSSH  = sshToModify_.begin();
-       iterSSH != sshToModify_.end(); )
+   for(uint32_t slot=0; slot<sshToModify_->numSlots(); slot++)
    {
-      // get our next one in case we delete the current
-      map<BinaryData, StoredScriptHistory>::iterator nextSSHi = iterSSH;
-      ++nextSSHi;
+      if(!sshToModify_->isLive(slot))
+         continue;
       
-      StoredScriptHistory & ssh = iterSSH->second;
+      StoredScriptHistory & ssh = sshToModify_->valueAt(slot);
       
       for(map<BinaryData, StoredSubHistory>::iterator iterSub = ssh.subHistMap_.begin(); 
           iterSub != ssh.subHistMap_.end(); 
@@ -2226,12 +2630,11 @@ set<BinaryData> BlockWriteBatcher::searchForSSHKeysToDelete()
       }
    
       // If the full SSH is empty (not just sub history), mark it to be removed
-      if(iterSSH->second.totalTxioCount_ == 0)
+      if(ssh.totalTxioCount_ == 0)
       {
-         sshToModify_.erase(iterSSH);
+         keysToDelete.insert(ssh.getDBKey(true));
+         sshToModify_->erase(sshToModify_->keyAt(slot));
       }
-      
-      iterSSH = nextSSHi;
    }
 
    return keysToDelete;
@@ -2239,21 +2642,125 @@ set<BinaryData> BlockWriteBatcher::searchForSSHKeysToDelete()
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
+// Reader/writer lock for the query* methods.  Queries take it shared for
+// their whole run.  The BDM thread takes it exclusively only while it changes
+// what they read outside of the DB snapshots:  the HeaderStore and chain 
+// organization, the zero-conf pool, and the DBs being opened or closed.
+// Applying blocks to the DB doesn't take it.
 //
-// Start BlockDataManager_LevelDB methods
-//
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-BlockDataManager_LevelDB::BlockDataManager_LevelDB(void) 
+// The exclusive side is re-entrant (Reset, organizeChain and friends call 
+// each other), and the thread holding it can also run queries.  Waiting 
+// writers block new readers, so a steady stream of queries can't starve 
+// readBlkFileUpdate.  C++11 has no shared_mutex, hence the hand-rolled one.
+class BDMQueryLock
 {
-   Reset();
-}
+public:
+   BDMQueryLock(void) : numReaders_(0), writeDepth_(0), writersWaiting_(0) {}
 
-/////////////////////////////////////////////////////////////////////////////
-BlockDataManager_LevelDB::~BlockDataManager_LevelDB(void)
-{
-   set<BtcWallet*>::iterator iter;
-   for(iter  = registeredWallets_.begin();
+   void lockShared(void)
+   {
+      unique_lock<mutex> lock(mu_);
+      if(!isWriter())
+         cv_.wait(lock, [this](void) 
+                  { return writeDepth_==0 && writersWaiting_==0; });
+      numReaders_++;
+   }
+
+   void unlockShared(void)
+   {
+      lock_guard<mutex> lock(mu_);
+      numReaders_--;
+      if(numReaders_ == 0)
+         cv_.notify_all();
+   }
+
+   void lock(void)
+   {
+      unique_lock<mutex> lock(mu_);
+      if(isWriter())
+      {
+         writeDepth_++;
+         return;
+      }
+
+      writersWaiting_++;
+      cv_.wait(lock, [this](void) 
+               { return writeDepth_==0 && numReaders_==0; });
+      writersWaiting_--;
+      writer_     = this_thread::get_id();
+      writeDepth_ = 1;
+   }
+
+   void unlock(void)
+   {
+      lock_guard<mutex> lock(mu_);
+      writeDepth_--;
+      if(writeDepth_ == 0)
+      {
+         writer_ = thread::id();
+         cv_.notify_all();
+      }
+   }
+
+private:
+   // mu_ must be held
+   bool isWriter(void) const 
+      { return writeDepth_>0 && writer_==this_thread::get_id(); }
+
+   mutex               mu_;
+   condition_variable  cv_;
+   uint32_t            numReaders_;
+   uint32_t            writeDepth_;
+   uint32_t            writersWaiting_;
+   thread::id          writer_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+class QueryReadGuard
+{
+public:
+   QueryReadGuard(BDMQueryLock* ql) : ql_(ql) { ql_->lockShared(); }
+   ~QueryReadGuard(void)                      { ql_->unlockShared(); }
+private:
+   BDMQueryLock* ql_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+class QueryWriteGuard
+{
+public:
+   QueryWriteGuard(BDMQueryLock* ql) : ql_(ql) { ql_->lock(); }
+   ~QueryWriteGuard(void)                      { ql_->unlock(); }
+private:
+   BDMQueryLock* ql_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Start BlockDataManager_LevelDB methods
+//
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+BlockDataManager_LevelDB::BlockDataManager_LevelDB(void) 
+{
+   queryLock_ = new BDMQueryLock;
+   blkDirWatcher_ = NULL;
+   Reset();
+   setNumThreads(0);
+   minBlocksPerScanThread_ = MIN_BLOCKS_PER_SCAN_THREAD;
+   asyncCommit_ = true;
+   writeBatchBytes_ = BlockWriteBatcher::UPDATE_BYTES_THRESH;
+   utxoCacheBytes_ = BlockWriteBatcher::UTXO_CACHE_BYTES;
+   undoRetention_ = BlockWriteBatcher::UNDO_RETENTION_BLOCKS;
+   txHashIndexLenReq_ = UINT32_MAX;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+BlockDataManager_LevelDB::~BlockDataManager_LevelDB(void)
+{
+   set<BtcWallet*>::iterator iter;
+   for(iter  = registeredWallets_.begin();
        iter != registeredWallets_.end();
        iter++)
    {
@@ -2261,6 +2768,7 @@ BlockDataManager_LevelDB::~BlockDataManager_LevelDB(void)
    }
 
    Reset();
+   delete queryLock_;
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -2383,6 +2891,7 @@ bool BlockDataManager_LevelDB::initializeDBInterface(ARMORY_DB_TYPE dbtype,
    }
 
 
+   QueryWriteGuard qwg(queryLock_);
    bool openWithErr = iface_->openDatabases(leveldbDir_, 
                                             GenesisHash_, 
                                             GenesisTxHash_, 
@@ -2390,6 +2899,10 @@ bool BlockDataManager_LevelDB::initializeDBInterface(ARMORY_DB_TYPE dbtype,
                                             dbtype, 
                                             prtype);
 
+   // May have to build the index from TXHINTS, which takes a while
+   if(openWithErr && txHashIndexLenReq_ != UINT32_MAX)
+      iface_->enableTxHashIndex(txHashIndexLenReq_);
+
    return openWithErr;
 }
 
@@ -2398,6 +2911,8 @@ bool BlockDataManager_LevelDB::detectCurrentSyncState(
                                           bool forceRebuild,
                                           bool initialLoad)
 {
+   QueryWriteGuard qwg(queryLock_);
+
    // Make sure we detected all the available blk files
    detectAllBlkFiles();
    vector<BinaryData> firstHashes = getFirstHashOfEachBlkFile();
@@ -2437,7 +2952,8 @@ bool BlockDataManager_LevelDB::detectCurrentSyncState(
       startApplyHgt_      = 0;
       startApplyBlkFile_  = 0;
       startApplyOffset_   = 0;
-      headerMap_.clear();
+      headerStore_.clear();
+      numHeadersOrganized_ = 0;
       topBlockPtr_ = NULL;
       genBlockPtr_ = NULL;
       lastTopBlock_ = UINT32_MAX;;
@@ -2459,9 +2975,9 @@ bool BlockDataManager_LevelDB::detectCurrentSyncState(
       return true;
    }
 
-   map<HashString, StoredHeader> sbhMap;
-   headerMap_.clear();
-   iface_->readAllHeaders(headerMap_, sbhMap);
+   headerStore_.clear();
+   numHeadersOrganized_ = 0;
+   iface_->readAllHeaders(headerStore_);
 
 
    // Organize them into the longest chain
@@ -2482,7 +2998,8 @@ bool BlockDataManager_LevelDB::detectCurrentSyncState(
       startApplyHgt_      = 0;
       startApplyBlkFile_  = 0;
       startApplyOffset_   = 0;
-      headerMap_.clear();
+      headerStore_.clear();
+      numHeadersOrganized_ = 0;
       headersByHeight_.clear();
       topBlockPtr_ = NULL;
       prevTopBlockPtr_ = NULL;
@@ -2496,10 +3013,9 @@ bool BlockDataManager_LevelDB::detectCurrentSyncState(
       // Now go through the linear list of main-chain headers, mark valid
       for(uint32_t i=0; i<headersByHeight_.size(); i++)
       {
-         BinaryDataRef headHash = headersByHeight_[i]->getThisHashRef();
-         StoredHeader & sbh = sbhMap[headHash];
-         sbh.isMainBranch_ = true;
-         iface_->setValidDupIDForHeight(sbh.blockHeight_, sbh.duplicateID_);
+         BlockHeader & bh = *headersByHeight_[i];
+         iface_->setValidDupIDForHeight(bh.getBlockHeight(), 
+                                        bh.getDuplicateID());
       }
 
       // startHeaderBlkFile_/Offset_ is where we were before the last shutdown
@@ -2838,22 +3354,16 @@ bool BlockDataManager_LevelDB::addHeadersFirst(BinaryDataRef rawHeader)
 // headers and applyToDB the raw blocks.
 bool BlockDataManager_LevelDB::addHeadersFirst(vector<StoredHeader> const & headVect)
 {
+   QueryWriteGuard qwg(queryLock_);
    vector<BlockHeader*> headersToDB;
    headersToDB.reserve(headVect.size());
+   BlockHeader bhInput;
    for(uint32_t h=0; h<headVect.size(); h++)
    {
-      pair<HashString, BlockHeader>                      bhInputPair;
-      pair<map<HashString, BlockHeader>::iterator, bool> bhInsResult;
-
-      // Actually insert it.  Take note of whether it was already there.
-      bhInputPair.second.unserialize(headVect[h].dataCopy_);
-      bhInputPair.first = bhInputPair.second.getThisHash();
-      bhInsResult       = headerMap_.insert(bhInputPair);
-      if(!bhInsResult.second)
-         bhInsResult.first->second = bhInputPair.second;
-
-      //if(bhInsResult.second) // true means didn't exist before
-      headersToDB.push_back(&(bhInsResult.first->second));
+      // Actually insert it.  Headers we already have keep their record, so
+      // that organizeChain only has to look at the new ones.
+      bhInput.unserialize(headVect[h].dataCopy_);
+      headersToDB.push_back(headerStore_.insert(bhInput));
    }
 
    // Organize the chain with the new headers, note whether a reorg occurred
@@ -2913,7 +3423,10 @@ BlockDataManager_LevelDB & BlockDataManager_LevelDB::GetInstance(void)
 void BlockDataManager_LevelDB::DestroyInstance(void)
 {
    theOnlyBDM_->Reset();
-   iface_->closeDatabases();
+   {
+      QueryWriteGuard qwg(theOnlyBDM_->queryLock_);
+      iface_->closeDatabases();
+   }
    delete theOnlyBDM_;
    bdmCreatedYet_ = false;
    iface_ = NULL;
@@ -2923,13 +3436,21 @@ void BlockDataManager_LevelDB::DestroyInstance(void)
 void BlockDataManager_LevelDB::Reset(void)
 {
    SCOPED_TIMER("BDM::Reset");
+   QueryWriteGuard qwg(queryLock_);
+
+   // The watcher is watching the old blkFileDir_
+   stopBlkDirWatcher();
 
    // Clear out all the "real" data in the blkfile
    blkFileDir_ = "";
-   headerMap_.clear();
-
-   zeroConfRawTxList_.clear();
-   zeroConfMap_.clear();
+   headerStore_.clear();
+   numHeadersOrganized_ = 0;
+   badPowOffsets_.clear();
+
+   zcPool_.clear();
+   balanceCache_.clear();
+   balanceCache_.clearZeroConf();
+   zcLogBytes_ = 0;
    zcEnabled_  = false;
    zcLiteMode_ = false;
    zcFilename_ = "";
@@ -2988,6 +3509,7 @@ void BlockDataManager_LevelDB::Reset(void)
 
    registeredWallets_.clear();
    registeredScrAddrMap_.clear();
+   registeredScrAddrMatcher_.clear();
    registeredTxSet_.clear();
    registeredTxList_.clear(); 
    registeredOutPoints_.clear(); 
@@ -3035,7 +3557,10 @@ BlockHeader & BlockDataManager_LevelDB::getTopBlockHeader(void)
 BlockHeader & BlockDataManager_LevelDB::getGenesisBlock(void) 
 {
    if(genBlockPtr_ == NULL)
-      genBlockPtr_ = &(headerMap_[GenesisHash_]);
+   {
+      QueryWriteGuard qwg(queryLock_);
+      genBlockPtr_ = &(headerStore_.getOrCreate(GenesisHash_));
+   }
    return *genBlockPtr_;
 }
 
@@ -3054,12 +3579,7 @@ BlockHeader * BlockDataManager_LevelDB::getHeaderByHeight(int index)
 // The most common access method is to get a block by its hash
 BlockHeader * BlockDataManager_LevelDB::getHeaderByHash(HashString const & blkHash)
 {
-   map<HashString, BlockHeader>::iterator it = headerMap_.find(blkHash);
-   //if(it==headerMap_.end())
-   if(ITER_NOT_IN_MAP(it, headerMap_))
-      return NULL;
-   else
-      return &(it->second);
+   return headerStore_.find(blkHash);
 }
 
 
@@ -3082,12 +3602,8 @@ Tx BlockDataManager_LevelDB::getTxByHash(HashString const & txhash)
    else
    {
       // It's not in the blockchain, but maybe in the zero-conf tx list
-      map<HashString, ZeroConfData>::const_iterator iter = zeroConfMap_.find(txhash);
-      //if(iter==zeroConfMap_.end())
-      if(ITER_NOT_IN_MAP(iter, zeroConfMap_))
-         return Tx();
-      else
-         return iter->second.txobj_;
+      ZeroConfData const * zcd = zcPool_.find(txhash);
+      return (zcd == NULL ? Tx() : zcd->txobj_);
    }
 }
 
@@ -3097,8 +3613,7 @@ TX_AVAILABILITY BlockDataManager_LevelDB::getTxHashAvail(BinaryDataRef txHash)
 {
    if(getTxRefByHash(txHash).isNull())
    {
-      //if(zeroConfMap_.find(txHash)==zeroConfMap_.end())
-      if(KEY_NOT_IN_MAP(txHash, zeroConfMap_))
+      if(!zcPool_.contains(txHash))
          return TX_DNE;  // No tx at all
       else
          return TX_ZEROCONF;  // Zero-conf tx
@@ -3119,14 +3634,13 @@ bool BlockDataManager_LevelDB::hasTxWithHash(BinaryData const & txHash)
    if(iface_->getTxRef(txHash).isInitialized())
       return true;
    else
-      return KEY_IN_MAP(txHash, zeroConfMap_);
+      return zcPool_.contains(txHash);
 }
 
 /////////////////////////////////////////////////////////////////////////////
 bool BlockDataManager_LevelDB::hasHeaderWithHash(BinaryData const & txHash) const
 {
-   //return (headerMap_.find(txHash) != headerMap_.end());
-   return KEY_IN_MAP(txHash, headerMap_);
+   return headerStore_.contains(txHash);
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -3262,6 +3776,7 @@ bool BlockDataManager_LevelDB::registerScrAddr(HashString scraddr,
       firstBlk = getTopBlockHeight() + 1;
 
    registeredScrAddrMap_[scraddr] = RegisteredScrAddr(scraddr, firstBlk);
+   registeredScrAddrMatcher_.insert(scraddr);
    allScannedUpToBlk_  = min(firstBlk, allScannedUpToBlk_);
    return true;
 }
@@ -3276,6 +3791,7 @@ bool BlockDataManager_LevelDB::registerNewScrAddr(HashString scraddr)
 
    uint32_t currBlk = getTopBlockHeight();
    registeredScrAddrMap_[scraddr] = RegisteredScrAddr(scraddr, currBlk);
+   registeredScrAddrMatcher_.insert(scraddr);
 
    // New address cannot affect allScannedUpToBlk_, so don't bother
    //allScannedUpToBlk_  = min(currBlk, allScannedUpToBlk_);
@@ -3295,6 +3811,7 @@ bool BlockDataManager_LevelDB::registerImportedScrAddr(HashString scraddr,
       createBlk = 0;
 
    registeredScrAddrMap_[scraddr] = RegisteredScrAddr(scraddr, createBlk);
+   registeredScrAddrMatcher_.insert(scraddr);
    allScannedUpToBlk_ = min(createBlk, allScannedUpToBlk_);
    return true;
 }
@@ -3309,6 +3826,7 @@ bool BlockDataManager_LevelDB::unregisterScrAddr(HashString scraddr)
       return false;
    
    registeredScrAddrMap_.erase(scraddr);
+   registeredScrAddrMatcher_.erase(scraddr);
    allScannedUpToBlk_ = evalLowestBlockNextScan();
    return true;
 }
@@ -3470,7 +3988,7 @@ bool BlockDataManager_LevelDB::walletIsRegistered(BtcWallet & wlt)
 bool BlockDataManager_LevelDB::scrAddrIsRegistered(HashString scraddr)
 {
    //return (registeredScrAddrMap_.find(scraddr)!=registeredScrAddrMap_.end());
-   return KEY_IN_MAP(scraddr, registeredScrAddrMap_);
+   return registeredScrAddrMatcher_.contains(scraddr);
 }
 
 
@@ -3554,6 +4072,123 @@ void BlockDataManager_LevelDB::scanBlockchainForTx(BtcWallet & myWallet,
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Warms the leveldb cache for the TxOuts that upcoming blocks spend.  Each
+// non-coinbase TxIn makes applyTxToBatchWriteData look up its OutPoint in
+// the UTXO set (or fetch its funding tx, if it's not in there), and those
+// reads are random, one after the other.  applyBlockRangeToDB queues the 
+// OutPoints of the blocks it has read ahead, and the workers do the same 
+// reads in parallel, so the apply loop finds them in memory.
+//
+// Nothing is handed back to the batcher, it still reads through the usual
+// path:  the batcher's buffers come first there, so a prefetched read can
+// never stand in for data the batcher has changed since.
+class TxPrefetcher
+{
+public:
+   /////////////////////////////////////////////////////////////////////////////
+   TxPrefetcher(InterfaceToLDB* iface, uint32_t nWorkers) :
+      iface_(iface),
+      applyingHgt_(0),
+      aborted_(false)
+   {
+      for(uint32_t i=0; i<nWorkers; i++)
+         workers_.push_back(thread(&TxPrefetcher::workerLoop, this));
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   ~TxPrefetcher(void)
+   {
+      {
+         unique_lock<mutex> lock(mu_);
+         aborted_ = true;
+         todo_.clear();
+         cvWork_.notify_all();
+      }
+      for(uint32_t i=0; i<workers_.size(); i++)
+         workers_[i].join();
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Queues the OutPoint of every TxIn in the block
+   void pushBlock(StoredHeader const & sbh)
+   {
+      if(workers_.size() == 0)
+         return;
+
+      vector<BinaryData> outPoints;
+      map<uint16_t, StoredTx>::const_iterator iter;
+      for(iter = sbh.stxMap_.begin(); iter != sbh.stxMap_.end(); iter++)
+      {
+         StoredTx const & stx = iter->second;
+         uint8_t const * txPtr = stx.dataCopy_.getPtr();
+         BtcUtils::StoredTxCalcLength(txPtr, stx.isFragged_, 
+                                      &txInOffsets_, &txOutOffsets_);
+         for(uint32_t iin=0; iin+1<txInOffsets_.size(); iin++)
+         {
+            uint8_t const * opPtr = txPtr + txInOffsets_[iin];
+            if(memcmp(opPtr, BtcUtils::EmptyHash_.getPtr(), 32) != 0)
+               outPoints.push_back(BinaryData(opPtr, 36));
+         }
+      }
+
+      unique_lock<mutex> lock(mu_);
+      for(uint32_t i=0; i<outPoints.size(); i++)
+         todo_.push_back(make_pair(sbh.blockHeight_, outPoints[i]));
+      cvWork_.notify_all();
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Anything queued for a block below this one is too late to help
+   void setApplyingHeight(uint32_t hgt)
+   {
+      unique_lock<mutex> lock(mu_);
+      applyingHgt_ = hgt;
+   }
+
+private:
+
+   /////////////////////////////////////////////////////////////////////////////
+   void workerLoop(void)
+   {
+      while(true)
+      {
+         BinaryData outPoint;
+         {
+            unique_lock<mutex> lock(mu_);
+            while(!aborted_ && todo_.empty())
+               cvWork_.wait(lock);
+
+            if(aborted_)
+               return;
+
+            uint32_t hgt = todo_.front().first;
+            outPoint = todo_.front().second;
+            todo_.pop_front();
+            if(hgt < applyingHgt_)
+               continue;
+         }
+
+         iface_->prefetchUtxo(outPoint);
+      }
+   }
+
+   InterfaceToLDB*                      iface_;
+
+   mutex                                mu_;
+   condition_variable                   cvWork_;
+   deque<pair<uint32_t, BinaryData> >   todo_;
+   uint32_t                             applyingHgt_;
+   bool                                 aborted_;
+
+   vector<thread>                       workers_;
+
+   // Only used by pushBlock, on the applying thread
+   vector<uint32_t>                     txInOffsets_;
+   vector<uint32_t>                     txOutOffsets_;
+};
+
+
 /////////////////////////////////////////////////////////////////////////////
 // This used to be "rescanBlocks", but now "scanning" has been replaced by
 // "reapplying" the blockdata to the databases.  Basically assumes that only
@@ -3574,40 +4209,60 @@ void BlockDataManager_LevelDB::applyBlockRangeToDB(uint32_t blk0, uint32_t blk1)
 
    // Start scanning and timer
    //bool doBatches = (blk1-blk0 > NUM_BLKS_BATCH_THRESH);
-   BlockWriteBatcher blockWrites(iface_);
+   BlockWriteBatcher blockWrites(iface_, asyncCommit_, writeBatchBytes_,
+                                 utxoCacheBytes_, undoRetention_);
+   blockWrites.setBalanceCache(&balanceCache_);
 
-   do
+   // Blocks are read up to APPLY_PREFETCH_BLOCKS ahead of the one being
+   // applied, and the txs they spend from are prefetched in the meantime.
+   // Nothing applied before a block can touch its own txs, so reading it 
+   // early gives the same StoredHeader as reading it right before applying.
+   TxPrefetcher prefetcher(iface_, numThreads_);
+   deque<StoredHeader> readAhead;
+   bool moreBlocks = true;
+
+   while(true)
    {
-      StoredHeader sbh;
-      iface_->readStoredBlockAtIter(ldbIter, sbh);
-      const uint32_t hgt = sbh.blockHeight_;
-      const uint8_t dup = sbh.duplicateID_;
-      if(blk0 > hgt || hgt >= blk1)
+      while(moreBlocks && readAhead.size() < APPLY_PREFETCH_BLOCKS)
+      {
+         readAhead.push_back(StoredHeader());
+         StoredHeader & sbh = readAhead.back();
+         iface_->readStoredBlockAtIter(ldbIter, sbh);
+         const uint32_t hgt = sbh.blockHeight_;
+         const uint8_t dup = sbh.duplicateID_;
+         if(blk0 > hgt || hgt >= blk1)
+         {
+            readAhead.pop_back();
+            moreBlocks = false;
+            break;
+         }
+
+         if(dup != iface_->getValidDupIDForHeight(hgt))
+            readAhead.pop_back();
+         else
+            prefetcher.pushBlock(sbh);
+
+         moreBlocks = iface_->advanceToNextBlock(ldbIter, false);
+      }
+
+      if(readAhead.empty())
          break;
 
+      StoredHeader & sbh = readAhead.front();
+      const uint32_t hgt = sbh.blockHeight_;
+      prefetcher.setApplyingHeight(hgt);
+
       if(hgt%2500 == 2499)
          LOGWARN << "Finished applying blocks up to " << (hgt+1);
 
-      if(dup != iface_->getValidDupIDForHeight(hgt))
-         continue;
-
-      // IS THIS COMMENT STILL RELEVANT? ~CS
-      // Ugh!  Design inefficiency: this loop and applyToBlockDB both use
-      // the same iterator, which means that applyBlockToDB will usually 
-      // leave us with the iterator in a different place than we started.
-      // I'm not clear how inefficient it is to keep re-seeking (given that
-      // there's a lot of caching going on under-the-hood).  It may be better
-      // to have each method create its own iterator... TODO:  profile/test
-      // this idea.  For now we will just save the current DB key, and 
-      // re-seek to it afterwards.
-      blockWrites.applyBlockToDB(hgt, dup); 
+      blockWrites.applyBlockToDB(sbh); 
 
       bytesReadSoFar_ += sbh.numBytes_;
+      readAhead.pop_front();
 
       // Will write out about once every 5 sec
       writeProgressFile(DB_BUILD_APPLY, blkProgressFile_, "applyBlockRangeToDB");
-
-   } while(iface_->advanceToNextBlock(ldbIter, false));
+   }
 
 }
 
@@ -3705,15 +4360,49 @@ void BlockDataManager_LevelDB::scanRegisteredTxForWallet( BtcWallet & wlt,
                                                            uint32_t blkStart,
                                                            uint32_t blkEnd)
 {
-   SCOPED_TIMER("scanRegisteredTxForWallet");
+   vector<BtcWallet*> wallets(1, &wlt);
+   scanRegisteredTxForWallets(wallets, blkStart, blkEnd);
+}
 
-   if(!wlt.ignoreLastScanned_)
-	   blkStart = wlt.lastScanned_;
-   else
-      wlt.ignoreLastScanned_ = false;
+/////////////////////////////////////////////////////////////////////////////
+// A registered tx in the range being scanned, read once for all wallets
+struct RegisteredTxToScan
+{
+   Tx             tx_;
+   uint32_t       txIndex_;
+   uint32_t       txTime_;
+   uint32_t       blkNum_;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Each BtcWallet only touches its own TxIOs and ledgers in scanTx, so the
+// wallets can be scanned at the same time.  What they share (the txs) is 
+// read from the DB beforehand, by this thread, and scanTx itself doesn't 
+// read the DB:  the wallet threads never touch it.
+void BlockDataManager_LevelDB::scanRegisteredTxForWallets(
+                                          vector<BtcWallet*> const & wallets,
+                                          uint32_t blkStart,
+                                          uint32_t blkEnd)
+{
+   SCOPED_TIMER("scanRegisteredTxForWallet");
+   if(wallets.size() == 0)
+      return;
 
-   bool isMainWallet = true;
-   if(&wlt != (*registeredWallets_.begin())) isMainWallet = false;
+   // Where each wallet starts
+   vector<uint32_t> walletStart(wallets.size());
+   uint32_t minStart = UINT32_MAX;
+   for(uint32_t w=0; w<wallets.size(); w++)
+   {
+      BtcWallet & wlt = *wallets[w];
+      if(!wlt.ignoreLastScanned_)
+         walletStart[w] = wlt.lastScanned_;
+      else
+      {
+         walletStart[w] = blkStart;
+         wlt.ignoreLastScanned_ = false;
+      }
+      minStart = min(minStart, walletStart[w]);
+   }
 
    // Make sure RegisteredTx objects have correct data, then sort.
    // TODO:  Why did I not need this with the MMAP blockchain?  Somehow
@@ -3732,12 +4421,12 @@ void BlockDataManager_LevelDB::scanRegisteredTxForWallet( BtcWallet & wlt,
    }
    registeredTxList_.sort();
 
-   ///// LOOP OVER ALL RELEVANT TX ////
+   ///// PULL ALL RELEVANT TX FROM DISK, ONCE ////
+   vector<RegisteredTxToScan> txToScan;
    for(txIter  = registeredTxList_.begin();
        txIter != registeredTxList_.end();
        txIter++)
    {
-      // Pull the tx from disk and check it for the supplied wallet
       Tx theTx = txIter->getTxCopy();
       if( !theTx.isInitialized() )
       {
@@ -3754,28 +4443,71 @@ void BlockDataManager_LevelDB::scanRegisteredTxForWallet( BtcWallet & wlt,
          continue;
 
       uint32_t thisBlk = bhptr->getBlockHeight();
-      if(thisBlk < blkStart  ||  thisBlk >= blkEnd)
+      if(thisBlk < minStart  ||  thisBlk >= blkEnd)
          continue;
 
       if( !isTxFinal(theTx) )
          continue;
 
-      // If we made it here, we want to scan this tx!
-      wlt.scanTx(theTx, txIter->txIndex_, bhptr->getTimestamp(), thisBlk, isMainWallet);
+      txToScan.push_back(RegisteredTxToScan());
+      RegisteredTxToScan & toScan = txToScan.back();
+      toScan.tx_      = theTx;
+      toScan.txIndex_ = txIter->txIndex_;
+      toScan.txTime_  = bhptr->getTimestamp();
+      toScan.blkNum_  = thisBlk;
    }
- 
-   wlt.sortLedger();
 
+   ///// SCAN THE WALLETS ////
+   BtcWallet* mainWallet = (registeredWallets_.size() > 0 ?
+                            *registeredWallets_.begin() : NULL);
+   atomic<uint32_t> nextWallet(0);
+   auto scanWallets = [&](void)
+   {
+      uint32_t w;
+      while((w = nextWallet++) < wallets.size())
+      {
+         BtcWallet & wlt = *wallets[w];
+         bool isMainWallet = (&wlt == mainWallet);
+         for(uint32_t i=0; i<txToScan.size(); i++)
+         {
+            RegisteredTxToScan & toScan = txToScan[i];
+            if(toScan.blkNum_ < walletStart[w])
+               continue;
+
+            wlt.scanTx(toScan.tx_, 
+                       toScan.txIndex_, 
+                       toScan.txTime_, 
+                       toScan.blkNum_, 
+                       isMainWallet);
+         }
+
+         wlt.sortLedger();
+      }
+   };
+
+   // The calling thread scans too
+   uint32_t nThreads = min(numThreads_, (uint32_t)wallets.size());
+   vector<thread> workers;
+   for(uint32_t t=1; t<nThreads; t++)
+      workers.push_back(thread(scanWallets));
+   scanWallets();
+   for(uint32_t t=0; t<workers.size(); t++)
+      workers[t].join();
+
+   uint32_t topBlk = getTopBlockHeight();
+   for(uint32_t w=0; w<wallets.size(); w++)
+   {
+      BtcWallet & wlt = *wallets[w];
 
-   // We should clean up any dangling TxIOs in the wallet then rescan
-   if(zcEnabled_)
-      rescanWalletZeroConf(wlt);
+      // We should clean up any dangling TxIOs in the wallet then rescan
+      if(zcEnabled_)
+         rescanWalletZeroConf(wlt);
 
-	uint32_t topBlk = getTopBlockHeight();
-	if(blkEnd > topBlk)
-		wlt.lastScanned_ = topBlk;
-	else if(blkEnd!=0)
-		wlt.lastScanned_ = blkEnd;
+      if(blkEnd > topBlk)
+         wlt.lastScanned_ = topBlk;
+      else if(blkEnd!=0)
+         wlt.lastScanned_ = blkEnd;
+   }
 }
 
 
@@ -3855,20 +4587,9 @@ vector<UnspentTxOut> BlockDataManager_LevelDB::getUTXOVectForHash160(
 }
 
 /////////////////////////////////////////////////////////////////////////////
-vector<TxIOPair> BlockDataManager_LevelDB::getHistoryForScrAddr(
-                                                BinaryDataRef uniqKey,
-                                                bool withMultisig)
+static vector<TxIOPair> getTxioVectForSSH(StoredScriptHistory & ssh,
+                                          bool withMultisig)
 {
-   StoredScriptHistory ssh;
-   iface_->getStoredScriptHistory(ssh, uniqKey);
-
-   map<BinaryData, RegisteredScrAddr>::iterator iter;
-   iter = registeredScrAddrMap_.find(uniqKey);
-   if(ITER_IN_MAP(iter, registeredScrAddrMap_))
-   {
-      iter->second.alreadyScannedUpToBlk_ = ssh.alreadyScannedUpToBlk_;
-   }
-   
    vector<TxIOPair> outVect(0);
    if(!ssh.isInitialized())
       return outVect;
@@ -3894,6 +4615,181 @@ vector<TxIOPair> BlockDataManager_LevelDB::getHistoryForScrAddr(
    return outVect;
 }
 
+/////////////////////////////////////////////////////////////////////////////
+vector<TxIOPair> BlockDataManager_LevelDB::getHistoryForScrAddr(
+                                                BinaryDataRef uniqKey,
+                                                bool withMultisig)
+{
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, uniqKey);
+
+   map<BinaryData, RegisteredScrAddr>::iterator iter;
+   iter = registeredScrAddrMap_.find(uniqKey);
+   if(ITER_IN_MAP(iter, registeredScrAddrMap_))
+   {
+      iter->second.alreadyScannedUpToBlk_ = ssh.alreadyScannedUpToBlk_;
+   }
+   
+   return getTxioVectForSSH(ssh, withMultisig);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+Tx BlockDataManager_LevelDB::queryTxByHash(BinaryData const & txHash)
+{
+   QueryReadGuard qrg(queryLock_);
+   if(!iface_->databasesAreOpen())
+      return Tx();
+
+   LDBReader reader(*iface_);
+   StoredTx stx;
+   if(iface_->getStoredTx(reader, stx, txHash) && stx.haveAllTxOut())
+      return stx.getTxCopy();
+
+   // Same fallback as getTxByHash
+   ZeroConfData const * zcd = zcPool_.find(txHash);
+   return (zcd == NULL ? Tx() : zcd->txobj_);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+BlockHeader BlockDataManager_LevelDB::queryHeaderByHash(BinaryData const & headHash)
+{
+   QueryReadGuard qrg(queryLock_);
+   BlockHeader const * bhptr = headerStore_.find(headHash);
+   return (bhptr==NULL ? BlockHeader() : *bhptr);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Unlike getHistoryForScrAddr, this doesn't update registeredScrAddrMap_
+vector<TxIOPair> BlockDataManager_LevelDB::queryHistoryForScrAddr(
+                                                BinaryData const & scrAddr,
+                                                bool withMultisig)
+{
+   QueryReadGuard qrg(queryLock_);
+   if(!iface_->databasesAreOpen())
+      return vector<TxIOPair>(0);
+
+   LDBReader reader(*iface_);
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(reader, ssh, scrAddr);
+   return getTxioVectForSSH(ssh, withMultisig);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+ScrAddrHistoryPage BlockDataManager_LevelDB::queryHistoryPageForScrAddr(
+                                                BinaryData const & scrAddr,
+                                                uint32_t startHeight,
+                                                uint32_t endHeight,
+                                                uint32_t pageSize,
+                                                BinaryData const & resumeToken,
+                                                bool withMultisig)
+{
+   QueryReadGuard qrg(queryLock_);
+   ScrAddrHistoryPage page;
+   if(!iface_->databasesAreOpen())
+      return page;
+
+   LDBReader reader(*iface_);
+   page.resumeToken_ = resumeToken;
+   page.scrAddrFound_ = iface_->getScriptHistoryPage(reader, 
+                                                     scrAddr,
+                                                     startHeight,
+                                                     endHeight,
+                                                     pageSize,
+                                                     page.resumeToken_,
+                                                     page.txioList_,
+                                                     withMultisig);
+   return page;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+uint64_t BlockDataManager_LevelDB::queryBalanceForScrAddr(
+                                                BinaryData const & scrAddr,
+                                                bool withMultisig)
+{
+   if(!withMultisig)
+   {
+      QueryReadGuard qrg(queryLock_);
+      if(!iface_->databasesAreOpen())
+         return 0;
+
+      ScrAddrBalance bal;
+      if(balanceCache_.get(scrAddr, getTopBlockHeight(), bal))
+         return bal.confirmed_;
+
+      // Nothing would get cached (blocks being written, or a full cache):
+      // the SSH summary alone is enough, skip the full history read
+      if(!balanceCache_.canInsert())
+      {
+         LDBReader reader(*iface_);
+         return iface_->getBalanceForScrAddr(reader, scrAddr, false);
+      }
+   }
+
+   ScrAddrBalance bal = queryBalanceSummary(scrAddr);
+   return bal.confirmed_ + (withMultisig ? bal.multisig_ : 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+ScrAddrBalance BlockDataManager_LevelDB::queryBalanceSummary(
+                                                BinaryData const & scrAddr)
+{
+   QueryReadGuard qrg(queryLock_);
+   ScrAddrBalance bal;
+   if(!iface_->databasesAreOpen())
+      return bal;
+
+   uint32_t topBlk = getTopBlockHeight();
+   if(balanceCache_.get(scrAddr, topBlk, bal))
+      return bal;
+
+   // Not cached yet:  the same reads as getBalanceForScrAddr with multisig.
+   // A batcher going through between the snapshot and the insert would make
+   // this SSH stale, the generation tells insert about it.
+   uint64_t writeGen = balanceCache_.getWriteGeneration();
+   LDBReader reader(*iface_);
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(reader, ssh, scrAddr);
+
+   uint64_t multisigUnspent = 0;
+   map<BinaryData, UnspentTxOut> utxoMap;
+   map<BinaryData, UnspentTxOut>::iterator iter;
+   iface_->getFullUTXOMapForSSH(reader, ssh, utxoMap, true);
+   for(iter = utxoMap.begin(); iter != utxoMap.end(); iter++)
+      if(iter->second.isMultisigRef())
+         multisigUnspent += iter->second.getValue();
+
+   balanceCache_.insert(scrAddr, ssh, multisigUnspent, topBlk, writeGen, bal);
+   return bal;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+vector<UnspentTxOut> BlockDataManager_LevelDB::queryUTXOVectForScrAddr(
+                                                BinaryData const & scrAddr,
+                                                bool withMultisig)
+{
+   QueryReadGuard qrg(queryLock_);
+   vector<UnspentTxOut> outVect(0);
+   if(!iface_->databasesAreOpen())
+      return outVect;
+
+   LDBReader reader(*iface_);
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(reader, ssh, scrAddr);
+   if(!ssh.isInitialized())
+      return outVect;
+
+   map<BinaryData, UnspentTxOut> utxoMap;
+   iface_->getFullUTXOMapForSSH(reader, ssh, utxoMap, withMultisig);
+
+   outVect.reserve(utxoMap.size());
+   map<BinaryData, UnspentTxOut>::iterator iter;
+   for(iter = utxoMap.begin(); iter != utxoMap.end(); iter++)
+      outVect.push_back(iter->second);
+
+   return outVect;
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 /*  This is not currently being used, and is actually likely to change 
@@ -3962,37 +4858,6 @@ vector<TxRef*> BlockDataManager_LevelDB::findAllNonStdTx(void)
 }
 */
 
-static bool scanFor(std::istream &in, const uint8_t * bytes, const unsigned len)
-{
-   unsigned matched=0; // how many bytes we've matched so far
-   std::vector<uint8_t> ahead(len); // the bytes matched
-   
-   in.read((char*)&ahead.front(), len);
-   unsigned count = in.gcount();
-   if (count < len) return false;
-   
-   unsigned offset=0; // the index mod len which we're in ahead
-   
-   do
-   {
-      bool found=true;
-      for (unsigned i=0; i < len; i++)
-      {
-         if (ahead[(i+offset)%len] != bytes[i])
-         {
-            found=false;
-            break;
-         }
-      }
-      if (found)
-         return true;
-      
-      ahead[offset++%len] = in.get();
-      
-   } while (!in.eof());
-   return false;
-}
-
 /////////////////////////////////////////////////////////////////////////////
 // With the LevelDB database integration, we now index all blockchain data
 // by block height and index (tx index in block, txout index in tx).  The
@@ -4024,11 +4889,12 @@ bool BlockDataManager_LevelDB::extractHeadersInBlkFile(uint32_t fnum,
       return true;
    
 
-   ifstream is(filename.c_str(), ios::in | ios::binary);
-   BinaryData fileMagic(4);
-   is.read((char*)(fileMagic.getPtr()), 4);
-   is.seekg(startOffset, ios::beg);
+   BlkFileMap blkMap;
+   if(!blkMap.open(filename))
+      return false;
+   blkMap.adviseSequential();
 
+   BinaryDataRef fileMagic = blkMap.getDataRef(0, 4);
    if( !(fileMagic == MagicBytes_ ) )
    {
       LOGERR << "Block file is the wrong network!  MagicBytes: "
@@ -4036,22 +4902,16 @@ bool BlockDataManager_LevelDB::extractHeadersInBlkFile(uint32_t fnum,
       return false;
    }
 
-
-   BinaryData rawHeader(HEADER_SIZE);
-
-   // Some objects to help insert header data efficiently
-   pair<HashString, BlockHeader>                      bhInputPair;
-   pair<map<HashString, BlockHeader>::iterator, bool> bhInsResult;
+   // Pass 1:  walk the magic/size prefixes to find every header.  This has
+   // to be serial, but it only touches the first few bytes of each block.
+   vector<RawHeaderLoc> headers;
    endOfLastBlockByte_ = startOffset;
 
    uint32_t const HEAD_AND_NTX_SZ = HEADER_SIZE + 10; // enough
-   BinaryData magic(4), szstr(4), rawHead(HEAD_AND_NTX_SZ);
-   while(!is.eof())
+   BinaryRefReader brr = blkMap.getReader(startOffset);
+   while(brr.getSizeRemaining() >= 8)
    {
-      is.read((char*)magic.getPtr(), 4);
-      if (is.eof())
-         break;
-         
+      BinaryDataRef magic = brr.get_BinaryDataRef(4);
       if(magic!=MagicBytes_)
       {
          // I have to start scanning for MagicBytes
@@ -4064,67 +4924,139 @@ bool BlockDataManager_LevelDB::extractHeadersInBlkFile(uint32_t fnum,
          LOGERR << "Did not find block header in expected location, "
             "possible corrupt data, searching for next block header.";
          
-         if (!scanFor(is, MagicBytes_.getPtr(), MagicBytes_.getSize()))
+         uint32_t bytesSkipped;
+         brr.rewind(3);
+         if (!scanForMagicBytes(brr, &bytesSkipped) || 
+             brr.getSizeRemaining() < 8)
          {
             LOGERR << "No more blocks found in file " << filename;
             break;
          }
          
-         LOGERR << "Next block header found at offset " << uint64_t(is.tellg())-4;
+         endOfLastBlockByte_ += 1 + bytesSkipped;
+         LOGERR << "Next block header found at offset " << endOfLastBlockByte_;
+         brr.advance(4);
       }
       
-      is.read((char*)szstr.getPtr(), 4);
-      uint32_t nextBlkSize = READ_UINT32_LE(szstr.getPtr());
-      if(is.eof()) break;
+      uint32_t nextBlkSize = brr.get_uint32_t();
+      if(brr.getSizeRemaining() < HEAD_AND_NTX_SZ)
+         break;
 
-      is.read((char*)rawHead.getPtr(), HEAD_AND_NTX_SZ); // plus #tx var_int
-      if(is.eof()) break;
+      RawHeaderLoc loc;
+      loc.rawHead_   = BinaryDataRef(brr.getCurrPtr(), HEAD_AND_NTX_SZ);
+      loc.offset_    = endOfLastBlockByte_;
+      loc.blockSize_ = nextBlkSize;
+      headers.push_back(loc);
+      
+      endOfLastBlockByte_ += nextBlkSize+8;
+      if(brr.getSizeRemaining() < nextBlkSize)
+         break;
+      brr.advance(nextBlkSize);
+   }
+
+   // Pass 2:  hash the headers and check their proof-of-work on all threads
+   hashAndVerifyHeaders(headers);
+
+   // Pass 3:  merge them into the header store, in file order
+   QueryWriteGuard qwg(queryLock_);
+   set<uint64_t> & badPow = badPowOffsets_[fnum];
+   badPow.erase(badPow.lower_bound(startOffset), badPow.end());
+   for(uint32_t i=0; i<headers.size(); i++)
+   {
+      RawHeaderLoc & loc = headers[i];
+
+      // We only needed the first few bytes of this block
+      blkMap.releaseBefore(loc.offset_ + loc.blockSize_ + 8);
 
-      // Create a reader for the entire block, grab header, skip rest
-      BinaryRefReader brr(rawHead);
-      bhInputPair.second.unserialize(brr);
-      uint32_t nTx = (uint32_t)brr.get_var_int();
-      bhInputPair.first = bhInputPair.second.getThisHash();
-      bhInsResult = headerMap_.insert(bhInputPair);
-      if(!bhInsResult.second)
+      if(!loc.powValid_)
+      {
+         LOGERR << "Header at offset " << loc.offset_ << " in " << filename
+                << " fails proof-of-work, skipping it.  Hash: "
+                << loc.header_.getThisHash().toHexStr();
+         badPow.insert(loc.offset_);
+         continue;
+      }
+
+      bool wasInserted;
+      BlockHeader* bhptr = headerStore_.insert(loc.header_, &wasInserted);
+      if(!wasInserted)
       {
          // We exclude the genesis block which is always in the DB here
-         if(fnum!=0 || endOfLastBlockByte_!=0)
+         if(fnum!=0 || loc.offset_!=0)
          {
             LOGWARN << "Somehow tried to add header that's already in map";
-            LOGWARN << "Header Hash: " << bhInputPair.first.toHexStr().c_str();
+            LOGWARN << "Header Hash: " << loc.header_.getThisHash().toHexStr().c_str();
          }
          // But overwrite the header anyway
-         bhInsResult.first->second = bhInputPair.second;
+         *bhptr = loc.header_;
       }
 
-      bhInsResult.first->second.setBlockFile(filename);
-      bhInsResult.first->second.setBlockFileNum(fnum);
-      bhInsResult.first->second.setBlockFileOffset(endOfLastBlockByte_);
-      bhInsResult.first->second.setNumTx(nTx);
-      bhInsResult.first->second.setBlockSize(nextBlkSize);
-      
-      endOfLastBlockByte_ += nextBlkSize+8;
-      is.seekg(nextBlkSize - HEAD_AND_NTX_SZ, ios::cur);
+      bhptr->setBlockFileNum(fnum);
+      bhptr->setBlockFileOffset(loc.offset_);
+      bhptr->setNumTx(loc.numTx_);
+      bhptr->setBlockSize(loc.blockSize_);
       
       // now check if the previous hash is in there
       // (unless the previous hash is 0
-      if (headerMap_.find(bhInputPair.second.getPrevHash()) == headerMap_.end()
-         && BtcUtils::EmptyHash_ != bhInputPair.second.getPrevHash())
+      BinaryDataRef prevHash = loc.header_.getPrevHashRef();
+      if (!headerStore_.contains(prevHash) && BtcUtils::EmptyHash_ != prevHash)
       {
-         LOGWARN << "Block header " << bhInputPair.second.getThisHash().toHexStr()
+         LOGWARN << "Block header " << loc.header_.getThisHash().toHexStr()
             << " refers to missing previous hash "
-            << bhInputPair.second.getPrevHash().toHexStr();
+            << prevHash.toHexStr();
             
-         missingBlockHeaderHashes_.push_back(bhInputPair.second.getPrevHash());
+         missingBlockHeaderHashes_.push_back(prevHash.copy());
       }
-      
    }
 
-   is.close();
    return true;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void RawHeaderLoc::hashChunk(vector<RawHeaderLoc>* headers, 
+                             uint32_t start, 
+                             uint32_t end)
+{
+   for(uint32_t i=start; i<end; i++)
+   {
+      RawHeaderLoc & loc = (*headers)[i];
+      uint8_t const * ptr = loc.rawHead_.getPtr();
+      loc.header_.unserialize(ptr, HEADER_SIZE);
+      loc.numTx_ = (uint32_t)BtcUtils::readVarInt(ptr + HEADER_SIZE,
+                                   loc.rawHead_.getSize() - HEADER_SIZE);
+      loc.powValid_ = BtcUtils::verifyProofOfWork(
+                                   loc.rawHead_.getSliceRef(0, HEADER_SIZE),
+                                   loc.header_.getThisHashRef());
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Splits the headers in one chunk per thread.  Each chunk only writes to its
+// own entries, and the refs point into a mapping that outlives the threads.
+void BlockDataManager_LevelDB::hashAndVerifyHeaders(vector<RawHeaderLoc> & headers)
+{
+   SCOPED_TIMER("hashAndVerifyHeaders");
+
+   uint32_t nHeaders = (uint32_t)headers.size();
+   uint32_t nChunks = min(numThreads_, 
+                          nHeaders / MIN_HEADERS_PER_THREAD + 1);
+   uint32_t chunkSize = (nHeaders + nChunks - 1) / nChunks;
+
+   vector<thread> workers;
+   for(uint32_t c=1; c<nChunks; c++)
+   {
+      uint32_t start = c*chunkSize;
+      uint32_t end   = min(start+chunkSize, nHeaders);
+      workers.push_back(thread(&RawHeaderLoc::hashChunk, &headers, start, end));
+   }
+
+   // The calling thread does the first chunk
+   RawHeaderLoc::hashChunk(&headers, 0, min(chunkSize, nHeaders));
+
+   for(uint32_t i=0; i<workers.size(); i++)
+      workers[i].join();
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 uint32_t BlockDataManager_LevelDB::detectAllBlkFiles(void)
@@ -4185,13 +5117,12 @@ bool BlockDataManager_LevelDB::processNewHeadersInBlkFiles(uint32_t fnumStart,
       LOGERR << "Did we shut down last time on an orphan block?";
    }
 
-   map<HashString, BlockHeader>::iterator iter;
-   for(iter = headerMap_.begin(); iter != headerMap_.end(); iter++)
+   for(uint32_t i=0; i<headerStore_.size(); i++)
    {
       StoredHeader sbh;
-      sbh.createFromBlockHeader(iter->second);
+      sbh.createFromBlockHeader(headerStore_[i]);
       uint8_t dup = iface_->putBareHeader(sbh);
-      iter->second.duplicateID_ = dup;  // make sure headerMap_ and DB agree
+      headerStore_[i].duplicateID_ = dup;  // make sure the store and DB agree
    }
 
    return prevTopBlkStillValid;
@@ -4292,7 +5223,9 @@ void BlockDataManager_LevelDB::destroyAndResetDatabases(void)
    if(iface_ != NULL)
    {
       LOGWARN << "Destroying databases;  will need to be rebuilt";
+      QueryWriteGuard qwg(queryLock_);
       iface_->destroyAndResetDatabases();
+      balanceCache_.clear();
       return;
    }
    LOGERR << "Attempted to destroy databases, but no DB interface set";
@@ -4535,7 +5468,11 @@ void BlockDataManager_LevelDB::buildAndScanDatabases(
    { 
       // In any DB type other than bare, we will be walking through the blocks
       // and updating the spentness fields and script histories
+      TIMER_START("applyBlockRangeToDB");
       applyBlockRangeToDB(startApplyHgt_, getTopBlockHeight()+1);
+      TIMER_STOP("applyBlockRangeToDB");
+      LOGINFO << "Applied blocks to DB (" 
+              << TIMER_READ_SEC("applyBlockRangeToDB") << " seconds)";
    }
 
    // We need to maintain the physical size of all blkXXXX.dat files together
@@ -4554,6 +5491,7 @@ void BlockDataManager_LevelDB::buildAndScanDatabases(
    uint32_t nWallet = 0;
 
    LOGINFO << "Scanning Wallets";
+   vector<BtcWallet*> walletsToScan;
    set<BtcWallet*>::iterator wltIter;
    for(wltIter  = registeredWallets_.begin();
        wltIter != registeredWallets_.end();
@@ -4565,10 +5503,11 @@ void BlockDataManager_LevelDB::buildAndScanDatabases(
          wlt->ignoreLastScanned_ = true;
 
       LOGINFO << "Scanning Wallet #" << nWallet << " from height " << (wlt->ignoreLastScanned_ ? 0 : wlt->lastScanned_);
-
-		scanRegisteredTxForWallet(*wlt, 0, lastTopBlock_);
+      walletsToScan.push_back(wlt);
 	}
 
+   scanRegisteredTxForWallets(walletsToScan, 0, lastTopBlock_);
+
    isInitialized_ = true;
    purgeZeroConfPool();
 
@@ -4616,148 +5555,403 @@ bool BlockDataManager_LevelDB::scanForMagicBytes(BinaryStreamBuffer& bsb, uint32
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-void BlockDataManager_LevelDB::readRawBlocksInFile(uint32_t fnum, uint32_t foffset)
+// Same as above, for data that is already entirely in RAM (or mapped)
+bool BlockDataManager_LevelDB::scanForMagicBytes(BinaryRefReader & brr, uint32_t *bytesSkipped) const
 {
-   string blkfile = blkFileList_[fnum];
-   uint64_t filesize = BtcUtils::GetFileSize(blkfile);
-   string fsizestr = BtcUtils::numToStrWCommas(filesize);
-   LOGINFO << blkfile.c_str() << " is " << fsizestr.c_str() << " bytes";
+   if (bytesSkipped) *bytesSkipped=0;
 
-   // Open the file, and check the magic bytes on the first block
-   ifstream is(blkfile.c_str(), ios::in | ios::binary);
-   BinaryData fileMagic(4);
-   is.read((char*)(fileMagic.getPtr()), 4);
-   if( !(fileMagic == MagicBytes_ ) )
+   while (brr.getSizeRemaining() >= 4)
    {
-      LOGERR << "Block file is the wrong network!  MagicBytes: "
-             << fileMagic.toHexStr().c_str();
+      if(brr.get_BinaryDataRef(4) == MagicBytes_)
+      {
+         brr.rewind(4);
+         return true;
+      }
+      // try again at the very next byte
+      if (bytesSkipped) (*bytesSkipped)++;
+      brr.rewind(3);
    }
 
-   // Seek to the supplied offset
-   is.seekg(foffset, ios::beg);
-   
-   uint64_t dbUpdateSize=0;
+   return false;
+}
 
-   BinaryStreamBuffer bsb;
-   bsb.attachAsStreamBuffer(is, (uint32_t)filesize-foffset);
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::setNumThreads(uint32_t n)
+{
+   if(n == 0)
+      n = thread::hardware_concurrency();
 
-   bool alreadyRead8B = false;
-   uint32_t nextBlkSize;
-   bool isEOF = false;
-   BinaryData firstFour(4);
+   // hardware_concurrency() returns 0 if it can't tell
+   numThreads_ = (n == 0 ? 1 : n);
+}
 
-   // We use these two vars to stop parsing if we exceed the last header
-   // that was processed (a new block was added since we processed headers)
-   bool breakbreak = false;
-   uint32_t locInBlkFile = foffset;
+////////////////////////////////////////////////////////////////////////////////
+bool BlockDataManager_LevelDB::setTxHashIndexLength(uint32_t prefixLen)
+{
+   QueryWriteGuard qwg(queryLock_);
+   if(iface_->databasesAreOpen())
+      return iface_->enableTxHashIndex(prefixLen);
 
-   iface_->startBatch(BLKDATA);
+   txHashIndexLenReq_ = prefixLen;
+   return true;
+}
 
-   unsigned failedAttempts=0;
-   
-   // It turns out that this streambuffering is probably not helping, but
-   // it doesn't hurt either, so I'm leaving it alone
-   while(bsb.streamPull())
+////////////////////////////////////////////////////////////////////////////////
+// RawBlockPipeline
+//
+// readRawBlocksInFile() used to deserialize, hash and write each block before
+// looking at the next one, which leaves all but one core idle during the 
+// initial build.  The pipeline splits that work in three stages:
+//
+//    reader  (1 thread)  :  frames blocks by magic bytes + length
+//    workers (N threads) :  unserializeFullBlock, which hashes every tx
+//    writer  (caller)    :  assigns hgt/dup from the headerMap and writes to
+//                           the BLKDATA batch, strictly in file order
+//
+// The writer is the only stage that touches the BDM or the DB, so none of 
+// that code needs to be thread-safe.  The number of blocks in flight is
+// bounded, so memory usage does not depend on how far the reader gets ahead.
+////////////////////////////////////////////////////////////////////////////////
+class RawBlockPipeline
+{
+public:
+   struct Job
+   {
+      Job(void) : seq_(0), offset_(0), parsed_(false) {}
+
+      uint32_t           seq_;
+      uint64_t           offset_;     // position of the block after magic+size
+      BinaryDataRef      rawBlock_;   // points into the BlkFileMap
+      StoredHeader       sbh_;
+      bool               parsed_;
+      exception_ptr      error_;      // anything but BlockDeserializingException
+   };
+
+   /////////////////////////////////////////////////////////////////////////////
+   RawBlockPipeline(uint32_t nWorkers) :
+      nextSeqIn_(0),
+      nextSeqOut_(0),
+      maxInFlight_(RAW_BLOCKS_IN_FLIGHT_PER_THREAD * (nWorkers+1)),
+      readerDone_(false),
+      aborted_(false)
+   {
+      for(uint32_t i=0; i<nWorkers; i++)
+         workers_.push_back(thread(&RawBlockPipeline::workerLoop, this));
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   ~RawBlockPipeline(void)
+   {
+      abort();
+      if(reader_.joinable())
+         reader_.join();
+      for(uint32_t i=0; i<workers_.size(); i++)
+         workers_[i].join();
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void startReader(function<void(void)> readerFunc)
+   {
+      reader_ = thread(readerFunc);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Called by the reader.  Blocks while too many blocks are in flight, and 
+   // returns false if the writer gave up on this pipeline.  No copy is made,
+   // rawBlock must stay valid until the pipeline is destroyed.
+   bool pushBlock(uint64_t offset, BinaryDataRef rawBlock)
+   {
+      shared_ptr<Job> job(new Job);
+      job->offset_ = offset;
+      job->rawBlock_ = rawBlock;
+
+      unique_lock<mutex> lock(mu_);
+      while(!aborted_ && nextSeqIn_ - nextSeqOut_ >= maxInFlight_)
+         cvSpace_.wait(lock);
+
+      if(aborted_)
+         return false;
+
+      job->seq_ = nextSeqIn_++;
+      todo_.push_back(job);
+      cvWork_.notify_one();
+      return true;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void finishReading(void)
+   {
+      unique_lock<mutex> lock(mu_);
+      readerDone_ = true;
+      cvWork_.notify_all();
+      cvDone_.notify_all();
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Called by the writer.  Returns the blocks in the order they were pushed,
+   // and false once the reader is done and everything has been handed out.
+   bool popNextInOrder(shared_ptr<Job> & job)
    {
-      while(bsb.reader().getSizeRemaining() >= 8)
+      unique_lock<mutex> lock(mu_);
+      while(true)
       {
-         
-         if(!alreadyRead8B)
+         map<uint32_t, shared_ptr<Job> >::iterator iter = done_.find(nextSeqOut_);
+         if(iter != done_.end())
          {
-            bsb.reader().get_BinaryData(firstFour, 4);
-            if(firstFour!=MagicBytes_)
-            {
-               isEOF = true; 
-               break;
-            }
-            nextBlkSize = bsb.reader().get_uint32_t();
-            bytesReadSoFar_ += 8;
-            locInBlkFile += 8;
+            job = iter->second;
+            done_.erase(iter);
+            nextSeqOut_++;
+            cvSpace_.notify_one();
+            return true;
          }
 
-         if(bsb.reader().getSizeRemaining() < nextBlkSize)
+         if(aborted_ || (readerDone_ && nextSeqOut_ == nextSeqIn_))
+            return false;
+
+         cvDone_.wait(lock);
+      }
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   void abort(void)
+   {
+      unique_lock<mutex> lock(mu_);
+      aborted_ = true;
+      todo_.clear();
+      cvWork_.notify_all();
+      cvDone_.notify_all();
+      cvSpace_.notify_all();
+   }
+
+private:
+
+   /////////////////////////////////////////////////////////////////////////////
+   void workerLoop(void)
+   {
+      while(true)
+      {
+         shared_ptr<Job> job;
          {
-            alreadyRead8B = true;
-            break;
+            unique_lock<mutex> lock(mu_);
+            while(!aborted_ && !readerDone_ && todo_.empty())
+               cvWork_.wait(lock);
+
+            if(aborted_ || todo_.empty())
+               return;
+
+            job = todo_.front();
+            todo_.pop_front();
          }
-         alreadyRead8B = false;
 
-         BinaryRefReader brr(bsb.reader().getCurrPtr(), nextBlkSize);
-         
+         // The writer reproduces the serial error handling, so we only note
+         // whether the block parsed.  Don't log from here, the logger is not
+         // thread-safe.
          try
          {
-            addRawBlockToDB(brr);
+            BinaryRefReader brr(job->rawBlock_);
+            job->sbh_.unserializeFullBlock(brr, true, false);
+            job->parsed_ = true;
          }
-         catch (BlockDeserializingException &e)
+         catch (BlockDeserializingException &)
          {
-            LOGERR << e.what() << " (error encountered processing block at byte "
-               << locInBlkFile << " file "
-               << blkfile << ", blocksize " << nextBlkSize << ")";
-            failedAttempts++;
-            
-            if (failedAttempts >= 4)
-            {
-               // It looks like this file is irredeemably corrupt
-               LOGERR << "Giving up searching " << blkfile
-                  << " after having found 4 block headers with unparseable contents";
-               breakbreak=true;
-               break;
-            }
-            
-            uint32_t bytesSkipped;
-            const bool next = scanForMagicBytes(bsb, &bytesSkipped);
-            if (!next)
-            {
-               LOGERR << "Could not find another block in the file";
-               breakbreak=true;
-               break;
-            }
-            else
-            {
-               locInBlkFile += bytesSkipped;
-               LOGERR << "Found another block header at " << locInBlkFile;
-            }
-
-            continue;
+            job->parsed_ = false;
          }
-         dbUpdateSize += nextBlkSize;
-
-         if(dbUpdateSize>BlockWriteBatcher::UPDATE_BYTES_THRESH && iface_->isBatchOn(BLKDATA))
+         catch (...)
          {
-            dbUpdateSize = 0;
-            iface_->commitBatch(BLKDATA);
-            iface_->startBatch(BLKDATA);
+            job->error_ = current_exception();
          }
 
-         blocksReadSoFar_++;
-         bytesReadSoFar_ += nextBlkSize;
-         locInBlkFile += nextBlkSize;
-         bsb.reader().advance(nextBlkSize);
+         unique_lock<mutex> lock(mu_);
+         done_[job->seq_] = job;
+         cvDone_.notify_all();
+      }
+   }
 
-         // This is a hack of hacks, but I can't seem to pass this data 
-         // out through getLoadProgress* methods, because they don't 
-         // update properly (from the main python thread) when the BDM 
-         // is actively loading/scanning in a separate thread.
-         // We'll watch for this file from the python code.
-         writeProgressFile(DB_BUILD_ADD_RAW, blkProgressFile_, "dumpRawBlocksToDB");
+   mutex                                mu_;
+   condition_variable                   cvWork_;
+   condition_variable                   cvDone_;
+   condition_variable                   cvSpace_;
+
+   deque<shared_ptr<Job> >              todo_;
+   map<uint32_t, shared_ptr<Job> >      done_;
+   uint32_t                             nextSeqIn_;
+   uint32_t                             nextSeqOut_;
+   uint32_t                             maxInFlight_;
+   bool                                 readerDone_;
+   bool                                 aborted_;
+
+   thread                               reader_;
+   vector<thread>                       workers_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::readRawBlocksInFile(uint32_t fnum, uint32_t foffset)
+{
+   string blkfile = blkFileList_[fnum];
+   uint64_t filesize = BtcUtils::GetFileSize(blkfile);
+   string fsizestr = BtcUtils::numToStrWCommas(filesize);
+   LOGINFO << blkfile.c_str() << " is " << fsizestr.c_str() << " bytes";
+
+   // Map the file, and check the magic bytes on the first block
+   BlkFileMap blkMap;
+   if(!blkMap.open(blkfile))
+      return;
+   blkMap.adviseSequential();
+
+   BinaryDataRef fileMagic = blkMap.getDataRef(0, 4);
+   if( !(fileMagic == MagicBytes_ ) )
+   {
+      LOGERR << "Block file is the wrong network!  MagicBytes: "
+             << fileMagic.toHexStr().c_str();
+   }
+
+   uint64_t dbUpdateSize=0;
+   uint64_t locInBlkFile = foffset;
+   unsigned failedAttempts=0;
+
+   iface_->startBatch(BLKDATA);
+
+   // Each pass runs the pipeline until the end of the file, or until it hits
+   // a block that can't be added.  In the latter case we look for the next 
+   // magic bytes after the bad block's prefix and start a new pass from there
+   while(true)
+   {
+      uint64_t badBlockOffset;
+      if(pipelineRawBlocks(blkMap, fnum, locInBlkFile, dbUpdateSize, badBlockOffset))
+         break;
+
+      failedAttempts++;
+      if (failedAttempts >= 4)
+      {
+         // It looks like this file is irredeemably corrupt
+         LOGERR << "Giving up searching " << blkfile
+            << " after having found 4 block headers with unparseable contents";
+         break;
+      }
+
+      BinaryRefReader brr = blkMap.getReader(badBlockOffset);
+      uint32_t bytesSkipped;
+      const bool next = scanForMagicBytes(brr, &bytesSkipped);
+      if (!next)
+      {
+         LOGERR << "Could not find another block in the file";
+         break;
+      }
+
+      locInBlkFile = badBlockOffset + bytesSkipped;
+      LOGERR << "Found another block header at " << locInBlkFile;
+   }
+
+   if(iface_->isBatchOn(BLKDATA))
+      iface_->commitBatch(BLKDATA);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Returns true if we got to the end of the file (or the last header we 
+// processed).  Returns false if a block could not be added, in which case
+// badBlockOffset is set to the position right after that block's magic+size.
+bool BlockDataManager_LevelDB::pipelineRawBlocks(BlkFileMap & blkMap,
+                                                 uint32_t fnum, 
+                                                 uint64_t foffset,
+                                                 uint64_t & dbUpdateSize,
+                                                 uint64_t & badBlockOffset)
+{
+   string blkfile = blkFileList_[fnum];
+   bool isLastFile = (fnum == numBlkFiles_-1);
+   uint64_t endOfLastBlock = endOfLastBlockByte_;
+   BinaryData magic = MagicBytes_;
+
+   // Their headers were never added, there is no hgt/dup to store them at.
+   // A copy, the reader doesn't touch BDM state.
+   set<uint64_t> badPow;
+   if(KEY_IN_MAP(fnum, badPowOffsets_))
+      badPow = badPowOffsets_[fnum];
+
+   RawBlockPipeline pipeline(numThreads_);
+
+   // The reader only frames blocks, it doesn't touch any BDM state.  The 
+   // blocks are handed to the workers as refs into the mapped file.
+   pipeline.startReader([&](void)
+   {
+      BinaryRefReader brr = blkMap.getReader(foffset);
+      uint64_t loc = foffset;
+
+      while(brr.getSizeRemaining() >= 8)
+      {
+         if(brr.get_BinaryDataRef(4) != magic)
+            break;
+
+         uint32_t nextBlkSize = brr.get_uint32_t();
+         bool skipBlock = (badPow.count(loc) > 0);
+         loc += 8;
+
+         // Partial block at the end of the file
+         if(brr.getSizeRemaining() < nextBlkSize)
+            break;
+
+         if(skipBlock)
+            brr.advance(nextBlkSize);
+         else if(!pipeline.pushBlock(loc, brr.get_BinaryDataRef(nextBlkSize)))
+            break;
+
+         loc += nextBlkSize;
 
          // Don't read past the last header we processed (in case new 
          // blocks were added since we processed the headers
-         if(fnum == numBlkFiles_-1 && locInBlkFile >= endOfLastBlockByte_)
-         {
-            breakbreak = true;
+         if(isLastFile && loc >= endOfLastBlock)
             break;
-         }
       }
 
+      pipeline.finishReading();
+   });
 
-      if(isEOF || breakbreak)
-         break;
+   shared_ptr<RawBlockPipeline::Job> job;
+   while(pipeline.popNextInOrder(job))
+   {
+      if(job->error_)
+         rethrow_exception(job->error_);
+
+      uint32_t blkSize = (uint32_t)job->rawBlock_.getSize();
+      bytesReadSoFar_ += 8;
+
+      try
+      {
+         addParsedBlockToDB(job->sbh_, job->parsed_);
+      }
+      catch (BlockDeserializingException &e)
+      {
+         LOGERR << e.what() << " (error encountered processing block at byte "
+            << job->offset_ << " file "
+            << blkfile << ", blocksize " << blkSize << ")";
+         badBlockOffset = job->offset_;
+         return false;
+      }
+
+      dbUpdateSize += blkSize;
+      if(dbUpdateSize>BlockWriteBatcher::UPDATE_BYTES_THRESH && iface_->isBatchOn(BLKDATA))
+      {
+         dbUpdateSize = 0;
+         iface_->commitBatch(BLKDATA);
+         iface_->startBatch(BLKDATA);
+      }
+
+      blocksReadSoFar_++;
+      bytesReadSoFar_ += blkSize;
+
+      // Everything before this block has been parsed and written
+      blkMap.releaseBefore(job->offset_ + blkSize);
+
+      // This is a hack of hacks, but I can't seem to pass this data 
+      // out through getLoadProgress* methods, because they don't 
+      // update properly (from the main python thread) when the BDM 
+      // is actively loading/scanning in a separate thread.
+      // We'll watch for this file from the python code.
+      writeProgressFile(DB_BUILD_ADD_RAW, blkProgressFile_, "dumpRawBlocksToDB");
    }
-   
 
-   if(iface_->isBatchOn(BLKDATA))
-      iface_->commitBatch(BLKDATA);
+   return true;
 }
 
 
@@ -4798,54 +5992,232 @@ StoredHeader BlockDataManager_LevelDB::getMainBlockFromDB(uint32_t hgt)
 
 
 ////////////////////////////////////////////////////////////////////////////////
-void BlockDataManager_LevelDB::scanDBForRegisteredTx(uint32_t blk0,
-                                                     uint32_t blk1)
+// RescanPartition
+//
+// scanDBForRegisteredTx splits the height range in one partition per thread.
+// Each thread walks its own range with its own LDBIter, and only writes to 
+// its own RescanPartition.  Everything else it touches (the DB, the 
+// registered scrAddrs and registeredOutPoints_) is only read until all the
+// threads are done, and then the calling thread merges the partitions in 
+// height order.  The DB reads can log (LOGERR on a missing block, etc), the 
+// logger serializes whole lines so that's safe from here.
+//
+// A TxIn can spend an outpoint found in an earlier partition, which that 
+// thread didn't know about.  So after the first pass, each partition is 
+// walked again for those spends only.  That pass reads the TxIns straight
+// from the DB values, and is skipped when the earlier partitions found 
+// nothing.
+////////////////////////////////////////////////////////////////////////////////
+class RescanPartition
 {
-   SCOPED_TIMER("scanDBForRegisteredTx");
-   bytesReadSoFar_ = 0;
+public:
+   RescanPartition(uint32_t hgtStart, 
+                   uint32_t hgtEnd, 
+                   atomic<uint64_t>* bytesScanned) :
+      hgtStart_(hgtStart),
+      hgtEnd_(hgtEnd),
+      bytesScanned_(bytesScanned),
+      writeProgress_(false) {}
 
-   bool doScanProgressThing = (blk1-blk0 > NUM_BLKS_IS_DIRTY);
-   if(doScanProgressThing)
-   {
-      //if(BtcUtils::GetFileSize(bfile) != FILE_DOES_NOT_EXIST)
-         //remove(bfile.c_str());
-   }
+   uint32_t                        hgtStart_;
+   uint32_t                        hgtEnd_;
+
+   // Relevant tx keyed by their 6-byte DB key, which sorts them by height
+   map<BinaryData, RegisteredTx>   txFound_;
+
+   // Outputs to registered scrAddrs created in this range
+   set<OutPoint>                   outPointsFound_;
 
+   // Shared by all partitions, only the calling thread writes progress
+   atomic<uint64_t>*               bytesScanned_;
+   bool                            writeProgress_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::scanPartitionForRegisteredTx(
+                                                   RescanPartition* part)
+{
    LDBIter ldbIter = iface_->getIterator(BLKDATA, BULK_SCAN);
-   BinaryData firstKey = DBUtils.getBlkDataKey(blk0, 0);
-   ldbIter.seekTo(firstKey);
+   ldbIter.seekTo(DBUtils.getBlkDataKey(part->hgtStart_, 0));
 
-   TIMER_START("ScanBlockchain");
    while(ldbIter.isValid(DB_PREFIX_TXDATA))
    {
       // Get the full block from the DB
       StoredHeader sbh;
       iface_->readStoredBlockAtIter(ldbIter, sbh);
-      bytesReadSoFar_ += sbh.numBytes_;
-
-      uint32_t hgt     = sbh.blockHeight_;
-      uint8_t  dup     = sbh.duplicateID_;
-      uint8_t  dupMain = iface_->getValidDupIDForHeight(hgt);
-      if(!sbh.isMainBranch_ || dup != dupMain)
-         continue;
+      *part->bytesScanned_ += sbh.numBytes_;
 
-      if(hgt >= blk1)
+      uint32_t hgt = sbh.blockHeight_;
+      if(hgt >= part->hgtEnd_)
          break;
+
+      if(!sbh.isMainBranch_ || 
+         sbh.duplicateID_ != iface_->getValidDupIDForHeight(hgt))
+         continue;
    
       // If we're here, we need to check the tx for relevance to the 
-      // global scrAddr list.  Add to registered Tx map if so
+      // global scrAddr list
       map<uint16_t, StoredTx>::iterator iter;
       for(iter  = sbh.stxMap_.begin();
           iter != sbh.stxMap_.end();
           iter++)
       {
          StoredTx & stx = iter->second;
-         registeredScrAddrScan_IterSafe(stx);
+         if(!findRegisteredTxIO(stx, part->outPointsFound_))
+            continue;
+
+         BinaryData dbKey6 = stx.getDBKey(false);
+         part->txFound_[dbKey6] = RegisteredTx(TxRef(dbKey6),
+                                               stx.thisHash_,
+                                               stx.blockHeight_,
+                                               stx.txIndex_);
+      }
+
+      // This will write out about once every 5 sec
+      if(part->writeProgress_)
+      {
+         bytesReadSoFar_ = *part->bytesScanned_;
+         writeProgressFile(DB_BUILD_SCAN, blkProgressFile_, "ScanBlockchain");
+      }
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Second pass over one partition, for the TxIns spending earlierOutPoints.
+// This doesn't unserialize anything, it only walks the TxIns at the start of
+// each tx value (which are there whether the tx is stored fragged or not).
+void BlockDataManager_LevelDB::scanPartitionForSpends(
+                                       RescanPartition* part,
+                                       set<OutPoint> const * earlierOutPoints)
+{
+   LDBIter ldbIter = iface_->getIterator(BLKDATA, BULK_SCAN);
+   ldbIter.seekTo(DBUtils.getBlkDataKey(part->hgtStart_, 0));
+
+   uint32_t hgt;
+   uint8_t  dup;
+   uint16_t txIdx;
+   vector<uint32_t> offsetsIn;
+   vector<uint32_t> offsetsOut;
+   OutPoint op;
+   for( ; ldbIter.isValid(DB_PREFIX_TXDATA); ldbIter.advanceAndRead())
+   {
+      ldbIter.resetReaders();
+      BLKDATA_TYPE bdtype = DBUtils.readBlkDataKey(ldbIter.getKeyReader(),
+                                                   hgt, dup, txIdx);
+      if(hgt >= part->hgtEnd_)
+         break;
+
+      if(bdtype != BLKDATA_TX || dup != iface_->getValidDupIDForHeight(hgt))
+         continue;
+
+      // Same layout as StoredTx::unserializeDBValue
+      BinaryRefReader & brr = ldbIter.getValueReader();
+      BitUnpacker<uint16_t> bitunpack(brr);
+      bitunpack.getBits(6);  // DB and tx versions
+      TX_SERIALIZE_TYPE serType = (TX_SERIALIZE_TYPE)bitunpack.getBits(4);
+      if(serType == TX_SER_COUNTOUT)
+         continue;
+
+      BinaryDataRef txHash = brr.get_BinaryDataRef(32);
+      uint8_t const * txPtr = brr.getCurrPtr();
+      BtcUtils::StoredTxCalcLength(txPtr, 
+                                   serType==TX_SER_FRAGGED,
+                                   &offsetsIn, 
+                                   &offsetsOut);
+
+      for(uint32_t iin=0; iin+1<offsetsIn.size(); iin++)
+      {
+         op.unserialize(txPtr + offsetsIn[iin], 
+                        brr.getSizeRemaining() - offsetsIn[iin]);
+         if(earlierOutPoints->count(op) == 0)
+            continue;
+
+         BinaryData dbKey6 = DBUtils.getBlkDataKeyNoPrefix(hgt, dup, txIdx);
+         part->txFound_[dbKey6] = RegisteredTx(TxRef(dbKey6), txHash, hgt, txIdx);
+         break;
+      }
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::scanDBForRegisteredTx(uint32_t blk0,
+                                                     uint32_t blk1)
+{
+   SCOPED_TIMER("scanDBForRegisteredTx");
+   bytesReadSoFar_ = 0;
+
+   bool doScanProgressThing = (blk1-blk0 > NUM_BLKS_IS_DIRTY);
+   if(doScanProgressThing)
+   {
+      //if(BtcUtils::GetFileSize(bfile) != FILE_DOES_NOT_EXIST)
+         //remove(bfile.c_str());
+   }
+
+   // One partition per thread.  The last one is open-ended, in case the DB 
+   // has blocks past the top header.
+   uint32_t blkEnd  = min(blk1, getTopBlockHeight()+1);
+   uint32_t nBlocks = (blkEnd > blk0 ? blkEnd - blk0 : 0);
+   uint32_t nParts  = min(numThreads_, nBlocks/minBlocksPerScanThread_ + 1);
+   uint32_t partSize = (nBlocks + nParts - 1) / nParts;
+   if(partSize > 0)
+      nParts = (nBlocks + partSize - 1) / partSize;
+
+   atomic<uint64_t> bytesScanned(0);
+   vector<RescanPartition> parts;
+   for(uint32_t p=0; p<nParts; p++)
+   {
+      uint32_t start = blk0 + p*partSize;
+      uint32_t end   = (p+1==nParts ? blk1 : start+partSize);
+      parts.push_back(RescanPartition(start, end, &bytesScanned));
+   }
+   parts[0].writeProgress_ = true;
+
+   TIMER_START("ScanBlockchain");
+
+   // The calling thread does the first partition
+   vector<thread> workers;
+   for(uint32_t p=1; p<nParts; p++)
+      workers.push_back(thread(&BlockDataManager_LevelDB::scanPartitionForRegisteredTx,
+                               this, &parts[p]));
+   scanPartitionForRegisteredTx(&parts[0]);
+   for(uint32_t i=0; i<workers.size(); i++)
+      workers[i].join();
+
+   // Spends of outpoints found by an earlier partition
+   vector< set<OutPoint> > earlierOutPoints(nParts);
+   workers.clear();
+   for(uint32_t p=1; p<nParts; p++)
+   {
+      earlierOutPoints[p] = earlierOutPoints[p-1];
+      earlierOutPoints[p].insert(parts[p-1].outPointsFound_.begin(),
+                                 parts[p-1].outPointsFound_.end());
+      if(earlierOutPoints[p].size() > 0)
+         workers.push_back(thread(&BlockDataManager_LevelDB::scanPartitionForSpends,
+                                  this, &parts[p], &earlierOutPoints[p]));
+   }
+   for(uint32_t i=0; i<workers.size(); i++)
+      workers[i].join();
+
+   // Partitions are in height order, and so is each txFound_ map
+   for(uint32_t p=0; p<nParts; p++)
+   {
+      map<BinaryData, RegisteredTx>::iterator iter;
+      for(iter  = parts[p].txFound_.begin();
+          iter != parts[p].txFound_.end();
+          iter++)
+      {
+         RegisteredTx & regTx = iter->second;
+         insertRegisteredTxIfNew(regTx.txRefObj_, 
+                                 regTx.txHash_, 
+                                 regTx.blkNum_, 
+                                 regTx.txIndex_);
       }
 
-      // This will write out about once every 5 sec
-      writeProgressFile(DB_BUILD_SCAN, blkProgressFile_, "ScanBlockchain");
+      registeredOutPoints_.insert(parts[p].outPointsFound_.begin(),
+                                  parts[p].outPointsFound_.end());
    }
+
+   bytesReadSoFar_ = bytesScanned;
    TIMER_STOP("ScanBlockchain");
 }
 
@@ -4854,6 +6226,7 @@ void BlockDataManager_LevelDB::scanDBForRegisteredTx(uint32_t blk0,
 void BlockDataManager_LevelDB::deleteHistories(void)
 {
    SCOPED_TIMER("deleteHistories");
+   balanceCache_.clear();
 
    LDBIter ldbIter = iface_->getIterator(BLKDATA);
 
@@ -4930,6 +6303,7 @@ void BlockDataManager_LevelDB::saveScrAddrHistories(void)
    }
 
    iface_->commitBatch(BLKDATA);
+   balanceCache_.clear();
 }
 
 
@@ -4941,27 +6315,55 @@ void BlockDataManager_LevelDB::saveScrAddrHistories(void)
 // NOTE:  You might want to check lastBlockWasReorg_ variable to know whether 
 //        to expect some previously valid headers/txs to still be valid
 //
+// Plain read of everything from offset to the end of a blk file.  Empty
+// if the file doesn't exist or ends before offset.
+//
+// Not a BlkFileMap:  bitcoind preallocates the file it's writing to, and
+// truncates it when it moves on to the next one.  Touching a mapped page 
+// past the new end raises SIGBUS, a read just comes back short.
+static bool readBlkFileTail(string const & filename, 
+                            uint64_t offset,
+                            BinaryData & tail)
+{
+   tail.resize(0);
+   ifstream is(OS_TranslatePath(filename).c_str(), ios::in|ios::binary);
+   if(!is.is_open())
+      return false;
+
+   is.seekg(0, ios::end);
+   uint64_t filesize = (uint64_t)is.tellg();
+   if(filesize <= offset)
+      return true;
+
+   tail.resize((size_t)(filesize - offset));
+   is.seekg(offset, ios::beg);
+   is.read((char*)tail.getPtr(), tail.getSize());
+   tail.resize((size_t)is.gcount());
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
 uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
 {
    SCOPED_TIMER("readBlkFileUpdate");
 
-   // Make sure the file exists and is readable
+   // Make sure the file exists and is readable.  Both the current and the 
+   // next file are live, they're read into memory, not mapped.
    string filename = blkFileList_[blkFileList_.size()-1];
 
    uint64_t filesize = FILE_DOES_NOT_EXIST;
-   ifstream is(OS_TranslatePath(filename).c_str(), ios::in|ios::binary);
-   if(is.is_open())
-   {
-      is.seekg(0, ios::end);
-      filesize = (size_t)is.tellg();
-   }
+   BinaryData currTail;
+   if(readBlkFileTail(filename, endOfLastBlockByte_, currTail))
+      filesize = endOfLastBlockByte_ + currTail.getSize();
       
    uint32_t prevTopBlk = getTopBlockHeight()+1;
    uint64_t currBlkBytesToRead;
+   bool     lastBlockIsPartial = false;
 
    if( filesize == FILE_DOES_NOT_EXIST )
    {
       LOGERR << "***ERROR:  Cannot open " << filename.c_str();
+      updateBlkDirWatcher();
       return 0;
    }
    else if((int64_t)filesize-(int64_t)endOfLastBlockByte_ < 8)
@@ -4976,19 +6378,23 @@ uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
       // Keep checking where we expect to see magic bytes, we know we're 
       // at the end if we see zero-bytes instead.
       uint64_t endOfNewLastBlock = endOfLastBlockByte_;
-      BinaryData fourBytes(4);
       while((int64_t)filesize - (int64_t)endOfNewLastBlock >= 8)
       {
-         is.seekg(endOfNewLastBlock, ios::beg);
-         is.read((char*)fourBytes.getPtr(), 4);
-
-         if(fourBytes != MagicBytes_)
+         uint8_t const * ptr = currTail.getPtr() + 
+                               (endOfNewLastBlock - endOfLastBlockByte_);
+         if(BinaryDataRef(ptr, 4) != MagicBytes_)
             break;
-         else
+
+         // A block that's still being written:  stop in front of it, and
+         // pick it up on a later update once it's all there
+         uint64_t endOfBlock = endOfNewLastBlock + READ_UINT32_LE(ptr+4) + 8;
+         if(endOfBlock > filesize)
          {
-            is.read((char*)fourBytes.getPtr(), 4);
-            endOfNewLastBlock += READ_UINT32_LE((fourBytes.getPtr())) + 8;
+            lastBlockIsPartial = true;
+            break;
          }
+
+         endOfNewLastBlock = endOfBlock;
       }
 
       currBlkBytesToRead = endOfNewLastBlock - endOfLastBlockByte_;
@@ -4996,18 +6402,30 @@ uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
       
 
    // Check to see if there was a blkfile split, and we have to switch
-   // to tracking the new file..  this condition triggers about once a week
+   // to tracking the new file..  this condition triggers about once a week.
+   // Not while the current file ends in a partial block though:  the switch
+   // resets endOfLastBlockByte_, and that block would never be read.
    string nextFilename = BtcUtils::getBlkFilename(blkFileDir_, numBlkFiles_);
    uint64_t nextBlkBytesToRead = BtcUtils::GetFileSize(nextFilename);
-   if(nextBlkBytesToRead == FILE_DOES_NOT_EXIST)
+   BinaryData nextData;
+   if(nextBlkBytesToRead == FILE_DOES_NOT_EXIST || lastBlockIsPartial)
       nextBlkBytesToRead = 0;
    else
+   {
       LOGINFO << "New block file split! " << nextFilename.c_str();
+      if(readBlkFileTail(nextFilename, 0, nextData))
+         nextBlkBytesToRead = nextData.getSize();
+      else
+         nextBlkBytesToRead = 0;
+   }
 
 
    // If there is no new data, no need to continue
    if(currBlkBytesToRead==0 && nextBlkBytesToRead==0)
+   {
+      updateBlkDirWatcher();
       return 0;
+   }
    
    // Observe if everything was up to date when we started, because we're 
    // going to add new blockchain data and don't want to trigger a rescan 
@@ -5015,63 +6433,61 @@ uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
    const uint32_t nextBlk = getTopBlockHeight() + 1;
    const bool prevRegisteredUpToDate = (allScannedUpToBlk_==nextBlk);
    
-   // Pull in the remaining data in old/curr blkfile, and beginning of new
-   BinaryData newBlockDataRaw((size_t)(currBlkBytesToRead+nextBlkBytesToRead));
-
-   // Seek to the beginning of the new data and read it
-   if(currBlkBytesToRead>0)
-   {
-      ifstream is(filename.c_str(), ios::in | ios::binary);
-      is.seekg(endOfLastBlockByte_, ios::beg);
-      is.read((char*)newBlockDataRaw.getPtr(), currBlkBytesToRead);
-      is.close();
-   }
-
-   // If a new block file exists, read that one too
-   // nextBlkBytesToRead will include up to 16 MB of padding if our gateway
-   // is a bitcoind/qt 0.8+ node.  Either way, it will be easy to detect when
-   // we've reached the end of the real data, as long as there is no gap 
-   // between the end of currBlk data and the start of newBlk data (there isn't)
-   if(nextBlkBytesToRead>0)
-   {
-      uint8_t* ptrNextData = newBlockDataRaw.getPtr() + currBlkBytesToRead;
-      ifstream is(nextFilename.c_str(), ios::in | ios::binary);
-      is.read((char*)ptrNextData, nextBlkBytesToRead);
-      is.close();
-   }
-
-
    // Walk through each of the new blocks, adding each one to RAM and DB
    // Do a full update of everything after each block, for simplicity
    // (which means we may be adding a couple blocks, the first of which
    // may appear valid but orphaned by later blocks -- that's okay as 
    // we'll just reverse it when we add the later block -- this is simpler)
-   BinaryRefReader brr(newBlockDataRaw);
-   BinaryData fourBytes(4);
+   //
+   // The new data is what was read above:  first the rest of the current
+   // blkfile, then the beginning of the new one if it split.
+   // nextBlkBytesToRead will include up to 16 MB of padding if our gateway
+   // is a bitcoind/qt 0.8+ node.  Either way, it will be easy to detect when
+   // we've reached the end of the real data.
+   BinaryRefReader brr(currTail.getPtr(), (uint32_t)currBlkBytesToRead);
+   bool readingNextFile = false;
    uint32_t nBlkRead = 0;
    vector<bool> blockAddResults;
-   bool keepGoing = true;
-   while(keepGoing)
+   while(true)
    {
-      // We concatenated all data together, even if across two files
-      // Check which file data belongs to and set FileDataPtr appropriately
+      if(brr.getSizeRemaining() < 8)
+      {
+         if(readingNextFile || nextBlkBytesToRead==0)
+            break;
+
+         brr = BinaryRefReader(nextData);
+         readingNextFile = true;
+
+         // From here on offsets are in the new file.  bitcoind creates it 
+         // (preallocated with zeros) before it writes the first block, so 
+         // if we got here before that block, the next update has to start
+         // at 0, not where the previous file ended.
+         endOfLastBlockByte_ = 0;
+         continue;
+      }
+
+      // Check which file the data belongs to
       uint32_t useFileIndex0Idx = numBlkFiles_-1;
       uint32_t bhOffset = (uint32_t)(endOfLastBlockByte_ + 8);
-      if(brr.getPosition() >= currBlkBytesToRead)
+      if(readingNextFile)
       {
          useFileIndex0Idx = numBlkFiles_;
-         bhOffset = (uint32_t)(brr.getPosition() - currBlkBytesToRead + 8);
+         bhOffset = (uint32_t)(brr.getPosition() + 8);
       }
       
 
       ////////////
       // The reader should be at the start of magic bytes of the new block
-      brr.get_BinaryData(fourBytes, 4);
-      if(fourBytes != MagicBytes_)
+      if(brr.get_BinaryDataRef(4) != MagicBytes_)
          break;
          
       uint32_t nextBlockSize = brr.get_uint32_t();
 
+      // addNewBlockData moves brr past it, keep it for the zero-conf purge
+      BinaryDataRef rawBlock;
+      if(brr.getSizeRemaining() >= nextBlockSize)
+         rawBlock = BinaryDataRef(brr.getCurrPtr(), nextBlockSize);
+
       blockAddResults = addNewBlockData(brr, 
                                         useFileIndex0Idx,
                                         bhOffset,
@@ -5103,9 +6519,12 @@ uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
          {
             LOGINFO << "Applying block to DB!";
             BlockWriteBatcher batcher(iface_);
+            batcher.setBalanceCache(&balanceCache_);
             batcher.applyBlockToDB(hgt, dup);
          }
 
+         purgeZeroConfPoolForBlock(rawBlock);
+
          // Replaced this with the scanDBForRegisteredTx call outside the loop
          //StoredHeader sbh;
          //iface_->getStoredHeader(sbh, hgt, dup);
@@ -5124,13 +6543,10 @@ uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
          // at all until the reorg actually happens
       }
       
-      if(brr.isEndOfStream() || brr.getSizeRemaining() < 8)
-         keepGoing = false;
    }
 
    lastTopBlock_ = getTopBlockHeight()+1;
 
-   purgeZeroConfPool();
    scanDBForRegisteredTx(prevTopBlk, lastTopBlock_);
 
    if(prevRegisteredUpToDate)
@@ -5150,6 +6566,8 @@ uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
       blkFileList_.push_back(nextFilename);
    }
 
+   updateBlkDirWatcher();
+
    #ifdef _DEBUG
 	   UniversalTimer::instance().printCSV(string("timings.csv"));
 	   #ifdef _DEBUG_FULL_VERBOSE 
@@ -5161,6 +6579,71 @@ uint32_t BlockDataManager_LevelDB::readBlkFileUpdate(void)
 
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::updateBlkDirWatcher(void)
+{
+   if(blkDirWatcher_ != NULL)
+      blkDirWatcher_->setReadPosition(numBlkFiles_-1, endOfLastBlockByte_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Starts watching from where the last readBlkFileUpdate stopped, so the 
+// blockchain has to be loaded first
+bool BlockDataManager_LevelDB::startBlkDirWatcher(uint32_t pollIntervalMs)
+{
+   if(!isInitialized_ || numBlkFiles_==0 || numBlkFiles_==UINT32_MAX)
+   {
+      LOGERR << "Load the blockchain before watching the blk dir";
+      return false;
+   }
+
+   if(blkDirWatcher_ == NULL)
+      blkDirWatcher_ = new BlkDirWatcher(blkFileDir_, MagicBytes_, pollIntervalMs);
+
+   if(blkDirWatcher_->start(numBlkFiles_-1, endOfLastBlockByte_))
+      return true;
+
+   delete blkDirWatcher_;
+   blkDirWatcher_ = NULL;
+   return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::stopBlkDirWatcher(void)
+{
+   // The destructor joins the thread
+   delete blkDirWatcher_;
+   blkDirWatcher_ = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool BlockDataManager_LevelDB::isBlkDirWatcherRunning(void) const
+{
+   return blkDirWatcher_ != NULL && blkDirWatcher_->isRunning();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Returns true if there is at least one new block to read.  Doesn't read it, 
+// the flag stays up until readBlkFileUpdate is called.
+bool BlockDataManager_LevelDB::waitForBlkFileData(uint32_t timeoutMs)
+{
+   if(blkDirWatcher_ == NULL)
+      return false;
+
+   return blkDirWatcher_->waitForNewData(timeoutMs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Same return value as readBlkFileUpdate:  the number of blocks added, 0 if
+// nothing showed up within timeoutMs
+uint32_t BlockDataManager_LevelDB::waitForBlkFileUpdate(uint32_t timeoutMs)
+{
+   if(!waitForBlkFileData(timeoutMs))
+      return 0;
+
+   return readBlkFileUpdate();
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // BDM detects the reorg, but is wallet-agnostic so it can't update any wallets
@@ -5272,18 +6755,10 @@ bool BlockDataManager_LevelDB::parseNewBlock(BinaryRefReader & brr,
       return false;
    }
 
-   // Create the objects once that will be used for insertion
-   // (txInsResult always succeeds--because multimap--so only iterator returns)
-   static pair<HashString, BlockHeader>                      bhInputPair;
-   static pair<map<HashString, BlockHeader>::iterator, bool> bhInsResult;
-   
-   // Read the header and insert it into the map.
-   bhInputPair.second.unserialize(brr);
-   bhInputPair.first = bhInputPair.second.getThisHash();
-   bhInsResult = headerMap_.insert(bhInputPair);
-   BlockHeader * bhptr = &(bhInsResult.first->second);
-   if(!bhInsResult.second)
-      *bhptr = bhInsResult.first->second; // overwrite it even if insert fails
+   // Read the header and insert it into the store.  If we already had it,
+   // the existing record is kept.
+   BlockHeader bhInput(brr);
+   BlockHeader * bhptr = headerStore_.insert(bhInput);
 
    // Then put the bare header into the DB and get its duplicate ID.
    StoredHeader sbh;
@@ -5368,29 +6843,30 @@ vector<bool> BlockDataManager_LevelDB::addNewBlockData(
       return vb;
    }
 
-   // Create the objects once that will be used for insertion
-   // (txInsResult always succeeds--because multimap--so only iterator returns)
-   static pair<HashString, BlockHeader>                      bhInputPair;
-   static pair<map<HashString, BlockHeader>::iterator, bool> bhInsResult;
-   
-   // Read the header and insert it into the map.
-   bhInputPair.second.unserialize(brrRawBlock);
-   bhInputPair.first = bhInputPair.second.getThisHash();
-   bhInsResult = headerMap_.insert(bhInputPair);
-   BlockHeader * bhptr = &(bhInsResult.first->second);
-   if(!bhInsResult.second)
-      *bhptr = bhInputPair.second; // overwrite it even if insert fails
-
-   // Finally, let's re-assess the state of the blockchain with the new data
-   // Check the lastBlockWasReorg_ variable to see if there was a reorg
-   bool prevTopBlockStillValid = organizeChain(); 
-   lastBlockWasReorg_ = !prevTopBlockStillValid;
+   // Queries wait while the header is added and the chain is reorganized,
+   // but not while the block data goes in.
+   bool prevTopBlockStillValid;
+   {
+      QueryWriteGuard qwg(queryLock_);
 
-   // Then put the bare header into the DB and get its duplicate ID.
-   StoredHeader sbh;
-   sbh.createFromBlockHeader(*bhptr);
-   uint8_t dup = iface_->putBareHeader(sbh);
-   bhptr->setDuplicateID(dup);
+      // Read the header and insert it into the store.  If we already have 
+      // it, keep the existing record:  the data is the same for the same 
+      // hash, and it already has its place in the chain.
+      BlockHeader bhInput(brrRawBlock);
+      BlockHeader * bhptr = headerStore_.insert(bhInput);
+
+      // Finally, let's re-assess the state of the blockchain with the new 
+      // data.  Check the lastBlockWasReorg_ variable to see if there was a 
+      // reorg
+      prevTopBlockStillValid = organizeChain(); 
+      lastBlockWasReorg_ = !prevTopBlockStillValid;
+
+      // Then put the bare header into the DB and get its duplicate ID.
+      StoredHeader sbh;
+      sbh.createFromBlockHeader(*bhptr);
+      uint8_t dup = iface_->putBareHeader(sbh);
+      bhptr->setDuplicateID(dup);
+   }
 
    // Regardless of whether this was a reorg, we have to add the raw block
    // to the DB, but we don't apply it yet.
@@ -5494,7 +6970,11 @@ void BlockDataManager_LevelDB::reassessAfterReorg( BlockHeader* oldTopPtr,
    txJustInvalidated_.clear();
    txJustAffected_.clear();
    
-   BlockWriteBatcher blockWrites(iface_);
+   BlockWriteBatcher blockWrites(iface_, false, 
+                                 BlockWriteBatcher::UPDATE_BYTES_THRESH,
+                                 BlockWriteBatcher::UTXO_CACHE_BYTES,
+                                 undoRetention_);
+   blockWrites.setBalanceCache(&balanceCache_);
    
    BlockHeader* thisHeaderPtr = oldTopPtr;
    LOGINFO << "Invalidating old-chain transactions...";
@@ -5507,9 +6987,18 @@ void BlockDataManager_LevelDB::reassessAfterReorg( BlockHeader* oldTopPtr,
       if(DBUtils.getArmoryDbType() != ARMORY_DB_BARE)
       {
          // Added with leveldb... in addition to reversing blocks in RAM, 
-         // we also need to undo the blocks in the DB
+         // we also need to undo the blocks in the DB.  When pruning, the
+         // spent TxOuts are only in the stored undo data.  If the reorg is
+         // deeper than what was kept, it's rebuilt as if not pruning, which
+         // can't bring back the pruned TxOuts.
          StoredUndoData sud;
-         createUndoDataFromBlock(hgt, dup, sud);
+         if(DBUtils.getDbPruneType() != DB_PRUNE_ALL ||
+            !iface_->getStoredUndoData(sud, hgt, dup))
+         {
+            if(DBUtils.getDbPruneType() == DB_PRUNE_ALL)
+               LOGERR << "No undo data for block " << hgt << ", was pruned";
+            createUndoDataFromBlock(hgt, dup, sud);
+         }
          blockWrites.undoBlockFromDB(sud);
       }
       
@@ -5570,13 +7059,10 @@ vector<BlockHeader*> BlockDataManager_LevelDB::getHeadersNotOnMainChain(void)
    SCOPED_TIMER("getHeadersNotOnMainChain");
    PDEBUG("Getting headers not on main chain");
    vector<BlockHeader*> out(0);
-   map<HashString, BlockHeader>::iterator iter;
-   for(iter  = headerMap_.begin(); 
-       iter != headerMap_.end(); 
-       iter++)
+   for(uint32_t i=0; i<headerStore_.size(); i++)
    {
-      if( ! iter->second.isMainBranch() )
-         out.push_back(&(iter->second));
+      if( ! headerStore_[i].isMainBranch() )
+         out.push_back(&headerStore_[i]);
    }
    PDEBUG("Getting headers not on main chain");
    return out;
@@ -5587,11 +7073,17 @@ vector<BlockHeader*> BlockDataManager_LevelDB::getHeadersNotOnMainChain(void)
 // This returns false if our new main branch does not include the previous
 // topBlock.  If this returns false, that probably means that we have
 // previously considered some blocks to be valid that no longer are valid.
+//
+// Unless forceRebuild is set, only the headers added to the store since the
+// last call are traced.  Their parents are already solved, so the cost is
+// proportional to the number of new headers plus the depth of a reorg, not
+// to the length of the chain.
 // TODO:  Figure out if there is an elegant way to deal with a forked 
 //        blockchain containing two equal-length chains
 bool BlockDataManager_LevelDB::organizeChain(bool forceRebuild)
 {
    SCOPED_TIMER("organizeChain");
+   QueryWriteGuard qwg(queryLock_);
 
    // Why did this line not through an error?  I left here to remind 
    // myself to go figure it out.
@@ -5599,25 +7091,21 @@ bool BlockDataManager_LevelDB::organizeChain(bool forceRebuild)
    LOGDEBUG << "Organizing chain " << (forceRebuild ? "w/ rebuild" : "");
 
    // If rebuild, we zero out any original organization data and do a 
-   // rebuild of the chain from scratch.  This will need to be done in
-   // the event that our first call to organizeChain returns false, which
-   // means part of blockchain that was previously valid, has become
-   // invalid.  Rather than get fancy, just rebuild all which takes less
-   // than a second, anyway.
+   // rebuild of the chain from scratch.  This is done on load, when we
+   // can't trust whatever state the headers were left in.
    if(forceRebuild)
    {
-      map<HashString, BlockHeader>::iterator iter;
-      for( iter  = headerMap_.begin(); 
-           iter != headerMap_.end(); 
-           iter++)
+      for(uint32_t i=0; i<headerStore_.size(); i++)
       {
-         iter->second.difficultySum_  = -1;
-         iter->second.blockHeight_    =  0;
-         iter->second.isFinishedCalc_ =  false;
-         iter->second.nextHash_       =  BtcUtils::EmptyHash_;
-         iter->second.isMainBranch_   =  false;
+         BlockHeader & bh = headerStore_[i];
+         bh.difficultySum_  = -1;
+         bh.blockHeight_    =  0;
+         bh.isFinishedCalc_ =  false;
+         bh.isMainBranch_   =  false;
+         memset(bh.nextHash_, 0, 32);
       }
       topBlockPtr_ = NULL;
+      numHeadersOrganized_ = 0;
    }
 
    // Set genesis block
@@ -5638,17 +7126,18 @@ bool BlockDataManager_LevelDB::organizeChain(bool forceRebuild)
    // in the new chain organization
    prevTopBlockPtr_ = topBlockPtr_;
 
-   // Iterate over all blocks, track the maximum difficulty-sum block
-   map<HashString, BlockHeader>::iterator iter;
+   // Iterate over the new blocks, track the maximum difficulty-sum block.
+   // The store only ever appends, so everything past numHeadersOrganized_
+   // is new since the last call.
    double   maxDiffSum     = prevTopBlockPtr_->getDifficultySum();
-   for( iter = headerMap_.begin(); iter != headerMap_.end(); iter ++)
+   for(uint32_t i=numHeadersOrganized_; i<headerStore_.size(); i++)
    {
       // *** Walk down the chain following prevHash fields, until
       //     you find a "solved" block.  Then walk back up and 
       //     fill in the difficulty-sum values (do not set next-
       //     hash ptrs, as we don't know if this is the main branch)
       //     Method returns instantly if block is already "solved"
-      double thisDiffSum = traceChainDown(iter->second);
+      double thisDiffSum = traceChainDown(headerStore_[i]);
 
       // If we hit orphans, we flag headers DB corruption
       if(corruptHeadersDB_)
@@ -5661,14 +7150,17 @@ bool BlockDataManager_LevelDB::organizeChain(bool forceRebuild)
       if(thisDiffSum > maxDiffSum)
       {
          maxDiffSum     = thisDiffSum;
-         topBlockPtr_   = &(iter->second);
+         topBlockPtr_   = &headerStore_[i];
       }
    }
+   numHeadersOrganized_ = headerStore_.size();
 
-   // Walk down the list one more time, set nextHash fields
-   // Also set headersByHeight_;
+   // Walk down from the top block until we hit the main branch, set the
+   // nextHash fields and headersByHeight_.  On a rebuild this goes all the
+   // way to the genesis block, otherwise it stops at the fork point (or at
+   // the previous top block if there was no reorg).
    bool prevChainStillValid = (topBlockPtr_ == prevTopBlockPtr_);
-   topBlockPtr_->nextHash_ = BtcUtils::EmptyHash_;
+   memset(topBlockPtr_->nextHash_, 0, 32);
    BlockHeader* thisHeaderPtr = topBlockPtr_;
    //headersByHeight_.reserve(topBlockPtr_->getBlockHeight()+32768);
    headersByHeight_.resize(topBlockPtr_->getBlockHeight()+1);
@@ -5689,9 +7181,16 @@ bool BlockDataManager_LevelDB::organizeChain(bool forceRebuild)
          //tx.setMainBranch(true);
       //}
 
-      HashString & childHash    = thisHeaderPtr->thisHash_;
-      thisHeaderPtr             = &(headerMap_[thisHeaderPtr->getPrevHash()]);
-      thisHeaderPtr->nextHash_  = childHash;
+      BlockHeader* childPtr = thisHeaderPtr;
+      thisHeaderPtr = headerStore_.find(childPtr->getPrevHashRef());
+      if(thisHeaderPtr == NULL)
+      {
+         // traceChainDown already made sure every parent is in the store
+         LOGERR << "Main branch header has no parent in the store!";
+         corruptHeadersDB_ = true;
+         return false;
+      }
+      memcpy(thisHeaderPtr->nextHash_, childPtr->thisHash_, 32);
 
       if(thisHeaderPtr == prevTopBlockPtr_)
          prevChainStillValid = true;
@@ -5702,20 +7201,28 @@ bool BlockDataManager_LevelDB::organizeChain(bool forceRebuild)
    headersByHeight_[thisHeaderPtr->getBlockHeight()] = thisHeaderPtr;
 
 
-   // Force a full rebuild to make sure everything is marked properly
-   // On a full rebuild, prevChainStillValid should ALWAYS be true
+   // On a full rebuild, prevChainStillValid should ALWAYS be true.  If not,
+   // the loop above stopped at the fork point and the old branch above it
+   // is still marked as main branch.  Unmark it, back to the fork point.
    if( !prevChainStillValid )
    {
       LOGWARN << "Reorg detected!";
       reorgBranchPoint_ = thisHeaderPtr;
 
-      // There was a dangerous bug -- prevTopBlockPtr_ is set correctly 
-      // RIGHT NOW, but won't be once I make the recursive call to organizeChain
-      // I need to save it now, and re-assign it after the organizeChain call.
-      // (I might consider finding a way to avoid this, but it's fine as-is)
-      BlockHeader* prevtopblk = prevTopBlockPtr_;
-      organizeChain(true); // force-rebuild blockchain (takes less than 1s)
-      prevTopBlockPtr_ = prevtopblk;
+      BlockHeader* oldPtr = prevTopBlockPtr_;
+      while(oldPtr != NULL && oldPtr != reorgBranchPoint_)
+      {
+         oldPtr->isMainBranch_   = false;
+         oldPtr->isFinishedCalc_ = false;
+         memset(oldPtr->nextHash_, 0, 32);
+         oldPtr = headerStore_.find(oldPtr->getPrevHashRef());
+      }
+
+      if(oldPtr == NULL)
+      {
+         LOGERR << "Previous top block does not trace down to the fork point";
+         corruptHeadersDB_ = true;
+      }
       return false;
    }
 
@@ -5735,25 +7242,21 @@ double BlockDataManager_LevelDB::traceChainDown(BlockHeader & bhpStart)
       return bhpStart.difficultySum_;
 
    // Prepare some data structures for walking down the chain
-   vector<BlockHeader*>   headerPtrStack(headerMap_.size());
-   vector<double>           difficultyStack(headerMap_.size());
+   // (they only grow as far as the unsolved part of this branch)
+   vector<BlockHeader*>   headerPtrStack;
    uint32_t blkIdx = 0;
-   double thisDiff;
 
    // Walk down the chain of prevHash_ values, until we find a block
    // that has a definitive difficultySum value (i.e. >0). 
    BlockHeader* thisPtr = &bhpStart;
-   map<HashString, BlockHeader>::iterator iter;
    while( thisPtr->difficultySum_ < 0)
    {
-      thisDiff                = thisPtr->difficultyDbl_;
-      difficultyStack[blkIdx] = thisDiff;
-      headerPtrStack[blkIdx]  = thisPtr;
+      headerPtrStack.push_back(thisPtr);
       blkIdx++;
 
-      iter = headerMap_.find(thisPtr->getPrevHash());
-      if(ITER_IN_MAP(iter, headerMap_))
-         thisPtr = &(iter->second);
+      BlockHeader* prevPtr = headerStore_.find(thisPtr->getPrevHashRef());
+      if(prevPtr != NULL)
+         thisPtr = prevPtr;
       else
       {
          // Under some circumstances, the headers DB is not getting written
@@ -5773,16 +7276,15 @@ double BlockDataManager_LevelDB::traceChainDown(BlockHeader & bhpStart)
    }
 
 
-   // Now we have a stack of difficulties and pointers.  Walk back up
-   // (by pointer) and accumulate the difficulty values 
+   // Now we have a stack of pointers.  Walk back up (by pointer) and
+   // accumulate the difficulty values 
    double   seedDiffSum = thisPtr->difficultySum_;
    uint32_t blkHeight   = thisPtr->blockHeight_;
    for(int32_t i=blkIdx-1; i>=0; i--)
    {
-      seedDiffSum += difficultyStack[i];
+      thisPtr = headerPtrStack[i];
+      seedDiffSum += thisPtr->difficultyDbl_;
       blkHeight++;
-      thisPtr                 = headerPtrStack[i];
-      thisPtr->difficultyDbl_ = difficultyStack[i];
       thisPtr->difficultySum_ = seedDiffSum;
       thisPtr->blockHeight_   = blkHeight;
    }
@@ -5807,27 +7309,27 @@ void BlockDataManager_LevelDB::markOrphanChain(BlockHeader & bhpStart)
    //        to check the old version of this method if any problems 
    //        crop up.
    LOGWARN << "Marking orphan chain";
-   map<HashString, BlockHeader>::iterator iter;
-   iter = headerMap_.find(bhpStart.getThisHash());
-   HashStringRef lastHeadHash;
-   while( ITER_IN_MAP(iter, headerMap_) )
+   BlockHeader* thisPtr = headerStore_.find(bhpStart.getThisHashRef());
+   BlockHeader* lastPtr = NULL;
+   while( thisPtr != NULL )
    {
       // I don't see how it's possible to have a header that used to be 
       // in the main branch, but is now an ORPHAN (meaning it has no
       // parent).  It will be good to detect this case, though
-      if(iter->second.isMainBranch() == true)
+      if(thisPtr->isMainBranch() == true)
       {
          // NOTE: this actually gets triggered when we scan the testnet
          //       blk0001.dat file on main net, etc
          LOGERR << "Block previously main branch, now orphan!?";
-         previouslyValidBlockHeaderPtrs_.push_back(&(iter->second));
+         previouslyValidBlockHeaderPtrs_.push_back(thisPtr);
       }
-      iter->second.isOrphan_ = true;
-      iter->second.isMainBranch_ = false;
-      lastHeadHash = iter->second.thisHash_.getRef();
-      iter = headerMap_.find(iter->second.getPrevHash());
+      thisPtr->isOrphan_ = true;
+      thisPtr->isMainBranch_ = false;
+      lastPtr = thisPtr;
+      thisPtr = headerStore_.find(thisPtr->getPrevHashRef());
    }
-   orphanChainStartBlocks_.push_back(&(headerMap_[lastHeadHash.copy()]));
+   if(lastPtr != NULL)
+      orphanChainStartBlocks_.push_back(lastPtr);
    LOGWARN << "Done marking orphan chain";
 }
 
@@ -5927,28 +7429,94 @@ void BlockDataManager_LevelDB::enableZeroConf(string zcFilename, bool zcLite)
 
 
 ////////////////////////////////////////////////////////////////////////////////
+// The file is ZC_LOG_MAGIC followed by records:
+//
+//    0x01 | txtime (uint64) | txSize (uint32) | raw tx     added
+//    0x02 | tx hash (32)                                    removed
+//
+// Files from older versions are just [txtime (uint64) | raw tx] repeated, 
+// those get rewritten in the new format.  So does a file with a truncated
+// or corrupt tail, or anything we no longer have, so that the next appends
+// start from a clean file.
 void BlockDataManager_LevelDB::readZeroConfFile(string zcFilename)
 {
    SCOPED_TIMER("readZeroConfFile");
+   zcLogBytes_ = 0;
    uint64_t filesize = BtcUtils::GetFileSize(zcFilename);
    if(filesize<8 || filesize==FILE_DOES_NOT_EXIST)
       return;
 
-   ifstream zcFile(zcFilename_.c_str(),  ios::in | ios::binary);
+   ifstream zcFile(zcFilename.c_str(),  ios::in | ios::binary);
    BinaryData zcData((size_t)filesize);
    zcFile.read((char*)zcData.getPtr(), filesize);
    zcFile.close();
 
    // We succeeded opening the file...
    BinaryRefReader brr(zcData);
-   while(brr.getSizeRemaining() > 8)
+   bool needsRewrite = false;
+   if(zcData.getSliceRef(0, 8) != BinaryDataRef((uint8_t*)ZC_LOG_MAGIC, 8))
+   {
+      LOGINFO << "Converting zero-conf file to the new format";
+      needsRewrite = true;
+      while(brr.getSizeRemaining() > 8)
+      {
+         uint64_t txTime = brr.get_uint64_t();
+         uint32_t txSize = BtcUtils::TxCalcLength(brr.getCurrPtr(), 
+                                                  brr.getSizeRemaining());
+         if(txSize > brr.getSizeRemaining())
+            break;
+
+         BinaryData rawtx(txSize);
+         brr.get_BinaryData(rawtx.getPtr(), txSize);
+         addNewZeroConfTx(rawtx, (uint32_t)txTime, false);
+      }
+   }
+   else
    {
-      uint64_t txTime = brr.get_uint64_t();
-      uint32_t txSize = BtcUtils::TxCalcLength(brr.getCurrPtr(), brr.getSizeRemaining());
-      BinaryData rawtx(txSize);
-      brr.get_BinaryData(rawtx.getPtr(), txSize);
-      addNewZeroConfTx(rawtx, (uint32_t)txTime, false);
+      brr.advance(8);
+      uint32_t nRecords = 0;
+      while(brr.getSizeRemaining() > 0)
+      {
+         uint8_t recType = brr.get_uint8_t();
+         if(recType == ZC_LOG_ADD && brr.getSizeRemaining() >= 12)
+         {
+            uint64_t txTime = brr.get_uint64_t();
+            uint32_t txSize = brr.get_uint32_t();
+            if(txSize > brr.getSizeRemaining())
+               break;
+
+            BinaryData rawtx(txSize);
+            brr.get_BinaryData(rawtx.getPtr(), txSize);
+            if(!addNewZeroConfTx(rawtx, (uint32_t)txTime, false))
+               needsRewrite = true;
+         }
+         else if(recType == ZC_LOG_REMOVE && brr.getSizeRemaining() >= 32)
+         {
+            // Descendants got their own records
+            vector<HashString> removed;
+            QueryWriteGuard qwg(queryLock_);
+            zcPool_.remove(brr.get_BinaryDataRef(32), false, removed);
+            for(uint32_t i=0; i<removed.size(); i++)
+               balanceCache_.removeZeroConf(removed[i]);
+         }
+         else
+            break;
+
+         nRecords++;
+      }
+
+      if(brr.getSizeRemaining() > 0)
+      {
+         LOGWARN << "Zero-conf file is corrupt after " << nRecords 
+                 << " records, dropping the rest";
+         needsRewrite = true;
+      }
    }
+
+   zcLogBytes_ = filesize;
+   if(needsRewrite)
+      rewriteZeroConfFile();
+
    purgeZeroConfPool();
 }
 
@@ -5959,6 +7527,14 @@ void BlockDataManager_LevelDB::disableZeroConf(void)
    zcEnabled_  = false; 
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Doesn't evict anything already in the pool, only affects what gets in
+void BlockDataManager_LevelDB::setZeroConfPoolMaxBytes(uint64_t maxBytes)
+{
+   QueryWriteGuard qwg(queryLock_);
+   zcPool_.setMaxBytes(maxBytes);
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 bool BlockDataManager_LevelDB::addNewZeroConfTx(BinaryData const & rawTx, 
@@ -5976,14 +7552,13 @@ bool BlockDataManager_LevelDB::addNewZeroConfTx(BinaryData const & rawTx,
    if(hasTxWithHash(txHash))
       return false;
 
+   Tx txObj(rawTx);
 
    // In zero-conf-lite-mode, we only actually add the ZC if it's related
    // to one of our registered wallets.  
    if(zcLiteMode_)
    {
       // The bulk filter
-      Tx txObj(rawTx);
-
       bool isOurs = false;
       set<BtcWallet*>::iterator wltIter;
       for(wltIter  = registeredWallets_.begin();
@@ -5998,81 +7573,255 @@ bool BlockDataManager_LevelDB::addNewZeroConfTx(BinaryData const & rawTx,
          return false;
    }
     
-   
-   zeroConfMap_[txHash] = ZeroConfData();
-   ZeroConfData & zc = zeroConfMap_[txHash];
-   zc.iter_ = zeroConfRawTxList_.insert(zeroConfRawTxList_.end(), rawTx);
-   zc.txobj_.unserialize(*(zc.iter_));
-   zc.txtime_ = txtime;
+   vector<ZeroConfDelta> deltas;
+   uint64_t fee = getZeroConfTxFee(txObj, &deltas);
+   vector<HashString> evicted;
+   {
+      QueryWriteGuard qwg(queryLock_);
+      if(!zcPool_.add(txHash, txObj, txtime, fee, evicted))
+         return false;
+
+      for(uint32_t i=0; i<evicted.size(); i++)
+         balanceCache_.removeZeroConf(evicted[i]);
+      balanceCache_.addZeroConf(txHash, deltas);
+   }
+
+   if(evicted.size() > 0)
+      LOGINFO << "Evicted " << evicted.size() << " zero-conf txs, pool is full";
 
    // Record time.  Write to file
    if(writeToFile)
-   {
-      ofstream zcFile(zcFilename_.c_str(), ios::app | ios::binary);
-      zcFile.write( (char*)(&zc.txtime_), sizeof(uint64_t) );
-      zcFile.write( (char*)zc.txobj_.getPtr(),  zc.txobj_.getSize());
-      zcFile.close();
-   }
+      appendZeroConfLog(evicted, zcPool_.find(txHash));
+
    return true;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// ZC_FEE_UNKNOWN if we can't find one of the txs it spends from (always the
+// case for most txs in lite mode)
+uint64_t BlockDataManager_LevelDB::getZeroConfTxFee(Tx & tx,
+                                                   vector<ZeroConfDelta>* deltas)
+{
+   if(deltas != NULL)
+   {
+      for(uint32_t i=0; i<tx.getNumTxOut(); i++)
+      {
+         TxOut txout = tx.getTxOutCopy(i);
+         deltas->push_back(ZeroConfDelta(txout.getScrAddressRef(),
+                                         txout.getValue(),
+                                         ZC_DELTA_RECEIVED));
+      }
+   }
+
+   uint64_t sumIn = 0;
+   bool feeKnown = true;
+   for(uint32_t i=0; i<tx.getNumTxIn(); i++)
+   {
+      OutPoint op(tx.getPtr() + tx.getTxInOffset(i), 36);
+
+      // Finds it in the pool too
+      Tx prevTx = getTxByHash(op.getTxHash());
+      if(!prevTx.isInitialized() || op.getTxOutIndex() >= prevTx.getNumTxOut())
+      {
+         if(deltas == NULL)
+            return ZC_FEE_UNKNOWN;
+
+         feeKnown = false;
+         continue;
+      }
+
+      TxOut prevTxOut = prevTx.getTxOutCopy(op.getTxOutIndex());
+      sumIn += prevTxOut.getValue();
+      if(deltas != NULL)
+         deltas->push_back(ZeroConfDelta(prevTxOut.getScrAddressRef(),
+                                         prevTxOut.getValue(),
+                                         zcPool_.contains(op.getTxHash()) ?
+                                            ZC_DELTA_SPENT_UNCONFIRMED :
+                                            ZC_DELTA_SPENT_CONFIRMED));
+   }
+
+   uint64_t sumOut = tx.getSumOfOutputs();
+   if(!feeKnown || sumOut > sumIn)
+      return ZC_FEE_UNKNOWN;
+
+   return sumIn - sumOut;
+}
 
 
 ////////////////////////////////////////////////////////////////////////////////
+// Removes the txs that made it into the blockchain.  This has to check every
+// tx in the pool against the DB, so it's only used after loading and after a
+// reorg.  New top blocks go through purgeZeroConfPoolForBlock.
 void BlockDataManager_LevelDB::purgeZeroConfPool(void)
 {
    SCOPED_TIMER("purgeZeroConfPool");
-   list< map<HashString, ZeroConfData>::iterator > mapRmList;
 
    // Find all zero-conf transactions that made it into the blockchain
-   map<HashString, ZeroConfData>::iterator iter;
-   for(iter  = zeroConfMap_.begin();
-       iter != zeroConfMap_.end();
+   vector<HashString> mined;
+   ZeroConfPool::const_iterator iter;
+   for(iter  = zcPool_.begin();
+       iter != zcPool_.end();
        iter++)
    {
-      if(!getTxRefByHash(iter->first).isNull())
-         mapRmList.push_back(iter);
+      if(!getTxRefByHash(iter->second).isNull())
+         mined.push_back(iter->second);
    }
 
-   // We've made a list of the zc tx to remove, now let's remove them
-   // I decided this was safer than erasing the data as we were iterating
-   // over it in the previous loop
-   list< map<HashString, ZeroConfData>::iterator >::iterator rmIter;
-   for(rmIter  = mapRmList.begin();
-       rmIter != mapRmList.end();
-       rmIter++)
+   if(mined.size() == 0)
+      return;
+
+   // Whatever spends them is still good, leave it
+   vector<HashString> removed;
+   {
+      QueryWriteGuard qwg(queryLock_);
+      for(uint32_t i=0; i<mined.size(); i++)
+         zcPool_.remove(mined[i], false, removed);
+      for(uint32_t i=0; i<removed.size(); i++)
+         balanceCache_.removeZeroConf(removed[i]);
+   }
+
+   appendZeroConfLog(removed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Removes the txs in a new top block, and the ones it double-spends (with
+// everything that spends those).  Only the block's txs are looked at.
+void BlockDataManager_LevelDB::purgeZeroConfPoolForBlock(BinaryDataRef rawBlock)
+{
+   SCOPED_TIMER("purgeZeroConfPoolForBlock");
+   if(zcPool_.size() == 0 || rawBlock.getSize() == 0)
+      return;
+
+   vector<HashString> removed;
    {
-      zeroConfRawTxList_.erase( (*rmIter)->second.iter_ );
-      zeroConfMap_.erase( *rmIter );
+      QueryWriteGuard qwg(queryLock_);
+      zcPool_.removeForBlock(rawBlock, removed);
+      for(uint32_t i=0; i<removed.size(); i++)
+         balanceCache_.removeZeroConf(removed[i]);
    }
 
-   // Rewrite the zero-conf pool file
-   if(mapRmList.size() > 0)
+   if(removed.size() == 0)
+      return;
+
+   LOGINFO << "Removed " << removed.size() << " zero-conf txs for new block";
+   appendZeroConfLog(removed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::appendZeroConfLog(
+                                          vector<HashString> const & removed,
+                                          ZeroConfData const * added)
+{
+   if(zcFilename_.size() == 0)
+      return;
+
+   // No file yet (or an unreadable one):  start one with the whole pool
+   if(zcLogBytes_ < 8)
+   {
       rewriteZeroConfFile();
+      return;
+   }
+
+   BinaryWriter bw;
+   for(uint32_t i=0; i<removed.size(); i++)
+   {
+      bw.put_uint8_t(ZC_LOG_REMOVE);
+      bw.put_BinaryData(removed[i]);
+   }
+
+   if(added != NULL)
+   {
+      bw.put_uint8_t(ZC_LOG_ADD);
+      bw.put_uint64_t(added->txtime_);
+      bw.put_uint32_t(added->txobj_.getSize());
+      bw.put_BinaryData(added->txobj_.getPtr(), added->txobj_.getSize());
+   }
+
+   if(bw.getSize() == 0)
+      return;
+
+   ofstream zcFile(zcFilename_.c_str(), ios::app | ios::binary);
+   zcFile.write((char*)bw.getData().getPtr(), bw.getSize());
+   zcFile.close();
+   zcLogBytes_ += bw.getSize();
+
+   compactZeroConfFileIfNeeded();
+}
 
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_LevelDB::compactZeroConfFileIfNeeded(void)
+{
+   // What a rewrite would write:  magic, and one add record per tx
+   uint64_t liveBytes = 8 + zcPool_.getTotalBytes() + 13*zcPool_.size();
+   if(zcLogBytes_ > ZC_LOG_COMPACT_MIN_BYTES && zcLogBytes_ > 2*liveBytes)
+      rewriteZeroConfFile();
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
+// Written to a temp file first, so a crash or a failed write here leaves the
+// old file intact (except on Windows, between the remove and the rename)
 void BlockDataManager_LevelDB::rewriteZeroConfFile(void)
 {
    SCOPED_TIMER("rewriteZeroConfFile");
-   ofstream zcFile(zcFilename_.c_str(), ios::out | ios::binary);
+   if(zcFilename_.size() == 0)
+      return;
+
+   string tmpFilename = zcFilename_ + ".tmp";
+   ofstream zcFile(tmpFilename.c_str(), ios::out | ios::binary);
+   if(!zcFile.is_open())
+   {
+      LOGERR << "Could not open " << tmpFilename.c_str() 
+             << ", keeping the old zero-conf file";
+      return;
+   }
 
-   static HashString txHash(32);
-   list<HashString>::iterator iter;
-   for(iter  = zeroConfRawTxList_.begin();
-       iter != zeroConfRawTxList_.end();
+   zcFile.write(ZC_LOG_MAGIC, 8);
+   uint64_t nBytes = 8;
+
+   ZeroConfPool::const_iterator iter;
+   for(iter  = zcPool_.begin();
+       iter != zcPool_.end();
        iter++)
    {
-      BtcUtils::getHash256(*iter, txHash);
-      ZeroConfData & zcd = zeroConfMap_[txHash];
-      zcFile.write( (char*)(&zcd.txtime_), sizeof(uint64_t) );
-      zcFile.write( (char*)(zcd.txobj_.getPtr()),  zcd.txobj_.getSize());
+      ZeroConfData const * zcd = zcPool_.find(iter->second);
+
+      BinaryWriter bw(13);
+      bw.put_uint8_t(ZC_LOG_ADD);
+      bw.put_uint64_t(zcd->txtime_);
+      bw.put_uint32_t(zcd->txobj_.getSize());
+      zcFile.write((char*)bw.getData().getPtr(), bw.getSize());
+      zcFile.write((char*)zcd->txobj_.getPtr(), zcd->txobj_.getSize());
+      nBytes += bw.getSize() + zcd->txobj_.getSize();
    }
 
    zcFile.close();
 
+   // Disk full, etc:  a truncated copy must not replace a good log
+   if(!zcFile.good())
+   {
+      LOGERR << "Could not write " << tmpFilename.c_str() 
+             << ", keeping the old zero-conf file";
+      remove(tmpFilename.c_str());
+      return;
+   }
+
+   // rename() replaces the old file atomically on POSIX, but won't replace
+   // an existing file at all on Windows
+#ifdef _WIN32
+   remove(zcFilename_.c_str());
+#endif
+   if(rename(tmpFilename.c_str(), zcFilename_.c_str()) != 0)
+   {
+      LOGERR << "Could not rewrite zero-conf file " << zcFilename_.c_str();
+      remove(tmpFilename.c_str());
+#ifdef _WIN32
+      zcLogBytes_ = 0;
+#endif
+      return;
+   }
+
+   zcLogBytes_ = nBytes;
 }
 
 
@@ -6083,18 +7832,13 @@ void BlockDataManager_LevelDB::rescanWalletZeroConf(BtcWallet & wlt)
    // Clear the whole list, rebuild
    wlt.clearZeroConfPool();
 
-   static HashString txHash(32);
-   list<HashString>::iterator iter;
-   for(iter  = zeroConfRawTxList_.begin();
-       iter != zeroConfRawTxList_.end();
+   // In arrival order, so parents are scanned before their children
+   ZeroConfPool::const_iterator iter;
+   for(iter  = zcPool_.begin();
+       iter != zcPool_.end();
        iter++)
    {
-
-      if(iter->getSize() == 0)
-         continue;
-
-      BtcUtils::getHash256(*iter, txHash);
-      ZeroConfData & zcd = zeroConfMap_[txHash];
+      ZeroConfData & zcd = *zcPool_.find(iter->second);
 
       if( !isTxFinal(zcd.txobj_) )
          continue;
@@ -6135,15 +7879,12 @@ void BlockDataManager_LevelDB::pprintSSHInfoAboutHash160(BinaryData const & a160
 ////////////////////////////////////////////////////////////////////////////////
 void BlockDataManager_LevelDB::pprintZeroConfPool(void)
 {
-   static HashString txHash(32);
-   list<HashString>::iterator iter;
-   for(iter  = zeroConfRawTxList_.begin();
-       iter != zeroConfRawTxList_.end();
+   ZeroConfPool::const_iterator iter;
+   for(iter  = zcPool_.begin();
+       iter != zcPool_.end();
        iter++)
    {
-      BtcUtils::getHash256(*iter, txHash);
-      ZeroConfData & zcd = zeroConfMap_[txHash];
-      Tx & tx = zcd.txobj_;
+      Tx & tx = zcPool_.find(iter->second)->txobj_;
       cout << tx.getThisHash().getSliceCopy(0,8).toHexStr().c_str() << " ";
       for(uint32_t i=0; i<tx.getNumTxOut(); i++)
          cout << tx.getTxOutCopy(i).getValue() << " ";
@@ -6190,6 +7931,9 @@ void BtcWallet::clearZeroConfPool(void)
        rmIter != rmList.end();
        rmIter++)
    {
+      OutPoint const & op = (*rmIter)->first;
+      txioIndex_.erase(OutPointKey(op.getTxHashRef().getPtr(), 
+                                   op.getTxOutIndex()));
       txioMap_.erase(*rmIter);
    }
 }
@@ -6301,47 +8045,58 @@ void BlockDataManager_LevelDB::addRawBlockToDB(BinaryRefReader & brr)
    // added to the headerMap and the DB, and we have its correct height 
    // and dupID
    StoredHeader sbh;
+   bool parsedCompletely = true;
    try
    {
       sbh.unserializeFullBlock(brr, true, false);
    }
    catch (BlockDeserializingException &)
    {
-      if (sbh.hasBlockHeader_)
-      {
-         // we still add this block to the chain in this case,
-         // if we miss a few transactions it's better than
-         // missing the entire block
-         BlockHeader & bh = headerMap_[sbh.thisHash_];
-         sbh.blockHeight_  = bh.getBlockHeight();
-         sbh.duplicateID_  = bh.getDuplicateID();
-         sbh.isMainBranch_ = bh.isMainBranch();
-         sbh.blockAppliedToDB_ = false;
-
-         // Don't put it into the DB if it's not proper!
-         if(sbh.blockHeight_==UINT32_MAX || sbh.duplicateID_==UINT8_MAX)
-            throw BlockDeserializingException("Error parsing block (corrupt?) - Cannot add raw block to DB without hgt & dup");
-
-         iface_->putStoredHeader(sbh, true);
-         missingBlockHashes_.push_back( sbh.thisHash_ );
-         throw BlockDeserializingException("Error parsing block (corrupt?) - block header valid");
-      }
-      else
-      {
-         throw BlockDeserializingException("Error parsing block (corrupt?) and block header invalid");
-      }
-      // throw a new exception with a useful "what"
+      parsedCompletely = false;
+   }
+
+   addParsedBlockToDB(sbh, parsedCompletely);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Second half of addRawBlockToDB, split out so that the parsing can be done
+// on another thread (see RawBlockPipeline).  parsedCompletely is false if
+// unserializeFullBlock threw.
+void BlockDataManager_LevelDB::addParsedBlockToDB(StoredHeader & sbh,
+                                                  bool parsedCompletely)
+{
+   if(!parsedCompletely && !sbh.hasBlockHeader_)
+      throw BlockDeserializingException("Error parsing block (corrupt?) and block header invalid");
+
+   // If only the header is valid, we still add this block to the chain:
+   // if we miss a few transactions it's better than missing the entire block
+   BlockHeader* bhptr = headerStore_.find(sbh.thisHash_);
+   if(bhptr == NULL)
+   {
+      if(!parsedCompletely)
+         throw BlockDeserializingException("Error parsing block (corrupt?) - Cannot add raw block to DB without hgt & dup");
+      throw BlockDeserializingException("Cannot add raw block to DB without hgt & dup");
    }
-   BlockHeader & bh = headerMap_[sbh.thisHash_];
-   sbh.blockHeight_  = bh.getBlockHeight();
-   sbh.duplicateID_  = bh.getDuplicateID();
-   sbh.isMainBranch_ = bh.isMainBranch();
+   sbh.blockHeight_  = bhptr->getBlockHeight();
+   sbh.duplicateID_  = bhptr->getDuplicateID();
+   sbh.isMainBranch_ = bhptr->isMainBranch();
    sbh.blockAppliedToDB_ = false;
 
    // Don't put it into the DB if it's not proper!
    if(sbh.blockHeight_==UINT32_MAX || sbh.duplicateID_==UINT8_MAX)
+   {
+      if(!parsedCompletely)
+         throw BlockDeserializingException("Error parsing block (corrupt?) - Cannot add raw block to DB without hgt & dup");
       throw BlockDeserializingException("Cannot add raw block to DB without hgt & dup");
+   }
+
    iface_->putStoredHeader(sbh, true);
+
+   if(!parsedCompletely)
+   {
+      missingBlockHashes_.push_back( sbh.thisHash_ );
+      throw BlockDeserializingException("Error parsing block (corrupt?) - block header valid");
+   }
 }
 
 
@@ -33,6 +33,13 @@
 #include "BlockObj.h"
 #include "StoredBlockObj.h"
 #include "leveldb_wrapper.h"
+#include "BlkFileMap.h"
+#include "HeaderStore.h"
+#include "ScrAddrMatcher.h"
+#include "TxScanIndex.h"
+#include "WriteBatchArena.h"
+#include "ZeroConfPool.h"
+#include "BalanceCache.h"
 
 #include "cryptlib.h"
 #include "sha.h"
@@ -43,12 +50,40 @@
 #define NUM_BLKS_BATCH_THRESH 30
 #define UPDATE_BYTES_SSH      25
 #define UPDATE_BYTES_SUBSSH   75
+#define UPDATE_BYTES_UTXO     80
 
 #define NUM_BLKS_IS_DIRTY 2016
 
+// Bounds the memory used by the raw block ingest pipeline:  this many blocks
+// per parsing thread may be waiting to be parsed or written at any time
+#define RAW_BLOCKS_IN_FLIGHT_PER_THREAD 8
+
+// applyBlockRangeToDB reads this many blocks ahead of the one it's applying,
+// and prefetches the txs they spend from
+#define APPLY_PREFETCH_BLOCKS 16
+
+// Don't bother starting a thread to hash fewer headers than this
+#define MIN_HEADERS_PER_THREAD 1000
+
+// Default for the smallest height range a rescan thread is given
+#define MIN_BLOCKS_PER_SCAN_THREAD 2000
+
+// How often the blk dir watcher checks for new blocks when it can't use
+// inotify (and as a safety net when it can)
+#define BLKDIR_POLL_INTERVAL_MS 250
+
+// The zero-conf file is an append-only log of added and removed txs.  It is
+// rewritten with only the live txs once it is bigger than this, and more
+// than twice the size of what it holds.
+#define ZC_LOG_COMPACT_MIN_BYTES (1024*1024)
+#define ZC_LOG_MAGIC  "ZCLOG001"
+#define ZC_LOG_ADD    0x01
+#define ZC_LOG_REMOVE 0x02
+
 using namespace std;
 
 class BlockDataManager_LevelDB;
+class RescanPartition;
 
 typedef enum
 {
@@ -221,6 +256,31 @@ private:
 };
 
 
+////////////////////////////////////////////////////////////////////////////////
+// What queryHistoryPageForScrAddr returns.  Pass getResumeToken() back in to
+// get the next page, as long as hasMore().  The token is the DB key of the
+// next TxIO, so it stays valid across new blocks.
+class ScrAddrHistoryPage
+{
+public:
+   ScrAddrHistoryPage(void) : scrAddrFound_(false) {}
+
+   bool                     isScrAddrFound(void) const { return scrAddrFound_; }
+   bool                     hasMore(void) const 
+                                       { return resumeToken_.getSize() > 0; }
+   BinaryData               getResumeToken(void) const { return resumeToken_; }
+   uint32_t                 getNumTxIO(void) const 
+                                       { return (uint32_t)txioList_.size(); }
+   TxIOPair                 getTxIOByIndex(uint32_t i) const 
+                                       { return txioList_[i]; }
+   vector<TxIOPair> const & getTxIOList(void) const { return txioList_; }
+
+   vector<TxIOPair>  txioList_;
+   BinaryData        resumeToken_;
+   bool              scrAddrFound_;
+};
+
+
 class BtcWallet;
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -388,6 +448,7 @@ public:
                                      map<OutPoint, TxIOPair> const & txiomap,
                                      bool withMultiSig=false) const;
 
+   // Never reads the DB:  the TxOut a TxIn spends is known from txioIndex_
    void scanTx(Tx & tx,
                uint32_t txIndex = UINT32_MAX,
                uint32_t blktime = UINT32_MAX,
@@ -429,6 +490,7 @@ public:
 
    vector<LedgerEntry> &     getZeroConfLedger(BinaryData const * scrAddr=NULL);
    vector<LedgerEntry> &     getTxLedger(BinaryData const * scrAddr=NULL); 
+   // Don't add or remove TxIOs through this, txioIndex_ wouldn't follow
    map<OutPoint, TxIOPair> & getTxIOMap(void)    {return txioMap_;}
    map<OutPoint, TxIOPair> & getNonStdTxIO(void) {return nonStdTxioMap_;}
 
@@ -458,6 +520,13 @@ private:
    map<BinaryData, ScrAddrObj>  scrAddrMap_;
    map<OutPoint, TxIOPair>      txioMap_;
 
+   // Same keys as scrAddrMap_, for isMineBulkFilter
+   ScrAddrMatcher               scrAddrMatcher_;
+
+   // For scanTx:  txioMap_, and the 21-byte keys of scrAddrMap_, by raw key
+   TxIOIndex                    txioIndex_;
+   ScrAddrIndex                 scrAddrIndex_;
+
    vector<LedgerEntry>          ledgerAllAddr_;  
    vector<LedgerEntry>          ledgerAllAddrZC_;
 
@@ -475,12 +544,20 @@ private:
 
 
 ////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-struct ZeroConfData
+// An OutPoint in the BlockWriteBatcher's UTXO cache.  value_ is the UTXO
+// entry value (see InterfaceToLDB::getUtxo).  Spent entries are kept until
+// the cache is flushed, so a lookup doesn't go on to older data.  onDisk_ is
+// whether the DB has a UTXO entry for it, or will once the in-flight batch 
+// is written:  spending it then needs a delete, spending it otherwise 
+// doesn't.  dirty_ is whether value_ still has to be written.
+struct UtxoCacheEntry
 {
-   Tx            txobj_;   
-   uint32_t      txtime_;
-   list<BinaryData>::iterator iter_;
+   UtxoCacheEntry(void) : onDisk_(false), spent_(false), dirty_(false) {}
+
+   BinaryData  value_;
+   bool        onDisk_;
+   bool        spent_;
+   bool        dirty_;
 };
 
 
@@ -488,12 +565,30 @@ struct ZeroConfData
  This class accumulates changes to write to the database,
  and will do so when it gets to a certain threshold
 */
+class BatchCommitter;
+
 class BlockWriteBatcher
 {
 public:
    static const uint64_t UPDATE_BYTES_THRESH = 96*1024*1024;
+   static const uint64_t UTXO_CACHE_BYTES    = 256*1024*1024;
+   static const uint32_t UNDO_RETENTION_BLOCKS = 288;
    
-   BlockWriteBatcher(InterfaceToLDB* iface);
+   // With asyncCommit, a full batch is written by a background thread while
+   // the next one is being filled (see commit()).  Everything is on disk
+   // by the time the destructor returns, either way.
+   //
+   // New UTXOs are kept in memory until utxoCacheBytes worth of them have
+   // been added, most get spent before that and never reach the DB.
+   //
+   // When pruning, the undo data of the last undoRetention blocks applied
+   // is kept, older records are purged as batches are committed.  A reorg
+   // deeper than that can't be undone.
+   BlockWriteBatcher(InterfaceToLDB* iface, 
+                     bool asyncCommit=false,
+                     uint64_t commitThresh=UPDATE_BYTES_THRESH,
+                     uint64_t utxoCacheBytes=UTXO_CACHE_BYTES,
+                     uint32_t undoRetention=UNDO_RETENTION_BLOCKS);
    ~BlockWriteBatcher();
    
    void applyBlockToDB(StoredHeader &sbh);
@@ -505,9 +600,19 @@ public:
    }
    void undoBlockFromDB(StoredUndoData &sud);
 
+   // Keeps the cached balances in step with the blocks applied/undone, and
+   // stops new scrAddrs from being cached until this batcher is destroyed
+   void setBalanceCache(BalanceCache* balanceCache);
+
 private:
-   // We have accumulated enough data, actually write it to the db
-   void commit();
+   // We have accumulated enough data, actually write it to the db.  The 
+   // unspent part of the UTXO cache is only written if it's full, or if
+   // flushUtxoCache.
+   void commit(bool flushUtxoCache=false);
+
+   // Blocks until the in-flight batch (if any) is on disk, then frees up
+   // its buffers for the next commit
+   void waitForInFlightCommit();
    
    // search for entries in sshToModify_ that are empty and should
    // be deleted, removing those empty ones from sshToModify
@@ -516,13 +621,93 @@ private:
    bool applyTxToBatchWriteData(
                            StoredTx &       thisSTX,
                            StoredUndoData * sud);
+
+   // Removes the OutPoint from the UTXO set.  If stxo isn't NULL, it's set
+   // to the TxOut, and false means the OutPoint isn't in the set (the DB is
+   // only read in that case).
+   bool takeUtxo(BinaryDataRef outPoint, StoredTxOut* stxo);
+   void addUtxo(BinaryDataRef outPoint, StoredTxOut const & stxo);
+
+   // Writes the spentness change of a single TxOut, instead of the whole tx
+   // it's part of (unless that one is being written anyway)
+   void updateStxo(StoredTxOut const & stxo, BinaryDataRef stxoKey);
+
+   // Puts the UTXO changes in the current batch, see commit()
+   void writeUtxoCache(bool flush);
+
+   // Puts the undo records in the current batch, and deletes the ones that
+   // fell out of the retention window
+   void writeUndoData(void);
+
+   // A TxOut went in (added) or out of the UTXO set.  Multisig TxOuts also
+   // update the cached addresses they're made of.
+   void updateBalanceCache(BinaryDataRef scrAddr, 
+                           StoredTxOut const & stxo, 
+                           bool added);
+
+   // The TXHASHIDX value for txHash, pulled into txHashIdxToModify_.  NULL
+   // if the DB has no index.
+   BinaryData* getTxHashIdxToModify(BinaryDataRef txHash);
 private:
    InterfaceToLDB* const iface_;
 
    // turn off batches by setting this to 0
    uint64_t dbUpdateSize_;
-   map<BinaryData, StoredTx>              stxToModify_;
-   map<BinaryData, StoredScriptHistory>   sshToModify_;
+   uint64_t const commitThresh_;
+
+   // Two sets of buffers:  the batch being filled, and the one the
+   // committer thread is writing.  The in-flight one is read-only until
+   // its write is done, lookups check it before going to the DB.
+   WriteBatchArena<StoredTx>              stxBuffers_[2];
+   WriteBatchArena<StoredScriptHistory>   sshBuffers_[2];
+   WriteBatchArena<StoredTx>*             stxToModify_;
+   WriteBatchArena<StoredScriptHistory>*  sshToModify_;
+   WriteBatchArena<StoredTx>*             stxInFlight_;
+   WriteBatchArena<StoredScriptHistory>*  sshInFlight_;
+
+   // Single TxOuts to write, by DB key.  Written after stxToModify_, since
+   // they are newer than any copy of their tx in there.  Same two buffers.
+   WriteBatchArena<StoredTxOut>           stxoBuffers_[2];
+   WriteBatchArena<StoredTxOut>*          stxoToModify_;
+   WriteBatchArena<StoredTxOut>*          stxoInFlight_;
+
+   // The UTXO cache is kept across batches.  Like the buffers above, it's
+   // double-buffered:  once flushed, it stays readable as the in-flight one.
+   WriteBatchArena<UtxoCacheEntry>        utxoBuffers_[2];
+   WriteBatchArena<UtxoCacheEntry>*       utxoCache_;
+   WriteBatchArena<UtxoCacheEntry>*       utxoInFlight_;
+   uint64_t const                         utxoCacheBytes_;
+   uint64_t                               utxoCacheUsed_;
+
+   // TXHASHIDX values by hash prefix, only used if the DB has the index.
+   // Applying a block puts its tx keys in front, undoing it removes them.
+   // An empty value deletes the entry.
+   map<BinaryData, BinaryData>            txHashIdxToModify_;
+   map<BinaryData, BinaryData>            txHashIdxInFlight_;
+
+   // Serialized StoredUndoData by DB key, only filled when pruning.  An
+   // empty value deletes the record (the block was undone).  Nothing reads
+   // them back before they're written, so there's no in-flight copy.
+   map<BinaryData, BinaryData>            undoToModify_;
+   uint32_t const                         undoRetention_;
+
+   // NULL unless asyncCommit
+   BatchCommitter*                        committer_;
+
+   // NULL unless setBalanceCache() was called
+   BalanceCache*                          balanceCache_;
+
+   // Scratch space for applyTxToBatchWriteData, reused for every tx so the
+   // per-TxIn/TxOut keys don't each need a heap allocation
+   vector<uint32_t>                       txInOffsets_;
+   vector<uint32_t>                       txOutOffsets_;
+   BinaryData                             opTxHash_;
+   BinaryData                             scrAddr_;
+   BinaryData                             hgtX_;
+   BinaryData                             txInKey_;
+   BinaryData                             txOutKey_;
+   BinaryData                             outPoint_;
+   StoredTxOut                            spentStxo_;
    
    // (theoretically) incremented for each
    // applyBlockToDB and decremented for each
@@ -544,6 +729,30 @@ private:
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+// A header found while walking a blk file.  The header import fills these in
+// from several threads (see hashAndVerifyHeaders), each on its own range.
+class RawHeaderLoc
+{
+public:
+   RawHeaderLoc(void) : 
+      offset_(0), blockSize_(0), numTx_(UINT32_MAX), powValid_(false) {}
+
+   static void hashChunk(vector<RawHeaderLoc>* headers, 
+                         uint32_t start, 
+                         uint32_t end);
+
+   BinaryDataRef  rawHead_;     // 80-byte header + start of the #tx var_int
+   uint64_t       offset_;      // offset of the magic bytes in the blk file
+   uint32_t       blockSize_;
+   BlockHeader    header_;
+   uint32_t       numTx_;
+   bool           powValid_;
+};
+
+class BDMQueryLock;
+class BlkDirWatcher;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // BlockDataManager is a SINGLETON:  only one is ever created.  
@@ -559,20 +768,24 @@ private:
    bool checkLdbStatus(leveldb::Status stat);
 
 
-   map<HashString, BlockHeader> headerMap_;
+   HeaderStore headerStore_;
 
    // This is our permanent link to the two databases used
    static InterfaceToLDB* iface_;
    
-   // Need a separate memory pool just for zero-confirmation transactions
-   // We need the second map to make sure we can find the data to remove
-   // it, when necessary
-   list<BinaryData>                   zeroConfRawTxList_;
-   map<HashString, ZeroConfData>      zeroConfMap_;
+   // Need a separate memory pool just for zero-confirmation transactions.
+   // zcLogBytes_ is the size of the zero-conf file, which is only ever
+   // appended to until it gets compacted.
+   ZeroConfPool                       zcPool_;
+   uint64_t                           zcLogBytes_;
    bool                               zcEnabled_;
    bool                               zcLiteMode_;
    string                             zcFilename_;
 
+   // Balances of the scrAddrs the query* methods were asked for, and the
+   // zero-conf pool's effect on them
+   BalanceCache                       balanceCache_;
+
    // This is for detecting external changes made to the blk0001.dat file
    bool                               isNetParamsSet_;
    bool                               isBlkParamsSet_;
@@ -617,6 +830,9 @@ private:
    BlockHeader*                       genBlockPtr_;
    uint32_t                           lastTopBlock_;
 
+   // Headers in headerStore_ below this slot have been through organizeChain
+   uint32_t                           numHeadersOrganized_;
+
    // Reorganization details
    bool                               lastBlockWasReorg_;
    BlockHeader*                       reorgBranchPoint_;
@@ -661,6 +877,7 @@ private:
    // track those in RAM (maybe on a huge server...?)
    set<BtcWallet*>                    registeredWallets_;
    map<BinaryData, RegisteredScrAddr> registeredScrAddrMap_;
+   ScrAddrMatcher                     registeredScrAddrMatcher_;
    list<RegisteredTx>                 registeredTxList_;
    set<HashString>                    registeredTxSet_;
    set<OutPoint>                      registeredOutPoints_;
@@ -669,10 +886,36 @@ private:
    // list of block headers that appear to be missing 
    // when scanned by buildAndScanDatabases
    vector<BinaryData>                 missingBlockHeaderHashes_;
+
+   // Offsets (of the magic bytes) of the headers that failed proof-of-work,
+   // per blk file.  The raw block pass skips those blocks.
+   map<uint32_t, set<uint64_t> >      badPowOffsets_;
    // list of blocks whose contents are invalid but we have
    // their headers
    vector<BinaryData>                 missingBlockHashes_;
 
+   // Number of threads used to hash headers/parse blocks in the initial build
+   uint32_t                           numThreads_;
+
+   // Smallest height range given to each scanDBForRegisteredTx thread
+   uint32_t                           minBlocksPerScanThread_;
+
+   // How applyBlockRangeToDB batches its writes (see BlockWriteBatcher)
+   bool                               asyncCommit_;
+   uint64_t                           writeBatchBytes_;
+   uint64_t                           utxoCacheBytes_;
+   uint32_t                           undoRetention_;
+
+   // Tx hash index prefix length to apply when the DB is opened, or
+   // UINT32_MAX to keep whatever the DB has
+   uint32_t                           txHashIndexLenReq_;
+
+   // Taken by the query* methods, see BlockUtils.cpp
+   BDMQueryLock*                      queryLock_;
+
+   // NULL unless startBlkDirWatcher() was called
+   BlkDirWatcher*                     blkDirWatcher_;
+
    
    // TODO: We eventually want to maintain some kind of master TxIO map, instead
    // of storing them in the individual wallets.  With the new DB, it makes more
@@ -685,6 +928,18 @@ private:
    BlockDataManager_LevelDB(void);
    ~BlockDataManager_LevelDB(void);
 
+   // Tells the blk dir watcher where readBlkFileUpdate stopped
+   void updateBlkDirWatcher(void);
+
+   // Zero-conf file records, see ZC_LOG_COMPACT_MIN_BYTES
+   void     appendZeroConfLog(vector<HashString> const & removed,
+                              ZeroConfData const * added=NULL);
+   void     compactZeroConfFileIfNeeded(void);
+
+   // Also fills deltas (what the tx does to each scrAddr's balance) if not
+   // NULL.  The TxIns we can't find the TxOut of are left out.
+   uint64_t getZeroConfTxFee(Tx & tx, vector<ZeroConfDelta>* deltas=NULL);
+
 public:
 
    static BlockDataManager_LevelDB & GetInstance(void);
@@ -767,7 +1022,7 @@ public:
    bool isDirty(uint32_t numBlockToBeConsideredDirty=NUM_BLKS_IS_DIRTY) const; 
 
    //uint32_t getNumTx(void) { return txHintMap_.size(); }
-   uint32_t getNumHeaders(void) { return headerMap_.size(); }
+   uint32_t getNumHeaders(void) { return headerStore_.size(); }
 
    /////////////////////////////////////////////////////////////////////////////
    // If you register you wallet with the BDM, it will automatically maintain 
@@ -805,10 +1060,7 @@ public:
                                    uint32_t txSize=0,
                                    vector<uint32_t> * txInOffsets=NULL,
                                    vector<uint32_t> * txOutOffsets=NULL);
-   void     registeredScrAddrScan_IterSafe( 
-                                   StoredTx & stx,
-                                   vector<uint32_t> * txInOffsets=NULL,
-                                   vector<uint32_t> * txOutOffsets=NULL);
+   void     registeredScrAddrScan_IterSafe(StoredTx & stx);
    void     resetRegisteredWallets(void);
    void     pprintRegisteredWallets(void);
 
@@ -828,6 +1080,7 @@ public:
    // These are the high-level methods for reading block files, and indexing
    // the blockfile data.
    bool     extractHeadersInBlkFile(uint32_t fnum, uint64_t offset=0);
+   void     hashAndVerifyHeaders(vector<RawHeaderLoc> & headers);
    uint32_t detectAllBlkFiles(void);
    bool     processNewHeadersInBlkFiles(uint32_t fnumStart=0, uint64_t offset=0);
    //bool     processHeadersInFile(string filename);
@@ -837,8 +1090,14 @@ public:
                                   bool skipFetch=false,
                                   bool initialLoad=false);
    bool scanForMagicBytes(BinaryStreamBuffer& bsb, uint32_t *bytesSkipped=0) const;
+   bool scanForMagicBytes(BinaryRefReader& brr, uint32_t *bytesSkipped=0) const;
 
    void readRawBlocksInFile(uint32_t blkFileNum, uint32_t offset);
+   bool pipelineRawBlocks(BlkFileMap & blkMap,
+                          uint32_t fnum, 
+                          uint64_t foffset,
+                          uint64_t & dbUpdateSize,
+                          uint64_t & badBlockOffset);
    // These are wrappers around "buildAndScanDatabases"
    void doRebuildDatabases(void);
    void doFullRescanRegardlessOfSync(void);
@@ -848,6 +1107,7 @@ public:
    void doInitialSyncOnLoad_Rebuild(void);
 
    void addRawBlockToDB(BinaryRefReader & brr);
+   void addParsedBlockToDB(StoredHeader & sbh, bool parsedCompletely);
 
    void applyBlockRangeToDB(uint32_t blk0=0, uint32_t blk1=UINT32_MAX);
 
@@ -858,6 +1118,19 @@ public:
    // permanent memory location before parsing it.
    // These methods return (blockAddSucceeded, newBlockIsTop, didCauseReorg)
    uint32_t       readBlkFileUpdate(void);
+
+   // Streams new blocks in as bitcoind writes them, instead of waiting for
+   // the next readBlkFileUpdate() poll.  The watcher thread only reads the
+   // blk files, the blocks are still added on the BDM thread:  either in 
+   // waitForBlkFileUpdate(), or with readBlkFileUpdate() once
+   // waitForBlkFileData() says there is something.  It follows bitcoind to
+   // the next blk file by itself.  Reset() stops it.
+   bool           startBlkDirWatcher(uint32_t pollIntervalMs=BLKDIR_POLL_INTERVAL_MS);
+   void           stopBlkDirWatcher(void);
+   bool           isBlkDirWatcherRunning(void) const;
+   bool           waitForBlkFileData(uint32_t timeoutMs);
+   uint32_t       waitForBlkFileUpdate(uint32_t timeoutMs);
+
    vector<bool> addNewBlockData(BinaryRefReader & brrRawBlock, 
                                 uint32_t fileIndex0Idx,
                                 uint32_t thisHeaderOffset,
@@ -882,7 +1155,7 @@ public:
    bool hasTxWithHashInDB(BinaryData const & txhash);
    bool hasHeaderWithHash(BinaryData const & headHash) const;
 
-   uint32_t getNumBlocks(void) const { return headerMap_.size(); }
+   uint32_t getNumBlocks(void) const { return headerStore_.size(); }
    //uint32_t getNumTx(void) const { return txHintMap_.size(); }
    StoredHeader getMainBlockFromDB(uint32_t hgt);
    uint8_t      getMainDupFromDB(uint32_t hgt);
@@ -911,7 +1184,18 @@ public:
                                    uint32_t blkStart=0,
                                    uint32_t blkEnd=UINT32_MAX);
 
+   // Same as scanRegisteredTxForWallet on each wallet, but the registered 
+   // tx are read from the DB once for all of them, and the wallets are 
+   // scanned in parallel (up to numThreads_ at once)
+   void scanRegisteredTxForWallets( vector<BtcWallet*> const & wallets,
+                                    uint32_t blkStart=0,
+                                    uint32_t blkEnd=UINT32_MAX);
+
    void scanDBForRegisteredTx(uint32_t blk0=0, uint32_t blk1=UINT32_MAX);
+   void scanPartitionForRegisteredTx(RescanPartition* part);
+   void scanPartitionForSpends(RescanPartition* part, 
+                               set<OutPoint> const * earlierOutPoints);
+   bool findRegisteredTxIO(StoredTx const & stx, set<OutPoint> & newOutPoints);
 
  
    /////////////////////////////////////////////////////////////////////////////
@@ -923,14 +1207,60 @@ public:
    vector<TxIOPair>     getHistoryForScrAddr(BinaryDataRef uniqKey, 
                                              bool withMultiSig=false);
 
+   // The TxOuts at these 8-byte DB keys, read in one ordered pass instead of
+   // two random reads each (see InterfaceToLDB::getUnspentTxOutsByDBKey).
+   // Works in any DB mode, for TxOuts of txs we have.
+   void getUnspentTxOutsByDBKey(vector<BinaryData> const & txOutKeys,
+                                map<BinaryData, UnspentTxOut> & mapToFill,
+                                bool skipSpent=true)
+         { iface_->getUnspentTxOutsByDBKey(txOutKeys, mapToFill, skipSpent); }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Read-only queries that can be called from any number of threads, also
+   // while the BDM thread is applying blocks (readBlkFileUpdate, rescans).
+   // Each one reads the DB through its own LDBReader snapshot, and only 
+   // waits on the BDM thread while it changes the headers or the zero-conf 
+   // pool.  They return copies, empty if not found:  check isInitialized()
+   // on the Tx/BlockHeader.  Nothing else in this class is thread-safe.
+   Tx                   queryTxByHash(BinaryData const & txHash);
+   BlockHeader          queryHeaderByHash(BinaryData const & headHash);
+   vector<TxIOPair>     queryHistoryForScrAddr(BinaryData const & scrAddr, 
+                                               bool withMultiSig=false);
+   uint64_t             queryBalanceForScrAddr(BinaryData const & scrAddr, 
+                                               bool withMultiSig=false);
+
+   // Confirmed, unconfirmed and spendable totals and the UTXO count.  The
+   // first call for a scrAddr reads its SSH, then it's served from the 
+   // balance cache, which new blocks and zero-conf txs keep up to date.
+   ScrAddrBalance       queryBalanceSummary(BinaryData const & scrAddr);
+   void                 setBalanceCacheMaxEntries(uint32_t maxEntries)
+                           { balanceCache_.setMaxEntries(maxEntries); }
+   vector<UnspentTxOut> queryUTXOVectForScrAddr(BinaryData const & scrAddr, 
+                                                bool withMultiSig=false);
+
+   // A page of at most pageSize TxIOs (0 for no limit) from the blocks
+   // startHeight to endHeight, oldest first.  Only the sub-histories of 
+   // those blocks are read, so it's cheap even for the 1dice addresses.
+   // Pass an empty resumeToken for the first page.
+   ScrAddrHistoryPage   queryHistoryPageForScrAddr(
+                                    BinaryData const & scrAddr,
+                                    uint32_t startHeight,
+                                    uint32_t endHeight,
+                                    uint32_t pageSize,
+                                    BinaryData const & resumeToken,
+                                    bool withMultiSig=false);
+
    // For zero-confirmation tx-handling
    void enableZeroConf(string filename, bool zcLite=true);
    void disableZeroConf(void);
    void readZeroConfFile(string filename);
    bool addNewZeroConfTx(BinaryData const & rawTx, uint32_t txtime, bool writeToFile);
    void purgeZeroConfPool(void);
+   void purgeZeroConfPoolForBlock(BinaryDataRef rawBlock);
    void pprintZeroConfPool(void);
    void rewriteZeroConfFile(void);
+   void setZeroConfPoolMaxBytes(uint64_t maxBytes);
+   uint32_t getZeroConfPoolSize(void) { return zcPool_.size(); }
    void rescanWalletZeroConf(BtcWallet & wlt);
    bool isTxFinal(Tx & tx);
 
@@ -973,7 +1303,7 @@ public:
    // A couple random methods to expose internal data structures for testing.
    // These methods should not be used for nominal operation.
    //multimap<HashString, TxRef> &  getTxHintMapRef(void) { return txHintMap_; }
-   map<HashString, BlockHeader> & getHeaderMapRef(void) { return headerMap_; }
+   HeaderStore &                  getHeaderStoreRef(void) { return headerStore_; }
    deque<BlockHeader*> &          getHeadersByHeightRef(void) { return headersByHeight_;}
 
 // These things should probably be private, but they also need to be test-able,
@@ -997,6 +1327,56 @@ public:
    void     setLdbBlockSize(uint32_t sz){iface_->setLdbBlockSize(sz);}
    uint32_t getLdbBlockSize(void)       {return iface_->getLdbBlockSize();}
 
+   // Per-DB LevelDB tuning (see LDBTuning), applied when the DBs are opened
+   void setLdbBloomBitsPerKey(DB_SELECT db, uint32_t bits)
+                           {iface_->getTuningRef(db).bloomBitsPerKey_ = bits;}
+   void setLdbBlockCacheSize(DB_SELECT db, uint32_t bytes)
+                           {iface_->getTuningRef(db).blockCacheSize_ = bytes;}
+   void setLdbWriteBufferSize(DB_SELECT db, uint32_t bytes)
+                           {iface_->getTuningRef(db).writeBufferSize_ = bytes;}
+   void setLdbCompression(DB_SELECT db, bool useCompression)
+                           {iface_->getTuningRef(db).useCompression_ = useCompression;}
+   uint32_t getLdbBloomBitsPerKey(DB_SELECT db)
+                           {return iface_->getTuning(db).bloomBitsPerKey_;}
+   uint32_t getLdbBlockCacheSize(DB_SELECT db)
+                           {return iface_->getTuning(db).blockCacheSize_;}
+   uint32_t getLdbWriteBufferSize(DB_SELECT db)
+                           {return iface_->getTuning(db).writeBufferSize_;}
+   bool     getLdbCompression(DB_SELECT db)
+                           {return iface_->getTuning(db).useCompression_;}
+
+   // Threads used to hash headers, parse raw blocks and prefetch spent txs
+   // when building the DB.  0 means one per core.  The DB writes are always
+   // done by the calling thread, except for the async batch commits below.
+   void     setNumThreads(uint32_t n);
+   uint32_t getNumThreads(void)         {return numThreads_;}
+   void     setMinBlocksPerScanThread(uint32_t n) {minBlocksPerScanThread_ = (n==0 ? 1 : n);}
+   uint32_t getMinBlocksPerScanThread(void)       {return minBlocksPerScanThread_;}
+
+   // Applying blocks to the DB writes a batch every writeBatchBytes of
+   // changes.  With asyncCommit (the default) each batch is written in the
+   // background while the next one is filled.
+   void     setAsyncCommit(bool async)          {asyncCommit_ = async;}
+   bool     getAsyncCommit(void)                {return asyncCommit_;}
+   void     setWriteBatchBytes(uint64_t n)      {writeBatchBytes_ = n;}
+   uint64_t getWriteBatchBytes(void)            {return writeBatchBytes_;}
+
+   // Memory for UTXOs created while applying blocks, before they are
+   // written to the UTXO set in the DB (see BlockWriteBatcher).  A bigger
+   // cache means fewer of them are ever written.
+   void     setUtxoCacheBytes(uint64_t n)       {utxoCacheBytes_ = n;}
+   uint64_t getUtxoCacheBytes(void)             {return utxoCacheBytes_;}
+
+   // How many blocks of undo data to keep when pruning, which is as deep
+   // as a reorg can go
+   void     setUndoRetentionBlocks(uint32_t n)  {undoRetention_ = n;}
+   uint32_t getUndoRetentionBlocks(void)        {return undoRetention_;}
+
+   // Optional tx hash index (see InterfaceToLDB::enableTxHashIndex), 0 to
+   // remove it.  If the DB isn't open yet, it's applied when it is opened.
+   bool     setTxHashIndexLength(uint32_t prefixLen);
+   uint32_t getTxHashIndexLength(void)  {return iface_->getTxHashIndexLength();}
+
    // Simple wrapper around the logger so that they are easy to access from SWIG
    void StartCppLogging(string fname, int lvl) { STARTLOGGING(fname, (LogLevel)lvl); }
    void ChangeCppLogLevel(int lvl) { SETLOGLEVEL((LogLevel)lvl); }
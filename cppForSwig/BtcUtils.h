@@ -505,6 +505,18 @@ public:
       sha256_.CalculateDigest(hashOutput.getPtr(), hashOutput.getPtr(), 32);
    }
 
+   /////////////////////////////////////////////////////////////////////////////
+   // Writes the 32-byte hash to a caller-owned buffer (no allocation)
+   static void getHash256(uint8_t const * strToHash,
+                          uint32_t        nBytes,
+                          uint8_t *       hashOutput)
+   {
+      CryptoPP::SHA256 sha256_;
+
+      sha256_.CalculateDigest(hashOutput, strToHash, nBytes);
+      sha256_.CalculateDigest(hashOutput, hashOutput, 32);
+   }
+
    /////////////////////////////////////////////////////////////////////////////
    static BinaryData getHash256(uint8_t const * strToHash,
                                 uint32_t        nBytes)
@@ -578,6 +590,21 @@ public:
 
    }
 
+   /////////////////////////////////////////////////////////////////////////////
+   // Into a caller-supplied 20-byte buffer, so the scan loops can hash the
+   // P2PK scripts without touching the heap
+   static void getHash160(uint8_t const * strToHash,
+                          uint32_t        nBytes,
+                          uint8_t *       hashOutput)
+   {
+      CryptoPP::SHA256 sha256_;
+      CryptoPP::RIPEMD160 ripemd160_;
+      uint8_t hash32[32];
+
+      sha256_.CalculateDigest(hash32, strToHash, nBytes);
+      ripemd160_.CalculateDigest(hashOutput, hash32, 32);
+   }
+
    /////////////////////////////////////////////////////////////////////////////
    static BinaryData getHash160(uint8_t const * strToHash,
                                 uint32_t        nBytes)
@@ -1008,6 +1035,41 @@ public:
       }
    }
 
+   /////////////////////////////////////////////////////////////////////////////
+   // Same, but into an existing buffer.  The std single-sig cases write the 
+   // 21 bytes in place, so a caller that keeps one scrAddr buffer around
+   // doesn't hit the heap for every TxOut.
+   static void getTxOutScrAddr(BinaryDataRef script, BinaryData & scrAddr)
+   {
+      TXOUT_SCRIPT_TYPE type = getTxOutScriptType(script);
+      switch(type)
+      {
+         case(TXOUT_SCRIPT_STDHASH160):  
+            scrAddr.resize(21);
+            scrAddr[0] = SCRIPT_PREFIX_HASH160;
+            memcpy(scrAddr.getPtr()+1, script.getPtr()+3, 20);
+            return;
+         case(TXOUT_SCRIPT_STDPUBKEY65): 
+            scrAddr.resize(21);
+            scrAddr[0] = SCRIPT_PREFIX_HASH160;
+            getHash160(script.getPtr()+1, 65, scrAddr.getPtr()+1);
+            return;
+         case(TXOUT_SCRIPT_STDPUBKEY33): 
+            scrAddr.resize(21);
+            scrAddr[0] = SCRIPT_PREFIX_HASH160;
+            getHash160(script.getPtr()+1, 33, scrAddr.getPtr()+1);
+            return;
+         case(TXOUT_SCRIPT_P2SH):       
+            scrAddr.resize(21);
+            scrAddr[0] = SCRIPT_PREFIX_P2SH;
+            memcpy(scrAddr.getPtr()+1, script.getPtr()+2, 20);
+            return;
+         default:
+            scrAddr = getTxOutScrAddr(script, type);
+            return;
+      }
+   }
+
    /////////////////////////////////////////////////////////////////////////////
    // This is basically just for SWIG to access via python
    static BinaryData getScrAddrForScript(BinaryData const & script)
@@ -1603,38 +1665,72 @@ public:
    }
 
 
-   /*
+   /////////////////////////////////////////////////////////////////////////////
    static bool verifyProofOfWork(BinaryDataRef bh80)
    {
       BinaryData theHash = getHash256(bh80);
       return verifyProofOfWork(bh80, theHash.getRef());
    }
 
-   static bool verifyProofOfWork(BinaryData bh80,
+   /////////////////////////////////////////////////////////////////////////////
+   static bool verifyProofOfWork(BinaryData const & bh80,
                                  BinaryData const & theHash)
    {
       return verifyProofOfWork(bh80.getRef(), theHash.getRef());
    }
 
+   /////////////////////////////////////////////////////////////////////////////
+   // Exact check of the header hash against the target encoded in its diff
+   // bits (the "compact" format:  1 byte exponent, 3 byte mantissa).  Both 
+   // the hash and the target are treated as 256-bit little-endian integers,
+   // which is how the hash comes out of getHash256.  Negative, zero and
+   // overflowing targets are rejected, like bitcoind does.
    static bool verifyProofOfWork(BinaryDataRef bh80, BinaryDataRef bhrHash)
    {
-      // This is only approximate.  I can put in an exact verifier once 
-      // I figure out big integers better in C++, or another way to do
-      // the calculation.  I just want to make sure this isn't a completely
-      // bogus proof of work.
-      double diff = convertDiffBitsToDouble( BinaryDataRef(bh80.getPtr()+72, 4) );
-      double diffFactor = diff * (double)UINT32_MAX;
-      double nZeroBits  = int( log(diffFactor) / log(2.0));
-      int    nZeroBytes = int( log(diffFactor) / log(2.0) / 8.0);
-
-      // TODO: check that I'm comparing the correct end of the hash
-      for(uint32_t i=0; i<nZeroBytes; i++)
-         if(bhrHash[31-i]!=0)
-            return false;
+      if(bh80.getSize() < HEADER_SIZE || bhrHash.getSize() != 32)
+         return false;
+
+      uint32_t diffBits = READ_UINT32_LE(bh80.getPtr()+72);
+      uint32_t nBytes   = diffBits >> 24;
+      uint32_t mantissa = diffBits & 0x007fffff;
+      if(mantissa == 0 || (diffBits & 0x00800000) != 0)
+         return false;
+
+      uint8_t target[32];
+      memset(target, 0, 32);
+      if(nBytes <= 3)
+      {
+         mantissa >>= 8*(3-nBytes);
+         for(uint32_t i=0; i<3; i++)
+            target[i] = (uint8_t)(mantissa >> (8*i));
+      }
+      else
+      {
+         for(uint32_t i=0; i<3; i++)
+         {
+            uint8_t b = (uint8_t)(mantissa >> (8*i));
+            uint32_t pos = nBytes - 3 + i;
+            if(pos >= 32)
+            {
+               if(b != 0)
+                  return false;
+               continue;
+            }
+            target[pos] = b;
+         }
+      }
 
+      // Compare from the most significant byte down:  hash <= target
+      uint8_t const * hashPtr = bhrHash.getPtr();
+      for(int i=31; i>=0; i--)
+      {
+         if(hashPtr[i] < target[i])
+            return true;
+         if(hashPtr[i] > target[i])
+            return false;
+      }
       return true;
    }
-   */
 
 };
    
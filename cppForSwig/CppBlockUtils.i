@@ -50,6 +50,7 @@ namespace std
    %template(vector_BtcWallet) std::vector<BtcWallet*>;
    %template(vector_AddressBookEntry) std::vector<AddressBookEntry>;
    %template(vector_RegisteredTx) std::vector<RegisteredTx>;
+   %template(vector_TxIOPair) std::vector<TxIOPair>;
 }
 /******************************************************************************/
 /* Convert Python(str) to C++(BinaryData) */
@@ -98,6 +99,23 @@ namespace std
 
 
 
+/*
+// -threads (see the Makefile) has every wrapper release the GIL while in 
+// C++.  The query* methods depend on it:  they are called straight from the
+// GUI/RPC threads, bypassing the BDM thread queue, and mustn't hold the GIL
+// while they wait on the BDM thread.  Don't %nothread them.
+*/
+%threadallow BlockDataManager_LevelDB::queryTxByHash;
+%threadallow BlockDataManager_LevelDB::queryHeaderByHash;
+%threadallow BlockDataManager_LevelDB::queryHistoryForScrAddr;
+%threadallow BlockDataManager_LevelDB::queryBalanceForScrAddr;
+%threadallow BlockDataManager_LevelDB::queryUTXOVectForScrAddr;
+%threadallow BlockDataManager_LevelDB::queryHistoryPageForScrAddr;
+
+/* Same for the blk dir watcher waits, which block for up to timeoutMs */
+%threadallow BlockDataManager_LevelDB::waitForBlkFileData;
+%threadallow BlockDataManager_LevelDB::waitForBlkFileUpdate;
+
 /* With our typemaps, we can finally include our other objects */
 %include "BlockObj.h"
 %include "StoredBlockObj.h"
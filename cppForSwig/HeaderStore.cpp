@@ -0,0 +1,152 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+#include "HeaderStore.h"
+
+////////////////////////////////////////////////////////////////////////////////
+HeaderStore::HeaderStore(void) :
+   numHeaders_(0),
+   index_(HEADER_INDEX_MIN_SIZE, 0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void HeaderStore::clear(void)
+{
+   chunks_.clear();
+   numHeaders_ = 0;
+   index_.assign(HEADER_INDEX_MIN_SIZE, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Block hashes are already uniformly distributed in their first bytes (the
+// PoW zeros are at the other end), so they don't need any extra mixing
+uint32_t HeaderStore::startPos(uint8_t const * hash, uint32_t mask)
+{
+   uint32_t h;
+   memcpy(&h, hash, 4);
+   return h & mask;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Returns the index position holding this hash, or the empty position where
+// it would go
+uint32_t HeaderStore::findIndexPos(uint8_t const * hash) const
+{
+   uint32_t mask = (uint32_t)index_.size() - 1;
+   uint32_t pos  = startPos(hash, mask);
+   while(index_[pos] != 0)
+   {
+      BlockHeader const & bh = (*this)[index_[pos]-1];
+      if(memcmp(bh.thisHash_, hash, 32) == 0)
+         break;
+      pos = (pos+1) & mask;
+   }
+   return pos;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeader* HeaderStore::find(BinaryDataRef hash)
+{
+   if(hash.getSize() != 32)
+      return NULL;
+
+   uint32_t pos = findIndexPos(hash.getPtr());
+   if(index_[pos] == 0)
+      return NULL;
+   return &(*this)[index_[pos]-1];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeader const* HeaderStore::find(BinaryDataRef hash) const
+{
+   if(hash.getSize() != 32)
+      return NULL;
+
+   uint32_t pos = findIndexPos(hash.getPtr());
+   if(index_[pos] == 0)
+      return NULL;
+   return &(*this)[index_[pos]-1];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeader* HeaderStore::appendRecord(void)
+{
+   if(numHeaders_ % HEADERS_PER_CHUNK == 0)
+   {
+      chunks_.push_back(vector<BlockHeader>());
+      chunks_.back().reserve(HEADERS_PER_CHUNK);
+   }
+
+   chunks_.back().push_back(BlockHeader());
+   numHeaders_++;
+
+   // Keep the load factor at or below one half
+   if(2*numHeaders_ > index_.size())
+      rebuildIndex(2*(uint32_t)index_.size());
+
+   return &chunks_.back().back();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void HeaderStore::rebuildIndex(uint32_t newIndexSize)
+{
+   index_.assign(newIndexSize, 0);
+   uint32_t mask = newIndexSize - 1;
+
+   // The record just appended is not indexed yet, the caller does it
+   for(uint32_t slot=0; slot+1<numHeaders_; slot++)
+   {
+      uint32_t pos = startPos((*this)[slot].thisHash_, mask);
+      while(index_[pos] != 0)
+         pos = (pos+1) & mask;
+      index_[pos] = slot+1;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeader* HeaderStore::insert(BlockHeader const & bh, bool* wasInserted)
+{
+   uint32_t pos = findIndexPos(bh.thisHash_);
+   if(index_[pos] != 0)
+   {
+      if(wasInserted != NULL)
+         *wasInserted = false;
+      return &(*this)[index_[pos]-1];
+   }
+
+   BlockHeader* rec = appendRecord();
+   *rec = bh;
+
+   // appendRecord may have rebuilt the index, find the empty spot again
+   pos = findIndexPos(bh.thisHash_);
+   index_[pos] = numHeaders_;
+
+   if(wasInserted != NULL)
+      *wasInserted = true;
+   return rec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeader& HeaderStore::getOrCreate(BinaryDataRef hash)
+{
+   assert(hash.getSize() == 32);
+   BlockHeader* existing = find(hash);
+   if(existing != NULL)
+      return *existing;
+
+   BlockHeader* rec = appendRecord();
+   memcpy(rec->thisHash_, hash.getPtr(), 32);
+
+   uint32_t pos = findIndexPos(rec->thisHash_);
+   index_[pos] = numHeaders_;
+   return *rec;
+}
+
+// kate: indent-width 3; replace-tabs on;
@@ -0,0 +1,85 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// HeaderStore
+//
+// Holds every block header the BDM knows about.  This used to be a
+// map<HashString, BlockHeader>, which cost a tree node plus a heap-allocated
+// key, raw header and two hashes for each of the ~300k headers.  Now the
+// BlockHeader records (which have no heap members) are packed in fixed-size
+// chunks, and an open-addressing table maps the block hash to the slot.
+//
+// Records are never moved or removed individually, so a BlockHeader* stays
+// valid until clear() is called.  headersByHeight_, topBlockPtr_ and the
+// SWIG layer all rely on that.  Slots are numbered in insertion order and
+// can be iterated with size() and operator[].
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _HEADERSTORE_H_
+#define _HEADERSTORE_H_
+
+#include <vector>
+#include "BinaryData.h"
+#include "BlockObj.h"
+
+#define HEADERS_PER_CHUNK       4096
+#define HEADER_INDEX_MIN_SIZE   1024
+
+using namespace std;
+
+class HeaderStore
+{
+public:
+   HeaderStore(void);
+
+   // NULL if we don't have a header with this hash
+   BlockHeader*       find(BinaryDataRef hash);
+   BlockHeader const* find(BinaryDataRef hash) const;
+   bool               contains(BinaryDataRef hash) const { return find(hash)!=NULL; }
+
+   // Adds a copy of bh, keyed by its hash.  If a header with the same hash
+   // is already in the store, it is left untouched and returned with
+   // wasInserted set to false.
+   BlockHeader* insert(BlockHeader const & bh, bool* wasInserted=NULL);
+
+   // Same as map::operator[]:  returns the header for this hash, adding an
+   // uninitialized one if it is not there yet.
+   BlockHeader& getOrCreate(BinaryDataRef hash);
+
+   BlockHeader&       operator[](uint32_t slot)
+                         { return chunks_[slot/HEADERS_PER_CHUNK][slot%HEADERS_PER_CHUNK]; }
+   BlockHeader const& operator[](uint32_t slot) const
+                         { return chunks_[slot/HEADERS_PER_CHUNK][slot%HEADERS_PER_CHUNK]; }
+
+   uint32_t size(void) const  { return numHeaders_; }
+   bool     empty(void) const { return numHeaders_==0; }
+   void     clear(void);
+
+private:
+   // Not copyable:  everyone holds raw pointers into the chunks
+   HeaderStore(HeaderStore const &);
+   HeaderStore & operator=(HeaderStore const &);
+
+   uint32_t     findIndexPos(uint8_t const * hash) const;
+   BlockHeader* appendRecord(void);
+   void         rebuildIndex(uint32_t newIndexSize);
+
+   static uint32_t startPos(uint8_t const * hash, uint32_t mask);
+
+   // Each chunk is reserved to HEADERS_PER_CHUNK up front and never grows
+   // past it, so the records never move.
+   vector< vector<BlockHeader> > chunks_;
+   uint32_t                      numHeaders_;
+
+   // Slot+1 for each used entry, 0 is empty.  Linear probing, the size is
+   // a power of two and kept at least twice the number of headers.
+   vector<uint32_t>              index_;
+};
+
+#endif
+// kate: indent-width 3; replace-tabs on;
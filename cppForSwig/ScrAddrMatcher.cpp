@@ -0,0 +1,236 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+#include "ScrAddrMatcher.h"
+
+////////////////////////////////////////////////////////////////////////////////
+ScrAddrMatcher::ScrAddrMatcher(void) :
+   keys_(SCRADDR_MATCH_MIN_SLOTS * SCRADDR_MATCH_KEY_LEN, 0),
+   slotUsed_(SCRADDR_MATCH_MIN_SLOTS, 0),
+   numKeys_(0),
+   filter_(SCRADDR_MATCH_FILTER_BITS/64, 0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void ScrAddrMatcher::clear(void)
+{
+   keys_.assign(SCRADDR_MATCH_MIN_SLOTS * SCRADDR_MATCH_KEY_LEN, 0);
+   slotUsed_.assign(SCRADDR_MATCH_MIN_SLOTS, 0);
+   numKeys_ = 0;
+   filter_.assign(SCRADDR_MATCH_FILTER_BITS/64, 0);
+   otherKeys_.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Returns the slot holding this scrAddr, or the empty slot where it would go.
+// The hash160 is already uniformly distributed, bytes 2-5 are used for the
+// start position since 0-1 already went into the filter.
+uint32_t ScrAddrMatcher::findSlot(uint8_t prefix, uint8_t const * hash160) const
+{
+   uint32_t mask = (uint32_t)slotUsed_.size() - 1;
+   uint32_t h;
+   memcpy(&h, hash160+2, 4);
+   uint32_t pos = (h ^ prefix) & mask;
+
+   while(slotUsed_[pos] != 0)
+   {
+      uint8_t const * key = &keys_[pos*SCRADDR_MATCH_KEY_LEN];
+      if(key[0]==prefix && memcmp(key+1, hash160, 20)==0)
+         break;
+      pos = (pos+1) & mask;
+   }
+   return pos;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Caller has checked it's not in the table yet, and that there's room
+void ScrAddrMatcher::insertKey(uint8_t prefix, uint8_t const * hash160)
+{
+   uint32_t pos = findSlot(prefix, hash160);
+   uint8_t * key = &keys_[pos*SCRADDR_MATCH_KEY_LEN];
+   key[0] = prefix;
+   memcpy(key+1, hash160, 20);
+   slotUsed_[pos] = 1;
+   numKeys_++;
+
+   uint32_t bit = filterBit(hash160);
+   filter_[bit >> 6] |= (1ULL << (bit & 63));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Re-inserts everything into a table of newNumSlots, leaving out skipSlot
+// (UINT32_MAX to keep everything).  The filter is rebuilt too, since bits
+// can't be cleared individually.
+void ScrAddrMatcher::rebuild(uint32_t newNumSlots, uint32_t skipSlot)
+{
+   vector<uint8_t> oldKeys;
+   vector<uint8_t> oldUsed;
+   oldKeys.swap(keys_);
+   oldUsed.swap(slotUsed_);
+
+   keys_.assign(newNumSlots * SCRADDR_MATCH_KEY_LEN, 0);
+   slotUsed_.assign(newNumSlots, 0);
+   filter_.assign(SCRADDR_MATCH_FILTER_BITS/64, 0);
+   numKeys_ = 0;
+
+   for(uint32_t i=0; i<oldUsed.size(); i++)
+   {
+      if(oldUsed[i] == 0 || i == skipSlot)
+         continue;
+
+      uint8_t const * key = &oldKeys[i*SCRADDR_MATCH_KEY_LEN];
+      insertKey(key[0], key+1);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool ScrAddrMatcher::insert(BinaryDataRef scrAddr)
+{
+   if(scrAddr.getSize() != SCRADDR_MATCH_KEY_LEN)
+      return otherKeys_.insert(scrAddr.copy()).second;
+
+   uint8_t const * ptr = scrAddr.getPtr();
+   uint32_t pos = findSlot(ptr[0], ptr+1);
+   if(slotUsed_[pos] != 0)
+      return false;
+
+   // Keep the load factor at or below one half
+   if(2*(numKeys_+1) > slotUsed_.size())
+      rebuild(2*(uint32_t)slotUsed_.size(), UINT32_MAX);
+
+   insertKey(ptr[0], ptr+1);
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Unregistering is rare, so just rebuild without it rather than dealing with
+// tombstones in the probe sequences
+bool ScrAddrMatcher::erase(BinaryDataRef scrAddr)
+{
+   if(scrAddr.getSize() != SCRADDR_MATCH_KEY_LEN)
+      return otherKeys_.erase(scrAddr.copy()) > 0;
+
+   uint8_t const * ptr = scrAddr.getPtr();
+   uint32_t pos = findSlot(ptr[0], ptr+1);
+   if(slotUsed_[pos] == 0)
+      return false;
+
+   rebuild((uint32_t)slotUsed_.size(), pos);
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool ScrAddrMatcher::contains(uint8_t prefix, uint8_t const * hash160) const
+{
+   uint32_t bit = filterBit(hash160);
+   if((filter_[bit >> 6] & (1ULL << (bit & 63))) == 0)
+      return false;
+
+   return slotUsed_[findSlot(prefix, hash160)] != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool ScrAddrMatcher::contains(BinaryDataRef scrAddr) const
+{
+   if(scrAddr.getSize() != SCRADDR_MATCH_KEY_LEN)
+      return !otherKeys_.empty() && otherKeys_.count(scrAddr.copy()) > 0;
+
+   return contains(scrAddr.getPtr()[0], scrAddr.getPtr()+1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// M <pubkey>...<pubkey> N OP_CHECKMULTISIG, with 33- or 65-byte keys, which is
+// all getMultisigPubKeyList accepts.  Walking the pushes here also keeps it
+// from reading past the end of a malformed script.
+static bool isBareMultisigScript(uint8_t const * script, uint32_t scrLen)
+{
+   if(scrLen < 37 || script[scrLen-1] != OP_CHECKMULTISIG)
+      return false;
+
+   uint8_t M = script[0];
+   uint8_t N = script[scrLen-2];
+   if(M<OP_1 || M>OP_16 || N<OP_1 || N>OP_16)
+      return false;
+
+   uint32_t nKeys = N - OP_1 + 1;
+   uint32_t pos = 1;
+   for(uint32_t i=0; i<nKeys; i++)
+   {
+      if(pos >= scrLen-2)
+         return false;
+      uint8_t pushSize = script[pos];
+      if(pushSize != 33 && pushSize != 65)
+         return false;
+      pos += 1 + pushSize;
+   }
+   return pos == scrLen-2;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool ScrAddrMatcher::containsTxOut(uint8_t const * txOutPtr, 
+                                   uint32_t        txOutSize,
+                                   bool            withMultiSig) const
+{
+   if(txOutSize <= 8 || empty())
+      return false;
+
+   uint32_t viLen;
+   uint64_t scrLen64 = BtcUtils::readVarInt(txOutPtr+8, txOutSize-8, &viLen);
+   if(scrLen64 == 0 || 8 + viLen + scrLen64 > txOutSize)
+      return false;
+
+   uint32_t scrLen = (uint32_t)scrLen64;
+
+   uint8_t const * script = txOutPtr + 8 + viLen;
+   uint8_t addr160[20];
+   switch(scrLen)
+   {
+      case 25:  // OP_DUP OP_HASH160 <addr160> OP_EQUALVERIFY OP_CHECKSIG
+         if(script[0]==OP_DUP && script[1]==OP_HASH160 && script[2]==20)
+            return contains(SCRIPT_PREFIX_HASH160, script+3);
+         break;
+      case 23:  // OP_HASH160 <hash160> OP_EQUAL
+         if(script[0]==OP_HASH160 && script[1]==20 && script[22]==OP_EQUAL)
+            return contains(SCRIPT_PREFIX_P2SH, script+2);
+         break;
+      case 67:  // <65-byte pubkey> OP_CHECKSIG
+      case 35:  // <33-byte pubkey> OP_CHECKSIG
+         if(script[0]==scrLen-2 && script[scrLen-1]==OP_CHECKSIG)
+         {
+            // Hashing is the expensive part, skip it if it can't match
+            if(numKeys_ == 0)
+               return false;
+            BtcUtils::getHash160(script+1, scrLen-2, addr160);
+            return contains(SCRIPT_PREFIX_HASH160, addr160);
+         }
+         break;
+      default:
+         break;
+   }
+
+   if(!withMultiSig || !isBareMultisigScript(script, scrLen))
+      return false;
+
+   BinaryData msigKey = BtcUtils::getMultisigUniqueKey(BinaryData(script, scrLen));
+   if(msigKey.getSize() == 0)
+      return false;
+
+   if(contains(MSIGPREFIX + msigKey))
+      return true;
+
+   // The unique key is M, N and then the N sorted addr160s
+   for(uint8_t a=0; a<msigKey[1]; a++)
+      if(contains(SCRIPT_PREFIX_HASH160, msigKey.getPtr() + 2 + 20*a))
+         return true;
+
+   return false;
+}
+
+// kate: indent-width 3; replace-tabs on;
@@ -0,0 +1,88 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// ScrAddrMatcher
+//
+// The set of scrAddrs the bulk scans test every TxOut against.  Those scans
+// used to copy the hash160 out of the script, build HASH160PREFIX+addr160 on
+// the heap and look that up in a map<BinaryData,...>, for each of the
+// hundreds of millions of TxOuts in the chain.  Here the 21-byte scrAddrs
+// (prefix byte + hash160) are stored inline in an open-addressing table, and
+// can be queried with a pointer straight into the raw tx.
+//
+// Nearly every lookup is for a scrAddr we don't have, so a 64k-bit map of
+// the first two hash160 bytes is checked before the table.  With a few
+// thousand addresses registered it rejects ~95% of TxOuts in one load.
+//
+// scrAddrs of any other size (multisig unique keys) go in a plain set, they
+// are rare and only looked up on the slow multisig path.
+//
+// containsTxOut does the script classification too, straight off the raw
+// TxOut:  P2PKH, P2SH, P2PK (compressed or not) and bare multisig.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _SCRADDRMATCHER_H_
+#define _SCRADDRMATCHER_H_
+
+#include <vector>
+#include <set>
+#include "BinaryData.h"
+#include "BtcUtils.h"
+
+#define SCRADDR_MATCH_KEY_LEN      21
+#define SCRADDR_MATCH_MIN_SLOTS    64
+#define SCRADDR_MATCH_FILTER_BITS  65536
+
+using namespace std;
+
+class ScrAddrMatcher
+{
+public:
+   ScrAddrMatcher(void);
+
+   // Returns false if the scrAddr was already in the set
+   bool insert(BinaryDataRef scrAddr);
+   bool erase(BinaryDataRef scrAddr);
+   void clear(void);
+
+   // The fast path:  no allocation, hash160 points at the 20 hash bytes
+   bool contains(uint8_t prefix, uint8_t const * hash160) const;
+   bool contains(BinaryDataRef scrAddr) const;
+
+   // Whether a standard TxOut script pays to one of our scrAddrs.  txOutPtr
+   // points at the start of the TxOut (the 8-byte value).  Bare multisig
+   // matches on the unique key or any of its addr160s; it's the only case
+   // that allocates, so it can be skipped with withMultiSig=false.
+   bool containsTxOut(uint8_t const * txOutPtr, 
+                      uint32_t        txOutSize,
+                      bool            withMultiSig=true) const;
+
+   uint32_t size(void) const  { return numKeys_ + (uint32_t)otherKeys_.size(); }
+   bool     empty(void) const { return size()==0; }
+
+private:
+   uint32_t findSlot(uint8_t prefix, uint8_t const * hash160) const;
+   void     insertKey(uint8_t prefix, uint8_t const * hash160);
+   void     rebuild(uint32_t newNumSlots, uint32_t skipSlot);
+
+   static uint32_t filterBit(uint8_t const * hash160)
+                  { return ((uint32_t)hash160[0] << 8) | hash160[1]; }
+
+   // SCRADDR_MATCH_KEY_LEN bytes per slot.  Linear probing, the number of
+   // slots is a power of two and kept at least twice numKeys_.
+   vector<uint8_t>   keys_;
+   vector<uint8_t>   slotUsed_;
+   uint32_t          numKeys_;
+
+   vector<uint64_t>  filter_;
+
+   set<BinaryData>   otherKeys_;
+};
+
+#endif
+// kate: indent-width 3; replace-tabs on;
@@ -1029,6 +1029,35 @@ void StoredTxOut::serializeDBValue(BinaryWriter & bw,
 
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void StoredTxOut::unserializeUtxoValue(BinaryDataRef val)
+{
+   if(val.getSize() < 8)
+   {
+      LOGERR << "UTXO value too short";
+      return;
+   }
+
+   unserializeDBKey(val.getSliceRef(0, 8));
+   unserializeDBValue(val.getSliceRef(8, val.getSize()-8));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Always written as unspent, spent TxOuts are not in the UTXO set
+void StoredTxOut::serializeUtxoValue(BinaryWriter & bw) const
+{
+   bw.put_BinaryData(getDBKey(false));
+
+   BitPacker<uint16_t> bitpack;
+   bitpack.putBits((uint16_t)ARMORY_DB_VERSION,  4);
+   bitpack.putBits((uint16_t)txVersion_,         2);
+   bitpack.putBits((uint16_t)TXOUT_UNSPENT,      2);
+   bitpack.putBit(           isCoinbase_);
+
+   bw.put_BitPacker(bitpack);
+   bw.put_BinaryData(dataCopy_);
+}
+
 /////////////////////////////////////////////////////////////////////////////
 BinaryData StoredTxOut::getDBKey(bool withPrefix) const
 {
@@ -1668,8 +1697,8 @@ bool StoredScriptHistory::mergeSubHistory(StoredSubHistory & subssh)
 
 ////////////////////////////////////////////////////////////////////////////////
 // This adds the TxOut if it doesn't exist yet
-uint64_t StoredScriptHistory::markTxOutSpent(BinaryData txOutKey8B, 
-                                             BinaryData txInKey8B)
+uint64_t StoredScriptHistory::markTxOutSpent(BinaryData const & txOutKey8B, 
+                                             BinaryData const & txInKey8B)
 {
    if(!isInitialized())
       return UINT64_MAX;
@@ -1692,6 +1721,19 @@ uint64_t StoredScriptHistory::markTxOutSpent(BinaryData txOutKey8B,
       return UINT64_MAX;
    }
 
+   // When pruning, spent TxIOs are removed instead, the undo data of the
+   // block has what it takes to put them back
+   if(DBUtils.getDbPruneType() == DB_PRUNE_ALL)
+   {
+      uint64_t prevUnspent = totalUnspent_;
+      if(!eraseTxio(txOutKey8B))
+      {
+         LOGERR << "We should've found an STXO in the SSH but didn't";
+         return UINT64_MAX;
+      }
+      return prevUnspent - totalUnspent_;
+   }
+
    uint64_t val = iter->second.markTxOutSpent(txOutKey8B, txInKey8B);
    if(val != UINT64_MAX)
       totalUnspent_ -= val;
@@ -1700,7 +1742,7 @@ uint64_t StoredScriptHistory::markTxOutSpent(BinaryData txOutKey8B,
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-uint64_t StoredScriptHistory::markTxOutUnspent(BinaryData txOutKey8B, 
+uint64_t StoredScriptHistory::markTxOutUnspent(BinaryData const & txOutKey8B, 
                                                uint64_t   value,
                                                bool       isCoinbase,
                                                bool       isMultisig)
@@ -1898,17 +1940,25 @@ void StoredSubHistory::unserializeDBValue(BinaryRefReader & brr)
 ////////////////////////////////////////////////////////////////////////////////
 void StoredSubHistory::serializeDBValue(BinaryWriter & bw ) const
 {
-   bw.put_var_int(txioSet_.size());
+   // If only maintaining a pruned DB, spent TxIOs are skipped
+   bool pruneSpent = (DBUtils.getDbPruneType()==DB_PRUNE_ALL);
    map<BinaryData, TxIOPair>::const_iterator iter;
+
+   uint32_t numTxo = txioSet_.size();
+   if(pruneSpent)
+      for(iter = txioSet_.begin(); iter != txioSet_.end(); iter++)
+         if(iter->second.hasTxInInMain())
+            numTxo--;
+
+   bw.put_var_int(numTxo);
    for(iter = txioSet_.begin(); iter != txioSet_.end(); iter++)
    {
       TxIOPair const & txio = iter->second;
       bool isSpent = txio.hasTxInInMain();
 
-      // If spent and only maintaining a pruned DB, skip it
       if(isSpent)
       {
-         if(DBUtils.getDbPruneType()==DB_PRUNE_ALL)
+         if(pruneSpent)
             continue;
 
          if(!txio.getTxRefOfInput().isInitialized())
@@ -2146,8 +2196,8 @@ uint64_t StoredSubHistory::getSubHistoryBalance(bool withMultisig)
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-uint64_t StoredSubHistory::markTxOutSpent(BinaryData txOutKey8B, 
-                                                BinaryData txInKey8B)
+uint64_t StoredSubHistory::markTxOutSpent(BinaryData const & txOutKey8B, 
+                                                BinaryData const & txInKey8B)
 {
    // We found the TxIO we care about 
    if(DBUtils.getDbPruneType() != DB_PRUNE_NONE)
@@ -2205,7 +2255,7 @@ uint64_t StoredSubHistory::markTxOutSpent(BinaryData txOutKey8B,
 //   
 // Returns the difference to be applied to totalUnspent_ in the outer SSH
 // (unless it's UINT64_MAX which is interpretted as failure)
-uint64_t StoredSubHistory::markTxOutUnspent(BinaryData txOutKey8B, 
+uint64_t StoredSubHistory::markTxOutUnspent(BinaryData const & txOutKey8B, 
                                                   uint64_t   value,
                                                   bool       isCoinbase,
                                                   bool       isMultisigRef)
@@ -2281,10 +2331,16 @@ void StoredUndoData::unserializeDBValue(BinaryRefReader & brr)
 {
    brr.get_BinaryData(blockHash_, 32);
 
-   uint32_t nStxoRmd = brr.get_uint32_t();
+   uint32_t nScripts = (uint32_t)brr.get_var_int();
+   vector<BinaryDataRef> scripts(nScripts);
+   for(uint32_t i=0; i<nScripts; i++)
+      scripts[i] = brr.get_BinaryDataRef((uint32_t)brr.get_var_int());
+
+   uint32_t nStxoRmd = (uint32_t)brr.get_var_int();
    stxOutsRemovedByBlock_.clear();
    stxOutsRemovedByBlock_.resize(nStxoRmd);
 
+   BinaryWriter bwTxOut;
    for(uint32_t i=0; i<nStxoRmd; i++)
    {
       StoredTxOut & stxo = stxOutsRemovedByBlock_[i];
@@ -2294,29 +2350,53 @@ void StoredUndoData::unserializeDBValue(BinaryRefReader & brr)
       stxo.unserDbType_ = bitunpack.getBits(4);
       stxo.txVersion_   = bitunpack.getBits(2);
       stxo.isCoinbase_  = bitunpack.getBit();
+      bool sameTx       = bitunpack.getBit();
 
-      BinaryData hgtx   = brr.get_BinaryData(4);
-      stxo.blockHeight_ = DBUtils.hgtxToHeight(hgtx);
-      stxo.duplicateID_ = DBUtils.hgtxToDupID(hgtx);
-      stxo.txIndex_     = brr.get_uint16_t(BIGENDIAN);
-      stxo.txOutIndex_  = brr.get_uint16_t(BIGENDIAN);
-
-      // This is the raw OutPoint of the removed TxOut.  May not strictly
-      // be necessary for processing undo ops in this DB (but might be), 
-      // but may be useful for giving to peers if needed w/o exta lookups
-      brr.get_BinaryData(stxo.parentHash_, 32);
-      stxo.txOutIndex_ = brr.get_uint32_t();
-   
-      // Then read the raw TxOut itself
-      stxo.unserialize(brr);
+      if(sameTx && i>0)
+      {
+         StoredTxOut const & prev = stxOutsRemovedByBlock_[i-1];
+         stxo.blockHeight_ = prev.blockHeight_;
+         stxo.duplicateID_ = prev.duplicateID_;
+         stxo.txIndex_     = prev.txIndex_;
+         stxo.parentHash_  = prev.parentHash_;
+      }
+      else
+      {
+         BinaryData hgtx   = brr.get_BinaryData(4);
+         stxo.blockHeight_ = DBUtils.hgtxToHeight(hgtx);
+         stxo.duplicateID_ = DBUtils.hgtxToDupID(hgtx);
+         stxo.txIndex_     = brr.get_uint16_t(BIGENDIAN);
+         brr.get_BinaryData(stxo.parentHash_, 32);
+      }
+      stxo.txOutIndex_ = (uint16_t)brr.get_var_int();
+
+      // Put the raw TxOut back together from its value and script
+      uint64_t value     = brr.get_uint64_t();
+      uint32_t scriptIdx = (uint32_t)brr.get_var_int();
+      if(scriptIdx >= nScripts)
+      {
+         LOGERR << "Undo data refers to a script it doesn't have";
+         stxOutsRemovedByBlock_.resize(i);
+         break;
+      }
+
+      bwTxOut.reset();
+      bwTxOut.put_uint64_t(value);
+      bwTxOut.put_var_int(scripts[scriptIdx].getSize());
+      bwTxOut.put_BinaryData(scripts[scriptIdx]);
+      stxo.unserialize(bwTxOut.getDataRef());
    }
 
-   uint32_t nOpAdded = brr.get_uint32_t();
+   uint32_t nRuns = (uint32_t)brr.get_var_int();
    outPointsAddedByBlock_.clear();
-   outPointsAddedByBlock_.resize(nStxoRmd);
-   for(uint32_t i=0; i<nOpAdded; i++)
-      outPointsAddedByBlock_[i].unserialize(brr);
-    
+   for(uint32_t i=0; i<nRuns; i++)
+   {
+      BinaryData txHash    = brr.get_BinaryData(32);
+      uint32_t firstIdx    = (uint32_t)brr.get_var_int();
+      uint32_t count       = (uint32_t)brr.get_var_int();
+      for(uint32_t j=0; j<count; j++)
+         outPointsAddedByBlock_.push_back(OutPoint(txHash, firstIdx+j));
+   }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -2327,48 +2407,100 @@ void StoredUndoData::serializeDBValue(BinaryWriter & bw ) const
    uint32_t nStxoRmd = stxOutsRemovedByBlock_.size();
    uint32_t nOpAdded = outPointsAddedByBlock_.size();
 
-
    // Store the full TxOuts that were removed... since they will have been
-   // removed from the DB and have to be fully added again if we undo the block
-   bw.put_uint32_t(nStxoRmd);
+   // removed from the DB and have to be fully added again if we undo the block.
+   // Lots of them pay to the same few scripts, each one is written only once.
+   map<BinaryDataRef, uint32_t> scriptIndex;
+   vector<BinaryDataRef> scripts;
+   vector<uint32_t> stxoScript(nStxoRmd);
    for(uint32_t i=0; i<nStxoRmd; i++)
    {
       StoredTxOut const & stxo = stxOutsRemovedByBlock_[i];
-
-      if(stxo.parentHash_.getSize() == 0          || 
+      if(stxo.parentHash_.getSize() != 32         || 
          stxo.txOutIndex_           == UINT16_MAX   )
       {
          LOGERR << "Can't write undo data w/o parent hash and/or TxOut index";
          return;
       }
 
+      BinaryDataRef script = stxo.getScriptRef();
+      pair<map<BinaryDataRef, uint32_t>::iterator, bool> ins = 
+               scriptIndex.insert(make_pair(script, (uint32_t)scripts.size()));
+      if(ins.second)
+         scripts.push_back(script);
+      stxoScript[i] = ins.first->second;
+   }
+
+   bw.put_var_int(scripts.size());
+   for(uint32_t i=0; i<scripts.size(); i++)
+   {
+      bw.put_var_int(scripts[i].getSize());
+      bw.put_BinaryData(scripts[i]);
+   }
+
+   bw.put_var_int(nStxoRmd);
+   for(uint32_t i=0; i<nStxoRmd; i++)
+   {
+      StoredTxOut const & stxo = stxOutsRemovedByBlock_[i];
+      bool sameTx = (i>0 && 
+                     stxo.parentHash_ == stxOutsRemovedByBlock_[i-1].parentHash_);
+
       // Store the standard flags that go with StoredTxOuts, minus spentness
       BitPacker<uint8_t> bitpack;
       bitpack.putBits( (uint8_t)DBUtils.getArmoryDbType(),  4);
       bitpack.putBits( (uint8_t)stxo.txVersion_,            2);
       bitpack.putBit(           stxo.isCoinbase_);
-
+      bitpack.putBit(           sameTx);
       bw.put_BitPacker(bitpack);
 
-      // Put the blkdata key directly into the DB to save us a lookup 
-      bw.put_BinaryData( DBUtils.getBlkDataKeyNoPrefix( stxo.blockHeight_,
-                                                        stxo.duplicateID_,
-                                                        stxo.txIndex_,
-                                                        stxo.txOutIndex_));
+      // Put the blkdata key of the tx directly into the DB to save us a 
+      // lookup, and the parent hash to rebuild the OutPoint
+      if(!sameTx)
+      {
+         bw.put_BinaryData( DBUtils.getBlkDataKeyNoPrefix( stxo.blockHeight_,
+                                                           stxo.duplicateID_,
+                                                           stxo.txIndex_));
+         bw.put_BinaryData(stxo.parentHash_);
+      }
 
-      bw.put_BinaryData(stxo.parentHash_);
-      bw.put_uint32_t((uint32_t)stxo.txOutIndex_);
-      bw.put_BinaryData(stxo.getSerializedTxOut());
+      bw.put_var_int(stxo.txOutIndex_);
+      bw.put_uint64_t(stxo.getValue());
+      bw.put_var_int(stxoScript[i]);
    }
 
-   // Store just the OutPoints of the TxOuts that were added by this block.
-   // If we're undoing this block, we have the full TxOuts already in the DB
-   // under the block key with same hgt & dup.   We could probably avoid 
-   // storing this data at all due to this DB design, but it is needed if we
-   // are ever going to serve any other process that expects the OutPoint list.
-   bw.put_uint32_t(nOpAdded);
+   // Just the OutPoints of the TxOuts that were added by this block, one
+   // entry per run of consecutive indices.  If we're undoing this block, we
+   // have the full TxOuts already in the DB under the block key with same 
+   // hgt & dup.  We could probably avoid storing this data at all due to this
+   // DB design, but it is needed if we are ever going to serve any other
+   // process that expects the OutPoint list.
+   uint32_t nRuns = 0;
    for(uint32_t i=0; i<nOpAdded; i++)
-      bw.put_BinaryData(outPointsAddedByBlock_[i].serialize()); 
+      if(i==0 || !continuesRun(outPointsAddedByBlock_[i-1], 
+                               outPointsAddedByBlock_[i]))
+         nRuns++;
+
+   bw.put_var_int(nRuns);
+   for(uint32_t i=0; i<nOpAdded; )
+   {
+      uint32_t runEnd = i+1;
+      while(runEnd < nOpAdded && 
+            continuesRun(outPointsAddedByBlock_[runEnd-1], 
+                         outPointsAddedByBlock_[runEnd]))
+         runEnd++;
+
+      bw.put_BinaryData(outPointsAddedByBlock_[i].getTxHashRef());
+      bw.put_var_int(outPointsAddedByBlock_[i].getTxOutIndex());
+      bw.put_var_int(runEnd - i);
+      i = runEnd;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool StoredUndoData::continuesRun(OutPoint const & prev, OutPoint const & op)
+{
+   return op.getTxOutIndex() == prev.getTxOutIndex()+1 && 
+          op.getTxHashRef()  == prev.getTxHashRef();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -2716,7 +2848,9 @@ string GlobalDBUtilities::getPrefixName(DB_PREFIX pref)
       case DB_PREFIX_TXDATA:    return string("TXDATA"); 
       case DB_PREFIX_SCRIPT:    return string("SCRIPT"); 
       case DB_PREFIX_TXHINTS:   return string("TXHINTS"); 
-      case DB_PREFIX_TRIENODES: return string("TRIENODES"); 
+      case DB_PREFIX_TRIENODES: return string("TRIENODES");
+      case DB_PREFIX_TXHASHIDX: return string("TXHASHIDX"); 
+      case DB_PREFIX_UTXO:      return string("UTXO");
       case DB_PREFIX_HEADHASH:  return string("HEADHASH"); 
       case DB_PREFIX_HEADHGT:   return string("HEADHGT"); 
       case DB_PREFIX_UNDODATA:  return string("UNDODATA"); 
@@ -37,6 +37,8 @@ enum DB_PREFIX
   DB_PREFIX_SCRIPT,
   DB_PREFIX_UNDODATA,
   DB_PREFIX_TRIENODES,
+  DB_PREFIX_TXHASHIDX,
+  DB_PREFIX_UTXO,
   DB_PREFIX_COUNT
 };
 
@@ -479,6 +481,11 @@ public:
    BinaryData   serializeDBValue(bool forceSaveSpent=false) const;
    void       unserializeDBKey(BinaryDataRef key);
 
+   // UTXO entry:  the 8-byte DB key (no prefix), then the DB value.  Doesn't
+   // hold the parent hash, that's in the UTXO key (the OutPoint).
+   void       unserializeUtxoValue(BinaryDataRef val);
+   void         serializeUtxoValue(BinaryWriter & bw) const;
+
    BinaryData getDBKey(bool withPrefix=true) const;
    BinaryData getDBKeyOfParentTx(bool withPrefix=true) const;
    BinaryData getHgtX(void) const {return getDBKey(false).getSliceCopy(0,4);}
@@ -577,13 +584,13 @@ public:
                        bool withMultisig=false);
 
    // This adds the TxOut if it doesn't exist yet
-   uint64_t   markTxOutUnspent(BinaryData txOutKey8B, 
+   uint64_t   markTxOutUnspent(BinaryData const & txOutKey8B, 
                                uint64_t   value=UINT64_MAX,
                                bool       isCoinbase=false,
                                bool       isMultisigRef=false);
 
-   uint64_t   markTxOutSpent(BinaryData txOutKey8B, 
-                             BinaryData  txInKey8B);
+   uint64_t   markTxOutSpent(BinaryData const & txOutKey8B, 
+                             BinaryData const & txInKey8B);
 
    BinaryData     uniqueKey_;  // includes the prefix byte!
    uint32_t       version_;
@@ -641,13 +648,13 @@ public:
 
    
    // This adds the TxOut if it doesn't exist yet
-   uint64_t   markTxOutUnspent(BinaryData txOutKey8B, 
+   uint64_t   markTxOutUnspent(BinaryData const & txOutKey8B, 
                                uint64_t   value=UINT64_MAX,
                                bool       isCoinbase=false,
                                bool       isMultisigRef=false);
 
-   uint64_t   markTxOutSpent(BinaryData txOutKey8B, 
-                             BinaryData  txInKey8B);
+   uint64_t   markTxOutSpent(BinaryData const & txOutKey8B, 
+                             BinaryData const & txInKey8B);
                               
 
    uint64_t getSubHistoryBalance(bool withMultisig=false);
@@ -663,10 +670,24 @@ public:
 };
 
 ////////////////////////////////////////////////////////////////////////////////
-// TODO:  it turns out that outPointsAddedByBlock_ is not "right."  If a Tx has
-//        20 txOuts, there's no reason to write 36 * 20 = 720 bytes when you 
-//        can just as easily write the header once, and the numTxOut and create
-//        the OutPoints yourself.  Will fix this later.
+// Only written when pruning (DB_PRUNE_ALL), where the spent TxOuts are gone
+// from TXDATA and this is the only place left to get them back from.
+//
+// The DB value is compact, it's written for every block:
+//
+//    blockHash_ (32)
+//    var_int #scripts, then each distinct script of the removed TxOuts once,
+//       as var_int size + script
+//    var_int #removed TxOuts, then for each:
+//       flags (1):  dbType(4), txVersion(2), isCoinbase(1), sameTx(1)
+//       if !sameTx, the 6-byte hgt/dup/txIdx key and parent tx hash (32)
+//       var_int txOutIndex, value (8), var_int index in the script list
+//    var_int #runs of added OutPoints, then for each:
+//       tx hash (32), var_int first TxOut index, var_int count
+//
+// sameTx means same parent tx as the previous TxOut in the list.  Added
+// OutPoints are stored as one entry per run of consecutive TxOut indices
+// of one tx, which is a single entry per tx for the ones a block creates.
 class StoredUndoData
 {
 public:
@@ -689,6 +710,10 @@ public:
 
    vector<StoredTxOut>  stxOutsRemovedByBlock_;
    vector<OutPoint>     outPointsAddedByBlock_;
+
+private:
+   // Whether op is the OutPoint right after prev in the same tx
+   static bool continuesRun(OutPoint const & prev, OutPoint const & op);
 };
 
 
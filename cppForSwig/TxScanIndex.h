@@ -0,0 +1,115 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// TxScanIndex
+//
+// Hash indexes BtcWallet::scanTx probes with pointers straight into the raw
+// tx.  The wallet keeps its TxIOPairs in a map<OutPoint, TxIOPair> and its
+// addresses in a map<BinaryData, ScrAddrObj>, which is what everything else
+// reads.  Looking a TxIn up in there means building an OutPoint (its hash on
+// the heap) and comparing BinaryData keys all the way down the tree, for
+// every TxIn of every tx scanned.
+//
+// Here the keys are fixed-size byte arrays, copied onto the stack from the
+// tx bytes:  the 36-byte serialized outpoint (tx hash + LE index, exactly
+// what a TxIn starts with), and the 21-byte scrAddr.  Both are hashes
+// already, so the first 8 bytes are used as is.
+//
+// Values point into the wallet's maps, std::map nodes don't move.  An
+// outpoint also points at the ScrAddrObj its TxOut pays to, so spending it
+// doesn't need the TxOut back from the DB to find out whose it was.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _TXSCANINDEX_H_
+#define _TXSCANINDEX_H_
+
+#include <unordered_map>
+#include "BinaryData.h"
+#include "ScrAddrMatcher.h"
+
+#define OUTPOINT_KEY_LEN  36
+
+using namespace std;
+
+class TxIOPair;
+class ScrAddrObj;
+
+////////////////////////////////////////////////////////////////////////////////
+template<uint32_t LEN>
+struct FixedKey
+{
+   FixedKey(void) { memset(bytes_, 0, LEN); }
+   explicit FixedKey(uint8_t const * ptr) { memcpy(bytes_, ptr, LEN); }
+
+   bool operator==(FixedKey<LEN> const & rhs) const
+                     { return memcmp(bytes_, rhs.bytes_, LEN) == 0; }
+
+   uint8_t bytes_[LEN];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+struct OutPointKey : public FixedKey<OUTPOINT_KEY_LEN>
+{
+   OutPointKey(void) {}
+
+   // Points at a serialized outpoint, i.e. the start of a TxIn
+   explicit OutPointKey(uint8_t const * ptr) :
+      FixedKey<OUTPOINT_KEY_LEN>(ptr) {}
+
+   OutPointKey(uint8_t const * txHash, uint32_t txOutIndex)
+   {
+      memcpy(bytes_, txHash, 32);
+      bytes_[32] = (uint8_t)( txOutIndex        & 0xff);
+      bytes_[33] = (uint8_t)((txOutIndex >>  8) & 0xff);
+      bytes_[34] = (uint8_t)((txOutIndex >> 16) & 0xff);
+      bytes_[35] = (uint8_t)((txOutIndex >> 24) & 0xff);
+   }
+};
+
+struct OutPointKeyHash
+{
+   size_t operator()(OutPointKey const & key) const
+   {
+      uint64_t h;
+      memcpy(&h, key.bytes_, 8);
+
+      // All the outputs of a tx share the hash bytes, mix the index in
+      uint64_t idx = READ_UINT32_LE(key.bytes_ + 32);
+      return (size_t)(h ^ (idx * 0x9E3779B97F4A7C15ULL));
+   }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+typedef FixedKey<SCRADDR_MATCH_KEY_LEN> ScrAddrKey;
+
+struct ScrAddrKeyHash
+{
+   // Skips the prefix byte
+   size_t operator()(ScrAddrKey const & key) const
+   {
+      uint64_t h;
+      memcpy(&h, key.bytes_ + 1, 8);
+      return (size_t)h;
+   }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+struct TxIORef
+{
+   TxIORef(TxIOPair* txio=NULL, ScrAddrObj* scrAddr=NULL) :
+      txio_(txio), scrAddr_(scrAddr) {}
+
+   TxIOPair*    txio_;
+   ScrAddrObj*  scrAddr_;
+};
+
+typedef unordered_map<OutPointKey, TxIORef, OutPointKeyHash>     TxIOIndex;
+typedef unordered_map<ScrAddrKey, ScrAddrObj*, ScrAddrKeyHash>  ScrAddrIndex;
+
+#endif
+// kate: indent-width 3; replace-tabs on;
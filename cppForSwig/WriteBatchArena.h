@@ -0,0 +1,240 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// WriteBatchArena
+//
+// The pending StoredTx and StoredScriptHistory objects in BlockWriteBatcher.
+// Those used to be map<BinaryData, T>, so filling a 96 MB batch built a tree
+// node and a heap key for every tx and scrAddr touched, and commit() freed
+// them all again, only for the next batch to allocate the same thing.
+//
+// Here the records are packed in fixed-size chunks with an open-addressing
+// index on the key, same layout as HeaderStore.  reset() forgets the whole
+// batch in one step (the index is zeroed, the record count goes back to 0),
+// but the chunks and records stay allocated:  the next batch overwrites them
+// in place, reusing the key buffers and whatever capacity the T members had.
+//
+// A T* stays valid until the next reset().  erase() only flags the record,
+// the slot isn't reused before reset().  Iterate with numSlots(), isLive(),
+// keyAt() and valueAt(), in insertion order.
+//
+// Keys are hashed on their first and last 4 bytes:  tx hashes are uniform
+// everywhere, scrAddrs (prefix + hash160, or a multisig key ending in one)
+// are uniform at the end, and OutPoints (tx hash + TxOut index) at the start.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _WRITEBATCHARENA_H_
+#define _WRITEBATCHARENA_H_
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include "BinaryData.h"
+
+#define WRITE_BATCH_RECORDS_PER_CHUNK   1024
+#define WRITE_BATCH_INDEX_MIN_SIZE      1024
+
+using namespace std;
+
+template<typename T>
+class WriteBatchArena
+{
+public:
+   WriteBatchArena(void) :
+      numRecords_(0),
+      numAllocated_(0),
+      numLive_(0),
+      index_(WRITE_BATCH_INDEX_MIN_SIZE, 0)
+   {
+   }
+
+   // NULL if the key isn't in this batch (or was erased)
+   T* find(BinaryDataRef key)
+   {
+      uint32_t pos = findIndexPos(key);
+      if(index_[pos] == 0)
+         return NULL;
+
+      Record & rec = record(index_[pos]-1);
+      return rec.live_ ? &rec.value_ : NULL;
+   }
+
+   bool contains(BinaryDataRef key) { return find(key) != NULL; }
+
+   // Same as map::operator[]:  returns the value for this key, adding a
+   // default-constructed one if it is not there yet.  Recycled records are
+   // reset, so nothing from the previous batch leaks into the new value.
+   T& getOrCreate(BinaryDataRef key)
+   {
+      Record & rec = findOrAddRecord(key);
+      if(!rec.live_)
+      {
+         rec.value_ = T();
+         rec.live_  = true;
+         numLive_++;
+      }
+      return rec.value_;
+   }
+
+   // Same as map[key] = val, copying over the recycled record directly
+   T& set(BinaryDataRef key, T const & val)
+   {
+      Record & rec = findOrAddRecord(key);
+      rec.value_ = val;
+      if(!rec.live_)
+      {
+         rec.live_ = true;
+         numLive_++;
+      }
+      return rec.value_;
+   }
+
+   void erase(BinaryDataRef key)
+   {
+      uint32_t pos = findIndexPos(key);
+      if(index_[pos] == 0)
+         return;
+
+      Record & rec = record(index_[pos]-1);
+      if(rec.live_)
+      {
+         rec.live_ = false;
+         numLive_--;
+      }
+   }
+
+   // Forget everything in the batch, keeping the memory for the next one
+   void reset(void)
+   {
+      for(uint32_t slot=0; slot<numRecords_; slot++)
+         record(slot).live_ = false;
+      numRecords_ = 0;
+      numLive_    = 0;
+      fill(index_.begin(), index_.end(), 0);
+   }
+
+   uint32_t            numSlots(void) const        { return numRecords_; }
+   bool                isLive(uint32_t slot)       { return record(slot).live_; }
+   BinaryData const &  keyAt(uint32_t slot)        { return record(slot).key_; }
+   T &                 valueAt(uint32_t slot)      { return record(slot).value_; }
+
+   uint32_t size(void) const  { return numLive_; }
+   bool     empty(void) const { return numLive_==0; }
+
+private:
+   struct Record
+   {
+      Record(void) : live_(false) {}
+
+      BinaryData key_;
+      T          value_;
+      bool       live_;
+   };
+
+   // Not copyable:  callers hold raw pointers into the chunks
+   WriteBatchArena(WriteBatchArena const &);
+   WriteBatchArena & operator=(WriteBatchArena const &);
+
+   Record & record(uint32_t slot)
+      { return chunks_[slot/WRITE_BATCH_RECORDS_PER_CHUNK][slot%WRITE_BATCH_RECORDS_PER_CHUNK]; }
+
+   static uint32_t startPos(BinaryDataRef key, uint32_t mask)
+   {
+      uint32_t h = key.getSize();
+      if(key.getSize() >= 4)
+      {
+         uint32_t first;
+         memcpy(&h, key.getPtr() + key.getSize() - 4, 4);
+         memcpy(&first, key.getPtr(), 4);
+         h ^= first;
+      }
+      else
+         for(uint32_t i=0; i<key.getSize(); i++)
+            h = (h << 8) | key[i];
+      return h & mask;
+   }
+
+   // Returns the index position holding this key, or the empty position
+   // where it would go
+   uint32_t findIndexPos(BinaryDataRef key)
+   {
+      uint32_t mask = (uint32_t)index_.size() - 1;
+      uint32_t pos  = startPos(key, mask);
+      while(index_[pos] != 0)
+      {
+         if(record(index_[pos]-1).key_ == key)
+            break;
+         pos = (pos+1) & mask;
+      }
+      return pos;
+   }
+
+   // Erased records keep their index entry, so an erased key comes back
+   // in the same record
+   Record & findOrAddRecord(BinaryDataRef key)
+   {
+      uint32_t pos = findIndexPos(key);
+      if(index_[pos] != 0)
+         return record(index_[pos]-1);
+
+      // Reuse a record left over from a previous batch if there is one
+      if(numRecords_ == numAllocated_)
+      {
+         if(numAllocated_ % WRITE_BATCH_RECORDS_PER_CHUNK == 0)
+         {
+            chunks_.push_back(vector<Record>());
+            chunks_.back().reserve(WRITE_BATCH_RECORDS_PER_CHUNK);
+         }
+         chunks_.back().push_back(Record());
+         numAllocated_++;
+      }
+
+      Record & rec = record(numRecords_);
+      rec.key_.copyFrom(key);
+      numRecords_++;
+
+      // Keep the load factor at or below one half
+      if(2*numRecords_ > index_.size())
+      {
+         rebuildIndex(2*(uint32_t)index_.size());
+         pos = findIndexPos(key);
+      }
+      index_[pos] = numRecords_;
+      return rec;
+   }
+
+   void rebuildIndex(uint32_t newIndexSize)
+   {
+      index_.assign(newIndexSize, 0);
+      uint32_t mask = newIndexSize - 1;
+
+      // The record just added is not indexed yet, the caller does it
+      for(uint32_t slot=0; slot+1<numRecords_; slot++)
+      {
+         uint32_t pos = startPos(record(slot).key_, mask);
+         while(index_[pos] != 0)
+            pos = (pos+1) & mask;
+         index_[pos] = slot+1;
+      }
+   }
+
+   // Each chunk is reserved to WRITE_BATCH_RECORDS_PER_CHUNK up front and
+   // never grows past it, so the records never move.  numAllocated_ counts
+   // every record ever created, numRecords_ the ones used by this batch.
+   vector< vector<Record> >  chunks_;
+   uint32_t                  numRecords_;
+   uint32_t                  numAllocated_;
+   uint32_t                  numLive_;
+
+   // Slot+1 for each used entry, 0 is empty.  Linear probing, the size is
+   // a power of two and kept at least twice the number of records.
+   vector<uint32_t>          index_;
+};
+
+#endif
+// kate: indent-width 3; replace-tabs on;
@@ -0,0 +1,287 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "ZeroConfPool.h"
+#include "BtcUtils.h"
+
+////////////////////////////////////////////////////////////////////////////////
+ZeroConfPool::ZeroConfPool(void) :
+   nextSeq_(0),
+   totalBytes_(0),
+   maxBytes_(ZC_POOL_MAX_BYTES)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void ZeroConfPool::clear(void)
+{
+   txMap_.clear();
+   arrivalOrder_.clear();
+   byFeeRate_.clear();
+   spentBy_.clear();
+   nextSeq_    = 0;
+   totalBytes_ = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BinaryData ZeroConfPool::getOutPointKey(BinaryDataRef txHash, uint32_t txOutIndex)
+{
+   BinaryWriter bw(36);
+   bw.put_BinaryData(txHash);
+   bw.put_uint32_t(txOutIndex);
+   return bw.getData();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool ZeroConfPool::contains(BinaryDataRef txHash) const
+{
+   return txMap_.find(txHash) != txMap_.end();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+ZeroConfData const * ZeroConfPool::find(BinaryDataRef txHash) const
+{
+   TxMap::const_iterator iter = txMap_.find(txHash);
+   return (iter == txMap_.end() ? NULL : &iter->second);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+ZeroConfData * ZeroConfPool::find(BinaryDataRef txHash)
+{
+   TxMap::iterator iter = txMap_.find(txHash);
+   return (iter == txMap_.end() ? NULL : &iter->second);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+HashString const * ZeroConfPool::findSpender(BinaryDataRef outPoint) const
+{
+   map<BinaryData, HashString>::const_iterator iter = spentBy_.find(outPoint);
+   return (iter == spentBy_.end() ? NULL : &iter->second);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool ZeroConfPool::add(HashString const & txHash,
+                       Tx const &         tx,
+                       uint32_t           txtime,
+                       uint64_t           fee,
+                       vector<HashString> & evicted)
+{
+   if(!tx.isInitialized() || contains(txHash))
+      return false;
+
+   // First seen wins
+   for(uint32_t i=0; i<tx.getNumTxIn(); i++)
+   {
+      BinaryDataRef outPoint(tx.getPtr() + tx.getTxInOffset(i), 36);
+      if(findSpender(outPoint) != NULL)
+         return false;
+   }
+
+   uint64_t feeRate = 0;
+   if(fee != ZC_FEE_UNKNOWN)
+      feeRate = fee * 1000 / tx.getSize();
+
+   if(!makeRoomFor(tx, feeRate, evicted))
+      return false;
+
+   ZeroConfData & zc = txMap_[txHash];
+   zc.txobj_   = tx;
+   zc.txtime_  = txtime;
+   zc.seq_     = nextSeq_++;
+   zc.fee_     = fee;
+   zc.feeRate_ = feeRate;
+
+   arrivalOrder_[zc.seq_] = txHash;
+   byFeeRate_.insert(make_pair(feeRate, zc.seq_));
+   for(uint32_t i=0; i<tx.getNumTxIn(); i++)
+   {
+      BinaryDataRef outPoint(tx.getPtr() + tx.getTxInOffset(i), 36);
+      spentBy_[outPoint] = txHash;
+   }
+
+   totalBytes_ += tx.getSize();
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Picks all the victims before evicting anything, so that a tx we end up
+// rejecting doesn't cost anyone their place
+bool ZeroConfPool::makeRoomFor(Tx const & tx,
+                               uint64_t feeRate,
+                               vector<HashString> & evicted)
+{
+   uint64_t txSize = tx.getSize();
+   if(txSize > maxBytes_)
+      return false;
+
+   if(totalBytes_ + txSize <= maxBytes_)
+      return true;
+
+   // Never evict what the new tx depends on
+   set<HashString> ancestors;
+   vector<Tx const *> parentsToVisit(1, &tx);
+   while(!parentsToVisit.empty())
+   {
+      Tx const * txptr = parentsToVisit.back();
+      parentsToVisit.pop_back();
+      for(uint32_t i=0; i<txptr->getNumTxIn(); i++)
+      {
+         HashString parent(txptr->getPtr() + txptr->getTxInOffset(i), 32);
+         TxMap::const_iterator pIter = txMap_.find(parent);
+         if(pIter != txMap_.end() && ancestors.insert(parent).second)
+            parentsToVisit.push_back(&pIter->second.txobj_);
+      }
+   }
+
+   // Each victim takes its descendants along, count those too
+   set<HashString> victims;
+   vector<HashString> toVisit;
+   uint64_t freed = 0;
+   set< pair<uint64_t, uint64_t> >::const_iterator iter;
+   for(iter  = byFeeRate_.begin();
+       iter != byFeeRate_.end() && totalBytes_ + txSize - freed > maxBytes_;
+       iter++)
+   {
+      if(iter->first >= feeRate)
+         return false;
+
+      HashString const & txHash = arrivalOrder_[iter->second];
+      if(ancestors.count(txHash) > 0 || victims.count(txHash) > 0)
+         continue;
+
+      toVisit.push_back(txHash);
+      while(!toVisit.empty())
+      {
+         HashString victim = toVisit.back();
+         toVisit.pop_back();
+         if(!victims.insert(victim).second)
+            continue;
+
+         Tx const & vtx = txMap_[victim].txobj_;
+         freed += vtx.getSize();
+         for(uint32_t i=0; i<vtx.getNumTxOut(); i++)
+         {
+            HashString const * child = findSpender(getOutPointKey(victim, i));
+            if(child != NULL)
+               toVisit.push_back(*child);
+         }
+      }
+   }
+
+   if(totalBytes_ + txSize - freed > maxBytes_)
+      return false;
+
+   set<HashString>::const_iterator vIter;
+   for(vIter = victims.begin(); vIter != victims.end(); vIter++)
+      remove(*vIter, true, evicted);
+
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool ZeroConfPool::remove(BinaryDataRef txHash,
+                          bool withDescendants,
+                          vector<HashString> & removed)
+{
+   TxMap::iterator iter = txMap_.find(txHash);
+   if(iter == txMap_.end())
+      return false;
+
+   removeEntry(iter, withDescendants, removed);
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void ZeroConfPool::removeEntry(TxMap::iterator iter,
+                               bool withDescendants,
+                               vector<HashString> & removed)
+{
+   // By hash:  a descendant can be reached more than once
+   vector<HashString> toRemove(1, iter->first);
+   while(!toRemove.empty())
+   {
+      HashString txHash = toRemove.back();
+      toRemove.pop_back();
+
+      TxMap::iterator rmIter = txMap_.find(txHash);
+      if(rmIter == txMap_.end())
+         continue;
+
+      ZeroConfData & zc = rmIter->second;
+      Tx const & tx = zc.txobj_;
+
+      if(withDescendants)
+      {
+         for(uint32_t i=0; i<tx.getNumTxOut(); i++)
+         {
+            HashString const * child = findSpender(getOutPointKey(txHash, i));
+            if(child != NULL)
+               toRemove.push_back(*child);
+         }
+      }
+
+      for(uint32_t i=0; i<tx.getNumTxIn(); i++)
+      {
+         BinaryData outPoint(tx.getPtr() + tx.getTxInOffset(i), 36);
+         map<BinaryData, HashString>::iterator spIter = spentBy_.find(outPoint);
+         if(spIter != spentBy_.end() && spIter->second == txHash)
+            spentBy_.erase(spIter);
+      }
+
+      byFeeRate_.erase(make_pair(zc.feeRate_, zc.seq_));
+      arrivalOrder_.erase(zc.seq_);
+      totalBytes_ -= tx.getSize();
+      txMap_.erase(rmIter);
+      removed.push_back(txHash);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Only the block's txs are looked at, the pool is never walked.  The block
+// was already parsed once to get here, so it is well-formed.
+void ZeroConfPool::removeForBlock(BinaryDataRef rawBlock,
+                                  vector<HashString> & removed)
+{
+   if(txMap_.empty() || rawBlock.getSize() <= HEADER_SIZE)
+      return;
+
+   BinaryRefReader brr(rawBlock);
+   brr.advance(HEADER_SIZE);
+   uint32_t nTx = (uint32_t)brr.get_var_int();
+
+   vector<uint32_t> offsetsIn;
+   for(uint32_t t=0; t<nTx && !txMap_.empty(); t++)
+   {
+      uint8_t const * txPtr = brr.getCurrPtr();
+      uint32_t txSize = BtcUtils::TxCalcLength(txPtr,
+                                               brr.getSizeRemaining(),
+                                               &offsetsIn);
+      brr.advance(txSize);
+
+      // Mined:  whatever spends it is still good
+      HashString txHash = BtcUtils::getHash256(txPtr, txSize);
+      TxMap::iterator iter = txMap_.find(txHash);
+      if(iter != txMap_.end())
+      {
+         removeEntry(iter, false, removed);
+         continue;
+      }
+
+      // Double-spent by the block, neither it nor its descendants will ever
+      // make it into the chain now
+      for(uint32_t i=0; i<offsetsIn.size()-1; i++)
+      {
+         HashString const * spender =
+            findSpender(BinaryDataRef(txPtr + offsetsIn[i], 36));
+         if(spender != NULL)
+            remove(*spender, true, removed);
+      }
+   }
+}
+
+// kate: indent-width 3; replace-tabs on;
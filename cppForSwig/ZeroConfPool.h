@@ -0,0 +1,128 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2014, Armory Technologies, Inc.                        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// ZeroConfPool
+//
+// The zero-conf txs the BDM knows about.  This used to be a list of raw txs
+// plus a map by hash, and the only way to find the ones a new block got rid
+// of was a DB lookup for every one of them.  This keeps an index of the
+// outpoints the pool txs spend, so for a new block we only look at the
+// block's own txs:  the ones in the pool are mined, and any other pool tx
+// spending one of their inputs is a double-spend that can never confirm.
+// The index also rejects a new zero-conf tx that double-spends one we
+// already have (first seen wins, same as bitcoind).
+//
+// The pool is bounded by the total size of its txs.  When a new tx doesn't
+// fit, txs with a lower fee rate are evicted, lowest first (then oldest
+// first).  If that isn't enough, the new tx is rejected.  Txs whose fee is
+// unknown (an input we can't find) have a fee rate of 0.  Whatever spends an
+// evicted or double-spent tx goes with it.
+//
+// Txs are kept in arrival order, so a child is always after its parent.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _ZEROCONFPOOL_H_
+#define _ZEROCONFPOOL_H_
+
+#include <map>
+#include <set>
+#include <vector>
+#include "BinaryData.h"
+#include "BlockObj.h"
+
+#define ZC_POOL_MAX_BYTES  (64*1024*1024)
+#define ZC_FEE_UNKNOWN     UINT64_MAX
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////
+struct ZeroConfData
+{
+   ZeroConfData(void) : txtime_(0), seq_(0), fee_(0), feeRate_(0) {}
+
+   Tx            txobj_;
+   uint32_t      txtime_;
+   uint64_t      seq_;        // arrival order
+   uint64_t      fee_;        // ZC_FEE_UNKNOWN if an input wasn't found
+   uint64_t      feeRate_;    // satoshis per kB, 0 if the fee is unknown
+};
+
+////////////////////////////////////////////////////////////////////////////////
+class ZeroConfPool
+{
+public:
+   // Arrival order, ->second is the tx hash
+   typedef map<uint64_t, HashString>::const_iterator const_iterator;
+
+   ZeroConfPool(void);
+
+   void     clear(void);
+   void     setMaxBytes(uint64_t maxBytes) { maxBytes_ = maxBytes; }
+   uint64_t getMaxBytes(void) const        { return maxBytes_; }
+   uint64_t getTotalBytes(void) const      { return totalBytes_; }
+   uint32_t size(void) const               { return (uint32_t)txMap_.size(); }
+
+   const_iterator begin(void) const { return arrivalOrder_.begin(); }
+   const_iterator end(void) const   { return arrivalOrder_.end(); }
+
+   bool                 contains(BinaryDataRef txHash) const;
+   ZeroConfData const * find(BinaryDataRef txHash) const;
+
+   // The scan functions take a Tx &.  Don't change anything through this.
+   ZeroConfData *       find(BinaryDataRef txHash);
+
+   // The pool tx spending this outpoint (tx hash + TxOut index, 36 bytes),
+   // NULL if none
+   HashString const *   findSpender(BinaryDataRef outPoint) const;
+
+   // Returns false if the tx is already in the pool, double-spends a pool
+   // tx, or doesn't fit.  The txs evicted to make room go in evicted.
+   bool add(HashString const & txHash,
+            Tx const &         tx,
+            uint32_t           txtime,
+            uint64_t           fee,
+            vector<HashString> & evicted);
+
+   // Removes the tx, and everything spending it if withDescendants
+   bool remove(BinaryDataRef txHash,
+               bool withDescendants,
+               vector<HashString> & removed);
+
+   // Removes the txs in this block (the full raw block, header included),
+   // and the pool txs double-spending any of them
+   void removeForBlock(BinaryDataRef rawBlock, vector<HashString> & removed);
+
+private:
+   typedef map<HashString, ZeroConfData>  TxMap;
+
+   static BinaryData getOutPointKey(BinaryDataRef txHash, uint32_t txOutIndex);
+
+   void removeEntry(TxMap::iterator iter,
+                    bool withDescendants,
+                    vector<HashString> & removed);
+
+   bool makeRoomFor(Tx const & tx,
+                    uint64_t feeRate,
+                    vector<HashString> & evicted);
+
+   TxMap                             txMap_;
+   map<uint64_t, HashString>         arrivalOrder_;
+
+   // (fee rate, seq), lowest fee rate first
+   set< pair<uint64_t, uint64_t> >   byFeeRate_;
+
+   // OutPoint -> hash of the pool tx spending it
+   map<BinaryData, HashString>       spentBy_;
+
+   uint64_t                          nextSeq_;
+   uint64_t                          totalBytes_;
+   uint64_t                          maxBytes_;
+};
+
+#endif
+// kate: indent-width 3; replace-tabs on;
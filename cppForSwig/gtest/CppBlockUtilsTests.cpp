@@ -1,6 +1,8 @@
 #include <limits.h>
 #include <iostream>
 #include <stdlib.h>
+#include <thread>
+#include <atomic>
 #include "gtest.h"
 
 #include "../log.h"
@@ -15,6 +17,8 @@
 #ifdef _MSC_VER
    #include "win32_posix.h"
 	#undef close
+#else
+   #include <sys/resource.h>
 #endif
 
 #define READHEX BinaryData::CreateFromHex
@@ -1996,6 +2000,50 @@ TEST_F(BtcUtilsTest, BitsToDifficulty)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BtcUtilsTest, VerifyProofOfWork)
+{
+   EXPECT_TRUE(BtcUtils::verifyProofOfWork(rawHead_.getRef()));
+   EXPECT_TRUE(BtcUtils::verifyProofOfWork(rawHead_, headHashLE_));
+
+   // The hash must be compared little-endian
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(rawHead_, headHashBE_));
+
+   // Changing the nonce breaks the PoW
+   BinaryData badNonce = rawHead_;
+   badNonce[79] ^= 0x01;
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(badNonce.getRef()));
+
+   // Same hash against a target 256x smaller (b3936a19)
+   BinaryData harder = rawHead_;
+   harder[75] = 0x19;
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(harder, headHashLE_));
+
+   // Negative, zero and overflowing targets are never met
+   BinaryData negative = rawHead_;
+   negative[74] = 0xea;
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(negative, headHashLE_));
+
+   BinaryData zero = rawHead_;
+   zero.getPtr()[72] = zero.getPtr()[73] = zero.getPtr()[74] = 0;
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(zero, headHashLE_));
+
+   BinaryData overflow = rawHead_;
+   overflow[75] = 0x22;
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(overflow, headHashLE_));
+
+   // Min-difficulty target (ffff001d)
+   BinaryData hash(32);
+   memset(hash.getPtr(), 0, 32);
+   BinaryData minDiff = rawHead_;
+   minDiff[72] = 0xff; minDiff[73] = 0xff; minDiff[74] = 0x00; minDiff[75] = 0x1d;
+   hash[27] = 0xff; hash[26] = 0xff;
+   EXPECT_TRUE(BtcUtils::verifyProofOfWork(minDiff, hash));
+   hash[25] = 0x01;
+   EXPECT_FALSE(BtcUtils::verifyProofOfWork(minDiff, hash));
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(BtcUtilsTest, ScriptToOpCodes)
 {
@@ -3693,17 +3741,30 @@ TEST_F(StoredBlockObjTest, SUndoDataSer)
    sud.blockHeight_ = 123000; // unused for this test
    sud.duplicateID_ = 15;     // unused for this test
 
-   BinaryData flags = READHEX("34");
-   BinaryData str2  = WRITE_UINT32_LE(2);
-   BinaryData str5  = WRITE_UINT32_LE(5);
+   // Scripts are written once up front, the second TxOut is from the same
+   // tx as the first (the sameTx bit in its flags), and each added OutPoint
+   // is its own run since they're from different txs
+   BinaryData flags0 = READHEX("34");
+   BinaryData flags1 = READHEX("35");
+   BinaryData vi0    = READHEX("00");
+   BinaryData vi1    = READHEX("01");
+   BinaryData vi2    = READHEX("02");
+   BinaryData vi5    = READHEX("05");
+   uint32_t   scrSz0 = rawTxOut0_.getSize()-8;
+   uint32_t   scrSz1 = rawTxOut1_.getSize()-8;
    BinaryData answer = 
          arbHash + 
-            str2 + 
-               flags + stxo0.getDBKey(false) + arbHash + str5 + rawTxOut0_ +
-               flags + stxo1.getDBKey(false) + arbHash + str5 + rawTxOut1_ +
-            str2 +
-               op0.serialize() +
-               op1.serialize();
+            vi2 + 
+               rawTxOut0_.getSliceCopy(8, scrSz0) +
+               rawTxOut1_.getSliceCopy(8, scrSz1) +
+            vi2 + 
+               flags0 + stxo0.getDBKey(false).getSliceCopy(0,6) + arbHash + 
+                  vi5 + rawTxOut0_.getSliceCopy(0,8) + vi0 +
+               flags1 + 
+                  vi5 + rawTxOut1_.getSliceCopy(0,8) + vi1 +
+            vi2 +
+               op0_str + vi1 + vi1 +
+               op1_str + vi2 + vi1;
 
    EXPECT_EQ(sud.serializeDBValue(), answer);
 }
@@ -3725,26 +3786,14 @@ TEST_F(StoredBlockObjTest, SUndoDataUnser)
    OutPoint op0(op0_str, 1);
    OutPoint op1(op1_str, 2);
 
-   //BinaryData sudToUnser = READHEX( 
-      //"1111222111122211112222221111222211112221111222111122211112221111"
-      //"0200000024111122211112221111222222111122221111222111122211112221"
-      //"111222111105000000ac4c8bd5000000001976a9148dce8946f1c7763bb60ea5"
-      //"cf16ef514cbed0633b88ac241111222111122211112222221111222211112221"
-      //"11122211112221111222111105000000002f6859000000001976a9146a59ac0e"
-      //"8f553f292dfe5e9f3aaa1da93499c15e88ac02000000aaaabbbbaaaabbbbaaaa"
-      //"bbbbaaaabbbbaaaabbbbaaaabbbbaaaabbbbaaaabbbb01000000ffffbbbbffff"
-      //"bbbbffffbbbbffffbbbbffffbbbbffffbbbbffffbbbbffffbbbb02000000");
-
    BinaryData sudToUnser = READHEX( 
       "1111222111122211112222221111222211112221111222111122211112221111"
-      "02000000240186a0020011000511112221111222111122222211112222111122"
-      "2111122211112221111222111105000000ac4c8bd5000000001976a9148dce89"
-      "46f1c7763bb60ea5cf16ef514cbed0633b88ac240186a0020011000511112221"
-      "1112221111222222111122221111222111122211112221111222111105000000"
-      "002f6859000000001976a9146a59ac0e8f553f292dfe5e9f3aaa1da93499c15e"
-      "88ac02000000aaaabbbbaaaabbbbaaaabbbbaaaabbbbaaaabbbbaaaabbbbaaaa"
-      "bbbbaaaabbbb01000000ffffbbbbffffbbbbffffbbbbffffbbbbffffbbbbffff"
-      "bbbbffffbbbbffffbbbb02000000");
+      "021976a9148dce8946f1c7763bb60ea5cf16ef514cbed0633b88ac1976a9146a"
+      "59ac0e8f553f292dfe5e9f3aaa1da93499c15e88ac02340186a0020011111122"
+      "211112221111222222111122221111222111122211112221111222111105ac4c"
+      "8bd500000000003505002f6859000000000102aaaabbbbaaaabbbbaaaabbbbaa"
+      "aabbbbaaaabbbbaaaabbbbaaaabbbbaaaabbbb0101ffffbbbbffffbbbbffffbb"
+      "bbffffbbbbffffbbbbffffbbbbffffbbbbffffbbbb0201");
 
    StoredUndoData sud;
    sud.unserializeDBValue(sudToUnser);
@@ -3766,6 +3815,8 @@ TEST_F(StoredBlockObjTest, SUndoDataUnser)
    EXPECT_EQ(sud.stxOutsRemovedByBlock_[1].duplicateID_, 2);
    EXPECT_EQ(sud.stxOutsRemovedByBlock_[0].txIndex_, 17);
    EXPECT_EQ(sud.stxOutsRemovedByBlock_[1].txIndex_, 17);
+   EXPECT_EQ(sud.stxOutsRemovedByBlock_[0].txOutIndex_, 5);
+   EXPECT_EQ(sud.stxOutsRemovedByBlock_[1].txOutIndex_, 5);
 }
 
 
@@ -4815,6 +4866,117 @@ TEST_F(LevelDBTest, OpenCloseOpenNominal)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(LevelDBTest, TuningProfile)
+{
+   LDBTuning tune;
+   EXPECT_EQ(tune.bloomBitsPerKey_, DEFAULT_LDB_BLOOM_BITS);
+   EXPECT_EQ(iface_->getTuning(BLKDATA).bloomBitsPerKey_, DEFAULT_LDB_BLOOM_BITS);
+
+   tune.blockCacheSize_  = 1024*1024;
+   tune.writeBufferSize_ = 1024*1024;
+   iface_->setTuning(HEADERS, tune);
+   tune.bloomBitsPerKey_ = 16;
+   tune.useCompression_  = true;
+   iface_->setTuning(BLKDATA, tune);
+   EXPECT_EQ(iface_->getTuning(HEADERS).bloomBitsPerKey_, DEFAULT_LDB_BLOOM_BITS);
+   EXPECT_EQ(iface_->getTuning(BLKDATA).bloomBitsPerKey_, 16);
+   EXPECT_TRUE(iface_->getTuning(BLKDATA).useCompression_);
+
+   ASSERT_TRUE(standardOpenDBs());
+   BinaryData key = READHEX("0123");
+   BinaryData val = READHEX("4567");
+   iface_->putValue(BLKDATA, DB_PREFIX_TXHINTS, key, val);
+   EXPECT_EQ(iface_->getValue(BLKDATA, DB_PREFIX_TXHINTS, key), val);
+   iface_->closeDatabases();
+
+   // The data is readable no matter what filter it was written with
+   iface_->setTuning(HEADERS, LDBTuning());
+   iface_->getTuningRef(BLKDATA).bloomBitsPerKey_ = 0;
+   ASSERT_TRUE(standardOpenDBs());
+   EXPECT_EQ(iface_->getValue(BLKDATA, DB_PREFIX_TXHINTS, key), val);
+   iface_->closeDatabases();
+
+   iface_->setTuning(BLKDATA, LDBTuning());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmark, not a test:  run with --gtest_also_run_disabled_tests.  Fills
+// TXHINTS with random 4-byte prefixes (like a real BLKDATA DB) and times
+// getHintsForTxHash for prefixes that are and aren't there, with and 
+// without the bloom filter.  A small block cache makes the difference show
+// on a DB this size.
+TEST_F(LevelDBTest, DISABLED_TxHashLookupLatency_usuallydisabled)
+{
+   uint32_t const nKeys    = 500000;
+   uint32_t const nLookups = 100000;
+   uint32_t const bloomBits[2] = {0, DEFAULT_LDB_BLOOM_BITS};
+
+   // Even entries go in the DB, odd ones are the tx we don't have
+   srand(0);
+   vector<BinaryData> hashes(2*nKeys);
+   for(uint32_t i=0; i<2*nKeys; i++)
+   {
+      hashes[i] = BinaryData(32);
+      for(uint32_t b=0; b<32; b++)
+         hashes[i][b] = (uint8_t)(rand() & 0xff);
+   }
+
+   for(uint32_t run=0; run<2; run++)
+   {
+      system("rm -rf ./ldbtestdir/level*");
+
+      LDBTuning tune;
+      tune.bloomBitsPerKey_ = bloomBits[run];
+      tune.blockCacheSize_  = 256*1024;
+      iface_->setTuning(BLKDATA, tune);
+      ASSERT_TRUE(standardOpenDBs());
+
+      BinaryData hint = READHEX("000001000100");
+      iface_->startBatch(BLKDATA);
+      for(uint32_t i=0; i<2*nKeys; i+=2)
+      {
+         StoredTxHints sths;
+         sths.txHashPrefix_ = hashes[i].getSliceCopy(0,4);
+         sths.dbKeyList_.push_back(hint);
+         iface_->putStoredTxHints(sths);
+      }
+      iface_->commitBatch(BLKDATA);
+
+      // Reopen so that everything is in tables on disk, not the memtable
+      iface_->closeDatabases();
+      ASSERT_TRUE(standardOpenDBs());
+
+      string tag = (bloomBits[run]==0 ? "NoFilter" : "Bloom");
+      uint32_t foundPresent = 0;
+      uint32_t foundMissing = 0;
+
+      TIMER_START("Present_" + tag);
+      for(uint32_t i=0; i<nLookups; i++)
+         foundPresent += iface_->getHintsForTxHash(hashes[2*i]).getNumHints();
+      TIMER_STOP("Present_" + tag);
+
+      TIMER_START("Missing_" + tag);
+      for(uint32_t i=0; i<nLookups; i++)
+         foundMissing += iface_->getHintsForTxHash(hashes[2*i+1]).getNumHints();
+      TIMER_STOP("Missing_" + tag);
+
+      EXPECT_EQ(foundPresent, nLookups);
+
+      cout << "Bloom bits/key: " << bloomBits[run] << endl;
+      cout << "   present: " 
+           << 1e6*TIMER_READ_SEC("Present_" + tag)/nLookups << " us/lookup" << endl;
+      cout << "   missing: " 
+           << 1e6*TIMER_READ_SEC("Missing_" + tag)/nLookups << " us/lookup"
+           << "  (" << foundMissing << " prefix collisions)" << endl;
+
+      iface_->closeDatabases();
+   }
+
+   iface_->setTuning(BLKDATA, LDBTuning());
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(LevelDBTest, DISABLED_OpenCloseOpenMismatch)
 {
@@ -5831,11 +5993,296 @@ TEST_F(DISABLED_PartialMerkleTest, EmptyTree)
    
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST(BlkFileMapTest, MapReadRelease)
+{
+   string fname("../reorgTest/blk_0_to_4.dat");
+   uint64_t fsize = BtcUtils::GetFileSize(fname);
+
+   BinaryData fromStream((size_t)fsize);
+   ifstream is(fname.c_str(), ios::in | ios::binary);
+   is.read((char*)fromStream.getPtr(), fsize);
+   is.close();
+
+   BlkFileMap blkMap;
+   EXPECT_FALSE(blkMap.isOpen());
+   EXPECT_FALSE(blkMap.open("./does_not_exist.dat"));
+
+   ASSERT_TRUE(blkMap.open(fname));
+   EXPECT_EQ(blkMap.getSize(), fsize);
+   EXPECT_EQ(blkMap.getDataRef(0, fsize), fromStream.getRef());
+   EXPECT_EQ(blkMap.getDataRef(0, 4), READHEX(MAINNET_MAGIC_BYTES));
+
+   // Out of range requests get an empty ref
+   EXPECT_EQ(blkMap.getDataRef(fsize-4, 8).getSize(), 0);
+   EXPECT_EQ(blkMap.getDataRef(fsize+1, 0).getSize(), 0);
+
+   BinaryRefReader brr = blkMap.getReader(4);
+   EXPECT_EQ(brr.getSizeRemaining(), fsize-4);
+   uint32_t blk0size = brr.get_uint32_t();
+   EXPECT_EQ(blk0size, 285);
+
+   // Dropped pages are read back from the file if we touch them again
+   blkMap.adviseSequential();
+   blkMap.releaseBefore(fsize);
+   EXPECT_EQ(blkMap.getDataRef(0, fsize), fromStream.getRef());
+
+   blkMap.close();
+   EXPECT_FALSE(blkMap.isOpen());
+   EXPECT_EQ(blkMap.getSize(), 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST(HeaderStoreTest, InsertFindGrow)
+{
+   BinaryData rawHead = READHEX(
+      "010000001d8f4ec0443e1f19f305e488c1085c95de7cc3fd25e0d2c5bb5d00000000"
+      "00009762547903d36881a86751f3f5049e23050113f779735ef82734ebf0b4450081"
+      "d8c8c84db3936a1a334b035b");
+
+   HeaderStore store;
+   EXPECT_EQ(store.size(), 0);
+   EXPECT_TRUE(store.find(BtcUtils::EmptyHash_) == NULL);
+
+   // Enough distinct headers to cross a chunk and rehash the index a few
+   // times:  changing the nonce changes the hash
+   uint32_t nHead = HEADERS_PER_CHUNK + 100;
+   vector<BinaryData> hashes;
+   BlockHeader* firstPtr = NULL;
+   for(uint32_t i=0; i<nHead; i++)
+   {
+      BinaryData raw = rawHead;
+      *(uint32_t*)(raw.getPtr()+76) = i;
+      BlockHeader bh(raw);
+      bh.setNumTx(i);
+
+      bool wasInserted;
+      BlockHeader* bhptr = store.insert(bh, &wasInserted);
+      EXPECT_TRUE(wasInserted);
+      if(i==0)
+         firstPtr = bhptr;
+      hashes.push_back(bh.getThisHash());
+   }
+   ASSERT_EQ(store.size(), nHead);
+
+   // Records don't move when the store grows
+   EXPECT_EQ(store.find(hashes[0]), firstPtr);
+   EXPECT_EQ(&store[0], firstPtr);
+
+   for(uint32_t i=0; i<nHead; i++)
+   {
+      BlockHeader* bhptr = store.find(hashes[i]);
+      ASSERT_TRUE(bhptr != NULL);
+      EXPECT_EQ(bhptr->getThisHash(), hashes[i]);
+      EXPECT_EQ(bhptr->getNumTx(), i);
+      EXPECT_EQ(&store[i], bhptr);
+   }
+
+   // Inserting a duplicate returns the existing record, untouched
+   BinaryData raw = rawHead;
+   *(uint32_t*)(raw.getPtr()+76) = 7;
+   BlockHeader dup(raw);
+   dup.setNumTx(99999);
+   bool wasInserted;
+   BlockHeader* dupPtr = store.insert(dup, &wasInserted);
+   EXPECT_FALSE(wasInserted);
+   EXPECT_EQ(dupPtr, store.find(hashes[7]));
+   EXPECT_EQ(dupPtr->getNumTx(), 7);
+   EXPECT_EQ(store.size(), nHead);
+
+   // getOrCreate adds an uninitialized record for unknown hashes
+   BlockHeader & created = store.getOrCreate(BtcUtils::EmptyHash_);
+   EXPECT_FALSE(created.isInitialized());
+   EXPECT_EQ(created.getThisHashRef(), BtcUtils::EmptyHash_);
+   EXPECT_EQ(&store.getOrCreate(BtcUtils::EmptyHash_), &created);
+   EXPECT_EQ(store.size(), nHead+1);
+
+   store.clear();
+   EXPECT_EQ(store.size(), 0);
+   EXPECT_TRUE(store.find(hashes[0]) == NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST(ScrAddrMatcherTest, InsertContainsErase)
+{
+   ScrAddrMatcher matcher;
+   EXPECT_TRUE(matcher.empty());
+
+   // Enough hash160s to grow the table several times
+   uint32_t nAddr = 1000;
+   vector<BinaryData> a160List;
+   for(uint32_t i=0; i<nAddr; i++)
+   {
+      BinaryData a160 = BtcUtils::getHash160(WRITE_UINT32_LE(i));
+      a160List.push_back(a160);
+      EXPECT_TRUE(matcher.insert(HASH160PREFIX + a160));
+   }
+   EXPECT_FALSE(matcher.insert(HASH160PREFIX + a160List[5]));
+   ASSERT_EQ(matcher.size(), nAddr);
+
+   for(uint32_t i=0; i<nAddr; i++)
+   {
+      EXPECT_TRUE(matcher.contains(HASH160PREFIX + a160List[i]));
+      EXPECT_TRUE(matcher.contains(SCRIPT_PREFIX_HASH160, a160List[i].getPtr()));
+
+      // Same hash160 under another prefix is a different scrAddr
+      EXPECT_FALSE(matcher.contains(SCRIPT_PREFIX_P2SH, a160List[i].getPtr()));
+   }
+
+   BinaryData notThere = BtcUtils::getHash160(WRITE_UINT32_LE(nAddr));
+   EXPECT_FALSE(matcher.contains(SCRIPT_PREFIX_HASH160, notThere.getPtr()));
+
+   // Multisig keys aren't 21 bytes, they are kept on the side
+   BinaryData msigKey = MSIGPREFIX + WRITE_UINT8_LE(1) + WRITE_UINT8_LE(2) +
+                        a160List[0] + a160List[1];
+   EXPECT_FALSE(matcher.contains(msigKey));
+   EXPECT_TRUE(matcher.insert(msigKey));
+   EXPECT_TRUE(matcher.contains(msigKey));
+   EXPECT_EQ(matcher.size(), nAddr+1);
+
+   // Erasing rebuilds the table, everything else must still be found
+   EXPECT_TRUE(matcher.erase(HASH160PREFIX + a160List[10]));
+   EXPECT_FALSE(matcher.erase(HASH160PREFIX + a160List[10]));
+   EXPECT_TRUE(matcher.erase(msigKey));
+   EXPECT_EQ(matcher.size(), nAddr-1);
+   for(uint32_t i=0; i<nAddr; i++)
+      EXPECT_EQ(matcher.contains(SCRIPT_PREFIX_HASH160, a160List[i].getPtr()),
+                i != 10);
+
+   matcher.clear();
+   EXPECT_TRUE(matcher.empty());
+   EXPECT_FALSE(matcher.contains(HASH160PREFIX + a160List[0]));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST(ScrAddrMatcherTest, ContainsTxOut)
+{
+   // P2PKH, P2PK65, P2PK33, P2SH, 2-of-2 multisig, and a non-std script
+   vector<BinaryData> scripts;
+   scripts.push_back(READHEX(
+      "76a914a134408afa258a50ed7a1d9817f26b63cc9002cc88ac"));
+   scripts.push_back(READHEX(
+      "4104b0bd634234abbb1ba1e986e884185c61cf43e001f9137f23c2c409273eb1"
+      "6e6537a576782eba668a7ef8bd3b3cfb1edb7117ab65129b8a2e681f3c1e0908ef7bac"));
+   scripts.push_back(READHEX(
+      "21024005c945d86ac6b01fb04258345abea7a845bd25689edb723d5ad4068ddd3036ac"));
+   scripts.push_back(READHEX(
+      "a914d0c15a7d41500976056b3345f542d8c944077c8a87"));
+   scripts.push_back(READHEX(
+      "5221034758cefcb75e16e4dfafb32383b709fa632086ea5ca982712de6add93"
+      "060b17a2103fe96237629128a0ae8c3825af8a4be8fe3109b16f62af19cec0b1"
+      "eb93b8717e252ae"));
+   scripts.push_back(READHEX("76a90088ac"));
+
+   vector<BinaryData> txOuts;
+   for(uint32_t i=0; i<scripts.size(); i++)
+   {
+      BinaryWriter bw;
+      bw.put_uint64_t(5000000000ULL);
+      bw.put_var_int(scripts[i].getSize());
+      bw.put_BinaryData(scripts[i]);
+      txOuts.push_back(bw.getData());
+   }
+
+   // Each std script matches its own scrAddr, and nothing else
+   for(uint32_t i=0; i<scripts.size(); i++)
+   {
+      ScrAddrMatcher matcher;
+      matcher.insert(BtcUtils::getTxOutScrAddr(scripts[i]));
+      for(uint32_t j=0; j<txOuts.size(); j++)
+      {
+         bool expectMatch = (i==j && i<5);
+         EXPECT_EQ(matcher.containsTxOut(txOuts[j].getPtr(), 
+                                         txOuts[j].getSize()), expectMatch);
+      }
+   }
+
+   // Multisig also matches on any of its addr160s, unless it's skipped
+   ScrAddrMatcher matcher;
+   matcher.insert(READHEX("00b3348abf9dd2d1491359f937e2af64b1bb6d525a"));
+   EXPECT_TRUE(matcher.containsTxOut(txOuts[4].getPtr(), txOuts[4].getSize()));
+   EXPECT_FALSE(matcher.containsTxOut(txOuts[4].getPtr(), 
+                                      txOuts[4].getSize(), false));
+
+   // Says 2-of-2 but only has the first key:  must not read past the end
+   BinaryData badScript = scripts[4].getSliceCopy(0, 35) + READHEX("52ae");
+   BinaryWriter bw;
+   bw.put_uint64_t(5000000000ULL);
+   bw.put_var_int(badScript.getSize());
+   bw.put_BinaryData(badScript);
+   EXPECT_FALSE(matcher.containsTxOut(bw.getData().getPtr(), 
+                                      bw.getSize()));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST(WriteBatchArenaTest, ResetAndReuse)
+{
+   WriteBatchArena<StoredTx> arena;
+   BinaryData hashA = READHEX("aa00000000000000000000000000000000000000000000000000000000000001");
+   BinaryData hashB = READHEX("bb00000000000000000000000000000000000000000000000000000000000002");
+
+   EXPECT_TRUE(arena.find(hashA) == NULL);
+
+   StoredTx stx;
+   stx.blockHeight_ = 123;
+   stx.stxoMap_[0].txOutIndex_ = 0;
+   StoredTx* ptrA = &arena.set(hashA, stx);
+   StoredTx* ptrB = &arena.getOrCreate(hashB);
+   ptrB->blockHeight_ = 456;
+
+   EXPECT_EQ(arena.size(), 2);
+   EXPECT_EQ(arena.find(hashA), ptrA);
+   EXPECT_EQ(arena.find(hashB)->blockHeight_, 456);
+   EXPECT_EQ(&arena.getOrCreate(hashA), ptrA);
+   EXPECT_EQ(ptrA->blockHeight_, 123);
+
+   // Erased records drop out of find() and iteration, and come back fresh
+   arena.erase(hashA);
+   EXPECT_EQ(arena.size(), 1);
+   EXPECT_TRUE(arena.find(hashA) == NULL);
+   EXPECT_FALSE(arena.isLive(0));
+   EXPECT_TRUE( arena.isLive(1));
+   EXPECT_EQ(arena.keyAt(1), hashB);
+   EXPECT_EQ(&arena.getOrCreate(hashA), ptrA);
+   EXPECT_EQ(ptrA->stxoMap_.size(), 0);
+
+   // After a reset the same records are handed out again, with nothing
+   // left over from the previous batch
+   arena.reset();
+   EXPECT_TRUE(arena.empty());
+   EXPECT_EQ(arena.numSlots(), 0);
+   EXPECT_TRUE(arena.find(hashA) == NULL);
+   EXPECT_TRUE(arena.find(hashB) == NULL);
+
+   StoredTx* ptrB2 = &arena.getOrCreate(hashB);
+   EXPECT_EQ(ptrB2, ptrA);
+   EXPECT_EQ(ptrB2->blockHeight_, UINT32_MAX);
+   EXPECT_EQ(arena.keyAt(0), hashB);
+
+   // Enough keys to grow the index and go past the first chunk
+   for(uint32_t i=0; i<3000; i++)
+   {
+      BinaryData key = hashA;
+      memcpy(key.getPtr()+28, &i, 4);
+      arena.getOrCreate(key).blockHeight_ = i;
+   }
+   EXPECT_EQ(arena.size(), 3001);
+   EXPECT_EQ(arena.find(hashB), ptrB2);
+   for(uint32_t i=0; i<3000; i++)
+   {
+      BinaryData key = hashA;
+      memcpy(key.getPtr()+28, &i, 4);
+      ASSERT_TRUE(arena.find(key) != NULL);
+      EXPECT_EQ(arena.find(key)->blockHeight_, i);
+   }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 // THESE ARE ARMORY_DB_BARE tests.  Identical to above except for the mode.
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 class BlockUtilsBare : public ::testing::Test
 {
 protected:
@@ -5996,6 +6443,48 @@ TEST_F(BlockUtilsBare, Load5Blocks)
    EXPECT_EQ(wlt.getFullBalance(), 150*COIN);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsBare, Load5Blocks_NumThreads)
+{
+   uint32_t nThreadsPrev = TheBDM.getNumThreads();
+   TheBDM.setNumThreads(0);
+   EXPECT_GT(TheBDM.getNumThreads(), 0);
+
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt);
+
+   // Build with a single parser thread, then rebuild with several:  the
+   // blocks must come out the same
+   TheBDM.setNumThreads(1);
+   TheBDM.doInitialSyncOnLoad(); 
+   TheBDM.scanBlockchainForTx(wlt);
+   EXPECT_EQ(wlt.getFullBalance(), 150*COIN);
+
+   vector<StoredHeader> sbhSingle(5);
+   for(uint32_t h=0; h<5; h++)
+      ASSERT_TRUE(iface_->getStoredHeader(sbhSingle[h], h, 0, true));
+
+   TheBDM.setNumThreads(4);
+   EXPECT_EQ(TheBDM.getNumThreads(), 4);
+   TheBDM.doRebuildDatabases();
+   TheBDM.scanBlockchainForTx(wlt);
+   EXPECT_EQ(wlt.getFullBalance(), 150*COIN);
+
+   for(uint32_t h=0; h<5; h++)
+   {
+      StoredHeader sbh;
+      ASSERT_TRUE(iface_->getStoredHeader(sbh, h, 0, true));
+      EXPECT_EQ(sbh.thisHash_, sbhSingle[h].thisHash_);
+      EXPECT_EQ(sbh.numTx_, sbhSingle[h].numTx_);
+      EXPECT_EQ(sbh.stxMap_.size(), sbhSingle[h].stxMap_.size());
+   }
+
+   TheBDM.setNumThreads(nThreadsPrev);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(BlockUtilsBare, Load4Blocks_Plus1)
 {
@@ -6033,6 +6522,65 @@ TEST_F(BlockUtilsBare, Load4Blocks_Plus1)
    EXPECT_EQ(scrobj->getFullBalance(),  0*COIN);  // hasn't been scanned yet
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsBare, Load3Blocks_PartialLastBlock)
+{
+   // Blocks 0-2
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_, 926);
+   TheBDM.doInitialSyncOnLoad(); 
+   EXPECT_EQ(iface_->getTopBlockHeight(HEADERS), 2);
+
+   // Block 3, then the first 100 bytes of block 4:  block 3 is read, and
+   // the update stops in front of block 4
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_, 1696);
+   EXPECT_EQ(TheBDM.readBlkFileUpdate(), 1);
+   EXPECT_EQ(iface_->getTopBlockHeight(HEADERS), 3);
+   EXPECT_EQ(iface_->getTopBlockHash(HEADERS), blkHash3);
+
+   // Block 4 once it's all there
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   EXPECT_EQ(TheBDM.readBlkFileUpdate(), 1);
+   EXPECT_EQ(iface_->getTopBlockHeight(HEADERS), 4);
+   EXPECT_EQ(iface_->getTopBlockHash(HEADERS), blkHash4);
+   EXPECT_TRUE(TheBDM.getHeaderByHash(blkHash4)->isMainBranch());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsBare, Load5Blocks_BadPowBlocksSkipped)
+{
+   // Blocks 0-3, four copies of block 3 with a different nonce (they fail
+   // proof-of-work), then block 4
+   BinaryData blk0to4(1975);
+   {
+      ifstream is("../reorgTest/blk_0_to_4.dat", ios::in | ios::binary);
+      is.read((char*)blk0to4.getPtr(), 1975);
+   }
+   BinaryData blk3 = blk0to4.getSliceCopy(926, 670);
+
+   BinaryData newFile = blk0to4.getSliceCopy(0, 1596);
+   for(uint8_t i=1; i<=4; i++)
+   {
+      BinaryData badBlk = blk3;
+      badBlk.getPtr()[8+76] ^= i;
+      newFile.append(badBlk);
+   }
+   newFile.append(blk0to4.getSliceCopy(1596, 379));
+   {
+      ofstream os(blk0dat_.c_str(), ios::out | ios::binary);
+      os.write((char*)newFile.getPtr(), newFile.getSize());
+   }
+
+   // They don't use up the corrupt-block attempts, block 4 is stored
+   TheBDM.doInitialSyncOnLoad(); 
+   EXPECT_EQ(iface_->getTopBlockHeight(HEADERS), 4);
+   EXPECT_EQ(iface_->getTopBlockHash(HEADERS), blkHash4);
+
+   StoredHeader sbh;
+   ASSERT_TRUE(iface_->getStoredHeader(sbh, 4, 0, true));
+   EXPECT_EQ(sbh.thisHash_, blkHash4);
+   EXPECT_GT(sbh.stxMap_.size(), 0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(BlockUtilsBare, Load5Blocks_FullReorg)
 {
@@ -6073,6 +6621,52 @@ TEST_F(BlockUtilsBare, Load5Blocks_FullReorg)
    EXPECT_EQ(wlt.getFullBalance(), 160*COIN);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsBare, Load5Blocks_IncrementalReorg)
+{
+   TheBDM.doInitialSyncOnLoad(); 
+   BlockHeader* oldTop = &TheBDM.getTopBlockHeader();
+   BlockHeader* old3   = TheBDM.getHeaderByHeight(3);
+   EXPECT_EQ(oldTop->getBlockHeight(), 4);
+
+   // These go through the incremental organizeChain, the last one reorgs
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   EXPECT_TRUE(oldTop->isMainBranch());
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   EXPECT_TRUE(TheBDM.isLastBlockReorg());
+
+   ASSERT_EQ(TheBDM.getTopBlockHeight(), 5);
+   EXPECT_FALSE(oldTop->isMainBranch());
+   EXPECT_FALSE(old3->isMainBranch());
+   EXPECT_EQ(oldTop->getNextHash(), BtcUtils::EmptyHash_);
+
+   vector<BinaryData> mainChain;
+   for(uint32_t i=0; i<=5; i++)
+   {
+      BlockHeader* bhptr = TheBDM.getHeaderByHeight(i);
+      ASSERT_TRUE(bhptr != NULL);
+      EXPECT_TRUE(bhptr->isMainBranch());
+      EXPECT_EQ(bhptr->getBlockHeight(), i);
+      if(i<5)
+         EXPECT_EQ(bhptr->getNextHash(), 
+                   TheBDM.getHeaderByHeight(i+1)->getThisHash());
+      mainChain.push_back(bhptr->getThisHash());
+   }
+   EXPECT_EQ(TheBDM.getTopBlockHeader().getNextHash(), BtcUtils::EmptyHash_);
+
+   // A full rebuild must come to the same result
+   EXPECT_TRUE(TheBDM.organizeChain(true));
+   ASSERT_EQ(TheBDM.getTopBlockHeight(), 5);
+   EXPECT_FALSE(oldTop->isMainBranch());
+   EXPECT_FALSE(old3->isMainBranch());
+   for(uint32_t i=0; i<=5; i++)
+      EXPECT_EQ(TheBDM.getHeaderByHeight(i)->getThisHash(), mainChain[i]);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_F(BlockUtilsBare, CorruptedBlock)
 {
@@ -6922,61 +7516,312 @@ TEST_F(BlockUtilsSuper, Load5Blocks)
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-TEST_F(BlockUtilsSuper, Load4BlocksPlus1)
-{
-   // Copy only the first four blocks.  Will copy the full file next to test
-   // readBlkFileUpdate method on non-reorg blocks.
-   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_, 1596);
-   TheBDM.doInitialSyncOnLoad(); 
-   EXPECT_EQ(iface_->getTopBlockHeight(HEADERS), 3);
-   EXPECT_EQ(iface_->getTopBlockHash(HEADERS), blkHash3);
-   EXPECT_TRUE(TheBDM.getHeaderByHash(blkHash3)->isMainBranch());
-   
-   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
-   TheBDM.readBlkFileUpdate(); 
-   EXPECT_EQ(iface_->getTopBlockHeight(HEADERS), 4);
-   EXPECT_EQ(iface_->getTopBlockHash(HEADERS), blkHash4);
-   EXPECT_TRUE(TheBDM.getHeaderByHash(blkHash4)->isMainBranch());
-}
-
-////////////////////////////////////////////////////////////////////////////////
-TEST_F(BlockUtilsSuper, Load5Blocks_Plus2NoReorg)
+// One-byte batches:  every block is committed in the background, and the
+// next one has to find the txs and SSHs it touches in the in-flight batch
+TEST_F(BlockUtilsSuper, Load5Blocks_AsyncCommitEveryBlock)
 {
    DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
    DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   EXPECT_TRUE(TheBDM.getAsyncCommit());
+   TheBDM.setWriteBatchBytes(1);
    TheBDM.doInitialSyncOnLoad(); 
+   TheBDM.setWriteBatchBytes(BlockWriteBatcher::UPDATE_BYTES_THRESH);
 
+   StoredDBInfo sdbi;
+   iface_->getStoredDBInfo(BLKDATA, sdbi);
+   EXPECT_EQ(sdbi.appliedToHgt_, 4);
 
-   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
-   TheBDM.readBlkFileUpdate();
-   EXPECT_EQ(TheBDM.getTopBlockHash(),   blkHash4);
-   EXPECT_EQ(TheBDM.getTopBlockHeight(), 4);
+   StoredScriptHistory ssh;
 
-   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
-   TheBDM.readBlkFileUpdate();
-   EXPECT_EQ(TheBDM.getTopBlockHash(),   blkHash4);
-   EXPECT_EQ(TheBDM.getTopBlockHeight(), 4);
+   iface_->getStoredScriptHistory(ssh, scrAddrA_);
+   EXPECT_EQ(ssh.getScriptBalance(),  100*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(), 100*COIN);
+   EXPECT_EQ(ssh.totalTxioCount_,       2);
 
-   //BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
-   //iface_->pprintBlkDataDB(BLKDATA);
+   iface_->getStoredScriptHistory(ssh, scrAddrB_);
+   EXPECT_EQ(ssh.getScriptBalance(),    0*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(), 140*COIN);
+   EXPECT_EQ(ssh.totalTxioCount_,       3);
+
+   iface_->getStoredScriptHistory(ssh, scrAddrC_);
+   EXPECT_EQ(ssh.getScriptBalance(),   50*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(),  60*COIN);
+   EXPECT_EQ(ssh.totalTxioCount_,       2);
+
+   iface_->getStoredScriptHistory(ssh, scrAddrD_);
+   EXPECT_EQ(ssh.getScriptBalance(),  100*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(), 100*COIN);
+   EXPECT_EQ(ssh.totalTxioCount_,       3);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-TEST_F(BlockUtilsSuper, Load5Blocks_FullReorg)
+// prefetchStoredTx only warms the cache, reads must come out the same
+TEST_F(BlockUtilsSuper, Load5Blocks_PrefetchStoredTx)
 {
    DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
    DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.setNumThreads(4);
    TheBDM.doInitialSyncOnLoad(); 
 
-   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
-   TheBDM.readBlkFileUpdate();
-   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
-   TheBDM.readBlkFileUpdate();
-   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
-   TheBDM.readBlkFileUpdate();
-
-   //iface_->pprintBlkDataDB(BLKDATA);
-   StoredScriptHistory ssh;
+   BinaryData missingHash = gentx_;
+   missingHash[31] ^= 0xff;
+
+   for(uint32_t idxLen=0; idxLen<=8; idxLen+=8)
+   {
+      EXPECT_TRUE(TheBDM.setTxHashIndexLength(idxLen));
+      uint32_t nTx = 0;
+      for(uint32_t h=0; h<5; h++)
+      {
+         StoredHeader sbh;
+         uint8_t dup = iface_->getValidDupIDForHeight(h);
+         ASSERT_TRUE(iface_->getStoredHeader(sbh, h, dup));
+         map<uint16_t, StoredTx>::iterator iter;
+         for(iter = sbh.stxMap_.begin(); iter != sbh.stxMap_.end(); iter++)
+         {
+            BinaryData txHash = iter->second.thisHash_;
+            iface_->prefetchStoredTx(txHash);
+
+            StoredTx stx;
+            EXPECT_TRUE(iface_->getStoredTx(stx, txHash));
+            EXPECT_EQ(stx.thisHash_, txHash);
+            EXPECT_EQ(stx.stxoMap_.size(), iter->second.stxoMap_.size());
+            nTx++;
+         }
+      }
+      EXPECT_EQ(nTx, 9);
+
+      iface_->prefetchStoredTx(missingHash);
+      iface_->prefetchStoredTx(BinaryData(0));
+      StoredTx stx;
+      EXPECT_FALSE(iface_->getStoredTx(stx, missingHash));
+   }
+
+   // The rebuild reads ahead and prefetches with 4 workers
+   TheBDM.doRebuildDatabases();
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrB_);
+   EXPECT_EQ(ssh.getScriptBalance(),    0*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(), 140*COIN);
+   iface_->getStoredScriptHistory(ssh, scrAddrD_);
+   EXPECT_EQ(ssh.getScriptBalance(),  100*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(), 100*COIN);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Every TxOut on the main chain has a UTXO entry iff TXDATA has it unspent.
+// Returns the number of unspent TxOuts.
+static uint32_t checkUtxoSetMatchesTxData(InterfaceToLDB* iface, uint32_t topHgt)
+{
+   uint32_t nUnspent = 0;
+   for(uint32_t h=0; h<=topHgt; h++)
+   {
+      StoredHeader sbh;
+      uint8_t dup = iface->getValidDupIDForHeight(h);
+      EXPECT_TRUE(iface->getStoredHeader(sbh, h, dup));
+      map<uint16_t, StoredTx>::iterator iter;
+      for(iter = sbh.stxMap_.begin(); iter != sbh.stxMap_.end(); iter++)
+      {
+         StoredTx stx;
+         EXPECT_TRUE(iface->getStoredTx(stx, iter->second.thisHash_));
+         map<uint16_t, StoredTxOut>::iterator iterTxOut;
+         for(iterTxOut  = stx.stxoMap_.begin(); 
+             iterTxOut != stx.stxoMap_.end(); 
+             iterTxOut++)
+         {
+            StoredTxOut & stxo = iterTxOut->second;
+            BinaryWriter bwOp;
+            bwOp.put_BinaryData(stx.thisHash_);
+            bwOp.put_uint32_t(iterTxOut->first);
+
+            StoredTxOut utxo;
+            bool inUtxoSet = iface->getUtxo(bwOp.getDataRef(), utxo);
+            EXPECT_EQ(inUtxoSet, stxo.spentness_ == TXOUT_UNSPENT);
+            if(!inUtxoSet)
+               continue;
+
+            nUnspent++;
+            EXPECT_EQ(utxo.getDBKey(false), stxo.getDBKey(false));
+            EXPECT_EQ(utxo.parentHash_,     stx.thisHash_);
+            EXPECT_EQ(utxo.dataCopy_,       stxo.dataCopy_);
+            EXPECT_EQ(utxo.isCoinbase_,     stxo.isCoinbase_);
+            EXPECT_EQ(utxo.spentness_,      TXOUT_UNSPENT);
+         }
+      }
+   }
+   return nUnspent;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_UtxoSet)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   // A batch per block, and the UTXO cache written out with each of them, 
+   // so spends find their TxOut in the in-flight batch or the DB
+   TheBDM.setWriteBatchBytes(1);
+   TheBDM.setUtxoCacheBytes(1);
+   TheBDM.doInitialSyncOnLoad(); 
+   TheBDM.setWriteBatchBytes(BlockWriteBatcher::UPDATE_BYTES_THRESH);
+   TheBDM.setUtxoCacheBytes(BlockWriteBatcher::UTXO_CACHE_BYTES);
+
+   uint32_t nUnspent = checkUtxoSetMatchesTxData(iface_, 4);
+   EXPECT_GT(nUnspent, 0);
+
+   // Nothing but the unspent TxOuts in there
+   uint32_t nEntries = 0;
+   LDBIter ldbIter = iface_->getIterator(BLKDATA);
+   if(ldbIter.seekToStartsWith(DB_PREFIX_UTXO))
+   {
+      do
+      {
+         nEntries++;
+      } while(ldbIter.advanceAndRead(DB_PREFIX_UTXO));
+   }
+   EXPECT_EQ(nEntries, nUnspent);
+
+   // Undoing blocks 3 and 4 puts their spent TxOuts back and removes the
+   // ones they created
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 5);
+   checkUtxoSetMatchesTxData(iface_, 5);
+
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrB_);
+   EXPECT_EQ(ssh.getScriptBalance(),   10*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(), 150*COIN);
+   iface_->getStoredScriptHistory(ssh, scrAddrD_);
+   EXPECT_EQ(ssh.getScriptBalance(),  140*COIN);
+   EXPECT_EQ(ssh.getScriptReceived(), 140*COIN);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_Pruned)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_ALL);
+
+   // A batch per block, only the top two blocks keep their undo data
+   TheBDM.setWriteBatchBytes(1);
+   TheBDM.setUndoRetentionBlocks(2);
+   TheBDM.doInitialSyncOnLoad(); 
+   TheBDM.setWriteBatchBytes(BlockWriteBatcher::UPDATE_BYTES_THRESH);
+
+   StoredUndoData sud;
+   EXPECT_FALSE(iface_->getStoredUndoData(sud, 1));
+   EXPECT_FALSE(iface_->getStoredUndoData(sud, 2));
+   EXPECT_TRUE( iface_->getStoredUndoData(sud, 3));
+   EXPECT_EQ(sud.blockHash_, blkHash3);
+   ASSERT_TRUE( iface_->getStoredUndoData(sud, 4));
+   EXPECT_EQ(sud.blockHash_, blkHash4);
+
+   // The TxOuts block 4 spent are only in its undo data now
+   ASSERT_GT(sud.stxOutsRemovedByBlock_.size(), 0);
+   for(uint32_t i=0; i<sud.stxOutsRemovedByBlock_.size(); i++)
+   {
+      StoredTxOut & removed = sud.stxOutsRemovedByBlock_[i];
+      StoredTxOut stxo;
+      EXPECT_FALSE(iface_->getStoredTxOut(stxo, removed.blockHeight_,
+                                                removed.duplicateID_,
+                                                removed.txIndex_,
+                                                removed.txOutIndex_));
+      EXPECT_EQ(removed.parentHash_.getSize(), 32);
+   }
+
+   StoredHeader sbh;
+   ASSERT_TRUE(iface_->getStoredHeader(sbh, 4, 0));
+   uint32_t nTxOut = 0;
+   map<uint16_t, StoredTx>::iterator iter;
+   for(iter = sbh.stxMap_.begin(); iter != sbh.stxMap_.end(); iter++)
+      nTxOut += iter->second.numTxOut_;
+   EXPECT_EQ(sud.outPointsAddedByBlock_.size(), nTxOut);
+
+   // The reorg gets the spent TxOuts back from the undo data
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 5);
+   EXPECT_FALSE(iface_->getStoredUndoData(sud, 3));
+   EXPECT_TRUE( iface_->getStoredUndoData(sud, 5));
+
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrA_);
+   EXPECT_EQ(ssh.getScriptBalance(),  150*COIN);
+   iface_->getStoredScriptHistory(ssh, scrAddrB_);
+   EXPECT_EQ(ssh.getScriptBalance(),   10*COIN);
+   iface_->getStoredScriptHistory(ssh, scrAddrD_);
+   EXPECT_EQ(ssh.getScriptBalance(),  140*COIN);
+
+   // C's only TxOut is spent, nothing is left of its history
+   StoredScriptHistory sshC;
+   iface_->getStoredScriptHistory(sshC, scrAddrC_);
+   EXPECT_FALSE(sshC.isInitialized());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load4BlocksPlus1)
+{
+   // Copy only the first four blocks.  Will copy the full file next to test
+   // readBlkFileUpdate method on non-reorg blocks.
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_, 1596);
+   TheBDM.doInitialSyncOnLoad(); 
+   EXPECT_EQ(iface_->getTopBlockHeight(HEADERS), 3);
+   EXPECT_EQ(iface_->getTopBlockHash(HEADERS), blkHash3);
+   EXPECT_TRUE(TheBDM.getHeaderByHash(blkHash3)->isMainBranch());
+   
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate(); 
+   EXPECT_EQ(iface_->getTopBlockHeight(HEADERS), 4);
+   EXPECT_EQ(iface_->getTopBlockHash(HEADERS), blkHash4);
+   EXPECT_TRUE(TheBDM.getHeaderByHash(blkHash4)->isMainBranch());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_Plus2NoReorg)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+
+
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   EXPECT_EQ(TheBDM.getTopBlockHash(),   blkHash4);
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 4);
+
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   EXPECT_EQ(TheBDM.getTopBlockHash(),   blkHash4);
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 4);
+
+   //BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   //iface_->pprintBlkDataDB(BLKDATA);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_FullReorg)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+
+   //iface_->pprintBlkDataDB(BLKDATA);
+   StoredScriptHistory ssh;
 
    iface_->getStoredScriptHistory(ssh, scrAddrA_);
    EXPECT_EQ(ssh.getScriptBalance(),  150*COIN);
@@ -6999,6 +7844,641 @@ TEST_F(BlockUtilsSuper, Load5Blocks_FullReorg)
    EXPECT_EQ(ssh.totalTxioCount_,       3);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_TxHashIndex)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+   EXPECT_EQ(iface_->getTxHashIndexLength(), 0);
+
+   // Migrate the TXHINTS of the existing DB
+   EXPECT_FALSE(TheBDM.setTxHashIndexLength(4));
+   EXPECT_TRUE( TheBDM.setTxHashIndexLength(8));
+   EXPECT_EQ(iface_->getTxHashIndexLength(), 8);
+
+   uint32_t nTx = 0;
+   for(uint32_t h=0; h<5; h++)
+   {
+      StoredHeader sbh;
+      uint8_t dup = iface_->getValidDupIDForHeight(h);
+      ASSERT_TRUE(iface_->getStoredHeader(sbh, h, dup));
+      map<uint16_t, StoredTx>::iterator iter;
+      for(iter = sbh.stxMap_.begin(); iter != sbh.stxMap_.end(); iter++)
+      {
+         BinaryData txHash = iter->second.thisHash_;
+         BinaryData dbKey6 = iter->second.getDBKey(false);
+         BinaryData keyList = iface_->getTxHashIndexEntry(txHash);
+         ASSERT_EQ(keyList.getSize(), 6);
+         EXPECT_EQ(keyList, dbKey6);
+         EXPECT_EQ(iface_->getTxRef(txHash).getDBKey(), dbKey6);
+
+         StoredTx stx;
+         EXPECT_TRUE(iface_->getStoredTx(stx, txHash));
+         EXPECT_EQ(stx.thisHash_, txHash);
+         nTx++;
+      }
+   }
+   EXPECT_EQ(nTx, 9);
+
+   // A hash that isn't there, but shares the 8-byte prefix of one that is
+   StoredTx stx;
+   BinaryData fakeHash = gentx_;
+   fakeHash[31] ^= 0xff;
+   EXPECT_FALSE(iface_->getStoredTx(stx, fakeHash));
+
+   // Blocks applied from now on are added by the BlockWriteBatcher
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+
+   StoredHeader sbh5;
+   uint8_t dup5 = iface_->getValidDupIDForHeight(5);
+   ASSERT_TRUE(iface_->getStoredHeader(sbh5, 5, dup5));
+   ASSERT_GT(sbh5.stxMap_.size(), 0);
+   StoredTx & cbtx = sbh5.stxMap_[0];
+   EXPECT_EQ(iface_->getTxHashIndexEntry(cbtx.thisHash_).getSliceCopy(0,6),
+             cbtx.getDBKey(false));
+   EXPECT_EQ(iface_->getTxRef(cbtx.thisHash_).getDBKey(), cbtx.getDBKey(false));
+
+   // Removing the index falls back to the TXHINTS
+   EXPECT_TRUE(TheBDM.setTxHashIndexLength(0));
+   EXPECT_EQ(iface_->getTxHashIndexLength(), 0);
+   LDBIter ldbIter = iface_->getIterator(BLKDATA);
+   EXPECT_FALSE(ldbIter.seekToStartsWith(DB_PREFIX_TXHASHIDX));
+   EXPECT_EQ(iface_->getTxRef(cbtx.thisHash_).getDBKey(), cbtx.getDBKey(false));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_TxHashIndexReorg)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+   EXPECT_TRUE(TheBDM.setTxHashIndexLength(8));
+
+   // The txs of blocks 3 and 4, which the reorg undoes
+   vector<StoredTx> undoneTxs;
+   for(uint32_t h=3; h<5; h++)
+   {
+      StoredHeader sbh;
+      ASSERT_TRUE(iface_->getStoredHeader(sbh, h, 
+                                          iface_->getValidDupIDForHeight(h)));
+      map<uint16_t, StoredTx>::iterator iter;
+      for(iter = sbh.stxMap_.begin(); iter != sbh.stxMap_.end(); iter++)
+         undoneTxs.push_back(iter->second);
+   }
+   ASSERT_GT(undoneTxs.size(), 0);
+
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+
+   // Their keys are out of the index.  What's left (a tx also mined in the 
+   // new branch) is in the main branch.
+   uint32_t nGone = 0;
+   for(uint32_t i=0; i<undoneTxs.size(); i++)
+   {
+      BinaryData txHash  = undoneTxs[i].thisHash_;
+      BinaryData oldKey  = undoneTxs[i].getDBKey(false);
+      BinaryData keyList = iface_->getTxHashIndexEntry(txHash);
+      if(keyList.getSize() == 0)
+      {
+         nGone++;
+         continue;
+      }
+
+      for(uint32_t k=0; k+6<=keyList.getSize(); k+=6)
+         EXPECT_NE(keyList.getSliceCopy(k, 6), oldKey);
+
+      uint32_t hgt;
+      uint8_t  dup;
+      uint16_t txIdx;
+      BinaryRefReader brr(keyList.getSliceRef(0, 6));
+      DBUtils.readBlkDataKeyNoPrefix(brr, hgt, dup, txIdx);
+      EXPECT_EQ(iface_->getValidDupIDForHeight(hgt), dup);
+   }
+   EXPECT_GT(nGone, 0);
+
+   // Lookups of an undone tx still find it, through the TXHINTS
+   StoredTx stx;
+   EXPECT_TRUE(iface_->getStoredTx(stx, undoneTxs.back().thisHash_));
+   EXPECT_EQ(stx.thisHash_, undoneTxs.back().thisHash_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_SnapshotReader)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+
+   LDBReader reader(*iface_);
+
+   vector<BinaryData> txHashes;
+   vector<BinaryData> txKeys;
+   for(uint32_t h=0; h<5; h++)
+   {
+      uint8_t dup = reader.getValidDupIDForHeight(h);
+      EXPECT_EQ(dup, iface_->getValidDupIDForHeight(h));
+
+      StoredHeader sbh;
+      LDBIter ldbIter = reader.getIterator(BLKDATA);
+      ASSERT_TRUE(ldbIter.seekToExact(DBUtils.getBlkDataKey(h, dup)));
+      ASSERT_TRUE(iface_->readStoredBlockAtIter(reader, ldbIter, sbh));
+      EXPECT_TRUE(sbh.isMainBranch_);
+      EXPECT_EQ(sbh.stxMap_.size(), sbh.numTx_);
+
+      map<uint16_t, StoredTx>::iterator iter;
+      for(iter = sbh.stxMap_.begin(); iter != sbh.stxMap_.end(); iter++)
+      {
+         txHashes.push_back(iter->second.thisHash_);
+         txKeys.push_back(iter->second.getDBKey(false));
+      }
+   }
+   ASSERT_EQ(txHashes.size(), 9);
+
+   // Refs from earlier gets are not overwritten by the later ones
+   BinaryDataRef hints0 = reader.getValueRef(BLKDATA, DB_PREFIX_TXHINTS, 
+                                             txHashes[0].getSliceRef(0,4));
+   BinaryData hints0Copy = hints0.copy();
+   for(uint32_t i=1; i<txHashes.size(); i++)
+      reader.getValueRef(BLKDATA, DB_PREFIX_TXHINTS, txHashes[i].getSliceRef(0,4));
+   EXPECT_GT(hints0Copy.getSize(), 0);
+   EXPECT_EQ(hints0.copy(), hints0Copy);
+   EXPECT_EQ(reader.getValueRef(BLKDATA, DB_PREFIX_TXHINTS, 
+                                BinaryData(4)).getSize(), 0);
+
+   // Several threads looking up every tx (by hash and by key) and scrAddr
+   // through the same reader
+   BinaryData scrAddrs[4] = {scrAddrA_, scrAddrB_, scrAddrC_, scrAddrD_};
+   uint64_t   balances[4] = {100*COIN, 0*COIN, 50*COIN, 100*COIN};
+   vector<uint32_t> nGood(4, 0);
+   vector<thread> threads;
+   for(uint32_t t=0; t<4; t++)
+      threads.push_back(thread([&, t](void)
+      {
+         for(uint32_t rep=0; rep<20; rep++)
+         {
+            for(uint32_t i=0; i<txHashes.size(); i++)
+            {
+               StoredTx stxByHash, stxByKey;
+               if(iface_->getStoredTx(reader, stxByHash, txHashes[i]) &&
+                  iface_->getStoredTx(reader, stxByKey,  txKeys[i]) &&
+                  stxByHash.thisHash_ == txHashes[i] &&
+                  stxByKey.thisHash_  == txHashes[i])
+                  nGood[t]++;
+            }
+
+            for(uint32_t a=0; a<4; a++)
+            {
+               StoredScriptHistory ssh;
+               iface_->getStoredScriptHistory(reader, ssh, scrAddrs[a]);
+               if(ssh.getScriptBalance() == balances[a])
+                  nGood[t]++;
+            }
+         }
+      }));
+
+   for(uint32_t t=0; t<threads.size(); t++)
+      threads[t].join();
+   for(uint32_t t=0; t<4; t++)
+      EXPECT_EQ(nGood[t], 20*(9+4));
+
+   StoredTx stx;
+   BinaryData missingHash = txHashes[0];
+   missingHash[31] ^= 0xff;
+   EXPECT_FALSE(iface_->getStoredTx(reader, stx, missingHash));
+
+   // The reorg is committed, but this reader still sees the DB as it was
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(reader, ssh, scrAddrA_);
+   EXPECT_EQ(ssh.getScriptBalance(),  100*COIN);
+   EXPECT_EQ(reader.getValidDupIDForHeight(5), UINT8_MAX);
+   EXPECT_EQ(hints0.copy(), hints0Copy);
+
+   LDBReader newReader(*iface_);
+   iface_->getStoredScriptHistory(newReader, ssh, scrAddrA_);
+   EXPECT_EQ(ssh.getScriptBalance(),  150*COIN);
+   EXPECT_NE(newReader.getValidDupIDForHeight(5), UINT8_MAX);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Query threads running the whole time the reorg blocks are added
+TEST_F(BlockUtilsSuper, Load5Blocks_ConcurrentQueries)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+
+   // Block 1 is below the fork, it doesn't change
+   StoredHeader sbh1;
+   ASSERT_TRUE(iface_->getStoredHeader(sbh1, 1, iface_->getValidDupIDForHeight(1)));
+   BinaryData txHash1 = sbh1.stxMap_[0].thisHash_;
+   BinaryData headHash1 = sbh1.thisHash_;
+
+   EXPECT_EQ(TheBDM.queryTxByHash(txHash1).getThisHash(), txHash1);
+   EXPECT_EQ(TheBDM.queryHeaderByHash(headHash1).getBlockHeight(), 1);
+   EXPECT_FALSE(TheBDM.queryHeaderByHash(BinaryData(32)).isInitialized());
+   EXPECT_EQ(TheBDM.queryBalanceForScrAddr(scrAddrA_), 100*COIN);
+   EXPECT_EQ(TheBDM.queryHistoryForScrAddr(scrAddrB_).size(), 3);
+   EXPECT_EQ(TheBDM.queryUTXOVectForScrAddr(scrAddrD_).size(), 3);
+
+   atomic<bool> done(false);
+   vector<uint32_t> nQueries(4, 0);
+   vector<uint32_t> nBad(4, 0);
+   vector<thread> threads;
+   for(uint32_t t=0; t<4; t++)
+      threads.push_back(thread([&, t](void)
+      {
+         while(!done)
+         {
+            if(TheBDM.queryTxByHash(txHash1).getThisHash() != txHash1)
+               nBad[t]++;
+            if(!TheBDM.queryHeaderByHash(ghash_).isInitialized())
+               nBad[t]++;
+            TheBDM.queryBalanceForScrAddr(scrAddrA_);
+            TheBDM.queryHistoryForScrAddr(scrAddrB_);
+            TheBDM.queryUTXOVectForScrAddr(scrAddrD_);
+            nQueries[t]++;
+         }
+      }));
+
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+
+   done = true;
+   for(uint32_t t=0; t<threads.size(); t++)
+   {
+      threads[t].join();
+      EXPECT_GT(nQueries[t], 0);
+      EXPECT_EQ(nBad[t], 0);
+   }
+
+   // Same as Load5Blocks_FullReorg
+   EXPECT_EQ(TheBDM.queryBalanceForScrAddr(scrAddrA_), 150*COIN);
+   EXPECT_EQ(TheBDM.queryBalanceForScrAddr(scrAddrB_),  10*COIN);
+   EXPECT_EQ(TheBDM.queryHistoryForScrAddr(scrAddrB_).size(), 4);
+   EXPECT_EQ(TheBDM.queryHeaderByHash(TheBDM.getTopBlockHash()).getBlockHeight(), 5);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_BalanceCache)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   // Blocks 0 and 1 only, so the block 2 tx can go through the pool first
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_, 513);
+   TheBDM.doInitialSyncOnLoad(); 
+
+   vector<BinaryData> scrAddrs;
+   scrAddrs.push_back(scrAddrA_);
+   scrAddrs.push_back(scrAddrB_);
+   scrAddrs.push_back(scrAddrC_);
+   scrAddrs.push_back(scrAddrD_);
+
+   // First call reads the DB and caches them
+   for(uint32_t i=0; i<scrAddrs.size(); i++)
+      TheBDM.queryBalanceSummary(scrAddrs[i]);
+   EXPECT_EQ(TheBDM.queryBalanceSummary(scrAddrB_).confirmed_,   50*COIN);
+   EXPECT_EQ(TheBDM.queryBalanceSummary(scrAddrB_).unconfirmed_,  0*COIN);
+
+   // Mined in block 2:  spends B's 50 BTC coinbase, 10 to C, 40 back to B
+   BinaryData txWithChange = READHEX(
+      "0100000001aee7e7fc832d028f454d4fa1ca60ba2f1760d35a80570cb63fe0d6"
+      "dd4755087a000000004a49304602210038fcc428e8f28ebea2e8682a611ac301"
+      "2aedf5289535f3776c3b3acf5fbcff74022100c51c373fab30abd0e9a594be13"
+      "8bdd99a21cdcdb2258cf9795c3d569ac25c3aa01ffffffff0200ca9a3b000000"
+      "001976a914cb2abde8bccacc32e893df3a054b9ef7f227a4ce88ac00286bee00"
+      "0000001976a914ee26c56fc1d942be8d7a24b2a1001dd89469398088ac000000"
+      "00");
+   BinaryData txHash = BtcUtils::getHash256(txWithChange);
+   ASSERT_TRUE(TheBDM.addNewZeroConfTx(txWithChange, 1300000000, false));
+
+   // The cached entries pick it up, confirmed totals don't move
+   ScrAddrBalance balB = TheBDM.queryBalanceSummary(scrAddrB_);
+   ScrAddrBalance balC = TheBDM.queryBalanceSummary(scrAddrC_);
+   EXPECT_EQ(balB.confirmed_,   50*COIN);
+   EXPECT_EQ(balB.unconfirmed_, 40*COIN);
+   EXPECT_EQ(balB.spendable_,    0*COIN);
+   EXPECT_EQ(balC.confirmed_,    0*COIN);
+   EXPECT_EQ(balC.unconfirmed_, 10*COIN);
+   EXPECT_EQ(TheBDM.queryBalanceSummary(scrAddrA_).unconfirmed_, 0*COIN);
+
+   // The coinbase it spends is immature here, so the spent-confirmed part
+   // only shows on a cache asked at a height where it's mature
+   {
+      uint32_t matureBlk = TheBDM.getTopBlockHeight() + COINBASE_MATURITY;
+      StoredScriptHistory ssh;
+      iface_->getStoredScriptHistory(ssh, scrAddrB_);
+
+      BalanceCache cache;
+      ScrAddrBalance bal;
+      ASSERT_TRUE(cache.insert(scrAddrB_, ssh, 0, matureBlk, 
+                               cache.getWriteGeneration(), bal));
+      EXPECT_EQ(bal.spendable_, 50*COIN);
+
+      vector<ZeroConfDelta> deltas;
+      deltas.push_back(ZeroConfDelta(scrAddrC_, 10*COIN, ZC_DELTA_RECEIVED));
+      deltas.push_back(ZeroConfDelta(scrAddrB_, 40*COIN, ZC_DELTA_RECEIVED));
+      deltas.push_back(ZeroConfDelta(scrAddrB_, 50*COIN, 
+                                     ZC_DELTA_SPENT_CONFIRMED));
+      cache.addZeroConf(txHash, deltas);
+      ASSERT_TRUE(cache.get(scrAddrB_, matureBlk, bal));
+      EXPECT_EQ(bal.confirmed_,   50*COIN);
+      EXPECT_EQ(bal.spendable_,    0*COIN);
+      EXPECT_EQ(bal.unconfirmed_, 40*COIN);
+
+      cache.removeZeroConf(txHash);
+      ASSERT_TRUE(cache.get(scrAddrB_, matureBlk, bal));
+      EXPECT_EQ(bal.spendable_,   50*COIN);
+      EXPECT_EQ(bal.unconfirmed_,  0*COIN);
+   }
+
+   // Mined:  purged from the pool, and out of the cached entries with it
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   EXPECT_FALSE(TheBDM.getTxRefByHash(txHash).isNull());
+   for(uint32_t i=0; i<scrAddrs.size(); i++)
+   {
+      StoredScriptHistory ssh;
+      iface_->getStoredScriptHistory(ssh, scrAddrs[i]);
+      ScrAddrBalance bal = TheBDM.queryBalanceSummary(scrAddrs[i]);
+      EXPECT_EQ(bal.confirmed_,   ssh.totalUnspent_);
+      EXPECT_EQ(bal.unconfirmed_, 0);
+   }
+   EXPECT_EQ(TheBDM.queryBalanceForScrAddr(scrAddrA_), 100*COIN);
+
+   // Undone and applied by the BlockWriteBatcher, never re-read
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+
+   // Same as Load5Blocks_FullReorg
+   EXPECT_EQ(TheBDM.queryBalanceSummary(scrAddrA_).confirmed_, 150*COIN);
+   EXPECT_EQ(TheBDM.queryBalanceSummary(scrAddrB_).confirmed_,  10*COIN);
+   EXPECT_EQ(TheBDM.queryBalanceSummary(scrAddrC_).confirmed_,   0*COIN);
+   EXPECT_EQ(TheBDM.queryBalanceSummary(scrAddrD_).confirmed_, 140*COIN);
+
+   // All the coinbases here are immature
+   for(uint32_t i=0; i<scrAddrs.size(); i++)
+   {
+      StoredScriptHistory ssh;
+      iface_->getStoredScriptHistory(ssh, scrAddrs[i]);
+
+      uint64_t spendable = 0;
+      uint32_t utxoCount = 0;
+      map<BinaryData, StoredSubHistory>::iterator iterSub;
+      map<BinaryData, TxIOPair>::iterator iterTxio;
+      for(iterSub  = ssh.subHistMap_.begin(); 
+          iterSub != ssh.subHistMap_.end(); 
+          iterSub++)
+      {
+         StoredSubHistory & subssh = iterSub->second;
+         for(iterTxio  = subssh.txioSet_.begin(); 
+             iterTxio != subssh.txioSet_.end(); 
+             iterTxio++)
+         {
+            TxIOPair & txio = iterTxio->second;
+            if(txio.hasTxIn() || txio.isMultisig())
+               continue;
+            utxoCount++;
+            if(!txio.isFromCoinbase())
+               spendable += txio.getValue();
+         }
+      }
+
+      ScrAddrBalance bal = TheBDM.queryBalanceSummary(scrAddrs[i]);
+      EXPECT_EQ(bal.confirmed_,   ssh.totalUnspent_);
+      EXPECT_EQ(bal.utxoCount_,   utxoCount);
+      EXPECT_EQ(bal.spendable_,   spendable);
+      EXPECT_EQ(bal.unconfirmed_, 0);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_BalanceCacheStaleInsert)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+   TheBDM.doInitialSyncOnLoad(); 
+
+   // A full cache:  plain balances come from the SSH summary
+   TheBDM.setBalanceCacheMaxEntries(0);
+   EXPECT_EQ(TheBDM.queryBalanceForScrAddr(scrAddrA_), 100*COIN);
+   EXPECT_EQ(TheBDM.queryBalanceSummary(scrAddrA_).confirmed_, 100*COIN);
+   TheBDM.setBalanceCacheMaxEntries(BALANCE_CACHE_MAX_ENTRIES);
+
+   // A reader takes the generation and its SSH snapshot...
+   BalanceCache cache;
+   uint64_t writeGen = cache.getWriteGeneration();
+   StoredScriptHistory sshOld;
+   iface_->getStoredScriptHistory(sshOld, scrAddrA_);
+   EXPECT_EQ(sshOld.totalUnspent_, 100*COIN);
+
+   // ...then a whole batcher run goes through before its insert
+   cache.beginWrites();
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_4A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   BtcUtils::copyFile("../reorgTest/blk_5A.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   cache.endWrites();
+
+   uint32_t topBlk = TheBDM.getTopBlockHeight();
+   ScrAddrBalance bal;
+   EXPECT_FALSE(cache.insert(scrAddrA_, sshOld, 0, topBlk, writeGen, bal));
+   EXPECT_EQ(bal.confirmed_, 100*COIN);
+   EXPECT_FALSE(cache.get(scrAddrA_, topBlk, bal));
+   EXPECT_EQ(cache.size(), 0);
+
+   // Nor while a batcher is running, whatever the generation
+   EXPECT_TRUE(cache.canInsert());
+   cache.beginWrites();
+   EXPECT_FALSE(cache.canInsert());
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrA_);
+   EXPECT_FALSE(cache.insert(scrAddrA_, ssh, 0, topBlk, 
+                             cache.getWriteGeneration(), bal));
+   cache.endWrites();
+
+   // A snapshot taken after the writes gets in
+   writeGen = cache.getWriteGeneration();
+   StoredScriptHistory sshNew;
+   iface_->getStoredScriptHistory(sshNew, scrAddrA_);
+   EXPECT_TRUE(cache.insert(scrAddrA_, sshNew, 0, topBlk, writeGen, bal));
+   ASSERT_TRUE(cache.get(scrAddrA_, topBlk, bal));
+   EXPECT_EQ(bal.confirmed_, 150*COIN);
+
+   // clear() also invalidates snapshots taken before it
+   writeGen = cache.getWriteGeneration();
+   cache.clear();
+   EXPECT_FALSE(cache.insert(scrAddrA_, sshNew, 0, topBlk, writeGen, bal));
+   EXPECT_EQ(cache.size(), 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_HistoryPages)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   // Blocks 0 and 1 only:  B has a single TxIO, kept in the summary entry
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_, 513);
+   TheBDM.doInitialSyncOnLoad(); 
+   ScrAddrHistoryPage single = TheBDM.queryHistoryPageForScrAddr(
+                                       scrAddrB_, 0, UINT32_MAX, 1, BinaryData(0));
+   EXPECT_EQ(single.getNumTxIO(), 1);
+   EXPECT_FALSE(single.hasMore());
+
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+
+   vector<TxIOPair> fullHist = TheBDM.queryHistoryForScrAddr(scrAddrB_);
+   ASSERT_EQ(fullHist.size(), 3);
+
+   // One TxIO at a time, same order as the full history
+   vector<TxIOPair> paged;
+   BinaryData token(0);
+   for(uint32_t i=0; i<10; i++)
+   {
+      ScrAddrHistoryPage page = TheBDM.queryHistoryPageForScrAddr(
+                                          scrAddrB_, 0, UINT32_MAX, 1, token);
+      EXPECT_TRUE(page.isScrAddrFound());
+      ASSERT_EQ(page.getNumTxIO(), 1);
+      paged.push_back(page.getTxIOByIndex(0));
+      if(!page.hasMore())
+         break;
+      token = page.getResumeToken();
+      EXPECT_EQ(token.getSize(), 8);
+   }
+
+   ASSERT_EQ(paged.size(), fullHist.size());
+   for(uint32_t i=0; i<paged.size(); i++)
+      EXPECT_EQ(paged[i].getDBKeyOfOutput(), fullHist[i].getDBKeyOfOutput());
+
+   // A page that fits it all
+   ScrAddrHistoryPage all = TheBDM.queryHistoryPageForScrAddr(
+                                       scrAddrB_, 0, UINT32_MAX, 3, BinaryData(0));
+   EXPECT_EQ(all.getNumTxIO(), 3);
+   EXPECT_FALSE(all.hasMore());
+
+   // Only the blocks in the range
+   uint32_t hgt1 = DBUtils.hgtxToHeight(fullHist[1].getDBKeyOfOutput().getSliceCopy(0,4));
+   ScrAddrHistoryPage range = TheBDM.queryHistoryPageForScrAddr(
+                                       scrAddrB_, hgt1, hgt1, 0, BinaryData(0));
+   ASSERT_GT(range.getNumTxIO(), 0);
+   for(uint32_t i=0; i<range.getNumTxIO(); i++)
+      EXPECT_EQ(DBUtils.hgtxToHeight(
+         range.getTxIOByIndex(i).getDBKeyOfOutput().getSliceCopy(0,4)), hgt1);
+
+   // No limit is the full history
+   BinaryData scrAddrs[] = {scrAddrA_, scrAddrB_, scrAddrC_, scrAddrD_};
+   for(uint32_t i=0; i<4; i++)
+      EXPECT_EQ(TheBDM.queryHistoryPageForScrAddr(
+                   scrAddrs[i], 0, UINT32_MAX, 0, BinaryData(0)).getNumTxIO(),
+                TheBDM.queryHistoryForScrAddr(scrAddrs[i]).size());
+
+   EXPECT_FALSE(TheBDM.queryHistoryPageForScrAddr(
+         READHEX("00ffffffffffffffffffffffffffffffffffffffff"), 
+         0, UINT32_MAX, 10, BinaryData(0)).isScrAddrFound());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsSuper, Load5Blocks_BlkDirWatcher)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   EXPECT_FALSE(TheBDM.startBlkDirWatcher());
+   TheBDM.doInitialSyncOnLoad(); 
+   ASSERT_TRUE(TheBDM.startBlkDirWatcher(50));
+   EXPECT_TRUE(TheBDM.isBlkDirWatcherRunning());
+
+   // Nothing new yet
+   EXPECT_FALSE(TheBDM.waitForBlkFileData(100));
+   EXPECT_EQ(TheBDM.waitForBlkFileUpdate(0), 0);
+
+   // blk_3A.dat is blk_0_to_4.dat plus block 3A, appended to the same file
+   BtcUtils::copyFile("../reorgTest/blk_3A.dat", blk0dat_);
+   EXPECT_EQ(TheBDM.waitForBlkFileUpdate(5000), 1);
+   EXPECT_EQ(TheBDM.getTopBlockHash(), blkHash4);
+   EXPECT_FALSE(TheBDM.waitForBlkFileData(0));
+
+   // bitcoind moves on to blk00001.dat, preallocated with zeros.  4A and 5A
+   // are the last 220 and 379 bytes of blk_4A.dat and blk_5A.dat.
+   string blk1dat = BtcUtils::getBlkFilename(blkdir_, 1);
+   BinaryData blk4A(220), blk5A(379);
+   ifstream is4A("../reorgTest/blk_4A.dat", ios::in | ios::binary);
+   is4A.seekg(-220, ios::end);
+   is4A.read((char*)blk4A.getPtr(), 220);
+   ifstream is5A("../reorgTest/blk_5A.dat", ios::in | ios::binary);
+   is5A.seekg(-379, ios::end);
+   is5A.read((char*)blk5A.getPtr(), 379);
+   ASSERT_EQ(blk4A.getSliceCopy(0,4), READHEX(MAINNET_MAGIC_BYTES));
+   ASSERT_EQ(blk5A.getSliceCopy(0,4), READHEX(MAINNET_MAGIC_BYTES));
+
+   BinaryData padding(1024);
+   memset(padding.getPtr(), 0, 1024);
+   {
+      ofstream os(blk1dat.c_str(), ios::out | ios::binary);
+      os.write((char*)padding.getPtr(), padding.getSize());
+   }
+
+   // An empty new file is a split with no block yet, no data
+   EXPECT_FALSE(TheBDM.waitForBlkFileData(200));
+   EXPECT_EQ(TheBDM.readBlkFileUpdate(), 0);
+   EXPECT_EQ(TheBDM.getTotalBlkFiles(), 2);
+
+   {
+      BinaryData newData = blk4A + padding;
+      fstream os(blk1dat.c_str(), ios::in | ios::out | ios::binary);
+      os.write((char*)newData.getPtr(), newData.getSize());
+   }
+   EXPECT_EQ(TheBDM.waitForBlkFileUpdate(5000), 1);
+   EXPECT_EQ(TheBDM.getTopBlockHash(), blkHash4);
+
+   {
+      BinaryData newData = blk4A + blk5A + padding;
+      fstream os(blk1dat.c_str(), ios::in | ios::out | ios::binary);
+      os.write((char*)newData.getPtr(), newData.getSize());
+   }
+   EXPECT_EQ(TheBDM.waitForBlkFileUpdate(5000), 1);
+   EXPECT_EQ(TheBDM.getTopBlockHash(), blkHash5A);
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 5);
+   EXPECT_EQ(TheBDM.getTotalBlkFiles(), 2);
+
+   TheBDM.stopBlkDirWatcher();
+   EXPECT_FALSE(TheBDM.isBlkDirWatcherRunning());
+   EXPECT_FALSE(TheBDM.waitForBlkFileData(0));
+
+   // Same as Load5Blocks_FullReorg
+   EXPECT_EQ(TheBDM.queryBalanceForScrAddr(scrAddrA_), 150*COIN);
+   EXPECT_EQ(TheBDM.queryBalanceForScrAddr(scrAddrB_),  10*COIN);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // These next two tests disabled because they broke after ARMORY_DB_BARE impl
 TEST_F(BlockUtilsSuper, DISABLED_RestartDBAfterBuild)
@@ -7155,6 +8635,83 @@ TEST_F(BlockUtilsSuper, DISABLED_TimeAndSpaceTest_usuallydisabled)
    cin >> pause;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// The write batches dominate memory use while the DB is being built
+static void printPeakRSS(void)
+{
+#if ! defined(_MSC_VER) && ! defined(__MINGW32__)
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+   cout << "Peak RSS:  " << usage.ru_maxrss/1024 << " MB" << endl;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmark, not a test:  run with --gtest_also_run_disabled_tests.  Rebuilds
+// the supernode DB repeatedly and reports how many blocks/sec go through
+// applyBlockRangeToDB.  The 5-block reorgTest chain mostly shows the fixed
+// per-tx costs;  if a testnet3 blocks dir is at testnetDir it is timed too.
+TEST_F(BlockUtilsSuper, DISABLED_ApplyBlocksRate_usuallydisabled)
+{
+   DBUtils.setArmoryDbType(ARMORY_DB_SUPER);
+   DBUtils.setDbPruneType(DB_PRUNE_NONE);
+
+   uint32_t const nRuns = 200;
+   string const testnetDir("/home/alan/.bitcoin/testnet3/blocks");
+
+   TheBDM.doInitialSyncOnLoad(); 
+   double applySec = 0;
+   double commitSec = 0;
+   uint32_t nApplied = 0;
+   for(uint32_t i=0; i<nRuns; i++)
+   {
+      double prevSec = TIMER_READ_SEC("applyBlockRangeToDB");
+      double prevCommitSec = TIMER_READ_SEC("commitBatch");
+      TheBDM.doRebuildDatabases();
+      applySec += TIMER_READ_SEC("applyBlockRangeToDB") - prevSec;
+      commitSec += TIMER_READ_SEC("commitBatch") - prevCommitSec;
+      nApplied += TheBDM.getTopBlockHeight() + 1;
+   }
+
+   // Make sure we timed a correct apply, not a broken one
+   StoredScriptHistory ssh;
+   iface_->getStoredScriptHistory(ssh, scrAddrA_);
+   EXPECT_EQ(ssh.getScriptBalance(), 100*COIN);
+
+   cout << "reorgTest: " << nApplied << " blocks in " << applySec << " s,  "
+        << nApplied/applySec << " blocks/sec, " << commitSec 
+        << " s in commit" << endl;
+   printPeakRSS();
+
+   string testnetBlk0 = BtcUtils::getBlkFilename(testnetDir, 0);
+   if(BtcUtils::GetFileSize(testnetBlk0) == FILE_DOES_NOT_EXIST)
+   {
+      cout << "No testnet blocks in " << testnetDir << ", skipping" << endl;
+      return;
+   }
+
+   BlockDataManager_LevelDB::DestroyInstance();
+   iface_->closeDatabases();
+   rmdir(ldbdir_ + "/level*");
+   TheBDM.SetDatabaseModes(ARMORY_DB_SUPER, DB_PRUNE_NONE);
+   TheBDM.SelectNetwork("Test");
+   TheBDM.SetBlkFileLocation(testnetDir);
+   TheBDM.SetHomeDirLocation(homedir_);
+   TheBDM.SetLevelDBLocation(ldbdir_);
+
+   double prevSec = TIMER_READ_SEC("applyBlockRangeToDB");
+   double prevCommitSec = TIMER_READ_SEC("commitBatch");
+   TheBDM.doInitialSyncOnLoad(); 
+   applySec = TIMER_READ_SEC("applyBlockRangeToDB") - prevSec;
+   commitSec = TIMER_READ_SEC("commitBatch") - prevCommitSec;
+   nApplied = TheBDM.getTopBlockHeight() + 1;
+
+   cout << "testnet:   " << nApplied << " blocks in " << applySec << " s,  "
+        << nApplied/applySec << " blocks/sec, " << commitSec 
+        << " s in commit" << endl;
+   printPeakRSS();
+}
+
 
 
 
@@ -7366,6 +8923,154 @@ TEST_F(BlockUtilsWithWalletTest, PostRegisterScrAddr)
    EXPECT_EQ(balanceDB,   100*COIN);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Only uses scanDBForRegisteredTx (no SSH fetch), split in one partition per 
+// block or two, so that most spends are found across partitions
+TEST_F(BlockUtilsWithWalletTest, PartitionedRescan)
+{
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TheBDM.doInitialSyncOnLoad();
+
+   uint32_t nThreadsPrev = TheBDM.getNumThreads();
+   TheBDM.setNumThreads(4);
+   TheBDM.setMinBlocksPerScanThread(1);
+
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt);
+   TheBDM.scanBlockchainForTx(wlt, 0, UINT32_MAX, false);
+
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrA_).getFullBalance(), 100*COIN);
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrB_).getFullBalance(),   0*COIN);
+   EXPECT_EQ(wlt.getScrAddrObjByKey(scrAddrC_).getFullBalance(),  50*COIN);
+   EXPECT_EQ(wlt.getFullBalance(), 150*COIN);
+
+   TheBDM.setMinBlocksPerScanThread(MIN_BLOCKS_PER_SCAN_THREAD);
+   TheBDM.setNumThreads(nThreadsPrev);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Several wallets scanned in parallel from the same registered tx, some of 
+// them sharing addresses, end up the same as one scanned alone
+TEST_F(BlockUtilsWithWalletTest, MultiWalletScan)
+{
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TheBDM.doInitialSyncOnLoad();
+
+   uint32_t nThreadsPrev = TheBDM.getNumThreads();
+   TheBDM.setNumThreads(4);
+
+   BtcWallet wltAB, wltC, wltABC, wltD, wltAlone;
+   wltAB.addScrAddress(scrAddrA_);
+   wltAB.addScrAddress(scrAddrB_);
+   wltC.addScrAddress(scrAddrC_);
+   wltABC.addScrAddress(scrAddrA_);
+   wltABC.addScrAddress(scrAddrB_);
+   wltABC.addScrAddress(scrAddrC_);
+   wltD.addScrAddress(scrAddrD_);
+   wltAlone.addScrAddress(scrAddrA_);
+   wltAlone.addScrAddress(scrAddrB_);
+   wltAlone.addScrAddress(scrAddrC_);
+
+   vector<BtcWallet*> wallets;
+   wallets.push_back(&wltAB);
+   wallets.push_back(&wltC);
+   wallets.push_back(&wltABC);
+   wallets.push_back(&wltD);
+   for(uint32_t i=0; i<wallets.size(); i++)
+      TheBDM.registerWallet(wallets[i]);
+   TheBDM.registerWallet(&wltAlone);
+   TheBDM.fetchAllRegisteredScrAddrData();
+
+   TheBDM.scanRegisteredTxForWallets(wallets);
+   TheBDM.scanRegisteredTxForWallet(wltAlone);
+
+   EXPECT_EQ(wltAB.getFullBalance(),  100*COIN);
+   EXPECT_EQ(wltC.getFullBalance(),    50*COIN);
+   EXPECT_EQ(wltABC.getFullBalance(), 150*COIN);
+   EXPECT_EQ(wltD.getFullBalance(),   100*COIN);
+
+   EXPECT_EQ(wltABC.getFullBalance(), wltAlone.getFullBalance());
+   EXPECT_EQ(wltABC.getTxIOMap().size(), wltAlone.getTxIOMap().size());
+
+   vector<LedgerEntry> & ledger      = wltABC.getTxLedger();
+   vector<LedgerEntry> & ledgerAlone = wltAlone.getTxLedger();
+   ASSERT_EQ(ledger.size(), ledgerAlone.size());
+   for(uint32_t i=0; i<ledger.size(); i++)
+   {
+      EXPECT_EQ(ledger[i].getTxHash(), ledgerAlone[i].getTxHash());
+      EXPECT_EQ(ledger[i].getValue(),  ledgerAlone[i].getValue());
+   }
+
+   TheBDM.setNumThreads(nThreadsPrev);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsWithWalletTest, ScanTxIndex)
+{
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TheBDM.doInitialSyncOnLoad();
+
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt);
+   TheBDM.fetchAllRegisteredScrAddrData();
+   TheBDM.scanRegisteredTxForWallet(wlt);
+
+   uint64_t balance = wlt.getFullBalance();
+   uint32_t numTxIO = wlt.getTxIOMap().size();
+   vector<LedgerEntry> ledger = wlt.getTxLedger();
+   ASSERT_GT(ledger.size(), 0);
+
+   for(uint32_t i=0; i<ledger.size(); i++)
+   {
+      Tx tx = TheBDM.getTxByHash(ledger[i].getTxHash());
+      ASSERT_TRUE(tx.isInitialized());
+
+      // txioIndex_ agrees with txioMap_
+      EXPECT_EQ(wlt.isMineBulkFilter(tx), 
+                wlt.isMineBulkFilter(tx, wlt.getTxIOMap()));
+
+      // Seen already, nothing changes
+      wlt.scanTx(tx, ledger[i].getIndex(), 
+                     ledger[i].getTxTime(), 
+                     ledger[i].getBlockNum());
+   }
+
+   EXPECT_EQ(wlt.getFullBalance(), balance);
+   EXPECT_EQ(wlt.getTxIOMap().size(), numTxIO);
+   EXPECT_EQ(wlt.getTxLedger().size(), ledger.size());
+
+   // The TxIns are booked to the address of the TxOut they spend
+   BinaryData scrAddrs[3] = {scrAddrA_, scrAddrB_, scrAddrC_};
+   for(uint32_t a=0; a<3; a++)
+   {
+      vector<LedgerEntry> & addrLedger = wlt.getTxLedger(&scrAddrs[a]);
+      for(uint32_t i=0; i<addrLedger.size(); i++)
+         EXPECT_EQ(addrLedger[i].getScrAddr(), scrAddrs[a]);
+   }
+
+   // A tx that isn't ours
+   BtcWallet wltD;
+   wltD.addScrAddress(scrAddrD_);
+   for(uint32_t i=0; i<ledger.size(); i++)
+   {
+      Tx tx = TheBDM.getTxByHash(ledger[i].getTxHash());
+      if(wltD.isMineBulkFilter(tx).first)
+         continue;
+
+      wltD.scanTx(tx, ledger[i].getIndex(), 
+                      ledger[i].getTxTime(), 
+                      ledger[i].getBlockNum());
+      EXPECT_EQ(wltD.getTxIOMap().size(), 0);
+      EXPECT_EQ(wltD.getTxLedger().size(), 0);
+   }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /* Never got around to finishing this...
 class TestMainnetBlkchain: public ::testing::Test
@@ -7556,6 +9261,150 @@ TEST_F(BlockUtilsWithWalletTest, ZeroConfUpdate)
    
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsWithWalletTest, ZeroConfPool_EvictAndPurgeForBlock)
+{
+   // Copy only the first two blocks
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_, 513);
+
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   wlt.addScrAddress(scrAddrD_);
+   TheBDM.registerWallet(&wlt);
+   TheBDM.doInitialSyncOnLoad();
+
+   // Mined in block 2, spends all 50 BTC of the block 1 coinbase, no fee
+   BinaryData txWithChange = READHEX(
+      "0100000001aee7e7fc832d028f454d4fa1ca60ba2f1760d35a80570cb63fe0d6"
+      "dd4755087a000000004a49304602210038fcc428e8f28ebea2e8682a611ac301"
+      "2aedf5289535f3776c3b3acf5fbcff74022100c51c373fab30abd0e9a594be13"
+      "8bdd99a21cdcdb2258cf9795c3d569ac25c3aa01ffffffff0200ca9a3b000000"
+      "001976a914cb2abde8bccacc32e893df3a054b9ef7f227a4ce88ac00286bee00"
+      "0000001976a914ee26c56fc1d942be8d7a24b2a1001dd89469398088ac000000"
+      "00");
+   string txHex = txWithChange.toHexStr();
+
+   // Spends a tx we don't have:  unknown fee, fee rate 0
+   string unkHex = txHex;
+   unkHex.replace(10, 8, "00000000");
+   BinaryData txUnknownFee = READHEX(unkHex);
+
+   // Same input as txWithChange, 8 BTC less to C:  8 BTC fee
+   string feeHex = txHex;
+   feeHex.replace(feeHex.find("0200ca9a3b000000"), 16, "0200c2eb0b000000");
+   BinaryData txWithFee = READHEX(feeHex);
+
+   uint32_t txSize = txWithChange.getSize();
+   string zcFile = homedir_ + string("/mempool.bin");
+   TheBDM.enableZeroConf(zcFile, false);
+   TheBDM.setZeroConfPoolMaxBytes(txSize + 10);
+
+   // Only room for one
+   EXPECT_TRUE( TheBDM.addNewZeroConfTx(txUnknownFee, 1300000000, true));
+   EXPECT_EQ(   TheBDM.getZeroConfPoolSize(), 1);
+   EXPECT_TRUE( TheBDM.addNewZeroConfTx(txWithFee,    1300000001, true));
+   EXPECT_EQ(   TheBDM.getZeroConfPoolSize(), 1);
+   EXPECT_TRUE( TheBDM.hasTxWithHash(BtcUtils::getHash256(txWithFee)));
+   EXPECT_FALSE(TheBDM.hasTxWithHash(BtcUtils::getHash256(txUnknownFee)));
+
+   // Double-spend of a pool tx, and a lower fee rate than what's there
+   EXPECT_FALSE(TheBDM.addNewZeroConfTx(txWithChange, 1300000002, true));
+   EXPECT_FALSE(TheBDM.addNewZeroConfTx(txUnknownFee, 1300000003, true));
+   EXPECT_EQ(   TheBDM.getZeroConfPoolSize(), 1);
+
+   // Add, remove, add:  nothing was rewritten
+   uint64_t logSize = 8 + (13+txSize) + 33 + (13+txSize);
+   EXPECT_EQ(BtcUtils::GetFileSize(zcFile), logSize);
+
+   // Replaying a copy leaves only the live tx in it
+   string zcCopy = homedir_ + string("/mempool_copy.bin");
+   BtcUtils::copyFile(zcFile, zcCopy);
+   TheBDM.enableZeroConf(zcCopy, false);
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), 1);
+   EXPECT_EQ(BtcUtils::GetFileSize(zcCopy), 8 + 13 + txSize);
+
+   // A rewrite that can't write its temp file leaves the old log alone
+   string zcBlocked = homedir_ + string("/mempool_blocked.bin");
+   BtcUtils::copyFile(zcFile, zcBlocked);
+   mkdir(zcBlocked + ".tmp");
+   TheBDM.enableZeroConf(zcBlocked, false);
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), 1);
+   EXPECT_EQ(BtcUtils::GetFileSize(zcBlocked), logSize);
+   TheBDM.enableZeroConf(zcCopy, false);
+
+   // txWithChange is in the new blocks, the pool tx double-spends it
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TheBDM.readBlkFileUpdate();
+   EXPECT_EQ(TheBDM.getTopBlockHeight(), 4);
+   EXPECT_EQ(TheBDM.getZeroConfPoolSize(), 0);
+   EXPECT_FALSE(TheBDM.hasTxWithHash(BtcUtils::getHash256(txWithFee)));
+   EXPECT_EQ(BtcUtils::GetFileSize(zcCopy), 8 + 13 + txSize + 33);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_F(BlockUtilsWithWalletTest, BatchedSpendableTxOuts)
+{
+   BtcWallet wlt;
+   wlt.addScrAddress(scrAddrA_);
+   wlt.addScrAddress(scrAddrB_);
+   wlt.addScrAddress(scrAddrC_);
+   TheBDM.registerWallet(&wlt);
+   TheBDM.registerNewScrAddr(scrAddrD_);
+
+   BtcUtils::copyFile("../reorgTest/blk_0_to_4.dat", blk0dat_);
+   TheBDM.doInitialSyncOnLoad();
+
+   TheBDM.fetchAllRegisteredScrAddrData();
+   TheBDM.scanBlockchainForTx(wlt);
+
+   // Coinbase outputs aren't spendable until COINBASE_MATURITY blocks on top
+   // of theirs, query far enough ahead that they all are
+   uint32_t topBlk = TheBDM.getTopBlockHeight() + COINBASE_MATURITY;
+   vector<UnspentTxOut> utxos = wlt.getSpendableTxOutList(topBlk);
+   ASSERT_GT(utxos.size(), 0);
+
+   // Same as reading them one at a time
+   vector<UnspentTxOut> slow;
+   map<OutPoint, TxIOPair> & txioMap = wlt.getTxIOMap();
+   map<OutPoint, TxIOPair>::iterator iter;
+   for(iter = txioMap.begin(); iter != txioMap.end(); iter++)
+   {
+      if(!iter->second.isSpendable(topBlk))
+         continue;
+      TxOut txout = iter->second.getTxOutCopy();
+      slow.push_back(UnspentTxOut(txout, topBlk));
+   }
+
+   ASSERT_EQ(utxos.size(), slow.size());
+   uint64_t total = 0;
+   for(uint32_t i=0; i<utxos.size(); i++)
+   {
+      EXPECT_EQ(utxos[i].getTxHash(),      slow[i].getTxHash());
+      EXPECT_EQ(utxos[i].getTxOutIndex(),  slow[i].getTxOutIndex());
+      EXPECT_EQ(utxos[i].getTxHeight(),    slow[i].getTxHeight());
+      EXPECT_EQ(utxos[i].getNumConfirm(),  slow[i].getNumConfirm());
+      EXPECT_EQ(utxos[i].getValue(),       slow[i].getValue());
+      EXPECT_EQ(utxos[i].getScript(),      slow[i].getScript());
+      total += utxos[i].getValue();
+   }
+   EXPECT_GT(total, 0);
+   EXPECT_EQ(total, wlt.getSpendableBalance(topBlk));
+
+   // Spent ones are left out by default, unknown keys are ignored
+   vector<BinaryData> keys;
+   for(iter = txioMap.begin(); iter != txioMap.end(); iter++)
+      keys.push_back(iter->second.getDBKeyOfOutput());
+   keys.push_back(READHEX("00ffffff00000000"));
+
+   map<BinaryData, UnspentTxOut> unspent, all;
+   iface_->getUnspentTxOutsByDBKey(keys, unspent);
+   iface_->getUnspentTxOutsByDBKey(keys, all, false);
+   EXPECT_EQ(all.size(), txioMap.size());
+   EXPECT_EQ(unspent.size(), utxos.size());
+}
+
 // This was really just to time the logging to determine how much impact it 
 // has.  It looks like writing to file is about 1,000,000 logs/sec, while 
 // writing to the null stream (below the threshold log level) is about 
@@ -12,10 +12,14 @@
 #include <list>
 #include <vector>
 #include <set>
+#include <deque>
+#include <algorithm>
+#include <mutex>
 #include "BinaryData.h"
 #include "BtcUtils.h"
 #include "BlockObj.h"
 #include "StoredBlockObj.h"
+#include "HeaderStore.h"
 #include "leveldb_wrapper.h"
 
 vector<InterfaceToLDB*> LevelDBWrapper::ifaceVect_(0);
@@ -23,17 +27,117 @@ vector<InterfaceToLDB*> LevelDBWrapper::ifaceVect_(0);
 
 
 ////////////////////////////////////////////////////////////////////////////////
-LDBIter::LDBIter(leveldb::DB* dbptr, bool fill_cache) 
+LDBIter::LDBIter(leveldb::DB* dbptr, 
+                 bool fill_cache,
+                 leveldb::Snapshot const * snapshot) 
 { 
    db_ = dbptr; 
    leveldb::ReadOptions readopts;
    readopts.fill_cache = fill_cache;
+   readopts.snapshot = snapshot;
    iter_ = db_->NewIterator(readopts);
    isDirty_ = true;
 }
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Every get appends a string here, which is never touched again until the
+// reader goes away.  A deque doesn't move its elements when it grows, so the
+// refs handed out stay valid.  The lock only covers the append:  the read
+// itself fills the new string outside of it.
+struct LDBReaderBuffers
+{
+   mutex          lock_;
+   deque<string>  values_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+LDBReader::LDBReader(InterfaceToLDB & iface) :
+   buffers_(new LDBReaderBuffers)
+{
+   for(uint32_t db=0; db<DB_COUNT; db++)
+   {
+      dbs_[db] = iface.dbs_[db];
+      snapshots_[db] = (dbs_[db]==NULL ? NULL : dbs_[db]->GetSnapshot());
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+LDBReader::~LDBReader(void)
+{
+   for(uint32_t db=0; db<DB_COUNT; db++)
+      if(snapshots_[db] != NULL)
+         dbs_[db]->ReleaseSnapshot(snapshots_[db]);
+
+   delete buffers_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BinaryDataRef LDBReader::getValueRef(DB_SELECT db, BinaryDataRef keyWithPrefix)
+{
+   if(dbs_[db] == NULL)
+      return BinaryDataRef();
+
+   string* value;
+   {
+      lock_guard<mutex> lock(buffers_->lock_);
+      buffers_->values_.push_back(string());
+      value = &buffers_->values_.back();
+   }
+
+   leveldb::ReadOptions readopts;
+   readopts.snapshot = snapshots_[db];
+   leveldb::Slice key((char*)keyWithPrefix.getPtr(), keyWithPrefix.getSize());
+   if(!dbs_[db]->Get(readopts, key, value).ok())
+      return BinaryDataRef();
+
+   return BinaryDataRef((uint8_t*)value->data(), value->size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BinaryDataRef LDBReader::getValueRef(DB_SELECT db, 
+                                     DB_PREFIX prefix, 
+                                     BinaryDataRef key)
+{
+   BinaryWriter bw(key.getSize() + 1);
+   bw.put_uint8_t((uint8_t)prefix);
+   bw.put_BinaryData(key);
+   return getValueRef(db, bw.getDataRef());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BinaryRefReader LDBReader::getValueReader(DB_SELECT db, 
+                                          DB_PREFIX prefix, 
+                                          BinaryDataRef key)
+{
+   return BinaryRefReader(getValueRef(db, prefix, key));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reads the StoredHeadHgtList in place:  a count byte, then the dup (with
+// 0x80 set on the valid one) and 32-byte hash of each header at this height
+uint8_t LDBReader::getValidDupIDForHeight(uint32_t blockHgt)
+{
+   BinaryData hgt4 = WRITE_UINT32_BE(blockHgt);
+   BinaryRefReader brrHgts = getValueReader(HEADERS, DB_PREFIX_HEADHGT, hgt4);
+   if(brrHgts.getSize() == 0)
+      return UINT8_MAX;
+
+   uint32_t numHeads = brrHgts.get_uint8_t();
+   for(uint32_t i=0; i<numHeads && brrHgts.getSizeRemaining()>=33; i++)
+   {
+      uint8_t dup8 = brrHgts.get_uint8_t();
+      brrHgts.advance(32);
+      if((dup8 & 0x80) > 0)
+         return (dup8 & 0x7f);
+   }
+
+   return UINT8_MAX;
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 bool LDBIter::isValid(DB_PREFIX dbpref)
 {
@@ -355,9 +459,13 @@ void InterfaceToLDB::init()
       dbs_[i] = NULL;
       dbPaths_[i] = string("");
       batchStarts_[i] = 0;
-      //dbFilterPolicy_[i] = NULL;
+      dbCache_[i] = NULL;
+      dbFilterPolicy_[i] = NULL;
+      tuning_[i] = LDBTuning();
    }
 
+   txHashIndexLen_ = 0;
+
    maxOpenFiles_ = 0;
    ldbBlockSize_ = DEFAULT_LDB_BLOCK_SIZE; 
 }
@@ -435,7 +543,6 @@ bool InterfaceToLDB::openDatabases(string basedir,
       leveldb::Options opts;
       opts.create_if_missing = true;
       opts.block_size = ldbBlockSize_;
-      opts.compression = leveldb::kNoCompression;
 
       if(maxOpenFiles_ != 0)
       {
@@ -445,9 +552,30 @@ bool InterfaceToLDB::openDatabases(string basedir,
 
       //LOGINFO << "Using LDB block_size = " << ldbBlockSize_ << " bytes";
 
-      //opts.block_cache = leveldb::NewLRUCache(100 * 1048576);
-      //dbFilterPolicy_[db] = leveldb::NewBloomFilterPolicy(10);
-      //opts.filter_policy = leveldb::NewBloomFilterPolicy(10);
+      LDBTuning const & tune = tuning_[db];
+      opts.compression = (tune.useCompression_ ? leveldb::kSnappyCompression :
+                                                 leveldb::kNoCompression);
+
+      if(tune.blockCacheSize_ != 0)
+      {
+         dbCache_[db] = leveldb::NewLRUCache(tune.blockCacheSize_);
+         opts.block_cache = dbCache_[db];
+      }
+
+      if(tune.writeBufferSize_ != 0)
+         opts.write_buffer_size = tune.writeBufferSize_;
+
+      if(tune.bloomBitsPerKey_ != 0)
+      {
+         dbFilterPolicy_[db] = leveldb::NewBloomFilterPolicy(tune.bloomBitsPerKey_);
+         opts.filter_policy = dbFilterPolicy_[db];
+      }
+
+      LOGINFO << "DB " << db << ": bloom bits/key = " << tune.bloomBitsPerKey_
+              << ", block cache = " << tune.blockCacheSize_
+              << ", write buffer = " << tune.writeBufferSize_
+              << ", compression = " << (tune.useCompression_ ? "on" : "off");
+
       leveldb::Status stat = leveldb::DB::Open(opts, dbPaths_[db],  &dbs_[db]);
       if(!checkStatus(stat))
          LOGERR << "Failed to open database! DB: " << db;
@@ -515,6 +643,16 @@ bool InterfaceToLDB::openDatabases(string basedir,
    validDupByHeight_.resize(getTopBlockHeight(HEADERS)+1);
    dbIsOpen_ = true;
 
+   // The bare prefix key holds the prefix length the index was built with
+   txHashIndexLen_ = 0;
+   BinaryData idxInfo = getValue(BLKDATA, DB_PREFIX_TXHASHIDX, BinaryDataRef());
+   if(idxInfo.getSize() > 0)
+   {
+      txHashIndexLen_ = idxInfo[0];
+      LOGINFO << "Using tx hash index with " << txHashIndexLen_ 
+              << "-byte prefixes";
+   }
+
    return true;
 }
 
@@ -568,6 +706,18 @@ void InterfaceToLDB::closeDatabases(void)
          dbs_[db] = NULL;
       }
 
+      // Only safe to delete once the DB that was using them is gone
+      if( dbCache_[db] != NULL)
+      {
+         delete dbCache_[db];
+         dbCache_[db] = NULL;
+      }
+
+      if( dbFilterPolicy_[db] != NULL)
+      {
+         delete dbFilterPolicy_[db];
+         dbFilterPolicy_[db] = NULL;
+      }
    }
    dbIsOpen_ = false;
 
@@ -582,6 +732,7 @@ void InterfaceToLDB::destroyAndResetDatabases(void)
    // it was called with originally
    ARMORY_DB_TYPE atype = DBUtils.getArmoryDbType();
    DB_PRUNE_TYPE  dtype = DBUtils.getDbPruneType();
+   uint32_t       idxLen = txHashIndexLen_;
 
    closeDatabases();
    leveldb::Options options;
@@ -592,6 +743,10 @@ void InterfaceToLDB::destroyAndResetDatabases(void)
    // The close & destroy operations shouldn't have changed any of that.
    openDatabases(baseDir_, genesisBlkHash_, genesisTxHash_, magicBytes_,
                                                                atype, dtype);
+
+   // Nothing to migrate in an empty DB, this just writes the index info
+   if(idxLen > 0)
+      enableTxHashIndex(idxLen);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -664,6 +819,40 @@ void InterfaceToLDB::commitBatch(DB_SELECT db)
    }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+leveldb::WriteBatch* InterfaceToLDB::detachBatch(DB_SELECT db)
+{
+   if(batches_[db] == NULL)
+   {
+      LOGERR << "Trying to detachBatch but we don't have one";
+      return NULL;
+   }
+
+   leveldb::WriteBatch* batch = batches_[db];
+   batches_[db] = new leveldb::WriteBatch;
+   iterIsDirty_[db] = true;
+   return batch;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::writeDetachedBatch(DB_SELECT db, 
+                                        leveldb::WriteBatch* batch)
+{
+   if(batch == NULL)
+      return false;
+
+   bool success = false;
+   if(dbs_[db] != NULL)
+   {
+      leveldb::WriteOptions opts;
+      opts.sync = true;
+      success = dbs_[db]->Write(opts, batch).ok();
+   }
+
+   delete batch;
+   return success;
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 // Get value using pre-created slice
@@ -939,6 +1128,9 @@ bool InterfaceToLDB::advanceToNextBlock(LDBIter & ldbIter, bool skip)
 bool InterfaceToLDB::seekToTxByHash(LDBIter & ldbIter, BinaryDataRef txHash)
 {
    SCOPED_TIMER("seekToTxByHash");
+   if(seekToTxByHashIndex(ldbIter, txHash))
+      return true;
+
    StoredTxHints sths = getHintsForTxHash(txHash);
 
    for(uint32_t i=0; i<sths.getNumHints(); i++)
@@ -1083,6 +1275,22 @@ void InterfaceToLDB::getStoredScriptHistory( StoredScriptHistory & ssh,
    readStoredScriptHistoryAtIter(ldbIter, ssh);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::getStoredScriptHistory( LDBReader & reader,
+                                             StoredScriptHistory & ssh,
+                                             BinaryDataRef scrAddrStr)
+{
+   SCOPED_TIMER("getStoredScriptHistory");
+   LDBIter ldbIter = reader.getIterator(BLKDATA);
+   if(!ldbIter.seekToExact(DB_PREFIX_SCRIPT, scrAddrStr))
+   {
+      ssh.uniqueKey_.resize(0);
+      return;
+   }
+
+   readStoredScriptHistoryAtIter(ldbIter, ssh);
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 void InterfaceToLDB::getStoredScriptHistoryByRawScript(
@@ -1146,6 +1354,147 @@ uint64_t InterfaceToLDB::getBalanceForScrAddr(BinaryDataRef scrAddr, bool withMu
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+uint64_t InterfaceToLDB::getBalanceForScrAddr(LDBReader & reader,
+                                              BinaryDataRef scrAddr, 
+                                              bool withMulti)
+{
+   StoredScriptHistory ssh;
+   if(!withMulti)
+   {
+      BinaryDataRef sshVal = reader.getValueRef(BLKDATA, DB_PREFIX_SCRIPT, scrAddr);
+      if(sshVal.getSize() == 0)
+         return 0;
+
+      ssh.unserializeDBValue(sshVal);
+      return ssh.totalUnspent_;
+   }
+   else
+   {
+      getStoredScriptHistory(reader, ssh, scrAddr);
+      uint64_t total = ssh.totalUnspent_;
+      map<BinaryData, UnspentTxOut> utxoList;
+      map<BinaryData, UnspentTxOut>::iterator iter;
+      getFullUTXOMapForSSH(reader, ssh, utxoList, true);
+      for(iter = utxoList.begin(); iter != utxoList.end(); iter++)
+         if(iter->second.isMultisigRef())
+            total += iter->second.getValue();
+      return total;
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Adds the TxIOs from startKey on to the page.  Returns true once the page is
+// full, with resumeKey set to the first TxIO that didn't fit.
+static bool addSubHistoryToPage(StoredSubHistory & subssh,
+                                BinaryData const & startKey,
+                                uint32_t pageSize,
+                                bool withMultisig,
+                                vector<TxIOPair> & txioList,
+                                BinaryData & resumeKey)
+{
+   map<BinaryData, TxIOPair>::iterator iter;
+   for(iter  = subssh.txioSet_.lower_bound(startKey);
+       iter != subssh.txioSet_.end();
+       iter++)
+   {
+      TxIOPair & txio = iter->second;
+      if(!withMultisig && txio.isMultisig())
+         continue;
+
+      // Only stop once we know there's more
+      if(pageSize > 0 && txioList.size() == pageSize)
+      {
+         resumeKey = iter->first;
+         return true;
+      }
+
+      txioList.push_back(txio);
+   }
+
+   return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::getScriptHistoryPage(LDBReader & reader,
+                                          BinaryDataRef scrAddr,
+                                          uint32_t startHeight,
+                                          uint32_t endHeight,
+                                          uint32_t pageSize,
+                                          BinaryData & resumeKey,
+                                          vector<TxIOPair> & txioList,
+                                          bool withMultisig)
+{
+   SCOPED_TIMER("getScriptHistoryPage");
+   txioList.clear();
+
+   BinaryData startKey = resumeKey;
+   resumeKey.resize(0);
+   if(startKey.getSize() == 0)
+      startKey = DBUtils.heightAndDupToHgtx(startHeight, 0) + BinaryData(4);
+   else if(startKey.getSize() != 8)
+   {
+      LOGERR << "Invalid script history resume key";
+      return false;
+   }
+
+   // The summary entry says whether there are sub-history entries at all
+   BinaryDataRef sshVal = reader.getValueRef(BLKDATA, DB_PREFIX_SCRIPT, scrAddr);
+   if(sshVal.getSize() == 0)
+      return false;
+
+   StoredScriptHistory ssh;
+   ssh.uniqueKey_ = scrAddr;
+   ssh.unserializeDBValue(sshVal);
+
+   // Single-TxIO scripts keep it in the summary entry
+   if(!ssh.useMultipleEntries_)
+   {
+      map<BinaryData, StoredSubHistory>::iterator iter;
+      for(iter = ssh.subHistMap_.begin(); iter != ssh.subHistMap_.end(); iter++)
+      {
+         if(DBUtils.hgtxToHeight(iter->first) <= endHeight)
+            addSubHistoryToPage(iter->second, startKey, pageSize, 
+                                withMultisig, txioList, resumeKey);
+      }
+      return true;
+   }
+
+   // Sub-history keys are the summary key + hgtX, so they are in block 
+   // order right after it
+   BinaryWriter bwSeek(scrAddr.getSize() + 4);
+   bwSeek.put_BinaryData(scrAddr);
+   bwSeek.put_BinaryData(startKey.getSliceRef(0,4));
+
+   LDBIter ldbIter = reader.getIterator(BLKDATA);
+   if(!ldbIter.seekTo(DB_PREFIX_SCRIPT, bwSeek.getDataRef()))
+      return true;
+
+   uint32_t subKeySize = 1 + scrAddr.getSize() + 4;
+   do
+   {
+      BinaryDataRef key = ldbIter.getKeyRef();
+      if(key.getSize() != subKeySize || 
+         key.getSliceRef(1, scrAddr.getSize()) != scrAddr)
+         break;
+
+      StoredSubHistory subssh;
+      subssh.unserializeDBKey(key);
+      if(DBUtils.hgtxToHeight(subssh.hgtX_) > endHeight)
+         break;
+
+      subssh.unserializeDBValue(ldbIter.getValueReader());
+      if(addSubHistoryToPage(subssh, startKey, pageSize, 
+                             withMultisig, txioList, resumeKey))
+         break;
+
+   } while(ldbIter.advanceAndRead(DB_PREFIX_SCRIPT));
+
+   return true;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // We need the block hashes and scripts, which need to be retrieved from the
 // DB, which is why this method can't be part of StoredBlockObj.h/.cpp
@@ -1153,10 +1502,33 @@ bool InterfaceToLDB::getFullUTXOMapForSSH(
                                 StoredScriptHistory & ssh,
                                 map<BinaryData, UnspentTxOut> & mapToFill,
                                 bool withMultisig)
+{
+   return readFullUTXOMapForSSH(ssh, mapToFill, withMultisig, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::getFullUTXOMapForSSH( 
+                                LDBReader & reader,
+                                StoredScriptHistory & ssh,
+                                map<BinaryData, UnspentTxOut> & mapToFill,
+                                bool withMultisig)
+{
+   return readFullUTXOMapForSSH(ssh, mapToFill, withMultisig, &reader);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::readFullUTXOMapForSSH( 
+                                StoredScriptHistory & ssh,
+                                map<BinaryData, UnspentTxOut> & mapToFill,
+                                bool withMultisig,
+                                LDBReader* reader)
 {
    if(!ssh.haveFullHistoryLoaded())
       return false;
 
+   vector<BinaryData> txOutKeys;
+   txOutKeys.reserve((size_t)ssh.totalTxioCount_);
+
    map<BinaryData, StoredSubHistory>::iterator iterSubSSH;
    map<BinaryData, TxIOPair>::iterator iterTxio;
    for(iterSubSSH  = ssh.subHistMap_.begin(); 
@@ -1169,28 +1541,128 @@ bool InterfaceToLDB::getFullUTXOMapForSSH(
           iterTxio++)
       {
          TxIOPair & txio = iterTxio->second;
-         StoredTx stx;
-         BinaryData txoKey = txio.getDBKeyOfOutput();
-         BinaryData txKey  = txio.getTxRefOfOutput().getDBKey();
-         uint16_t txoIdx = txio.getIndexOfOutput();
-         getStoredTx(stx, txKey);
-
-         StoredTxOut & stxo = stx.stxoMap_[txoIdx];
-         if(stxo.isSpent())
+         if(!withMultisig && txio.isMultisig())
             continue;
-         
-         mapToFill[txoKey] = UnspentTxOut(
-                                   stx.thisHash_,
-                                   txoIdx,
-                                   stx.blockHeight_,
-                                   txio.getValue(),
-                                   stx.stxoMap_[txoIdx].getScriptRef());
+
+         txOutKeys.push_back(txio.getDBKeyOfOutput());
       }
    }
 
+   readUnspentTxOutsByDBKey(txOutKeys, mapToFill, true, reader);
    return true;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::getUnspentTxOutsByDBKey(
+                                vector<BinaryData> const & txOutKeys,
+                                map<BinaryData, UnspentTxOut> & mapToFill,
+                                bool skipSpent)
+{
+   readUnspentTxOutsByDBKey(txOutKeys, mapToFill, skipSpent, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::getUnspentTxOutsByDBKey(
+                                LDBReader & reader,
+                                vector<BinaryData> const & txOutKeys,
+                                map<BinaryData, UnspentTxOut> & mapToFill,
+                                bool skipSpent)
+{
+   readUnspentTxOutsByDBKey(txOutKeys, mapToFill, skipSpent, &reader);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Moves the iterator forward to key (with prefix).  If it's only a few 
+// entries ahead, like the next TxOut of the same tx, steps to it instead of
+// seeking.  Returns whether that exact key is in the DB.
+static bool iterForwardTo(LDBIter & ldbIter, BinaryDataRef key)
+{
+   for(uint32_t i=0; i<ITER_FORWARD_MAX_STEPS && ldbIter.isValid(); i++)
+   {
+      BinaryDataRef currKey = ldbIter.getKeyRef();
+      if(currKey == key)
+         return true;
+
+      // Passed it:  it's not there
+      if(key < currKey)
+         return false;
+
+      if(!ldbIter.advanceAndRead())
+         return false;
+   }
+
+   return ldbIter.seekToExact(key);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TXDATA keys are hgtX|txIdx for the tx and hgtX|txIdx|txOutIdx for its 
+// TxOuts, so in key order each tx entry comes right before its TxOuts
+void InterfaceToLDB::readUnspentTxOutsByDBKey(
+                                vector<BinaryData> const & txOutKeys,
+                                map<BinaryData, UnspentTxOut> & mapToFill,
+                                bool skipSpent,
+                                LDBReader* reader)
+{
+   SCOPED_TIMER("readUnspentTxOutsByDBKey");
+
+   vector<BinaryData> sortedKeys(txOutKeys);
+   sort(sortedKeys.begin(), sortedKeys.end());
+
+   LDBIter ldbIter = (reader==NULL ? getIterator(BLKDATA) :
+                                     reader->getIterator(BLKDATA));
+
+   BinaryWriter bwKey(9);
+   BinaryData currTxKey(0);
+   BinaryData currTxHash(0);
+   for(uint32_t i=0; i<sortedKeys.size(); i++)
+   {
+      BinaryData const & txOutKey = sortedKeys[i];
+      if(txOutKey.getSize() != 8)
+         continue;
+
+      if(currTxKey.getSize() == 0 || txOutKey.getSliceRef(0,6) != currTxKey)
+      {
+         currTxKey = txOutKey.getSliceCopy(0,6);
+         currTxHash.resize(0);
+
+         bwKey.reset();
+         bwKey.put_uint8_t((uint8_t)DB_PREFIX_TXDATA);
+         bwKey.put_BinaryData(currTxKey);
+         if(!iterForwardTo(ldbIter, bwKey.getDataRef()))
+            continue;
+
+         // 2 bytes of flags, then the hash
+         BinaryRefReader brr = ldbIter.getValueReader();
+         if(brr.getSizeRemaining() < 34)
+            continue;
+         brr.advance(2);
+         currTxHash = brr.get_BinaryData(32);
+      }
+
+      if(currTxHash.getSize() == 0)
+         continue;
+
+      bwKey.reset();
+      bwKey.put_uint8_t((uint8_t)DB_PREFIX_TXDATA);
+      bwKey.put_BinaryData(txOutKey);
+      if(!iterForwardTo(ldbIter, bwKey.getDataRef()))
+         continue;
+
+      StoredTxOut stxo;
+      stxo.unserializeDBValue(ldbIter.getValueReader());
+      if(skipSpent && stxo.isSpent())
+         continue;
+
+      uint16_t txOutIdx = READ_UINT16_BE(txOutKey.getPtr() + 6);
+      mapToFill[txOutKey] = UnspentTxOut(currTxHash,
+                                         txOutIdx,
+                                         DBUtils.hgtxToHeight(
+                                            txOutKey.getSliceCopy(0,4)),
+                                         stxo.getValue(),
+                                         stxo.getScriptRef());
+   }
+}
+
 
 
 
@@ -1236,8 +1708,7 @@ void InterfaceToLDB::addRegisteredScript(BinaryDataRef rawScript,
 //       sorting that is saved in the DB.  But right now, I'm not sure what
 //       that would get us since we are reading all the headers and doing
 //       a fresh organize/sort anyway.
-void InterfaceToLDB::readAllHeaders(map<HashString, BlockHeader> & headerMap,
-                                    map<HashString, StoredHeader> & storedMap)
+void InterfaceToLDB::readAllHeaders(HeaderStore & headerStore)
 {
    LDBIter ldbIter = getIterator(HEADERS);
    if(!ldbIter.seekToStartsWith(DB_PREFIX_HEADHASH))
@@ -1247,8 +1718,9 @@ void InterfaceToLDB::readAllHeaders(map<HashString, BlockHeader> & headerMap,
    }
    
 
-   StoredHeader sbh;
-   BlockHeader  regHead;
+   // The value is the raw header followed by the hgtx.  We parse it straight
+   // into the store's record, there's no need for a StoredHeader here.
+   BlockHeader regHead;
    do
    {
       ldbIter.resetReaders();
@@ -1260,13 +1732,20 @@ void InterfaceToLDB::readAllHeaders(map<HashString, BlockHeader> & headerMap,
          continue;
       }
 
-      ldbIter.getKeyReader().get_BinaryData(sbh.thisHash_, 32);
+      BinaryRefReader & brr = ldbIter.getValueReader();
+      if(brr.getSizeRemaining() < HEADER_SIZE+4)
+      {
+         LOGERR << "Header value in DB is too short";
+         continue;
+      }
 
-      sbh.unserializeDBValue(HEADERS, ldbIter.getValueRef());
-      regHead.unserialize(sbh.dataCopy_);
+      regHead.unserialize(brr);
+      regHead.setDuplicateID((uint8_t)(brr.get_uint32_t(BE) & 0x7f));
 
-      headerMap[sbh.thisHash_] = regHead;
-      storedMap[sbh.thisHash_] = sbh;
+      bool wasInserted;
+      BlockHeader* bhptr = headerStore.insert(regHead, &wasInserted);
+      if(!wasInserted)
+         *bhptr = regHead;
 
    } while(ldbIter.advanceAndRead(DB_PREFIX_HEADHASH));
 }
@@ -1748,6 +2227,24 @@ void InterfaceToLDB::updatePreferredTxHint( BinaryDataRef hashOrPrefix,
 ////////////////////////////////////////////////////////////////////////////////
 // We assume we have a valid iterator left at the header entry for this block
 bool InterfaceToLDB::readStoredBlockAtIter(LDBIter & ldbIter, StoredHeader & sbh)
+{
+   return readBlockAtIter(ldbIter, sbh, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Same, with ldbIter from reader.getIterator().  The main-branch flag comes
+// from the snapshot too, rather than from validDupByHeight_.
+bool InterfaceToLDB::readStoredBlockAtIter(LDBReader & reader,
+                                           LDBIter & ldbIter, 
+                                           StoredHeader & sbh)
+{
+   return readBlockAtIter(ldbIter, sbh, &reader);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::readBlockAtIter(LDBIter & ldbIter, 
+                                     StoredHeader & sbh,
+                                     LDBReader* reader)
 {
    SCOPED_TIMER("readStoredBlockAtIter");
 
@@ -1761,7 +2258,10 @@ bool InterfaceToLDB::readStoredBlockAtIter(LDBIter & ldbIter, StoredHeader & sbh
    
    // Grab the header first, then iterate over 
    sbh.unserializeDBValue(BLKDATA, ldbIter.getValueRef(), false);
-   sbh.isMainBranch_ = (sbh.duplicateID_==getValidDupIDForHeight(sbh.blockHeight_));
+   uint8_t validDup = (reader==NULL ? 
+                         getValidDupIDForHeight(sbh.blockHeight_) :
+                         reader->getValidDupIDForHeight(sbh.blockHeight_));
+   sbh.isMainBranch_ = (sbh.duplicateID_==validDup);
 
    // If for some reason we hit the end of the DB without any tx, bail
    //if(!ldbIter.advanceAndRead(DB_PREFIX_TXDATA)
@@ -2115,6 +2615,245 @@ StoredTxHints InterfaceToLDB::getHintsForTxHash(BinaryDataRef txHash)
    return sths;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+BinaryData InterfaceToLDB::getTxHashIndexEntry(BinaryDataRef txHash)
+{
+   return getValue(BLKDATA, DB_PREFIX_TXHASHIDX, 
+                   txHash.getSliceRef(0, txHashIndexLen_));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::putTxHashIndexEntry(BinaryDataRef txHash, 
+                                         BinaryDataRef keyList)
+{
+   if(keyList.getSize() == 0)
+      deleteValue(BLKDATA, DB_PREFIX_TXHASHIDX, 
+                  txHash.getSliceRef(0, txHashIndexLen_));
+   else
+      putValue(BLKDATA, DB_PREFIX_TXHASHIDX, 
+               txHash.getSliceRef(0, txHashIndexLen_), keyList);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::getUtxo(BinaryDataRef outPoint, StoredTxOut & stxo)
+{
+   BinaryDataRef val = getValueRef(BLKDATA, DB_PREFIX_UTXO, outPoint);
+   if(val.getSize() < 8)
+      return false;
+
+   stxo.unserializeUtxoValue(val);
+   stxo.parentHash_ = outPoint.getSliceCopy(0, 32);
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::putUtxo(BinaryDataRef outPoint, BinaryDataRef utxoValue)
+{
+   putValue(BLKDATA, DB_PREFIX_UTXO, outPoint, utxoValue);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::deleteUtxo(BinaryDataRef outPoint)
+{
+   deleteValue(BLKDATA, DB_PREFIX_UTXO, outPoint);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::preferTxKeyInList(BinaryData & keyList, 
+                                       BinaryDataRef dbKey6)
+{
+   BinaryWriter bw(keyList.getSize() + 6);
+   bw.put_BinaryData(dbKey6);
+   for(uint32_t i=0; i+6<=keyList.getSize(); i+=6)
+   {
+      BinaryDataRef key = keyList.getSliceRef(i, 6);
+      if(key != dbKey6)
+         bw.put_BinaryData(key);
+   }
+   keyList = bw.getData();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::removeTxKeyFromList(BinaryData & keyList, 
+                                         BinaryDataRef dbKey6)
+{
+   BinaryWriter bw(keyList.getSize());
+   for(uint32_t i=0; i+6<=keyList.getSize(); i+=6)
+   {
+      BinaryDataRef key = keyList.getSliceRef(i, 6);
+      if(key != dbKey6)
+         bw.put_BinaryData(key);
+   }
+   keyList = bw.getData();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Same contract as seekToTxByHash, but only uses the TXHASHIDX.  Returns 
+// false right away if there is no index.
+bool InterfaceToLDB::seekToTxByHashIndex(LDBIter & ldbIter, 
+                                         BinaryDataRef txHash)
+{
+   if(txHashIndexLen_ == 0 || txHash.getSize() != 32)
+      return false;
+
+   BinaryData keyList = getTxHashIndexEntry(txHash);
+   return seekToTxInKeyList(ldbIter, txHash, keyList);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::seekToTxInKeyList(LDBIter & ldbIter, 
+                                       BinaryDataRef txHash,
+                                       BinaryDataRef keyList)
+{
+   for(uint32_t i=0; i+6<=keyList.getSize(); i+=6)
+   {
+      if(!ldbIter.seekToExact(DB_PREFIX_TXDATA, keyList.getSliceRef(i, 6)))
+         continue;
+
+      // The index key is only a prefix, so check the full hash
+      ldbIter.getValueReader().advance(2);  // skip flags
+      if(ldbIter.getValueReader().get_BinaryDataRef(32) == txHash)
+      {
+         ldbIter.resetReaders();
+         return true;
+      }
+   }
+
+   ldbIter.resetReaders();
+   return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool InterfaceToLDB::enableTxHashIndex(uint32_t prefixLen)
+{
+   SCOPED_TIMER("enableTxHashIndex");
+   if(prefixLen != 0 && (prefixLen < TX_HASH_INDEX_MIN_LEN || 
+                         prefixLen > TX_HASH_INDEX_MAX_LEN))
+   {
+      LOGERR << "Tx hash index prefix must be between " 
+             << TX_HASH_INDEX_MIN_LEN << " and " << TX_HASH_INDEX_MAX_LEN
+             << " bytes, got " << prefixLen;
+      return false;
+   }
+
+   if(!databasesAreOpen())
+   {
+      LOGERR << "Cannot change the tx hash index before the DB is open";
+      return false;
+   }
+
+   // Nothing would keep it current
+   if(prefixLen != 0 && DBUtils.getArmoryDbType() == ARMORY_DB_BARE)
+   {
+      LOGERR << "No tx hash index in ARMORY_DB_BARE mode";
+      return false;
+   }
+
+   if(prefixLen == txHashIndexLen_)
+      return true;
+
+   if(prefixLen == 0)
+      dropTxHashIndex();
+   else
+      buildTxHashIndexFromHints(prefixLen);
+
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::dropTxHashIndex(void)
+{
+   SCOPED_TIMER("dropTxHashIndex");
+   LOGINFO << "Removing tx hash index";
+
+   // The info key sorts first, so an interrupted drop leaves no index
+   // behind, just some entries that the next build will clear
+   LDBIter ldbIter = getIterator(BLKDATA, BULK_SCAN);
+   startBatch(BLKDATA);
+   if(ldbIter.seekToStartsWith(DB_PREFIX_TXHASHIDX))
+   {
+      uint32_t nDeleted = 0;
+      do
+      {
+         deleteValue(BLKDATA, ldbIter.getKeyRef());
+         if(++nDeleted % 100000 == 0)
+         {
+            commitBatch(BLKDATA);
+            startBatch(BLKDATA);
+         }
+      } while(ldbIter.advanceAndRead(DB_PREFIX_TXHASHIDX));
+   }
+   commitBatch(BLKDATA);
+
+   txHashIndexLen_ = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Migration path for DBs that only have TXHINTS.  Every hinted tx is read 
+// once to get the rest of its hash.  The info key is written last, so an
+// interrupted build is simply redone on the next start.
+void InterfaceToLDB::buildTxHashIndexFromHints(uint32_t prefixLen)
+{
+   SCOPED_TIMER("buildTxHashIndexFromHints");
+   LOGINFO << "Building tx hash index with " << prefixLen 
+           << "-byte prefixes from TXHINTS";
+
+   // Clear out anything left by an interrupted drop or build
+   dropTxHashIndex();
+   txHashIndexLen_ = prefixLen;
+
+   uint32_t nEntries = 0;
+   LDBIter ldbIter = getIterator(BLKDATA, BULK_SCAN);
+   startBatch(BLKDATA);
+   if(ldbIter.seekToStartsWith(DB_PREFIX_TXHINTS))
+   {
+      // Hints with different 4-byte prefixes can never share an index key,
+      // so each TXHINTS entry can be converted on its own
+      map<BinaryData, BinaryData> idxEntries;
+      do
+      {
+         ldbIter.resetReaders();
+         StoredTxHints sths;
+         sths.unserializeDBValue(ldbIter.getValueReader());
+
+         idxEntries.clear();
+         for(uint32_t i=0; i<sths.getNumHints(); i++)
+         {
+            BinaryDataRef hint = sths.getHint(i);
+            BinaryRefReader brr = getValueReader(BLKDATA, DB_PREFIX_TXDATA, hint);
+            if(brr.getSizeRemaining() < 34)
+            {
+               LOGERR << "TxHint referenced a BLKDATA tx that doesn't exist";
+               continue;
+            }
+
+            // Hints are in preferred order, keep it that way
+            brr.advance(2);  // skip flags
+            idxEntries[brr.get_BinaryData(prefixLen)].append(hint);
+         }
+
+         map<BinaryData, BinaryData>::iterator iter;
+         for(iter = idxEntries.begin(); iter != idxEntries.end(); iter++)
+         {
+            putTxHashIndexEntry(iter->first, iter->second);
+            if(++nEntries % 100000 == 0)
+            {
+               commitBatch(BLKDATA);
+               startBatch(BLKDATA);
+            }
+         }
+      } while(ldbIter.advanceAndRead(DB_PREFIX_TXHINTS));
+   }
+
+   BinaryData idxInfo(1);
+   idxInfo[0] = (uint8_t)prefixLen;
+   putValue(BLKDATA, DB_PREFIX_TXHASHIDX, BinaryDataRef(), idxInfo.getRef());
+   commitBatch(BLKDATA);
+
+   LOGINFO << "Tx hash index has " << nEntries << " entries";
+}
+
+
 
 ////////////////////////////////////////////////////////////////////////////////
 bool InterfaceToLDB::getStoredTx( StoredTx & stx,
@@ -2164,6 +2903,18 @@ bool InterfaceToLDB::getStoredTx_byHash( StoredTx & stx,
                                          BinaryDataRef txHash)
 {
    SCOPED_TIMER("getStoredTx");
+   uint32_t height;
+   uint8_t  dup;
+   uint16_t txIdx;
+
+   LDBIter ldbIter = getIterator(BLKDATA);
+   if(seekToTxByHashIndex(ldbIter, txHash))
+   {
+      DBUtils.readBlkDataKey(ldbIter.getKeyReader(), height, dup, txIdx);
+      ldbIter.resetReaders();
+      return readStoredTxAtIter(ldbIter, height, dup, stx);
+   }
+
    BinaryData hash4(txHash.getSliceRef(0,4));
    BinaryData hintsDBVal = getValue(BLKDATA, DB_PREFIX_TXHINTS, hash4);
    uint32_t valSize = hintsDBVal.getSize();
@@ -2174,12 +2925,8 @@ bool InterfaceToLDB::getStoredTx_byHash( StoredTx & stx,
       return false;
    }
 
-   LDBIter ldbIter = getIterator(BLKDATA);
    BinaryRefReader brrHints(hintsDBVal);
    uint32_t numHints = (uint32_t)brrHints.get_var_int();
-   uint32_t height;
-   uint8_t  dup;
-   uint16_t txIdx;
    for(uint32_t i=0; i<numHints; i++)
    {
       BinaryDataRef hint = brrHints.get_BinaryDataRef(6);
@@ -2216,6 +2963,155 @@ bool InterfaceToLDB::getStoredTx_byHash( StoredTx & stx,
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// The hash lookup tries the TXHASHIDX first and then the TXHINTS, like
+// getStoredTx_byHash.  The values are refs into the reader's buffers, so 
+// neither list is copied.
+bool InterfaceToLDB::getStoredTx( LDBReader & reader,
+                                  StoredTx & stx,
+                                  BinaryDataRef txHashOrDBKey)
+{
+   SCOPED_TIMER("getStoredTx");
+   uint32_t sz = txHashOrDBKey.getSize();
+   LDBIter ldbIter = reader.getIterator(BLKDATA);
+
+   if(sz == 6 || sz == 7)
+   {
+      BinaryWriter bw(7);
+      if(sz == 6)
+         bw.put_uint8_t((uint8_t)DB_PREFIX_TXDATA);
+      bw.put_BinaryData(txHashOrDBKey);
+      if(!ldbIter.seekToExact(bw.getDataRef()))
+         return false;
+   }
+   else if(sz == 32)
+   {
+      bool found = false;
+      if(txHashIndexLen_ > 0)
+      {
+         BinaryDataRef keyList = reader.getValueRef(BLKDATA, 
+                                    DB_PREFIX_TXHASHIDX,
+                                    txHashOrDBKey.getSliceRef(0, txHashIndexLen_));
+         found = seekToTxInKeyList(ldbIter, txHashOrDBKey, keyList);
+      }
+
+      if(!found)
+      {
+         BinaryRefReader brrHints = reader.getValueReader(BLKDATA, 
+                                       DB_PREFIX_TXHINTS,
+                                       txHashOrDBKey.getSliceRef(0, 4));
+         if(brrHints.getSize() < 2)
+            return false;
+
+         uint32_t numHints = (uint32_t)brrHints.get_var_int();
+         if(brrHints.getSizeRemaining() < numHints*6)
+            return false;
+
+         BinaryDataRef hints = brrHints.get_BinaryDataRef(numHints*6);
+         if(!seekToTxInKeyList(ldbIter, txHashOrDBKey, hints))
+            return false;
+      }
+   }
+   else
+      return false;
+
+   uint32_t height;
+   uint8_t  dup;
+   uint16_t txIdx;
+   DBUtils.readBlkDataKey(ldbIter.getKeyReader(), height, dup, txIdx);
+   ldbIter.resetReaders();
+   return readStoredTxAtIter(ldbIter, height, dup, stx);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Same lookups as getStoredTx_byHash, but without the LDBIter and getValue 
+// wrappers, which share state with the calling thread
+void InterfaceToLDB::prefetchStoredTx(BinaryDataRef txHash)
+{
+   if(dbs_[BLKDATA] == NULL || txHash.getSize() != 32)
+      return;
+
+   leveldb::ReadOptions opts;
+   string dbVal;
+   BinaryData keyList;
+
+   if(txHashIndexLen_ > 0)
+   {
+      BinaryData idxKey(1 + txHashIndexLen_);
+      idxKey[0] = (uint8_t)DB_PREFIX_TXHASHIDX;
+      txHash.copyTo(idxKey.getPtr()+1, txHashIndexLen_);
+      if(dbs_[BLKDATA]->Get(opts, binaryDataRefToSlice(idxKey), &dbVal).ok())
+         keyList.copyFrom(dbVal);
+   }
+
+   if(keyList.getSize() == 0)
+   {
+      BinaryData hintKey(5);
+      hintKey[0] = (uint8_t)DB_PREFIX_TXHINTS;
+      txHash.copyTo(hintKey.getPtr()+1, 4);
+      if(!dbs_[BLKDATA]->Get(opts, binaryDataRefToSlice(hintKey), &dbVal).ok())
+         return;
+
+      BinaryRefReader brrHints((uint8_t const *)dbVal.data(), dbVal.size());
+      if(brrHints.getSize() < 2)
+         return;
+      uint32_t numHints = (uint32_t)brrHints.get_var_int();
+      if(numHints > brrHints.getSizeRemaining()/6)
+         return;
+      keyList = brrHints.get_BinaryData(6*numHints);
+   }
+
+   // The tx entry and then each of its TxOut entries, all under the same
+   // 7-byte prefix
+   leveldb::Iterator* iter = dbs_[BLKDATA]->NewIterator(opts);
+   BinaryData txKey(7);
+   txKey[0] = (uint8_t)DB_PREFIX_TXDATA;
+   for(uint32_t i=0; i+6<=keyList.getSize(); i+=6)
+   {
+      keyList.getSliceRef(i, 6).copyTo(txKey.getPtr()+1, 6);
+      leveldb::Slice txSlice = binaryDataRefToSlice(txKey);
+
+      bool isThisTx = false;
+      for(iter->Seek(txSlice); 
+          iter->Valid() && iter->key().starts_with(txSlice); 
+          iter->Next())
+      {
+         // Only the tx entry has the hash:  2 bytes of flags, then the hash
+         if(iter->key().size() == 7)
+         {
+            leveldb::Slice val = iter->value();
+            isThisTx = (val.size() >= 34 && 
+                        memcmp(val.data()+2, txHash.getPtr(), 32) == 0);
+            if(!isThisTx)
+               break;
+         }
+      }
+
+      if(isThisTx)
+         break;
+   }
+   delete iter;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void InterfaceToLDB::prefetchUtxo(BinaryDataRef outPoint)
+{
+   if(dbs_[BLKDATA] == NULL || outPoint.getSize() != 36)
+      return;
+
+   BinaryData utxoKey(37);
+   utxoKey[0] = (uint8_t)DB_PREFIX_UTXO;
+   outPoint.copyTo(utxoKey.getPtr()+1, 36);
+
+   string dbVal;
+   leveldb::ReadOptions opts;
+   if(!dbs_[BLKDATA]->Get(opts, binaryDataRefToSlice(utxoKey), &dbVal).ok())
+      prefetchStoredTx(outPoint.getSliceRef(0, 32));
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 bool InterfaceToLDB::getStoredTx( StoredTx & stx,
                                   uint32_t blockHeight,
@@ -2339,15 +3235,21 @@ bool InterfaceToLDB::getStoredTxOut(
 ////////////////////////////////////////////////////////////////////////////////
 bool InterfaceToLDB::putStoredUndoData(StoredUndoData const & sud)
 {
-   LOGERR << "putStoredUndoData not implemented yet!!!";
-   return false;
+   SCOPED_TIMER("putStoredUndoData");
+   if(sud.blockHash_.getSize() != 32)
+   {
+      LOGERR << "Undo data has no block hash, not writing it";
+      return false;
+   }
+
+   putValue(BLKDATA, sud.getDBKey(), sud.serializeDBValue());
+   return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 bool InterfaceToLDB::getStoredUndoData(StoredUndoData & sud, uint32_t height)
 {
-   LOGERR << "getStoredUndoData not implemented yet!!!";
-   return false;
+   return getStoredUndoData(sud, height, getValidDupIDForHeight(height));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -2355,33 +3257,60 @@ bool InterfaceToLDB::getStoredUndoData(StoredUndoData & sud,
                                        uint32_t         height, 
                                        uint8_t          dup)
 {
-   LOGERR << "getStoredUndoData not implemented yet!!!";
-   return false;
-
-   /*
+   SCOPED_TIMER("getStoredUndoData");
    BinaryData key = DBUtils.getBlkDataKeyNoPrefix(height, dup); 
-   BinaryRefReader brr = getValueReader(BLKDATA, DB_PREFIX_UNDODATA, key);
-
-   if(brr.getSize() == 0)
-   {
-      LOGERR << " 
-   }
+   BinaryDataRef bdr = getValueRef(BLKDATA, DB_PREFIX_UNDODATA, key);
+   if(bdr.getSize() == 0)
+      return false;
 
-   for(uint32_t i=0; i<sud.stxOutsRemovedByBlock_.size(); i++)
-   {
-      sud.stxOutsRemovedByBlock_[i].blockHeight_ = height;
-      sud.stxOutsRemovedByBlock_[i].duplicateID_ = dup;
-   }
-   */
+   sud.unserializeDBValue(bdr);
+   sud.blockHeight_ = height;
+   sud.duplicateID_ = dup;
+   return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 bool InterfaceToLDB::getStoredUndoData(StoredUndoData & sud, 
                                        BinaryDataRef    headHash)
 {
-   SCOPED_TIMER("getStoredUndoData");
-   LOGERR << "getStoredUndoData not implemented yet!!!";
-   return false;
+   StoredHeader sbh;
+   if(!getBareHeader(sbh, headHash))
+      return false;
+
+   return getStoredUndoData(sud, sbh.blockHeight_, sbh.duplicateID_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// UNDODATA keys are the prefix and the hgtx, so they are in height order and
+// only the records being deleted are visited.  The deletes go in the current
+// batch if there is one.
+uint32_t InterfaceToLDB::purgeOldUndoData(uint32_t earlierThanHeight)
+{
+   SCOPED_TIMER("purgeOldUndoData");
+   LDBIter ldbIter = getIterator(BLKDATA);
+   if(!ldbIter.seekToStartsWith(DB_PREFIX_UNDODATA))
+      return 0;
+
+   uint32_t nDeleted = 0;
+   startBatch(BLKDATA);
+   do
+   {
+      BinaryDataRef key = ldbIter.getKeyRef();
+      if(key.getSize() != 5)
+      {
+         LOGERR << "Bad UNDODATA key: " << key.toHexStr();
+         break;
+      }
+
+      if(DBUtils.hgtxToHeight(key.getSliceCopy(1,4)) >= earlierThanHeight)
+         break;
+
+      deleteValue(BLKDATA, key);
+      nDeleted++;
+   } while(ldbIter.advanceAndRead(DB_PREFIX_UNDODATA));
+   commitBatch(BLKDATA);
+
+   return nDeleted;
 }
 
 
@@ -2772,11 +3701,6 @@ BinaryData InterfaceToLDB::getUndoDataForBlock( list<TxOut> &    txOutsRemoved,
       getUndoDataForTx(block.txList[i], txOutsRemoved, outpointsAdded);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-bool InterfaceToLDB::purgeOldUndoData(uint32_t earlierThanHeight)
-{
-   // For ARMORY_DB_FULL we don't need undo data yet.
-}
 */
 
    
@@ -20,7 +20,7 @@
 #include "leveldb/db.h"
 #include "leveldb/write_batch.h"
 #include "leveldb/cache.h"
-//#include "leveldb/filter_policy.h"
+#include "leveldb/filter_policy.h"
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -36,11 +36,27 @@
 
 #define DEFAULT_LDB_BLOCK_SIZE 32*1024
 
+// Bloom filters let point reads on missing keys (TXHINTS lookups for tx we
+// don't have, mostly) skip the disk.  10 bits/key is a ~1% false positive
+// rate.  Tables written before the filter was enabled are still readable,
+// they just don't get the benefit until they are compacted.
+#define DEFAULT_LDB_BLOOM_BITS 10
+
+// Allowed hash prefix lengths for the TXHASHIDX entries.  At 8 bytes there
+// is about one collision per 10^19 tx, so a lookup is a single point read.
+#define TX_HASH_INDEX_MIN_LEN  8
+#define TX_HASH_INDEX_MAX_LEN  32
+
 // Use this to create iterators that are intended for bulk scanning
 // It's actually that the ReadOptions::fill_cache arg needs to be false
 #define BULK_SCAN false
 
+// In an ordered pass over sorted keys, step the iterator forward to the next
+// key if it's at most this many entries ahead, seek to it otherwise
+#define ITER_FORWARD_MAX_STEPS 8
+
 class BlockHeader;
+class HeaderStore;
 class Tx;
 class TxIn;
 class TxOut;
@@ -149,6 +165,9 @@ class StoredScriptHistory;
 //         understand how to use it safely.  Only use getValue() unless there
 //         is reason to believe that the optimization is needed.
 //
+//         An LDBReader (below) doesn't have this problem, and can be used
+//         from several threads at once.
+//
 //
 //
 // NOTE 2: Batch writing operations are smoothed so that multiple, nested
@@ -167,7 +186,8 @@ public:
 
    // fill_cache argument should be false for large bulk scans
    LDBIter(void) { db_=NULL; iter_=NULL; isDirty_=true;}
-   LDBIter(leveldb::DB* dbptr, bool fill_cache=true);
+   LDBIter(leveldb::DB* dbptr, bool fill_cache=true,
+           leveldb::Snapshot const * snapshot=NULL);
    ~LDBIter(void) { destroy(); }
    void destroy(void) {if(iter_!=NULL) delete iter_; iter_ = NULL; db_ = NULL;}
 
@@ -230,9 +250,78 @@ private:
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+// LevelDB options we let the user tune, separately for HEADERS and BLKDATA.
+// Zero for any of the sizes means "use the LevelDB default" (8 MB block 
+// cache, 4 MB write buffer).  bloomBitsPerKey_==0 disables the filter.
+// These only take effect the next time the databases are opened.
+class LDBTuning
+{
+public:
+   LDBTuning(void) : 
+      bloomBitsPerKey_(DEFAULT_LDB_BLOOM_BITS),
+      blockCacheSize_(0),
+      writeBufferSize_(0),
+      useCompression_(false) {}
+
+   uint32_t bloomBitsPerKey_;
+   uint32_t blockCacheSize_;    // bytes
+   uint32_t writeBufferSize_;   // bytes
+   bool     useCompression_;    // snappy, if leveldb was built with it
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// A read handle on both databases, pinned to a LevelDB snapshot taken when
+// it is created.  Unlike InterfaceToLDB::getValueRef, every value it returns
+// has its own buffer, owned by the reader:  the BinaryDataRefs stay valid 
+// until the reader is destroyed, no matter how many other gets follow.  And
+// since everything read through it comes from the same snapshot, writes 
+// committed in the meantime don't show up halfway through a query.
+//
+// The reader can be shared by several threads, each with its own LDBIter
+// from getIterator().  It never touches InterfaceToLDB's shared state 
+// (lastGetValue_, validDupByHeight_), only the leveldb::DB objects, which
+// do their own locking.  Destroy it before closing the databases.
+//
+// Buffers are only freed with the reader, so don't keep one around for a 
+// whole scan:  one per query (or batch of queries) is the intended use.
+class InterfaceToLDB;
+struct LDBReaderBuffers;
+
+class LDBReader
+{
+public:
+   LDBReader(InterfaceToLDB & iface);
+   ~LDBReader(void);
+
+   // Empty ref if the key is not in the DB
+   BinaryDataRef   getValueRef(DB_SELECT db, BinaryDataRef keyWithPrefix);
+   BinaryDataRef   getValueRef(DB_SELECT db, DB_PREFIX prefix, BinaryDataRef key);
+   BinaryRefReader getValueReader(DB_SELECT db, DB_PREFIX prefix, BinaryDataRef key);
+
+   LDBIter getIterator(DB_SELECT db, bool fill_cache=true) 
+                   { return LDBIter(dbs_[db], fill_cache, snapshots_[db]); }
+
+   // Read from HEADHGT, as of the snapshot.  UINT8_MAX if none is main.
+   uint8_t getValidDupIDForHeight(uint32_t blockHgt);
+
+private:
+   // Not copyable:  it owns the snapshots and the buffers
+   LDBReader(LDBReader const &);
+   LDBReader & operator=(LDBReader const &);
+
+   leveldb::DB*               dbs_[2];
+   leveldb::Snapshot const *  snapshots_[2];
+   LDBReaderBuffers*          buffers_;
+};
+
+
 ////////////////////////////////////////////////////////////////////////////////
 class InterfaceToLDB
 {
+   friend class LDBReader;
+
 private:
 
    /////////////////////////////////////////////////////////////////////////////
@@ -367,8 +456,7 @@ public:
    bool dbIterIsValid(DB_SELECT db, DB_PREFIX prefix=DB_PREFIX_COUNT);
 
    /////////////////////////////////////////////////////////////////////////////
-   void readAllHeaders(map<HashString, BlockHeader>  & headerMap,
-                       map<HashString, StoredHeader> & storedMap);
+   void readAllHeaders(HeaderStore & headerStore);
 
    /////////////////////////////////////////////////////////////////////////////
    // When we're not in supernode mode, we're going to need to track only 
@@ -415,6 +503,18 @@ public:
    void commitBatch(DB_SELECT db);
    bool isBatchOn(DB_SELECT db)   { return batchStarts_[db] > 0; }
 
+   // Takes everything put in the current batch so far, leaving an empty
+   // batch in its place (the start/commit count is unchanged).  The caller
+   // owns the result and hands it to writeDetachedBatch.
+   leveldb::WriteBatch* detachBatch(DB_SELECT db);
+
+   // Writes and deletes a batch from detachBatch, synced so it is durable
+   // when this returns.  It only touches the leveldb::DB, which does its own
+   // locking, so it can run in another thread while this one keeps reading.
+   // It doesn't log either (the logger isn't thread-safe), the caller checks
+   // the return value.
+   bool writeDetachedBatch(DB_SELECT db, leveldb::WriteBatch* batch);
+
 
    /////////////////////////////////////////////////////////////////////////////
    uint8_t getValidDupIDForHeight_fromDB(uint32_t blockHgt);
@@ -509,6 +609,25 @@ public:
    void getStoredScriptHistorySummary( StoredScriptHistory & ssh,
                                        BinaryDataRef scrAddrStr);
 
+   /////////////////////////////////////////////////////////////////////////////
+   // Same as the regular getStoredTx(stx, txHashOrDBKey), getStoredScript-
+   // History and readStoredBlockAtIter, but everything is read through the
+   // reader's snapshot (the LDBIter too, get it from reader.getIterator).
+   // These can run in parallel as long as each thread fills its own objects.
+   // A tx or scrAddr that isn't there is not logged, it just returns false
+   // (or leaves the ssh uninitialized).
+   bool getStoredTx(            LDBReader & reader,
+                                StoredTx & stx,
+                                BinaryDataRef txHashOrDBKey);
+
+   void getStoredScriptHistory( LDBReader & reader,
+                                StoredScriptHistory & ssh,
+                                BinaryDataRef scrAddrStr);
+
+   bool readStoredBlockAtIter(  LDBReader & reader,
+                                LDBIter & iter,
+                                StoredHeader & sbh);
+
    void getStoredScriptHistoryByRawScript(
                                 StoredScriptHistory & ssh,
                                 BinaryDataRef rawScript);
@@ -529,18 +648,56 @@ public:
                                  bool withMultisig=false);
 
    uint64_t getBalanceForScrAddr(BinaryDataRef scrAddr, bool withMulti=false);
-   
-   // TODO: We should probably implement some kind of method for accessing or 
-   //       running calculations on an SSH without ever loading the entire
-   //       thing into RAM.  
 
-   // None of the SUD methods are implemented because we don't actually need
-   // to read/write SUD to the database -- our only mode is ARMORY_DB_SUPER
-   // which doesn't require storing undo data
+   // Through an LDBReader, like the getStoredTx(reader,...) set below
+   bool     getFullUTXOMapForSSH(LDBReader & reader,
+                                 StoredScriptHistory & ssh,
+                                 map<BinaryData, UnspentTxOut> & mapToFill,
+                                 bool withMultisig=false);
+
+   uint64_t getBalanceForScrAddr(LDBReader & reader, 
+                                 BinaryDataRef scrAddr, 
+                                 bool withMulti=false);
+
+   // UnspentTxOuts for these 8-byte TxOut DB keys (any order), keyed by 
+   // them.  The keys are sorted and read with one forward pass of an 
+   // iterator over TXDATA:  only the tx entry (for the hash) and the TxOut
+   // entry, never the whole StoredTx.  Keys not in the DB are left out, so
+   // are spent TxOuts if skipSpent.
+   void     getUnspentTxOutsByDBKey(vector<BinaryData> const & txOutKeys,
+                                    map<BinaryData, UnspentTxOut> & mapToFill,
+                                    bool skipSpent=true);
+
+   void     getUnspentTxOutsByDBKey(LDBReader & reader,
+                                    vector<BinaryData> const & txOutKeys,
+                                    map<BinaryData, UnspentTxOut> & mapToFill,
+                                    bool skipSpent=true);
+
+   // One page of a script's history, without loading the whole SSH:  only
+   // the sub-histories of blocks startHeight to endHeight are read, up to 
+   // pageSize TxIOs (0 for no limit).  TxIOs come in DB-key order of their
+   // TxOut (block, tx index, TxOut index), so oldest first.  resumeKey is 
+   // the 8-byte DB key of the TxIO to start at, empty for startHeight.  On
+   // return it's the key of the first TxIO of the next page, or empty if 
+   // there is none.  Returns false if the script isn't in the DB.
+   bool     getScriptHistoryPage(LDBReader & reader,
+                                 BinaryDataRef scrAddr,
+                                 uint32_t startHeight,
+                                 uint32_t endHeight,
+                                 uint32_t pageSize,
+                                 BinaryData & resumeKey,
+                                 vector<TxIOPair> & txioList,
+                                 bool withMultisig=false);
+
+   // Undo data is only stored when pruning (DB_PRUNE_ALL), the 
+   // BlockWriteBatcher writes it with the rest of each batch and keeps
+   // only the most recent blocks' worth.  purgeOldUndoData deletes the
+   // records of all blocks below that height and returns how many.
    bool putStoredUndoData(StoredUndoData const & sud);
    bool getStoredUndoData(StoredUndoData & sud, uint32_t height);
    bool getStoredUndoData(StoredUndoData & sud, uint32_t height, uint8_t dup);
    bool getStoredUndoData(StoredUndoData & sud, BinaryDataRef headHash);
+   uint32_t purgeOldUndoData(uint32_t earlierThanHeight);
 
    bool putStoredTxHints(StoredTxHints const & sths);
    bool getStoredTxHints(StoredTxHints & sths, BinaryDataRef hashPrefix);
@@ -597,6 +754,57 @@ public:
 
    StoredTxHints getHintsForTxHash(BinaryDataRef txHash);
 
+   // Does the reads getStoredTx(stx, txHash) would do and throws the data
+   // away, so that call finds them in the leveldb cache later.  Safe to call
+   // from other threads while this one is in use:  it only goes through the
+   // leveldb::DB (which does its own locking) and never logs.
+   void prefetchStoredTx(BinaryDataRef txHash);
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Optional tx hash index.  TXHASHIDX entries map the first 
+   // txHashIndexLen_ bytes of a tx hash directly to the 6-byte hgt/dup/txIdx
+   // keys of the tx with that prefix, preferred (main-branch) key first.
+   // The BlockWriteBatcher adds to it as blocks are applied, and takes the
+   // keys of undone blocks back out.  TXHINTS are still written, and are 
+   // used whenever the index doesn't find the tx.
+   //
+   // Blocks are never applied in ARMORY_DB_BARE, so the index isn't 
+   // available in that mode.
+   //
+   // enableTxHashIndex() builds the index from the existing TXHINTS if it's
+   // missing or was built with a different length.  Pass 0 to remove it.
+   bool       enableTxHashIndex(uint32_t prefixLen);
+   uint32_t   getTxHashIndexLength(void) const { return txHashIndexLen_; }
+   BinaryData getTxHashIndexEntry(BinaryDataRef txHash);
+   void       putTxHashIndexEntry(BinaryDataRef txHash, BinaryDataRef keyList);
+
+   /////////////////////////////////////////////////////////////////////////////
+   // UTXO set (supernode).  One UTXO entry per unspent TxOut, keyed by the
+   // 36-byte serialized OutPoint (tx hash, then the TxOut index as LE32), 
+   // with the TxOut's 8-byte DB key and TXDATA value as the value.  The
+   // BlockWriteBatcher keeps it up to date, so spending a TxOut doesn't need
+   // its funding StoredTx.  A missing entry is not an error:  DBs built before
+   // the UTXO set have none for their old TxOuts, and the batcher falls back
+   // to TXDATA for those.
+   bool getUtxo(BinaryDataRef outPoint, StoredTxOut & stxo);
+   void putUtxo(BinaryDataRef outPoint, BinaryDataRef utxoValue);
+   void deleteUtxo(BinaryDataRef outPoint);
+
+   // Same as prefetchStoredTx, for the UTXO entry (or the funding tx, if
+   // the outPoint has no entry)
+   void prefetchUtxo(BinaryDataRef outPoint);
+   bool       seekToTxByHashIndex(LDBIter & ldbIter, BinaryDataRef txHash);
+
+   // Seeks to the tx among the 6-byte keys of a TXHASHIDX value (or hints)
+   // whose hash is txHash.  Doesn't log, missing keys are skipped.
+   static bool seekToTxInKeyList(LDBIter & ldbIter, 
+                                 BinaryDataRef txHash,
+                                 BinaryDataRef keyList);
+
+   // Moves (or adds) dbKey6 to the front of a TXHASHIDX value
+   static void preferTxKeyInList(BinaryData & keyList, BinaryDataRef dbKey6);
+   static void removeTxKeyFromList(BinaryData & keyList, BinaryDataRef dbKey6);
+
 
    ////////////////////////////////////////////////////////////////////////////
    bool markBlockHeaderValid(BinaryDataRef headHash);
@@ -623,6 +831,10 @@ public:
    void     setLdbBlockSize(uint32_t sz){ ldbBlockSize_ = sz;   }
    uint32_t getLdbBlockSize(void)       { return ldbBlockSize_; }
 
+   void              setTuning(DB_SELECT db, LDBTuning const & t) { tuning_[db] = t; }
+   LDBTuning const & getTuning(DB_SELECT db) const { return tuning_[db]; }
+   LDBTuning &       getTuningRef(DB_SELECT db)    { return tuning_[db]; }
+
 
    KVLIST getAllDatabaseEntries(DB_SELECT db);
    void   printAllDatabaseEntries(DB_SELECT db);
@@ -635,6 +847,21 @@ public:
 
 
 private:
+   void dropTxHashIndex(void);
+   void buildTxHashIndexFromHints(uint32_t prefixLen);
+
+   // Both readStoredBlockAtIter/getFullUTXOMapForSSH/getUnspentTxOutsByDBKey
+   // overloads, reader is NULL for the regular ones
+   bool readBlockAtIter(LDBIter & ldbIter, StoredHeader & sbh, LDBReader* reader);
+   bool readFullUTXOMapForSSH(StoredScriptHistory & ssh,
+                              map<BinaryData, UnspentTxOut> & mapToFill,
+                              bool withMultisig,
+                              LDBReader* reader);
+   void readUnspentTxOutsByDBKey(vector<BinaryData> const & txOutKeys,
+                                 map<BinaryData, UnspentTxOut> & mapToFill,
+                                 bool skipSpent,
+                                 LDBReader* reader);
+
    string               baseDir_;
 
    BinaryData           genesisBlkHash_;
@@ -649,7 +876,14 @@ private:
    leveldb::DB*           dbs_[2];  
    string                 dbPaths_[2];
    bool                   iterIsDirty_[2];
-   //leveldb::FilterPolicy* dbFilterPolicy_[2];
+
+   // The DB objects don't own these, they are deleted after the DBs are
+   LDBTuning                    tuning_[2];
+   leveldb::Cache*              dbCache_[2];
+   leveldb::FilterPolicy const* dbFilterPolicy_[2];
+
+   // 0 if there is no TXHASHIDX in the BLKDATA DB.  Read from the DB at open
+   uint32_t                     txHashIndexLen_;
 
    // This will be incremented every time startBatch is called, decremented
    // every time commitBatch is called.  We will only *actually* start a new
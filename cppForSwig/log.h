@@ -51,6 +51,11 @@
 // move the __FILE__ and/or __LINE__ commands into the getLogStream() method
 // because then it will always print "log.h:282" for the file and line).
 //
+// Any thread can log.  A LOGERR, etc, statement holds the log mutex from the 
+// moment it's evaluated until its newline is written, so lines from different
+// threads don't interleave.  The mutex is recursive, a function called while
+// building a log line can log too.
+//
 ////////////////////////////////////////////////////////////////////////////////
 #ifndef __LOG_H__
 #define __LOG_H__
@@ -61,6 +66,7 @@
 #include <fstream>
 #include <iostream>
 #include <stdio.h>
+#include <mutex>
 #include "OS_TranslatePath.h"
 
 #define FILEANDLINE "(" << __FILE__ << ":" << __LINE__ << ") "
@@ -229,8 +235,15 @@ class Log
 public:
    Log(void) : isInitialized_(false), disableStdout_(false) {}
 
+   static recursive_mutex & GetMutex(void)
+   {
+      static recursive_mutex mu;
+      return mu;
+   }
+
    static Log & GetInstance(const char * filename=NULL)
    {
+      lock_guard<recursive_mutex> lock(GetMutex());
       static Log* theOneLog=NULL;
       if(theOneLog==NULL || filename!=NULL)
       {
@@ -270,6 +283,7 @@ public:
    static void SetLogFile(string logfile) { GetInstance(logfile.c_str()); }
    static void CloseLogFile(void)
    { 
+      lock_guard<recursive_mutex> lock(GetMutex());
       GetInstance().ds_.FlushStreams();
       GetInstance().ds_ << "Closing logfile.\n";
       GetInstance().ds_.close();
@@ -311,7 +325,8 @@ private:
 class LoggerObj
 {
 public:
-   LoggerObj(LogLevel lvl) : logLevel_(lvl) {}
+   // The lock is held until the destructor has written the newline
+   LoggerObj(LogLevel lvl) : lock_(Log::GetMutex()), logLevel_(lvl) {}
 
    LogStream & getLogStream(void) 
    { 
@@ -328,6 +343,7 @@ public:
    }
 
 private:
+   unique_lock<recursive_mutex> lock_;
    LogLevel logLevel_;
 };
 